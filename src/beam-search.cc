@@ -0,0 +1,144 @@
+#include "beam-search.h"
+
+#include <algorithm>
+#include <functional>
+
+void TopK(const float* x, const unsigned& n, const unsigned& k,
+          const float& offset, pair<float, unsigned>* best) {
+  // Insertion into a sorted array: k is a beam size and n a vocabulary, so
+  // most elements are rejected by the first comparison.
+  unsigned size = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    pair<float, unsigned> item(x[i] + offset, i);
+    if (size == k && !(best[k - 1] < item)) {
+      continue;
+    }
+    unsigned j = size < k ? size++ : k - 1;
+    for (; j > 0 && best[j - 1] < item; --j) {
+      best[j] = best[j - 1];
+    }
+    best[j] = item;
+  }
+}
+
+void BeamSearch::Start(const unsigned& beam_size, const unsigned& bow,
+                       const unsigned& eow, const unsigned& max_len,
+                       const float* log_dist, const unsigned& vocab_size,
+                       const BeamPruning& pruning) {
+  vocab_len = vocab_size;
+  eow_index = eow;
+  max_length = max_len;
+  options = pruning;
+  stats = BeamStats();
+  best_finished = -numeric_limits<float>::infinity();
+  nodes.clear();
+  nodes.reserve(1 + beam_size * (max_len + 1));
+  nodes.push_back(Node{0, bow, 1});
+  beam_best.resize(beam_size);
+  TopK(log_dist, vocab_size, beam_size, 0.0f, beam_best.data());
+
+  // Every slot is extended at least once, even if it starts with eow.
+  slot_node.resize(beam_size);
+  slot_scores.resize(beam_size);
+  parent_column.assign(beam_size, 0);
+  column.resize(beam_size);
+  finished.assign(beam_size, false);
+  active.clear();
+  extended.clear();
+  for (unsigned slot = 0; slot < beam_size; ++slot) {
+    slot_node[slot] = nodes.size();
+    slot_scores[slot] = beam_best[slot].first;
+    nodes.push_back(Node{0, beam_best[slot].second, 2});
+    active.push_back(slot);
+  }
+  Prune();
+}
+
+void BeamSearch::Prune() {
+  float best_active = -numeric_limits<float>::infinity();
+  for (unsigned slot : active) {
+    best_active = max(best_active, slot_scores[slot]);
+  }
+  float min_score = best_active - options.threshold;
+  if (options.stop_early) {
+    min_score = max(min_score, best_finished);
+  }
+  live.clear();
+  for (unsigned slot : active) {
+    if (slot_scores[slot] >= min_score) {
+      live.push_back(slot);
+    }
+  }
+  stats.pruned += active.size() - live.size();
+}
+
+void BeamSearch::Step(const float* log_dists, const unsigned& dist_stride) {
+  // Only the num_active best extensions of a slot can be among the
+  // num_active best candidates overall.
+  unsigned num_active = active.size();
+  unsigned k = min(num_active, vocab_len);
+  if (options.max_per_parent > 0) {
+    k = min(k, options.max_per_parent);
+  }
+  candidates.clear();
+  for (unsigned i = 0; i < live.size(); ++i) {
+    unsigned slot = live[i];
+    column[slot] = i;
+    TopK(log_dists + i * dist_stride, vocab_len, k, slot_scores[slot],
+         beam_best.data());
+    for (unsigned j = 0; j < k; ++j) {
+      candidates.push_back(make_pair(beam_best[j].first,
+                                     make_pair(slot, beam_best[j].second)));
+    }
+  }
+  stats.expanded += live.size();
+  unsigned num_new = min<unsigned>(num_active, candidates.size());
+  partial_sort(candidates.begin(), candidates.begin() + num_new,
+               candidates.end(),
+               greater<pair<float, pair<unsigned, unsigned> > >());
+
+  // The new nodes are added before any slot is overwritten, as a candidate
+  // may extend a slot which comes earlier. Slots left without a candidate
+  // keep their skipped hypothesis and are dropped.
+  unsigned first_node = nodes.size();
+  for (unsigned i = 0; i < num_new; ++i) {
+    unsigned old_slot = candidates[i].second.first;
+    const Node& parent = nodes[slot_node[old_slot]];
+    nodes.push_back(Node{slot_node[old_slot], candidates[i].second.second,
+                         parent.length + 1});
+  }
+  extended.assign(active.begin(), active.begin() + num_new);
+  active.clear();
+  for (unsigned i = 0; i < num_new; ++i) {
+    unsigned slot = extended[i];
+    slot_node[slot] = first_node + i;
+    slot_scores[slot] = candidates[i].first;
+    parent_column[slot] = column[candidates[i].second.first];
+    const Node& node = nodes[slot_node[slot]];
+    if (node.char_id != eow_index && node.length <= max_length) {
+      active.push_back(slot);
+    } else {
+      finished[slot] = true;
+      best_finished = max(best_finished, slot_scores[slot]);
+    }
+  }
+  Prune();
+}
+
+void BeamSearch::Results(vector<vector<unsigned> >* sequences,
+                         vector<float>* scores) const {
+  sequences->clear();
+  scores->clear();
+  for (unsigned slot = 0; slot < slot_node.size(); ++slot) {
+    if (!finished[slot]) {
+      continue;
+    }
+    sequences->push_back(vector<unsigned>(nodes[slot_node[slot]].length));
+    scores->push_back(slot_scores[slot]);
+    vector<unsigned>& seq = sequences->back();
+    unsigned node = slot_node[slot];
+    for (unsigned i = seq.size(); i > 0; --i, node = nodes[node].parent) {
+      seq[i - 1] = nodes[node].char_id;
+    }
+  }
+}
@@ -0,0 +1,115 @@
+#ifndef BEAM_SEARCH_H_
+#define BEAM_SEARCH_H_
+
+#include <limits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Writes the k largest (x[i] + offset, i) pairs to best in decreasing order,
+// breaking ties towards the larger index like a priority queue of pairs.
+// k must be at most n.
+void TopK(const float* x, const unsigned& n, const unsigned& k,
+          const float& offset, pair<float, unsigned>* best);
+
+// Options to stop expanding hypotheses which are unlikely to matter. Scores
+// are sums of log probabilities, so a hypothesis never gains by growing.
+struct BeamPruning {
+  // Hypotheses scoring more than this below the best unfinished one are not
+  // expanded. This may change the results.
+  float threshold;
+  // Hypotheses scoring below the best finished one are not expanded, and the
+  // search ends when no hypothesis can beat it. The best finished hypothesis
+  // stays the same.
+  bool stop_early;
+  // Every hypothesis gives at most this many candidates to the next step,
+  // 0 for no limit. This may change the results.
+  unsigned max_per_parent;
+
+  BeamPruning() : threshold(numeric_limits<float>::infinity()),
+                  stop_early(false), max_per_parent(0) {}
+};
+
+// Counts of one search: the hypotheses whose next character distribution
+// was computed, and the ones which were skipped by the pruning.
+struct BeamStats {
+  unsigned expanded, pruned;
+
+  BeamStats() : expanded(0), pruned(0) {}
+  void Add(const BeamStats& other) {
+    expanded += other.expanded;
+    pruned += other.pruned;
+  }
+};
+
+// The bookkeeping of the beam search of the ensemble decoders, independent
+// of how the distributions are computed. A hypothesis is a node of an arena
+// holding its last character and a backpointer to the hypothesis it extends,
+// so extending a beam never copies sequences; they are only spelled out by
+// Results(). Beam slots whose hypothesis ended stay fixed and drop out of
+// Live(), so they are neither expanded nor scored again. After the first
+// calls the search does not allocate, as the buffers are reused.
+//
+// Selection follows the original priority queue decoders exactly: every
+// live slot, in order, gets the next best extension among the live slots by
+// (score, (slot, char)), larger slots and characters winning ties.
+//
+// A hypothesis skipped by the pruning keeps its slot, which is filled with
+// the next best candidate of the expanded ones like any other unfinished
+// slot, so that pruning does not narrow the beam. The slots which still
+// hold a skipped hypothesis when the search ends are left out of Results().
+class BeamSearch {
+ public:
+  // Starts from the log distribution over the first character after bow.
+  // A hypothesis ends after eow or when it is longer than max_len with bow.
+  void Start(const unsigned& beam_size, const unsigned& bow,
+             const unsigned& eow, const unsigned& max_len,
+             const float* log_dist, const unsigned& vocab_size,
+             const BeamPruning& pruning = BeamPruning());
+
+  bool Done() const { return live.empty(); }
+
+  // The slots to expand, in increasing order. The i-th live slot is the
+  // i-th column of the distributions passed to Step().
+  const vector<unsigned>& Live() const { return live; }
+  unsigned LastChar(const unsigned& slot) const {
+    return nodes[slot_node[slot]].char_id;
+  }
+
+  // Extends the live hypotheses; log_dists + i * dist_stride is the log
+  // distribution of the next character of the i-th live slot.
+  void Step(const float* log_dists, const unsigned& dist_stride);
+
+  // The slots given a new hypothesis by the last Step(), and the column the
+  // new hypothesis of such a slot extends. The callers copy their
+  // decoder states by these backpointers.
+  const vector<unsigned>& Extended() const { return extended; }
+  unsigned Parent(const unsigned& slot) const { return parent_column[slot]; }
+
+  const BeamStats& Stats() const { return stats; }
+
+  void Results(vector<vector<unsigned> >* sequences,
+               vector<float>* scores) const;
+
+ private:
+  // Picks the unfinished slots to expand next.
+  void Prune();
+
+  struct Node {
+    unsigned parent, char_id, length;
+  };
+
+  unsigned vocab_len, eow_index, max_length;
+  BeamPruning options;
+  BeamStats stats;
+  float best_finished;
+  vector<Node> nodes;  // Node 0 is bow
+  vector<unsigned> slot_node, active, live, extended, parent_column, column;
+  vector<bool> finished;
+  vector<float> slot_scores;
+  vector<pair<float, unsigned> > beam_best;
+  vector<pair<float, pair<unsigned, unsigned> > > candidates;
+};
+
+#endif
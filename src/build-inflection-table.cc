@@ -0,0 +1,197 @@
+/*
+Decodes every lemma of a list with every morph tag and writes the forms to
+an inflection table for lookup-inflection. The lemmas are one per line in
+the character format of the data, e.g. "<s> a b c </s>"; with a '|' only the
+first field is read, so a data file can be used as the list.
+
+With SepMorph binary models the lemmas are decoded here with the graph-free
+inference engine, --batch=N words of a tag at a time on --threads=N threads.
+The models of the other architectures are decoded by the EnsembleDecode() of
+their eval binaries, since every architecture defines its own globals and
+they cannot share a binary: --requests=requests.txt writes every lemma and
+tag as a test file, the eval binary writes the prediction of every row to
+--forms, one per line, and --forms=forms.txt reads them back. The forms file
+has to have exactly one line per request, in the order of the requests:
+
+  build-inflection-table --requests=requests.txt vocab morph lemmas.txt
+  eval-ensemble-joint-enc-morph --paradigm=1 --forms=forms.txt \
+      vocab morph requests.txt model
+  build-inflection-table --forms=forms.txt vocab morph lemmas.txt table.bin
+*/
+#include "utils.h"
+#include "inflection-table.h"
+#include "sep-morph-infer.h"
+
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+
+using namespace std;
+
+// Reads a line of characters. A lemma gets <s> and </s> if they are
+// missing, a predicted form is kept as it is.
+static void ReadWord(const string& field, const bool& is_lemma,
+                     unordered_map<string, unsigned>& char_to_id,
+                     vector<unsigned>* ids, unsigned* num_unknown) {
+  vector<string> chars = split_line(field, ' ');
+  ids->clear();
+  if (is_lemma && (chars.empty() || chars[0] != "<s>")) {
+    ids->push_back(char_to_id["<s>"]);
+  }
+  for (const string& ch : chars) {
+    auto it = char_to_id.find(ch);
+    if (it == char_to_id.end()) {
+      ++*num_unknown;
+    }
+    ids->push_back(it == char_to_id.end() ? 0 : it->second);
+  }
+  if (is_lemma && (chars.empty() || chars.back() != "</s>")) {
+    ids->push_back(char_to_id["</s>"]);
+  }
+}
+
+int main(int argc, char** argv) {
+  unsigned batch_size =
+      max(atoi(GetOption("batch", "64", &argc, argv).c_str()), 1);
+  unsigned num_threads = atoi(GetOption("threads", "1", &argc, argv).c_str());
+  string requests_filename = GetOption("requests", "", &argc, argv);
+  string forms_filename = GetOption("forms", "", &argc, argv);
+  bool decode = requests_filename.empty() && forms_filename.empty();
+  int num_args = requests_filename.empty() ? 5 : 4;
+  if ((decode && argc <= num_args) || (!decode && argc != num_args)) {
+    cerr << "Usage: " << argv[0] << " [--batch=N] [--threads=N]"
+         << " char_vocab.txt morph_vocab.txt lemmas.txt table.bin"
+         << " model1.bin [model2.bin ...]" << endl;
+    cerr << "       " << argv[0] << " --requests=requests.txt"
+         << " char_vocab.txt morph_vocab.txt lemmas.txt" << endl;
+    cerr << "       " << argv[0] << " --forms=forms.txt"
+         << " char_vocab.txt morph_vocab.txt lemmas.txt table.bin" << endl;
+    return 0;
+  }
+  string vocab_filename = argv[1];  // vocabulary of words/characters
+  string morph_filename = argv[2];
+  string lemmas_filename = argv[3];
+
+  unordered_map<string, unsigned> char_to_id, morph_to_id;
+  unordered_map<unsigned, string> id_to_char, id_to_morph;
+
+  ReadVocab(vocab_filename, &char_to_id, &id_to_char);
+  ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
+  unsigned morph_size = morph_to_id.size();
+
+  auto line_of = [&](const vector<unsigned>& ids) {
+    string line = "";
+    for (unsigned i = 0; i < ids.size(); ++i) {
+      line += (i > 0 ? " " : "") + id_to_char[ids[i]];
+    }
+    return line;
+  };
+
+  // The distinct lemmas, in the order of the list.
+  vector<string> lines;
+  ReadData(lemmas_filename, &lines);
+  vector<vector<unsigned> > lemmas;
+  unordered_map<string, unsigned> lemma_index;
+  unsigned num_unknown = 0;
+  for (const string& line : lines) {
+    vector<string> items = split_line(line, '|');
+    if (items.empty()) {
+      continue;
+    }
+    vector<unsigned> ids;
+    ReadWord(items[0], true, char_to_id, &ids, &num_unknown);
+    string key = line_of(ids);
+    if (lemma_index.find(key) == lemma_index.end()) {
+      lemma_index[key] = lemmas.size();
+      lemmas.push_back(ids);
+    }
+  }
+  if (num_unknown > 0) {
+    cerr << num_unknown << " characters not in the vocabulary" << endl;
+  }
+  cerr << "Read " << lemmas.size() << " lemmas" << endl;
+
+  if (!requests_filename.empty()) {
+    ofstream outfile(requests_filename);
+    if (!outfile.is_open()) {
+      cerr << "File opening failed" << endl;
+      return 0;
+    }
+    for (const vector<unsigned>& lemma : lemmas) {
+      string word = line_of(lemma);
+      for (unsigned morph_id = 0; morph_id < morph_size; ++morph_id) {
+        outfile << word << "|" << word << "|" << id_to_morph[morph_id]
+                << endl;
+      }
+    }
+    cerr << "Wrote " << lemmas.size() * morph_size << " requests to "
+         << requests_filename << endl;
+    return 1;
+  }
+
+  // forms[i][morph_id]
+  vector<vector<vector<unsigned> > > forms(
+      lemmas.size(), vector<vector<unsigned> >(morph_size));
+  if (!forms_filename.empty()) {
+    // One form per request, the tags of a lemma after each other.
+    vector<string> output;
+    ReadData(forms_filename, &output);
+    if (output.size() != lemmas.size() * morph_size) {
+      cerr << forms_filename << " has " << output.size() << " forms, but "
+           << lemmas.size() * morph_size << " were requested" << endl;
+      return 0;
+    }
+    num_unknown = 0;
+    for (unsigned i = 0; i < lemmas.size(); ++i) {
+      for (unsigned morph_id = 0; morph_id < morph_size; ++morph_id) {
+        ReadWord(output[i * morph_size + morph_id], false, char_to_id,
+                 &forms[i][morph_id], &num_unknown);
+      }
+    }
+    if (num_unknown > 0) {
+      cerr << num_unknown << " predicted characters not in the vocabulary"
+           << endl;
+    }
+  } else {
+    vector<SepMorphInfer> ensmb_nn(argc - 5);
+    vector<SepMorphInfer*> object_pointers;
+    for (unsigned i = 0; i < argc - 5; ++i) {
+      string f = argv[i + 5];
+      if (!Read(f, &ensmb_nn[i])) {
+        return 0;
+      }
+      object_pointers.push_back(&ensmb_nn[i]);
+    }
+    WorkerPool workers(max(num_threads, 1u));
+    for (unsigned morph_id = 0; morph_id < morph_size; ++morph_id) {
+      for (unsigned start = 0; start < lemmas.size(); start += batch_size) {
+        unsigned end = min(start + batch_size, unsigned(lemmas.size()));
+        vector<vector<unsigned> > inputs(lemmas.begin() + start,
+                                         lemmas.begin() + end), preds;
+        EnsembleDecodeBatch(morph_id, char_to_id, inputs, &preds,
+                            &object_pointers, &workers);
+        for (unsigned i = 0; i < preds.size(); ++i) {
+          forms[start + i][morph_id] = preds[i];
+        }
+      }
+      cerr << "Decoded " << id_to_morph[morph_id] << endl;
+    }
+  }
+
+  vector<char> image;
+  if (!BuildInflectionTable(lemmas, forms, char_to_id.size(), morph_size,
+                            &image)) {
+    return 0;
+  }
+  string table_filename = argv[4];
+  ofstream outfile(table_filename, ios::binary);
+  if (!outfile.is_open()) {
+    cerr << "File opening failed" << endl;
+    return 0;
+  }
+  outfile.write(image.data(), image.size());
+  outfile.close();
+  cerr << "Wrote the forms of " << lemmas.size() << " lemmas to "
+       << table_filename << " (" << image.size() << " bytes)" << endl;
+  return 1;
+}
@@ -0,0 +1,43 @@
+#include "utils.h"
+#include "corpus.h"
+
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+
+using namespace std;
+
+int main(int argc, char** argv) {
+  if (argc != 5) {
+    cerr << "Usage: " << argv[0]
+         << " char_vocab.txt morph_vocab.txt infl.txt infl.bin" << endl;
+    return 0;
+  }
+  string vocab_filename = argv[1];  // vocabulary of words/characters
+  string morph_filename = argv[2];
+  string data_filename = argv[3];
+  string corpus_filename = argv[4];
+
+  unordered_map<string, unsigned> char_to_id, morph_to_id;
+  unordered_map<unsigned, string> id_to_char, id_to_morph;
+
+  ReadVocab(vocab_filename, &char_to_id, &id_to_char);
+  ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
+
+  vector<string> data;
+  ReadData(data_filename, &data);
+
+  vector<char> image;
+  CompileCorpus(data, char_to_id, morph_to_id, &image);
+
+  ofstream outfile(corpus_filename, ios::binary);
+  if (!outfile.is_open()) {
+    cerr << "File opening failed" << endl;
+    return 0;
+  }
+  outfile.write(image.data(), image.size());
+  outfile.close();
+  cerr << "Compiled " << data.size() << " lines into " << corpus_filename
+       << " (" << image.size() << " bytes)" << endl;
+  return 1;
+}
@@ -0,0 +1,34 @@
+#include "cnn/cnn.h"
+
+#include "utils.h"
+#include "joint-enc-dec-morph.h"
+
+#include <iostream>
+
+using namespace std;
+using namespace cnn;
+
+// Converts a JointEncDecMorph model saved in the boost text format into the
+// binary model format.
+int main(int argc, char** argv) {
+  cnn::Initialize(argc, argv);
+  if (argc != 3) {
+    cerr << "Usage: " << argv[0] << " text_model.txt binary_model.bin" << endl;
+    return 0;
+  }
+  string input_filename = argv[1];
+  string output_filename = argv[2];
+
+  if (IsBinaryModel(input_filename)) {
+    cerr << "Already a binary model: " << input_filename << endl;
+    return 0;
+  }
+
+  vector<Model*> m;
+  JointEncDecMorph nn;
+  if (!Read(input_filename, &nn, &m)) {
+    return 0;
+  }
+  Serialize(output_filename, nn, &m);
+  return 1;
+}
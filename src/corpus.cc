@@ -0,0 +1,313 @@
+#include "corpus.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+static size_t Align8(const size_t& size) {
+  return (size + 7) & ~size_t(7);
+}
+
+static size_t IdsOffset(const uint64_t& num_rows) {
+  return Align8(sizeof(CorpusHeader) + sizeof(uint32_t) * (2 * num_rows + 1) +
+                sizeof(uint16_t) * num_rows);
+}
+
+Corpus::Corpus() : num_rows(0), offsets(NULL), morph_ids(NULL), ids8(NULL),
+                   ids16(NULL), mapped(NULL), mapped_size(0) {}
+
+Corpus::~Corpus() {
+  if (mapped != NULL) {
+    munmap(mapped, mapped_size);
+  }
+}
+
+void Corpus::GetIds(const unsigned& begin, const unsigned& end,
+                    vector<unsigned>* ids) const {
+  ids->resize(end - begin);
+  if (ids8 != NULL) {
+    for (unsigned i = begin; i < end; ++i) {
+      (*ids)[i - begin] = ids8[i];
+    }
+  } else {
+    for (unsigned i = begin; i < end; ++i) {
+      (*ids)[i - begin] = ids16[i];
+    }
+  }
+}
+
+void Corpus::GetInput(const unsigned& row, vector<unsigned>* input_ids) const {
+  GetIds(offsets[2 * row], offsets[2 * row + 1], input_ids);
+}
+
+void Corpus::GetOutput(const unsigned& row,
+                       vector<unsigned>* output_ids) const {
+  GetIds(offsets[2 * row + 1], offsets[2 * row + 2], output_ids);
+}
+
+string Corpus::Line(const unsigned& row,
+                    unordered_map<unsigned, string>& id_to_char,
+                    unordered_map<unsigned, string>& id_to_morph) const {
+  vector<unsigned> ids;
+  string line = "";
+  GetInput(row, &ids);
+  for (unsigned i = 0; i < ids.size(); ++i) {
+    line += (i > 0 ? " " : "") + id_to_char[ids[i]];
+  }
+  line += "|";
+  GetOutput(row, &ids);
+  for (unsigned i = 0; i < ids.size(); ++i) {
+    line += (i > 0 ? " " : "") + id_to_char[ids[i]];
+  }
+  return line + "|" + id_to_morph[morph_id(row)];
+}
+
+// Checks that the offsets of the rows are increasing and within the ids, and
+// that the ids and tags are in the vocabularies, so that a corrupt image
+// cannot make the readers or the models index out of bounds.
+static bool CheckRows(const uint32_t* offsets, const uint16_t* morph_ids,
+                      const uint64_t& num_rows, const uint8_t* ids8,
+                      const uint16_t* ids16, const uint64_t& num_ids,
+                      const unsigned& char_vocab_size,
+                      const unsigned& morph_vocab_size) {
+  for (uint64_t i = 0; i < 2 * num_rows; ++i) {
+    if (offsets[i] > offsets[i + 1]) {
+      return false;
+    }
+  }
+  if (offsets[2 * num_rows] > num_ids) {
+    return false;
+  }
+  for (uint64_t row = 0; row < num_rows; ++row) {
+    if (morph_ids[row] >= morph_vocab_size) {
+      return false;
+    }
+  }
+  for (uint64_t i = 0; i < num_ids; ++i) {
+    if ((ids8 != NULL ? ids8[i] : ids16[i]) >= char_vocab_size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Corpus::Attach(const char* data, const size_t& size,
+                    const unsigned& char_vocab_size,
+                    const unsigned& morph_vocab_size) {
+  if (size < sizeof(CorpusHeader)) {
+    cerr << "Corpus is truncated" << endl;
+    return false;
+  }
+  const CorpusHeader* header = reinterpret_cast<const CorpusHeader*>(data);
+  if (memcmp(header->magic, kCorpusMagic, sizeof(kCorpusMagic)) != 0 ||
+      header->version != kCorpusVersion) {
+    cerr << "Not a compiled corpus of version " << kCorpusVersion << endl;
+    return false;
+  }
+  if (header->char_vocab_size != char_vocab_size ||
+      header->morph_vocab_size != morph_vocab_size) {
+    cerr << "Corpus was compiled with a different vocabulary" << endl;
+    return false;
+  }
+  if (header->id_bytes != 1 && header->id_bytes != 2) {
+    cerr << "Corpus is corrupt" << endl;
+    return false;
+  }
+  // Every row takes two offsets and a tag, so the number of rows is bounded
+  // by the size before any offset is computed from it. Rows are indexed with
+  // 32 bits.
+  const size_t row_bytes = 2 * sizeof(uint32_t) + sizeof(uint16_t);
+  if (header->num_rows > (size - sizeof(CorpusHeader)) / row_bytes ||
+      header->num_rows > UINT32_MAX) {
+    cerr << "Corpus is truncated" << endl;
+    return false;
+  }
+  size_t ids_offset = IdsOffset(header->num_rows);
+  if (size < ids_offset ||
+      header->num_ids > (size - ids_offset) / header->id_bytes) {
+    cerr << "Corpus is truncated" << endl;
+    return false;
+  }
+
+  const uint32_t* row_offsets =
+      reinterpret_cast<const uint32_t*>(data + sizeof(CorpusHeader));
+  const uint16_t* row_morph_ids = reinterpret_cast<const uint16_t*>(
+      row_offsets + 2 * header->num_rows + 1);
+  const uint8_t* row_ids8 = NULL;
+  const uint16_t* row_ids16 = NULL;
+  if (header->id_bytes == 1) {
+    row_ids8 = reinterpret_cast<const uint8_t*>(data + ids_offset);
+  } else {
+    row_ids16 = reinterpret_cast<const uint16_t*>(data + ids_offset);
+  }
+  if (!CheckRows(row_offsets, row_morph_ids, header->num_rows, row_ids8,
+                 row_ids16, header->num_ids, char_vocab_size,
+                 morph_vocab_size)) {
+    cerr << "Corpus is corrupt" << endl;
+    return false;
+  }
+
+  num_rows = header->num_rows;
+  offsets = row_offsets;
+  morph_ids = row_morph_ids;
+  ids8 = row_ids8;
+  ids16 = row_ids16;
+  return true;
+}
+
+bool Corpus::Map(const string& filename, const unsigned& char_vocab_size,
+                 const unsigned& morph_vocab_size) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "File opening failed" << endl;
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) < 0 || file_stat.st_size == 0) {
+    cerr << "File opening failed" << endl;
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    cerr << "Memory mapping failed: " << filename << endl;
+    return false;
+  }
+  // Training makes several sequential passes over the whole file.
+  madvise(data, file_stat.st_size, MADV_WILLNEED);
+
+  if (mapped != NULL) {
+    munmap(mapped, mapped_size);
+  }
+  mapped = data;
+  mapped_size = file_stat.st_size;
+  return Attach(static_cast<const char*>(data), mapped_size, char_vocab_size,
+                morph_vocab_size);
+}
+
+static unsigned LookupId(unordered_map<string, unsigned>& item_to_id,
+                         const string& item, unsigned* num_unknown) {
+  auto it = item_to_id.find(item);
+  if (it == item_to_id.end()) {
+    ++*num_unknown;
+    return 0;
+  }
+  return it->second;
+}
+
+void CompileCorpus(const vector<string>& data,
+                   unordered_map<string, unsigned>& char_to_id,
+                   unordered_map<string, unsigned>& morph_to_id,
+                   vector<char>* image) {
+  vector<uint32_t> offsets(1, 0);
+  vector<uint16_t> morph_ids;
+  vector<uint16_t> ids;
+  unsigned num_unknown = 0;
+  for (const string& line : data) {
+    vector<string> items = split_line(line, '|');
+    if (items.size() < 3) {
+      continue;
+    }
+    for (unsigned field = 0; field < 2; ++field) {
+      for (const string& ch : split_line(items[field], ' ')) {
+        ids.push_back(LookupId(char_to_id, ch, &num_unknown));
+      }
+      offsets.push_back(ids.size());
+    }
+    morph_ids.push_back(LookupId(morph_to_id, items[2], &num_unknown));
+  }
+  if (num_unknown > 0) {
+    cerr << num_unknown << " characters or tags not in the vocabulary" << endl;
+  }
+
+  CorpusHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kCorpusMagic, sizeof(kCorpusMagic));
+  header.version = kCorpusVersion;
+  header.id_bytes = char_to_id.size() <= 256 ? 1 : 2;
+  header.char_vocab_size = char_to_id.size();
+  header.morph_vocab_size = morph_to_id.size();
+  header.num_rows = morph_ids.size();
+  header.num_ids = ids.size();
+
+  size_t ids_offset = IdsOffset(header.num_rows);
+  image->assign(ids_offset + header.id_bytes * header.num_ids, 0);
+  char* out = image->data();
+  memcpy(out, &header, sizeof(header));
+  memcpy(out + sizeof(header), offsets.data(),
+         sizeof(uint32_t) * offsets.size());
+  memcpy(out + sizeof(header) + sizeof(uint32_t) * offsets.size(),
+         morph_ids.data(), sizeof(uint16_t) * morph_ids.size());
+  if (header.id_bytes == 1) {
+    for (size_t i = 0; i < ids.size(); ++i) {
+      out[ids_offset + i] = static_cast<char>(ids[i]);
+    }
+  } else {
+    memcpy(out + ids_offset, ids.data(), sizeof(uint16_t) * ids.size());
+  }
+}
+
+bool ReadCorpus(const string& filename,
+                unordered_map<string, unsigned>& char_to_id,
+                unordered_map<string, unsigned>& morph_to_id, Corpus* corpus) {
+  char magic[sizeof(kCorpusMagic)] = {0};
+  ifstream infile(filename, ios::binary);
+  if (!infile.is_open()) {
+    cerr << "File opening failed" << endl;
+    return false;
+  }
+  infile.read(magic, sizeof(magic));
+  infile.close();
+
+  if (memcmp(magic, kCorpusMagic, sizeof(kCorpusMagic)) == 0) {
+    return corpus->Map(filename, char_to_id.size(), morph_to_id.size());
+  }
+  vector<string> data;
+  string name = filename;
+  ReadData(name, &data);
+  CompileCorpus(data, char_to_id, morph_to_id, &corpus->buffer);
+  return corpus->Attach(corpus->buffer.data(), corpus->buffer.size(),
+                        char_to_id.size(), morph_to_id.size());
+}
+
+bool SplitRequest(const string& line, string* lemma, string* tag) {
+  size_t begin = line.find_first_not_of(" \t");
+  size_t end = line.find_first_not_of("0123456789", begin);
+  if (begin != string::npos && end != begin && end != string::npos &&
+      (line[end] == ' ' || line[end] == '\t')) {
+    begin = end + 1;  // Skip the count
+  }
+  vector<string> items =
+      split_line(begin == string::npos ? "" : line.substr(begin), '|');
+  if (items.size() < 2) {
+    return false;
+  }
+  *lemma = items[0];
+  *tag = items.back();
+  return true;
+}
+
+bool ReadRequests(const string& filename,
+                  unordered_map<string, unsigned>& char_to_id,
+                  unordered_map<string, unsigned>& morph_to_id,
+                  Corpus* corpus) {
+  ifstream infile(filename);
+  if (!infile.is_open()) {
+    cerr << "File opening failed" << endl;
+    return false;
+  }
+  vector<string> data;
+  string line, lemma, tag;
+  while (getline(infile, line)) {
+    if (SplitRequest(line, &lemma, &tag)) {
+      data.push_back(lemma + "|" + lemma + "|" + tag);
+    }
+  }
+  CompileCorpus(data, char_to_id, morph_to_id, &corpus->buffer);
+  return corpus->Attach(corpus->buffer.data(), corpus->buffer.size(),
+                        char_to_id.size(), morph_to_id.size());
+}
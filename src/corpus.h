@@ -0,0 +1,112 @@
+#ifndef CORPUS_H_
+#define CORPUS_H_
+
+#include "utils.h"
+
+#include <cstdint>
+#include <unordered_map>
+
+using namespace std;
+
+// A compiled corpus file starts with this header, followed by:
+//   uint32 offsets[2 * num_rows + 1]  row r reads its input from
+//                                     ids[offsets[2r], offsets[2r+1]) and
+//                                     its output from
+//                                     ids[offsets[2r+1], offsets[2r+2])
+//   uint16 morph_ids[num_rows]
+//   padding up to a multiple of 8 bytes
+//   ids[num_ids]                      uint8 if the vocabulary has at most 256
+//                                     characters and uint16 otherwise
+// The vocabulary sizes are stored to catch files compiled with a different
+// vocabulary.
+struct CorpusHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t id_bytes;
+  uint32_t char_vocab_size;
+  uint32_t morph_vocab_size;
+  uint64_t num_rows;
+  uint64_t num_ids;
+};
+
+const char kCorpusMagic[8] = {'I', 'N', 'F', 'L', 'C', 'R', 'P', '\0'};
+const uint32_t kCorpusVersion = 1;
+
+// Read-only view of the inflection data, either memory-mapped from a
+// compiled corpus file or compiled in memory from the text format. Iterating
+// over it does not allocate once the output vectors have grown to the
+// longest row.
+class Corpus {
+ public:
+  Corpus();
+  ~Corpus();
+
+  unsigned size() const { return num_rows; }
+  unsigned morph_id(const unsigned& row) const { return morph_ids[row]; }
+  unsigned input_size(const unsigned& row) const {
+    return offsets[2 * row + 1] - offsets[2 * row];
+  }
+  unsigned output_size(const unsigned& row) const {
+    return offsets[2 * row + 2] - offsets[2 * row + 1];
+  }
+
+  void GetInput(const unsigned& row, vector<unsigned>* input_ids) const;
+  void GetOutput(const unsigned& row, vector<unsigned>* output_ids) const;
+
+  // Rebuilds the "<s> a b </s>|<s> a b c </s>|tag" line of a row.
+  string Line(const unsigned& row, unordered_map<unsigned, string>& id_to_char,
+              unordered_map<unsigned, string>& id_to_morph) const;
+
+  // Points the corpus at a compiled image. Returns false if the image is not
+  // a valid corpus for the given vocabulary sizes.
+  bool Attach(const char* data, const size_t& size,
+              const unsigned& char_vocab_size,
+              const unsigned& morph_vocab_size);
+
+  // Memory-maps a compiled corpus file and attaches to it.
+  bool Map(const string& filename, const unsigned& char_vocab_size,
+           const unsigned& morph_vocab_size);
+
+  vector<char> buffer;  // Owns the image when it is not memory-mapped
+
+ private:
+  Corpus(const Corpus&);
+  Corpus& operator=(const Corpus&);
+  void GetIds(const unsigned& begin, const unsigned& end,
+              vector<unsigned>* ids) const;
+
+  unsigned num_rows;
+  const uint32_t* offsets;
+  const uint16_t* morph_ids;
+  const uint8_t* ids8;
+  const uint16_t* ids16;
+  void* mapped;
+  size_t mapped_size;
+};
+
+// Compiles the text format into a corpus image. Characters and tags missing
+// from the vocabularies are mapped to id 0, as the text readers do.
+void CompileCorpus(const vector<string>& data,
+                   unordered_map<string, unsigned>& char_to_id,
+                   unordered_map<string, unsigned>& morph_to_id,
+                   vector<char>* image);
+
+// Loads either a compiled corpus file, which is memory-mapped, or a file in
+// the text format, which is compiled in memory.
+bool ReadCorpus(const string& filename,
+                unordered_map<string, unsigned>& char_to_id,
+                unordered_map<string, unsigned>& morph_to_id, Corpus* corpus);
+
+// Splits a request, "lemma|tag" or a line of the data "lemma|form|tag",
+// optionally preceded by its count as uniq -c writes it, into the lemma and
+// the tag. Returns false if the line is not a request.
+bool SplitRequest(const string& line, string* lemma, string* tag);
+
+// Loads a file of requests (see SplitRequest()) as a corpus whose outputs
+// are the lemmas.
+bool ReadRequests(const string& filename,
+                  unordered_map<string, unsigned>& char_to_id,
+                  unordered_map<string, unsigned>& morph_to_id,
+                  Corpus* corpus);
+
+#endif
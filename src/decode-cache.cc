@@ -0,0 +1,35 @@
+#include "decode-cache.h"
+
+using namespace std;
+
+size_t DecodeKeyHash::operator()(const DecodeKey& key) const {
+  size_t seed = key.model_id * 0x9e3779b9u + key.morph_id;
+  for (const unsigned& id : key.input_ids) {
+    HashCombine(id, &seed);
+  }
+  return seed;
+}
+
+bool DecodeCache::Find(const DecodeKey& key, DecodeResult* result) {
+  return cache.Find(key, [result](const DecodeResult& cached) {
+    *result = cached;
+  });
+}
+
+void DecodeCache::Insert(const DecodeKey& key, const DecodeResult& result) {
+  cache.Insert(key, [&result](DecodeResult* cached) {
+    *cached = result;
+  });
+}
+
+void DecodeCache::Decode(const DecodeKey& key,
+                         const DecodeOutputFunc& decode,
+                         DecodeResult* result) {
+  if (Find(key, result)) {
+    return;
+  }
+  result->sequences.clear();
+  result->scores.clear();
+  decode(result);
+  Insert(key, *result);
+}
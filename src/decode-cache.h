@@ -0,0 +1,72 @@
+#ifndef DECODE_CACHE_H_
+#define DECODE_CACHE_H_
+
+#include "sharded-lru-cache.h"
+
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+// What a decode is asked for. model_id tells apart the models, or the
+// decoding settings such as the beam size, that share a cache.
+struct DecodeKey {
+  unsigned model_id, morph_id;
+  vector<unsigned> input_ids;
+
+  bool operator==(const DecodeKey& other) const {
+    return model_id == other.model_id && morph_id == other.morph_id &&
+           input_ids == other.input_ids;
+  }
+};
+
+struct DecodeKeyHash {
+  size_t operator()(const DecodeKey& key) const;
+};
+
+// The output of a decode: the prediction, or the strings of a beam with
+// their scores.
+struct DecodeResult {
+  vector<vector<unsigned> > sequences;
+  vector<float> scores;
+};
+
+typedef CacheStats DecodeCacheStats;
+
+typedef function<void(DecodeResult* result)> DecodeOutputFunc;
+
+// A bounded cache of decoded outputs, evicting the least recently used one
+// when it is full, shared by the threads serving the words (see
+// ShardedLRUCache). A shard is not locked while a missing output is being
+// decoded, so two threads missing the same key at the same time both decode
+// it.
+class DecodeCache {
+ public:
+  // Keeps at most about capacity outputs, split evenly over at most
+  // num_shards shards.
+  DecodeCache(const unsigned& capacity, const unsigned& num_shards = 16)
+      : cache(capacity, num_shards) {}
+
+  // Copies the cached output of key to result and returns true, or returns
+  // false if it is not cached.
+  bool Find(const DecodeKey& key, DecodeResult* result);
+
+  // Caches the output of key, evicting the least recently used output of
+  // its shard if the shard is full.
+  void Insert(const DecodeKey& key, const DecodeResult& result);
+
+  // Returns the cached output of key, or calls decode and caches its output.
+  void Decode(const DecodeKey& key, const DecodeOutputFunc& decode,
+              DecodeResult* result);
+
+  // The sums of the counters of all the shards.
+  DecodeCacheStats Stats() { return cache.Stats(); }
+
+  // Zeroes the counters, e.g. after warming the cache.
+  void ResetStats() { cache.ResetStats(); }
+
+ private:
+  ShardedLRUCache<DecodeKey, DecodeResult, DecodeKeyHash> cache;
+};
+
+#endif
@@ -10,7 +10,9 @@
 #include "cnn/gpu-ops.h"
 #include "cnn/expr.h"
 
+#include "beam-search.h"
 #include "utils.h"
+#include "model-io.h"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -39,6 +41,10 @@ class EncDecAttn {
   unsigned char_len, hidden_len, vocab_len, layers, morph_len, max_eps = 5;
   vector<LookupParameters*> eps_vecs;
 
+  MappedModel* lazy_model = NULL;  // NULL unless read from a binary model
+  int loaded_tag = -1;  // The tag the parameters point at, -1 for none
+  Model* tag_model = NULL;
+
   EncDecAttn() {}
 
   EncDecAttn(const unsigned& char_length, const unsigned& hidden_length,
@@ -48,12 +54,30 @@ class EncDecAttn {
 
   void InitParams(vector<Model*>* m);
 
+  void InitParams(const unsigned& morph_id, Model* m);
+
+  void ResizeParams();
+
+  // Lazy loading: the tags share one set of parameters, which LoadTag()
+  // points at the weights of a tag in the mapped model whenever
+  // AddParamsToCG() switches to another tag.
+  void InitLazy(MappedModel* mapped);
+
+  // Returns false if the parameters of the tag do not match the model.
+  bool LoadTag(const unsigned& morph_id);
+
   void AddParamsToCG(const unsigned& morph_id, ComputationGraph* cg);
 
   void RunFwdBwd(const unsigned& morph_id, const vector<unsigned>& inputs,
                  Expression* hidden, vector<Expression>* all_hidden, 
                  ComputationGraph *cg);
 
+  // Encodes a batch of inputs which all have the same length.
+  void RunFwdBwd(const unsigned& morph_id,
+                 const vector<vector<unsigned> >& inputs,
+                 Expression* hidden, vector<Expression>* all_hidden,
+                 ComputationGraph *cg);
+
   Expression GetAvgAttnLayer(const Expression& hidden,
                            const vector<Expression>& all_input_hidden) const ;
 
@@ -69,9 +93,20 @@ class EncDecAttn {
                          const vector<unsigned>& targets,
                          const vector<Expression>& all_input_hidden) const;
 
+  Expression ComputeLoss(const vector<Expression>& hidden_units,
+                         const vector<vector<unsigned> >& targets,
+                         const vector<Expression>& all_input_hidden) const;
+
   float Train(const unsigned& morph_id, const vector<unsigned>& inputs,
               const vector<unsigned>& outputs, AdadeltaTrainer* ada_gd);
 
+  // Trains on a batch of examples that all have the same input length and
+  // the same output length, with one update for the whole batch.
+  float TrainBatch(const unsigned& morph_id,
+                   const vector<vector<unsigned> >& inputs,
+                   const vector<vector<unsigned> >& outputs,
+                   AdadeltaTrainer* ada_gd);
+
   friend class boost::serialization::access;
   template<class Archive> void serialize(Archive& ar, const unsigned int) {
     ar & char_len;
@@ -93,11 +128,16 @@ EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
                    unordered_map<string, unsigned>& char_to_id,
                    const vector<unsigned>& input_ids,
                    vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
-                   vector<EncDecAttn*>* ensmb_model);
+                   vector<EncDecAttn*>* ensmb_model,
+                   const BeamPruning& pruning = BeamPruning(),
+                   BeamStats* stats = NULL);
 
 void Serialize(string& filename, EncDecAttn& model, vector<Model*>* cnn_model);
 
-void Read(string& filename, EncDecAttn* model, vector<Model*>* cnn_model);
+// Reads a model, returning false on failure. A binary model is mapped and
+// its tags are loaded lazily, see InitLazy(); only the text models fill
+// cnn_model.
+bool Read(string& filename, EncDecAttn* model, vector<Model*>* cnn_model);
 
 
 #endif
@@ -11,6 +11,7 @@ This file outputs all the strings in the beam.
 #include "cnn/expr.h"
 
 #include "utils.h"
+#include "corpus.h"
 #include "joint-enc-morph.h"
 
 #include <iostream>
@@ -22,6 +23,16 @@ using namespace cnn::expr;
 
 int main(int argc, char** argv) {
   cnn::Initialize(argc, argv);
+  // Beam pruning: --beam-threshold=X skips hypotheses more than X below the
+  // best unfinished one, --beam-stop=1 the ones which cannot beat the best
+  // finished one, --beam-per-parent=N keeps N candidates per hypothesis.
+  BeamPruning pruning;
+  pruning.threshold =
+      atof(GetOption("beam-threshold", "inf", &argc, argv).c_str());
+  pruning.stop_early =
+      atoi(GetOption("beam-stop", "0", &argc, argv).c_str()) != 0;
+  pruning.max_per_parent =
+      atoi(GetOption("beam-per-parent", "0", &argc, argv).c_str());
 
   string vocab_filename = argv[1];  // vocabulary of words/characters
   string morph_filename = argv[2];
@@ -36,8 +47,10 @@ int main(int argc, char** argv) {
   ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
   unsigned morph_size = morph_to_id.size();
 
-  vector<string> test_data;  // Read the dev file in a vector
-  ReadData(test_filename, &test_data);
+  Corpus test_data;  // Read the test file, either as text or a compiled corpus
+  if (!ReadCorpus(test_filename, char_to_id, morph_to_id, &test_data)) {
+    return 0;
+  }
 
   vector<vector<Model*> > ensmb_m;
   vector<JointEncMorph> ensmb_nn;
@@ -45,7 +58,9 @@ int main(int argc, char** argv) {
     vector<Model*> m;
     JointEncMorph nn;
     string f = argv[i + 5];
-    Read(f, &nn, &m);
+    if (!Read(f, &nn, &m)) {
+      return 0;
+    }
     ensmb_m.push_back(m);
     ensmb_nn.push_back(nn);
   }
@@ -58,25 +73,25 @@ int main(int argc, char** argv) {
     object_pointers.push_back(&ensmb_nn[i]);
   }
 
-  for (string& line : test_data) {
-    vector<string> items = split_line(line, '|');
-    vector<unsigned> input_ids, target_ids, pred_target_ids;
-    input_ids.clear(); target_ids.clear(); pred_target_ids.clear();
-    for (const string& ch : split_line(items[0], ' ')) {
-      input_ids.push_back(char_to_id[ch]);
-    }
-    for (const string& ch : split_line(items[1], ' ')) {
-      target_ids.push_back(char_to_id[ch]);
-    }
+  BeamStats beam_stats;
+  vector<unsigned> input_ids, target_ids, pred_target_ids;
+  for (unsigned row = 0; row < test_data.size(); ++row) {
+    pred_target_ids.clear();
+    test_data.GetInput(row, &input_ids);
+    test_data.GetOutput(row, &target_ids);
 
     vector<vector<unsigned> > pred_beams;
     vector<float> beam_score;
-    unsigned morph_id = morph_to_id[items[2]];
+    unsigned morph_id = test_data.morph_id(row);
+    BeamStats word_stats;
     EnsembleBeamDecode(morph_id, beam_size, char_to_id, input_ids, &pred_beams,
-                       &beam_score, &object_pointers);
+                       &beam_score, &object_pointers, pruning, &word_stats);
+    beam_stats.Add(word_stats);
+    total += 1;
 
-    cout << "GOLD: " << line << endl;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
+    cout << "GOLD: " << test_data.Line(row, id_to_char, id_to_morph)
+         << endl;
+    for (unsigned beam_id = 0; beam_id < pred_beams.size(); ++beam_id) {
       pred_target_ids = pred_beams[beam_id];
       string prediction = "";
       for (unsigned i = 0; i < pred_target_ids.size(); ++i) { 
@@ -88,5 +103,7 @@ int main(int argc, char** argv) {
       cout << "PRED: " << prediction << " " << beam_score[beam_id] << endl;
     }
   }
+  cerr << "Expanded " << beam_stats.expanded / total
+       << " hypotheses per word, pruned " << beam_stats.pruned / total << endl;
   return 1;
 }
@@ -8,8 +8,10 @@
 #include "cnn/expr.h"
 
 #include "utils.h"
+#include "corpus.h"
 #include "joint-enc-dec-morph.h"
 
+#include <chrono>
 #include <iostream>
 #include <fstream>
 
@@ -19,6 +21,17 @@ using namespace cnn::expr;
 
 int main(int argc, char** argv) {
   cnn::Initialize(argc, argv);
+  // With --paradigm=1 every lemma is encoded once and decoded with all the
+  // tags together, see EnsembleDecodeParadigm(), and the rows of the lemma
+  // that follow it take their tag's prediction.
+  bool paradigm = atoi(GetOption("paradigm", "0", &argc, argv).c_str()) != 0;
+  // Otherwise --batch=N decodes the words N at a time, in batches of words
+  // with the same tag and input length, see EnsembleBatchDecode().
+  unsigned batch_size = atoi(GetOption("batch", "1", &argc, argv).c_str());
+  // With --forms=forms.txt the prediction of every row is also written to
+  // forms.txt, one per line in the order of the rows, which is what
+  // build-inflection-table --forms reads.
+  string forms_filename = GetOption("forms", "", &argc, argv);
 
   string vocab_filename = argv[1];  // vocabulary of words/characters
   string morph_filename = argv[2];
@@ -32,8 +45,10 @@ int main(int argc, char** argv) {
   ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
   unsigned morph_size = morph_to_id.size();
 
-  vector<string> test_data;  // Read the dev file in a vector
-  ReadData(test_filename, &test_data);
+  Corpus test_data;  // Read the test file, either as text or a compiled corpus
+  if (!ReadCorpus(test_filename, char_to_id, morph_to_id, &test_data)) {
+    return 0;
+  }
 
   vector<vector<Model*> > ensmb_m;
   vector<JointEncDecMorph> ensmb_nn;
@@ -41,31 +56,76 @@ int main(int argc, char** argv) {
     vector<Model*> m;
     JointEncDecMorph nn;
     string f = argv[i + 4];
-    Read(f, &nn, &m);
+    if (!Read(f, &nn, &m)) {
+      return 0;
+    }
     ensmb_m.push_back(m);
     ensmb_nn.push_back(nn);
   }
 
+  ofstream forms_file;
+  if (!forms_filename.empty()) {
+    forms_file.open(forms_filename);
+    if (!forms_file.is_open()) {
+      cerr << "Could not write " << forms_filename << endl;
+      return 0;
+    }
+  }
+
   // Read the test file and output predictions for the words.
   string line;
   vector<JointEncDecMorph*> object_pointers;
   for (unsigned i = 0; i < ensmb_nn.size(); ++i) {
     object_pointers.push_back(&ensmb_nn[i]);
   }
-  double correct = 0, total = 0;
-  for (string& line : test_data) {
-    vector<string> items = split_line(line, '|');
-    vector<unsigned> input_ids, target_ids, pred_target_ids;
-    input_ids.clear(); target_ids.clear(); pred_target_ids.clear();
-    for (const string& ch : split_line(items[0], ' ')) {
-      input_ids.push_back(char_to_id[ch]);
+  double correct = 0, total = 0, num_paradigms = 0;
+  vector<unsigned> input_ids, target_ids, pred_target_ids, paradigm_input;
+  vector<vector<unsigned> > paradigm_preds;
+
+  auto start = chrono::steady_clock::now();
+  // The batches are decoded first, and the loop below takes their
+  // predictions.
+  vector<vector<unsigned> > batch_preds(test_data.size());
+  if (!paradigm && batch_size > 1) {
+    vector<vector<unsigned> > keys, batches;
+    for (unsigned row = 0; row < test_data.size(); ++row) {
+      keys.push_back({test_data.morph_id(row), test_data.input_size(row)});
     }
-    for (const string& ch : split_line(items[1], ' ')) {
-      target_ids.push_back(char_to_id[ch]);
+    MakeBatches(keys, batch_size, &batches);
+    vector<vector<unsigned> > inputs, preds;
+    for (const vector<unsigned>& batch : batches) {
+      inputs.clear();
+      for (const unsigned& row : batch) {
+        test_data.GetInput(row, &input_ids);
+        inputs.push_back(input_ids);
+      }
+      EnsembleBatchDecode(keys[batch[0]][0], char_to_id, inputs, &preds,
+                          &object_pointers);
+      for (unsigned i = 0; i < batch.size(); ++i) {
+        batch_preds[batch[i]] = preds[i];
+      }
+    }
+  }
+
+  for (unsigned row = 0; row < test_data.size(); ++row) {
+    pred_target_ids.clear();
+    test_data.GetInput(row, &input_ids);
+    test_data.GetOutput(row, &target_ids);
+    unsigned morph_id = test_data.morph_id(row);
+    if (paradigm) {
+      if (paradigm_preds.empty() || input_ids != paradigm_input) {
+        paradigm_input = input_ids;
+        EnsembleDecodeParadigm(char_to_id, input_ids, &paradigm_preds,
+                               &object_pointers);
+        num_paradigms += 1;
+      }
+      pred_target_ids = paradigm_preds[morph_id];
+    } else if (batch_size > 1) {
+      pred_target_ids = batch_preds[row];
+    } else {
+      EnsembleDecode(morph_id, char_to_id, input_ids, &pred_target_ids,
+                     &object_pointers);
     }
-    unsigned morph_id = morph_to_id[items[2]];
-    EnsembleDecode(morph_id, char_to_id, input_ids, &pred_target_ids,
-                   &object_pointers);
 
     string prediction = "";
     for (unsigned i = 0; i < pred_target_ids.size(); ++i) {
@@ -74,14 +134,27 @@ int main(int argc, char** argv) {
         prediction += " ";
       }
     }
-    if (prediction == items[1]) {
+    if (forms_file.is_open()) {
+      forms_file << prediction << endl;
+    }
+    if (pred_target_ids == target_ids) {
       correct += 1;     
     } else {
+      string line = test_data.Line(row, id_to_char, id_to_morph);
+      vector<string> items = split_line(line, '|');
       cout << "GOLD: " << line << endl;
       cout << "PRED: " << items[0] << "|" << prediction << "|" << items[2] << endl;
     }
     total += 1;
   }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() -
+                                            start).count();
   cerr << "Prediction Accuracy: " << correct / total << endl;
+  if (paradigm) {
+    cerr << "Decoded " << num_paradigms << " paradigms for " << total
+         << " words" << endl;
+  }
+  cerr << "Decoded " << total << " words in " << seconds << " seconds ("
+       << total / seconds << " words/sec)" << endl;
   return 1;
 }
@@ -0,0 +1,130 @@
+/*
+This file outputs all the strings in the beam of the models combined with
+the character LM.
+*/
+#include "cnn/nodes.h"
+#include "cnn/cnn.h"
+#include "cnn/rnn.h"
+#include "cnn/gru.h"
+#include "cnn/lstm.h"
+#include "cnn/training.h"
+#include "cnn/gpu-ops.h"
+#include "cnn/expr.h"
+
+#include "lm.h"
+#include "lm-cache.h"
+#include "utils.h"
+#include "corpus.h"
+#include "lm-joint-enc.h"
+
+#include <iostream>
+#include <fstream>
+
+using namespace std;
+using namespace cnn;
+using namespace cnn::expr;
+
+int main(int argc, char** argv) {
+  cnn::Initialize(argc, argv);
+  // Beam pruning: --beam-threshold=X skips hypotheses more than X below the
+  // best unfinished one, --beam-stop=1 the ones which cannot beat the best
+  // finished one, --beam-per-parent=N keeps N candidates per hypothesis.
+  BeamPruning pruning;
+  pruning.threshold =
+      atof(GetOption("beam-threshold", "inf", &argc, argv).c_str());
+  pruning.stop_early =
+      atoi(GetOption("beam-stop", "0", &argc, argv).c_str()) != 0;
+  pruning.max_per_parent =
+      atoi(GetOption("beam-per-parent", "0", &argc, argv).c_str());
+  // With --lm-cache=N the LM keeps the next-character distributions of the
+  // last N contexts it scored.
+  unsigned lm_cache_size =
+      atoi(GetOption("lm-cache", "0", &argc, argv).c_str());
+
+  string vocab_filename = argv[1];  // vocabulary of words/characters
+  string morph_filename = argv[2];
+  string test_filename = argv[3];
+  string lm_model_filename = argv[4];
+  unsigned beam_size = atoi(argv[5]);
+
+  unordered_map<string, unsigned> char_to_id, morph_to_id;
+  unordered_map<unsigned, string> id_to_char, id_to_morph;
+
+  ReadVocab(vocab_filename, &char_to_id, &id_to_char);
+  unsigned vocab_size = char_to_id.size();
+  ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
+  unsigned morph_size = morph_to_id.size();
+
+  Corpus test_data;  // Read the test file, either as text or a compiled corpus
+  if (!ReadCorpus(test_filename, char_to_id, morph_to_id, &test_data)) {
+    return 0;
+  }
+
+  LM lm(lm_model_filename, char_to_id, id_to_char);
+  LMCache lm_cache(lm_cache_size, lm.vocab_size());
+  if (lm_cache_size > 0) {
+    lm.SetCache(&lm_cache);
+  }
+
+  vector<vector<Model*> > ensmb_m;
+  vector<LMJointEnc> ensmb_nn;
+  for (unsigned i = 0; i < argc - 6; ++i) {
+    vector<Model*> m;
+    LMJointEnc nn;
+    string f = argv[i + 6];
+    if (!Read(f, &nn, &m)) {
+      return 0;
+    }
+    ensmb_m.push_back(m);
+    ensmb_nn.push_back(nn);
+  }
+
+  // Read the test file and output predictions for the words.
+  string line;
+  double correct = 0, total = 0;
+  vector<LMJointEnc*> object_pointers;
+  for (unsigned i = 0; i < ensmb_nn.size(); ++i) {
+    object_pointers.push_back(&ensmb_nn[i]);
+  }
+
+  BeamStats beam_stats;
+  vector<unsigned> input_ids, target_ids, pred_target_ids;
+  for (unsigned row = 0; row < test_data.size(); ++row) {
+    pred_target_ids.clear();
+    test_data.GetInput(row, &input_ids);
+    test_data.GetOutput(row, &target_ids);
+
+    vector<vector<unsigned> > pred_beams;
+    vector<float> beam_score;
+    unsigned morph_id = test_data.morph_id(row);
+    BeamStats word_stats;
+    EnsembleBeamDecode(morph_id, beam_size, char_to_id, input_ids, &pred_beams,
+                       &beam_score, &lm, &object_pointers, pruning,
+                       &word_stats);
+    beam_stats.Add(word_stats);
+    total += 1;
+
+    cout << "GOLD: " << test_data.Line(row, id_to_char, id_to_morph)
+         << endl;
+    for (unsigned beam_id = 0; beam_id < pred_beams.size(); ++beam_id) {
+      pred_target_ids = pred_beams[beam_id];
+      string prediction = "";
+      for (unsigned i = 0; i < pred_target_ids.size(); ++i) { 
+        prediction += id_to_char[pred_target_ids[i]];
+        if (i != pred_target_ids.size() - 1) {
+          prediction += " ";
+        }
+      }
+      cout << "PRED: " << prediction << " " << beam_score[beam_id] << endl;
+    }
+  }
+  if (lm_cache_size > 0) {
+    LMCacheStats cache_stats = lm_cache.Stats();
+    cerr << "LM cache hits: " << cache_stats.hits << ", misses: "
+         << cache_stats.misses << ", evictions: " << cache_stats.evictions
+         << endl;
+  }
+  cerr << "Expanded " << beam_stats.expanded / total
+       << " hypotheses per word, pruned " << beam_stats.pruned / total << endl;
+  return 1;
+}
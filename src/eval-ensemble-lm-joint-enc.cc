@@ -8,7 +8,9 @@
 #include "cnn/expr.h"
 
 #include "lm.h"
+#include "lm-cache.h"
 #include "utils.h"
+#include "corpus.h"
 #include "lm-joint-enc.h"
 
 #include <iostream>
@@ -20,6 +22,18 @@ using namespace cnn::expr;
 
 int main(int argc, char** argv) {
   cnn::Initialize(argc, argv);
+  // With --paradigm=1 every lemma is encoded once and decoded with all the
+  // tags together, see EnsembleDecodeParadigm(), and the rows of the lemma
+  // that follow it take their tag's prediction.
+  bool paradigm = atoi(GetOption("paradigm", "0", &argc, argv).c_str()) != 0;
+  // With --lm-cache=N the LM keeps the next-character distributions of the
+  // last N contexts it scored.
+  unsigned lm_cache_size =
+      atoi(GetOption("lm-cache", "0", &argc, argv).c_str());
+  // With --forms=forms.txt the prediction of every row is also written to
+  // forms.txt, one per line in the order of the rows, which is what
+  // build-inflection-table --forms reads.
+  string forms_filename = GetOption("forms", "", &argc, argv);
 
   string vocab_filename = argv[1];  // vocabulary of words/characters
   string morph_filename = argv[2];
@@ -34,10 +48,16 @@ int main(int argc, char** argv) {
   ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
   unsigned morph_size = morph_to_id.size();
 
-  vector<string> test_data;  // Read the dev file in a vector
-  ReadData(test_filename, &test_data);
+  Corpus test_data;  // Read the test file, either as text or a compiled corpus
+  if (!ReadCorpus(test_filename, char_to_id, morph_to_id, &test_data)) {
+    return 0;
+  }
 
   LM lm(lm_model_filename, char_to_id, id_to_char);
+  LMCache lm_cache(lm_cache_size, lm.vocab_size());
+  if (lm_cache_size > 0) {
+    lm.SetCache(&lm_cache);
+  }
 
   vector<vector<Model*> > ensmb_m;
   vector<LMJointEnc> ensmb_nn;
@@ -45,31 +65,48 @@ int main(int argc, char** argv) {
     vector<Model*> m;
     LMJointEnc nn;
     string f = argv[i + 5];
-    Read(f, &nn, &m);
+    if (!Read(f, &nn, &m)) {
+      return 0;
+    }
     ensmb_m.push_back(m);
     ensmb_nn.push_back(nn);
   }
 
+  ofstream forms_file;
+  if (!forms_filename.empty()) {
+    forms_file.open(forms_filename);
+    if (!forms_file.is_open()) {
+      cerr << "Could not write " << forms_filename << endl;
+      return 0;
+    }
+  }
+
   // Read the test file and output predictions for the words.
   string line;
   vector<LMJointEnc*> object_pointers;
   for (unsigned i = 0; i < ensmb_nn.size(); ++i) {
     object_pointers.push_back(&ensmb_nn[i]);
   }
-  double correct = 0, total = 0;
-  for (string& line : test_data) {
-    vector<string> items = split_line(line, '|');
-    vector<unsigned> input_ids, target_ids, pred_target_ids;
-    input_ids.clear(); target_ids.clear(); pred_target_ids.clear();
-    for (const string& ch : split_line(items[0], ' ')) {
-      input_ids.push_back(char_to_id[ch]);
-    }
-    for (const string& ch : split_line(items[1], ' ')) {
-      target_ids.push_back(char_to_id[ch]);
+  double correct = 0, total = 0, num_paradigms = 0;
+  vector<unsigned> input_ids, target_ids, pred_target_ids, paradigm_input;
+  vector<vector<unsigned> > paradigm_preds;
+  for (unsigned row = 0; row < test_data.size(); ++row) {
+    pred_target_ids.clear();
+    test_data.GetInput(row, &input_ids);
+    test_data.GetOutput(row, &target_ids);
+    unsigned morph_id = test_data.morph_id(row);
+    if (paradigm) {
+      if (paradigm_preds.empty() || input_ids != paradigm_input) {
+        paradigm_input = input_ids;
+        EnsembleDecodeParadigm(char_to_id, input_ids, &paradigm_preds, &lm,
+                               &object_pointers);
+        num_paradigms += 1;
+      }
+      pred_target_ids = paradigm_preds[morph_id];
+    } else {
+      EnsembleDecode(morph_id, char_to_id, input_ids, &pred_target_ids, &lm,
+                     &object_pointers);
     }
-    unsigned morph_id = morph_to_id[items[2]];
-    EnsembleDecode(morph_id, char_to_id, input_ids, &pred_target_ids, &lm,
-                   &object_pointers);
 
     string prediction = "";
     for (unsigned i = 0; i < pred_target_ids.size(); ++i) {
@@ -78,14 +115,29 @@ int main(int argc, char** argv) {
         prediction += " ";
       }
     }
-    if (prediction == items[1]) {
+    if (forms_file.is_open()) {
+      forms_file << prediction << endl;
+    }
+    if (pred_target_ids == target_ids) {
       correct += 1;     
     } else {
+      string line = test_data.Line(row, id_to_char, id_to_morph);
+      vector<string> items = split_line(line, '|');
       cout << "GOLD: " << line << endl;
       cout << "PRED: " << items[0] << "|" << prediction << "|" << items[2] << endl;
     }
     total += 1;
   }
+  if (lm_cache_size > 0) {
+    LMCacheStats cache_stats = lm_cache.Stats();
+    cerr << "LM cache hits: " << cache_stats.hits << ", misses: "
+         << cache_stats.misses << ", evictions: " << cache_stats.evictions
+         << endl;
+  }
   cerr << "Prediction Accuracy: " << correct / total << endl;
+  if (paradigm) {
+    cerr << "Decoded " << num_paradigms << " paradigms for " << total
+         << " words" << endl;
+  }
   return 1;
 }
@@ -8,6 +8,7 @@
 #include "cnn/expr.h"
 
 #include "utils.h"
+#include "corpus.h"
 #include "no-enc.h"
 
 #include <iostream>
@@ -20,6 +21,11 @@ using namespace cnn::expr;
 int main(int argc, char** argv) {
   cnn::Initialize(argc, argv);
 
+  // With --forms=forms.txt the prediction of every row is also written to
+  // forms.txt, one per line in the order of the rows, which is what
+  // build-inflection-table --forms reads.
+  string forms_filename = GetOption("forms", "", &argc, argv);
+
   string vocab_filename = argv[1];  // vocabulary of words/characters
   string morph_filename = argv[2];
   string test_filename = argv[3];
@@ -33,8 +39,10 @@ int main(int argc, char** argv) {
   ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
   unsigned morph_size = morph_to_id.size();
 
-  vector<string> test_data;  // Read the dev file in a vector
-  ReadData(test_filename, &test_data);
+  Corpus test_data;  // Read the test file, either as text or a compiled corpus
+  if (!ReadCorpus(test_filename, char_to_id, morph_to_id, &test_data)) {
+    return 0;
+  }
 
   vector<vector<Model*> > ensmb_m;
   vector<NoEnc> ensmb_nn;
@@ -42,11 +50,22 @@ int main(int argc, char** argv) {
     vector<Model*> m;
     NoEnc nn;
     string f = argv[i + 4];
-    Read(f, &nn, &m);
+    if (!Read(f, &nn, &m)) {
+      return 0;
+    }
     ensmb_m.push_back(m);
     ensmb_nn.push_back(nn);
   }
 
+  ofstream forms_file;
+  if (!forms_filename.empty()) {
+    forms_file.open(forms_filename);
+    if (!forms_file.is_open()) {
+      cerr << "Could not write " << forms_filename << endl;
+      return 0;
+    }
+  }
+
   // Read the test file and output predictions for the words.
   string line;
   double correct = 0, total = 0;
@@ -54,17 +73,12 @@ int main(int argc, char** argv) {
   for (unsigned i = 0; i < ensmb_nn.size(); ++i) {
     object_pointers.push_back(&ensmb_nn[i]);
   }
-  for (string& line : test_data) {
-    vector<string> items = split_line(line, '|');
-    vector<unsigned> input_ids, target_ids, pred_target_ids;
-    input_ids.clear(); target_ids.clear(); pred_target_ids.clear();
-    for (const string& ch : split_line(items[0], ' ')) {
-      input_ids.push_back(char_to_id[ch]);
-    }
-    for (const string& ch : split_line(items[1], ' ')) {
-      target_ids.push_back(char_to_id[ch]);
-    }
-    unsigned morph_id = morph_to_id[items[2]];
+  vector<unsigned> input_ids, target_ids, pred_target_ids;
+  for (unsigned row = 0; row < test_data.size(); ++row) {
+    pred_target_ids.clear();
+    test_data.GetInput(row, &input_ids);
+    test_data.GetOutput(row, &target_ids);
+    unsigned morph_id = test_data.morph_id(row);
     EnsembleDecode(morph_id, char_to_id, input_ids, &pred_target_ids,
                    &object_pointers);
 
@@ -75,7 +89,12 @@ int main(int argc, char** argv) {
         prediction += " ";
       }
     }
-    if (prediction == items[1]) {
+    if (forms_file.is_open()) {
+      forms_file << prediction << endl;
+    }
+    vector<string> items =
+        split_line(test_data.Line(row, id_to_char, id_to_morph), '|');
+    if (pred_target_ids == target_ids) {
       correct += 1;     
     } else {
       //cout << "GOLD: " << line << endl;
@@ -11,7 +11,9 @@ This file outputs all the strings in the beam.
 #include "cnn/expr.h"
 
 #include "utils.h"
+#include "corpus.h"
 #include "sep-morph.h"
+#include "decode-cache.h"
 
 #include <iostream>
 #include <fstream>
@@ -22,11 +24,26 @@ using namespace cnn::expr;
 
 int main(int argc, char** argv) {
   cnn::Initialize(argc, argv);
+  // Beam pruning: --beam-threshold=X skips hypotheses more than X below the
+  // best unfinished one, --beam-stop=1 the ones which cannot beat the best
+  // finished one, --beam-per-parent=N keeps N candidates per hypothesis.
+  BeamPruning pruning;
+  pruning.threshold =
+      atof(GetOption("beam-threshold", "inf", &argc, argv).c_str());
+  pruning.stop_early =
+      atoi(GetOption("beam-stop", "0", &argc, argv).c_str()) != 0;
+  pruning.max_per_parent =
+      atoi(GetOption("beam-per-parent", "0", &argc, argv).c_str());
+  // --cache=N keeps the beams of the last N distinct (tag, lemma) requests,
+  // and --cache-warm=file.txt searches the first N requests of a file sorted
+  // by frequency into the cache first, as in infer-sep-morph --beam=N.
+  unsigned cache_size = atoi(GetOption("cache", "0", &argc, argv).c_str());
+  string warm_filename = GetOption("cache-warm", "", &argc, argv);
 
   string vocab_filename = argv[1];  // vocabulary of words/characters
   string morph_filename = argv[2];
   string test_filename = argv[3];
-  string lm_filename = argv[4];
+  string lm_filename = argv[4];  // Unused, see eval-ensemble-lm-sep-morph-beam
   unsigned beam_size = atoi(argv[5]);
 
   unordered_map<string, unsigned> char_to_id, morph_to_id;
@@ -37,8 +54,10 @@ int main(int argc, char** argv) {
   ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
   unsigned morph_size = morph_to_id.size();
 
-  vector<string> test_data;  // Read the dev file in a vector
-  ReadData(test_filename, &test_data);
+  Corpus test_data;  // Read the test file, either as text or a compiled corpus
+  if (!ReadCorpus(test_filename, char_to_id, morph_to_id, &test_data)) {
+    return 0;
+  }
 
   vector<vector<Model*> > ensmb_m;
   vector<SepMorph> ensmb_nn;
@@ -46,7 +65,9 @@ int main(int argc, char** argv) {
     vector<Model*> m;
     SepMorph nn;
     string f = argv[i + 6];
-    Read(f, &nn, &m);
+    if (!Read(f, &nn, &m)) {
+      return 0;
+    }
     ensmb_m.push_back(m);
     ensmb_nn.push_back(nn);
   }
@@ -59,25 +80,64 @@ int main(int argc, char** argv) {
     object_pointers.push_back(&ensmb_nn[i]);
   }
 
-  for (string& line : test_data) {
-    vector<string> items = split_line(line, '|');
-    vector<unsigned> input_ids, target_ids, pred_target_ids;
-    input_ids.clear(); target_ids.clear(); pred_target_ids.clear();
-    for (const string& ch : split_line(items[0], ' ')) {
-      input_ids.push_back(char_to_id[ch]);
+  DecodeCache cache(cache_size);
+  // Returns false if the beam came from the cache without searching.
+  auto decode = [&](const unsigned& morph_id,
+                    const vector<unsigned>& input_ids,
+                    DecodeResult* result, BeamStats* stats) {
+    bool decoded = false;
+    DecodeOutputFunc run = [&](DecodeResult* output) {
+      decoded = true;
+      EnsembleBeamDecode(morph_id, beam_size, char_to_id, input_ids,
+                         &output->sequences, &output->scores,
+                         &object_pointers, pruning, stats);
+    };
+    if (cache_size > 0) {
+      cache.Decode(DecodeKey{beam_size, morph_id, input_ids}, run, result);
+    } else {
+      result->sequences.clear();
+      result->scores.clear();
+      run(result);
+    }
+    return decoded;
+  };
+  vector<unsigned> input_ids, target_ids, pred_target_ids;
+  if (cache_size > 0 && !warm_filename.empty()) {
+    Corpus warm_data;
+    if (!ReadRequests(warm_filename, char_to_id, morph_to_id, &warm_data)) {
+      return 0;
     }
-    for (const string& ch : split_line(items[1], ' ')) {
-      target_ids.push_back(char_to_id[ch]);
+    // The least frequent requests go in first, so that the most frequent
+    // ones are the last to be evicted.
+    DecodeResult result;
+    for (unsigned row = min(cache_size, warm_data.size()); row-- > 0;) {
+      warm_data.GetInput(row, &input_ids);
+      decode(warm_data.morph_id(row), input_ids, &result, NULL);
     }
+    cerr << "Warmed the cache with " << cache.Stats().size << " outputs"
+         << endl;
+    cache.ResetStats();
+  }
+
+  BeamStats beam_stats;
+  double beam_searches = 0;  // Words not answered from the cache
+  for (unsigned row = 0; row < test_data.size(); ++row) {
+    pred_target_ids.clear();
+    test_data.GetInput(row, &input_ids);
+    test_data.GetOutput(row, &target_ids);
 
-    vector<vector<unsigned> > pred_beams;
-    vector<float> beam_score;
-    unsigned morph_id = morph_to_id[items[2]];
-    EnsembleBeamDecode(morph_id, beam_size, char_to_id, input_ids, &pred_beams,
-                       &beam_score, &object_pointers);
+    unsigned morph_id = test_data.morph_id(row);
+    BeamStats word_stats;
+    DecodeResult result;
+    beam_searches += decode(morph_id, input_ids, &result, &word_stats);
+    const vector<vector<unsigned> >& pred_beams = result.sequences;
+    const vector<float>& beam_score = result.scores;
+    beam_stats.Add(word_stats);
+    total += 1;
 
-    cout << "GOLD: " << line << endl;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
+    cout << "GOLD: " << test_data.Line(row, id_to_char, id_to_morph)
+         << endl;
+    for (unsigned beam_id = 0; beam_id < pred_beams.size(); ++beam_id) {
       pred_target_ids = pred_beams[beam_id];
       string prediction = "";
       for (unsigned i = 0; i < pred_target_ids.size(); ++i) { 
@@ -89,5 +149,17 @@ int main(int argc, char** argv) {
       cout << "PRED: " << prediction << " " << beam_score[beam_id] << endl;
     }
   }
+  if (cache_size > 0) {
+    DecodeCacheStats cache_stats = cache.Stats();
+    cerr << "Cache hits: " << cache_stats.hits << ", misses: "
+         << cache_stats.misses << ", evictions: " << cache_stats.evictions
+         << endl;
+  }
+  // The words answered from the cache expanded no hypotheses.
+  double searches = max(beam_searches, 1.0);
+  cerr << "Expanded " << beam_stats.expanded / searches
+       << " hypotheses per searched word, pruned "
+       << beam_stats.pruned / searches << " (" << beam_searches
+       << " of " << total << " words searched)" << endl;
   return 1;
 }
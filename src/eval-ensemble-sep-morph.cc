@@ -8,8 +8,12 @@
 #include "cnn/expr.h"
 
 #include "utils.h"
+#include "corpus.h"
 #include "sep-morph.h"
+#include "suffix-rules.h"
+#include "decode-cache.h"
 
+#include <chrono>
 #include <iostream>
 #include <fstream>
 
@@ -19,6 +23,31 @@ using namespace cnn::expr;
 
 int main(int argc, char** argv) {
   cnn::Initialize(argc, argv);
+  // With --speculative=1 the rest of the input is guessed as the output and
+  // checked in one forward pass, see EnsembleSpeculativeDecode().
+  bool speculative =
+      atoi(GetOption("speculative", "0", &argc, argv).c_str()) != 0;
+  // With --batch=N the words are decoded N at a time instead, in batches of
+  // words with the same tag and input length, see EnsembleBatchDecode().
+  unsigned batch_size = atoi(GetOption("batch", "1", &argc, argv).c_str());
+  // With --rules=rules.txt from train-suffix-rules, the words whose edit a
+  // rule knows with at least --rule-threshold confidence from at least
+  // --rule-min-count training lemmas are answered without the models.
+  string rules_filename = GetOption("rules", "", &argc, argv);
+  float rule_threshold =
+      atof(GetOption("rule-threshold", "0.98", &argc, argv).c_str());
+  unsigned rule_min_count =
+      atoi(GetOption("rule-min-count", "5", &argc, argv).c_str());
+  // With --cache=N the outputs of the last N distinct (tag, lemma) requests
+  // are kept and repeated requests are answered from them, and
+  // --cache-warm=file.txt decodes the first N requests of a file sorted by
+  // frequency into the cache first, as in infer-sep-morph.
+  unsigned cache_size = atoi(GetOption("cache", "0", &argc, argv).c_str());
+  string warm_filename = GetOption("cache-warm", "", &argc, argv);
+  // With --forms=forms.txt the prediction of every row is also written to
+  // forms.txt, one per line in the order of the rows, which is what
+  // build-inflection-table --forms reads.
+  string forms_filename = GetOption("forms", "", &argc, argv);
 
   string vocab_filename = argv[1];  // vocabulary of words/characters
   string morph_filename = argv[2];
@@ -32,8 +61,22 @@ int main(int argc, char** argv) {
   ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
   unsigned morph_size = morph_to_id.size();
 
-  vector<string> test_data;  // Read the dev file in a vector
-  ReadData(test_filename, &test_data);
+  SuffixRules rules;
+  if (!rules_filename.empty()) {
+    if (!Read(rules_filename, &rules)) {
+      return 0;
+    }
+    if (rules.char_vocab_size != vocab_size ||
+        rules.morph_vocab_size != morph_size) {
+      cerr << "The rules were trained with other vocabularies" << endl;
+      return 0;
+    }
+  }
+
+  Corpus test_data;  // Read the test file, either as text or a compiled corpus
+  if (!ReadCorpus(test_filename, char_to_id, morph_to_id, &test_data)) {
+    return 0;
+  }
 
   vector<vector<Model*> > ensmb_m;
   vector<SepMorph> ensmb_nn;
@@ -41,31 +84,148 @@ int main(int argc, char** argv) {
     vector<Model*> m;
     SepMorph nn;
     string f = argv[i + 4];
-    Read(f, &nn, &m);
+    if (!Read(f, &nn, &m)) {
+      return 0;
+    }
     ensmb_m.push_back(m);
     ensmb_nn.push_back(nn);
   }
 
+  ofstream forms_file;
+  if (!forms_filename.empty()) {
+    forms_file.open(forms_filename);
+    if (!forms_file.is_open()) {
+      cerr << "Could not write " << forms_filename << endl;
+      return 0;
+    }
+  }
+
   // Read the test file and output predictions for the words.
   string line;
-  double correct = 0, total = 0;
+  double correct = 0, total = 0, steps = 0, passes = 0;
+  double rule_answered = 0, rule_correct = 0;
   vector<SepMorph*> object_pointers;
   for (unsigned i = 0; i < ensmb_nn.size(); ++i) {
     object_pointers.push_back(&ensmb_nn[i]);
   }
-  for (string& line : test_data) {
-    vector<string> items = split_line(line, '|');
-    vector<unsigned> input_ids, target_ids, pred_target_ids;
-    input_ids.clear(); target_ids.clear(); pred_target_ids.clear();
-    for (const string& ch : split_line(items[0], ' ')) {
-      input_ids.push_back(char_to_id[ch]);
+  vector<unsigned> input_ids, target_ids, pred_target_ids;
+
+  DecodeCache cache(cache_size);
+  // Returns false if the output came from the cache without decoding.
+  auto decode = [&](const unsigned& morph_id,
+                    const vector<unsigned>& input_ids,
+                    vector<unsigned>* pred_target_ids,
+                    unsigned* word_passes) {
+    bool decoded = false;
+    DecodeOutputFunc run = [&](DecodeResult* output) {
+      decoded = true;
+      vector<unsigned> pred;
+      if (speculative) {
+        EnsembleSpeculativeDecode(morph_id, char_to_id, input_ids, &pred,
+                                  &object_pointers, word_passes);
+      } else {
+        EnsembleDecode(morph_id, char_to_id, input_ids, &pred,
+                       &object_pointers);
+      }
+      output->sequences.push_back(pred);
+    };
+    DecodeResult result;
+    if (cache_size > 0) {
+      cache.Decode(DecodeKey{0, morph_id, input_ids}, run, &result);
+    } else {
+      run(&result);
     }
-    for (const string& ch : split_line(items[1], ' ')) {
-      target_ids.push_back(char_to_id[ch]);
+    *pred_target_ids = result.sequences[0];
+    return decoded;
+  };
+  if (cache_size > 0 && !warm_filename.empty()) {
+    Corpus warm_data;
+    if (!ReadRequests(warm_filename, char_to_id, morph_to_id, &warm_data)) {
+      return 0;
+    }
+    // The least frequent requests go in first, so that the most frequent
+    // ones are the last to be evicted.
+    unsigned word_passes;
+    for (unsigned row = min(cache_size, warm_data.size()); row-- > 0;) {
+      warm_data.GetInput(row, &input_ids);
+      unsigned morph_id = warm_data.morph_id(row);
+      if (rules_filename.empty() ||
+          !rules.Apply(morph_id, input_ids, rule_threshold, rule_min_count,
+                       &pred_target_ids)) {
+        decode(morph_id, input_ids, &pred_target_ids, &word_passes);
+      }
+    }
+    cerr << "Warmed the cache with " << cache.Stats().size << " outputs"
+         << endl;
+    cache.ResetStats();
+  }
+
+  auto start = chrono::steady_clock::now();
+  // The batches are decoded first, and the loop below takes their
+  // predictions.
+  vector<vector<unsigned> > batch_preds(test_data.size());
+  if (batch_size > 1) {
+    vector<unsigned> rows;
+    vector<vector<unsigned> > keys, batches;
+    DecodeResult cached;
+    for (unsigned row = 0; row < test_data.size(); ++row) {
+      test_data.GetInput(row, &input_ids);
+      unsigned morph_id = test_data.morph_id(row);
+      if (!rules_filename.empty() &&
+          rules.Apply(morph_id, input_ids, rule_threshold, rule_min_count,
+                      &pred_target_ids)) {
+        continue;
+      }
+      if (cache_size > 0 &&
+          cache.Find(DecodeKey{0, morph_id, input_ids}, &cached)) {
+        batch_preds[row] = cached.sequences[0];
+      } else {
+        rows.push_back(row);
+        keys.push_back({morph_id, (unsigned) input_ids.size()});
+      }
+    }
+    MakeBatches(keys, batch_size, &batches);
+    vector<vector<unsigned> > inputs, preds;
+    for (const vector<unsigned>& batch : batches) {
+      inputs.clear();
+      for (const unsigned& i : batch) {
+        test_data.GetInput(rows[i], &input_ids);
+        inputs.push_back(input_ids);
+      }
+      EnsembleBatchDecode(keys[batch[0]][0], char_to_id, inputs, &preds,
+                          &object_pointers);
+      for (unsigned i = 0; i < batch.size(); ++i) {
+        batch_preds[rows[batch[i]]] = preds[i];
+        if (cache_size > 0) {
+          cached.sequences.assign(1, preds[i]);
+          cache.Insert(DecodeKey{0, keys[batch[0]][0], inputs[i]}, cached);
+        }
+      }
+    }
+  }
+
+  for (unsigned row = 0; row < test_data.size(); ++row) {
+    pred_target_ids.clear();
+    test_data.GetInput(row, &input_ids);
+    test_data.GetOutput(row, &target_ids);
+    unsigned morph_id = test_data.morph_id(row);
+    bool by_rule = !rules_filename.empty() &&
+                   rules.Apply(morph_id, input_ids, rule_threshold,
+                               rule_min_count, &pred_target_ids);
+    if (by_rule) {
+      rule_answered += 1;
+      rule_correct += pred_target_ids == target_ids;
+    } else if (batch_size > 1) {
+      pred_target_ids = batch_preds[row];
+      steps += pred_target_ids.size() - 1;
+    } else {
+      // The words answered from the cache take no passes or steps.
+      unsigned word_passes = 0;
+      if (decode(morph_id, input_ids, &pred_target_ids, &word_passes)) {
+        passes += word_passes;
+        steps += pred_target_ids.size() - 1;
+      }
     }
-    unsigned morph_id = morph_to_id[items[2]];
-    EnsembleDecode(morph_id, char_to_id, input_ids, &pred_target_ids,
-                   &object_pointers);
 
     string prediction = "";
     for (unsigned i = 0; i < pred_target_ids.size(); ++i) {
@@ -74,14 +234,40 @@ int main(int argc, char** argv) {
         prediction += " ";
       }
     }
-    if (prediction == items[1]) {
+    if (forms_file.is_open()) {
+      forms_file << prediction << endl;
+    }
+    if (pred_target_ids == target_ids) {
       correct += 1;     
     } else {
+      string line = test_data.Line(row, id_to_char, id_to_morph);
+      vector<string> items = split_line(line, '|');
       cout << "GOLD: " << line << endl;
       cout << "PRED: " << items[0] << "|" << prediction << "|" << items[2] << endl;
     }
     total += 1;
   }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() -
+                                            start).count();
+  if (cache_size > 0) {
+    DecodeCacheStats cache_stats = cache.Stats();
+    cerr << "Cache hits: " << cache_stats.hits << ", misses: "
+         << cache_stats.misses << ", evictions: " << cache_stats.evictions
+         << endl;
+  }
   cerr << "Prediction Accuracy: " << correct / total << endl;
+  if (!rules_filename.empty()) {
+    cerr << "Rules answered " << rule_answered / total << " of the words "
+         << "with accuracy " << rule_correct / max(rule_answered, 1.0)
+         << ", the models the others with accuracy "
+         << (correct - rule_correct) / max(total - rule_answered, 1.0)
+         << endl;
+  }
+  if (speculative) {
+    cerr << "Forward passes per word: " << passes / total << " instead of "
+         << steps / total << endl;
+  }
+  cerr << "Decoded " << total << " words in " << seconds << " seconds ("
+       << total / seconds << " words/sec)" << endl;
   return 1;
 }
@@ -0,0 +1,286 @@
+/*
+Decodes with SepMorph models using the graph-free inference engine instead
+of cnn. Without --beam it prints the errors and the accuracy like
+eval-ensemble-sep-morph, with --beam=N it prints all the strings in the beam
+like eval-ensemble-sep-morph-beam. --int8=1 runs float models with the int8
+kernels; models written by quantize-sep-morph always use them. --threads=N
+runs the members of an ensemble on N threads. --batch=N decodes N words at
+a time without beam, stepping the words of a tag together. --beam-threshold=X,
+--beam-stop=1 and --beam-per-parent=N prune the beam as in
+eval-ensemble-sep-morph-beam. --rules=rules.txt, --rule-threshold=X and
+--rule-min-count=N answer words from suffix rules without beam, as in
+eval-ensemble-sep-morph. --cache=N keeps the outputs of the last N distinct
+(tag, lemma) requests, and --cache-warm=file.txt decodes the first N
+requests of a file sorted by frequency into the cache before the test data.
+The requests are read as by lookup-inflection, "lemma|tag" or a line of the
+data, optionally preceded by their count as from sort | uniq -c | sort -rn.
+*/
+#include "utils.h"
+#include "corpus.h"
+#include "sep-morph-infer.h"
+#include "suffix-rules.h"
+#include "decode-cache.h"
+
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <map>
+
+using namespace std;
+
+int main(int argc, char** argv) {
+  unsigned beam_size = atoi(GetOption("beam", "0", &argc, argv).c_str());
+  bool int8 = atoi(GetOption("int8", "0", &argc, argv).c_str()) != 0;
+  unsigned num_threads = atoi(GetOption("threads", "1", &argc, argv).c_str());
+  unsigned batch_size = atoi(GetOption("batch", "1", &argc, argv).c_str());
+  BeamPruning pruning;
+  pruning.threshold =
+      atof(GetOption("beam-threshold", "inf", &argc, argv).c_str());
+  pruning.stop_early =
+      atoi(GetOption("beam-stop", "0", &argc, argv).c_str()) != 0;
+  pruning.max_per_parent =
+      atoi(GetOption("beam-per-parent", "0", &argc, argv).c_str());
+  string rules_filename = GetOption("rules", "", &argc, argv);
+  float rule_threshold =
+      atof(GetOption("rule-threshold", "0.98", &argc, argv).c_str());
+  unsigned rule_min_count =
+      atoi(GetOption("rule-min-count", "5", &argc, argv).c_str());
+  unsigned cache_size = atoi(GetOption("cache", "0", &argc, argv).c_str());
+  string warm_filename = GetOption("cache-warm", "", &argc, argv);
+  if (argc < 5) {
+    cerr << "Usage: " << argv[0] << " [--beam=N] [--int8=1] [--threads=N]"
+         << " [--batch=N]"
+         << " [--beam-threshold=X] [--beam-stop=1] [--beam-per-parent=N]"
+         << " [--rules=rules.txt] [--rule-threshold=X] [--rule-min-count=N]"
+         << " [--cache=N] [--cache-warm=file.txt]"
+         << " char_vocab.txt morph_vocab.txt test_infl.txt model1.bin"
+         << " [model2.bin ...]"
+         << endl;
+    return 0;
+  }
+
+  string vocab_filename = argv[1];  // vocabulary of words/characters
+  string morph_filename = argv[2];
+  string test_filename = argv[3];
+
+  unordered_map<string, unsigned> char_to_id, morph_to_id;
+  unordered_map<unsigned, string> id_to_char, id_to_morph;
+
+  ReadVocab(vocab_filename, &char_to_id, &id_to_char);
+  ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
+
+  SuffixRules rules;
+  if (!rules_filename.empty()) {
+    if (!Read(rules_filename, &rules)) {
+      return 0;
+    }
+    if (rules.char_vocab_size != char_to_id.size() ||
+        rules.morph_vocab_size != morph_to_id.size()) {
+      cerr << "The rules were trained with other vocabularies" << endl;
+      return 0;
+    }
+  }
+  auto by_rule = [&](const unsigned& morph_id,
+                     const vector<unsigned>& input_ids,
+                     vector<unsigned>* output_ids) {
+    return !rules_filename.empty() &&
+           rules.Apply(morph_id, input_ids, rule_threshold, rule_min_count,
+                       output_ids);
+  };
+
+  Corpus test_data;  // Read the test file, either as text or a compiled corpus
+  if (!ReadCorpus(test_filename, char_to_id, morph_to_id, &test_data)) {
+    return 0;
+  }
+
+  vector<SepMorphInfer> ensmb_nn(argc - 4);
+  vector<SepMorphInfer*> object_pointers;
+  for (unsigned i = 0; i < argc - 4; ++i) {
+    string f = argv[i + 4];
+    if (!Read(f, &ensmb_nn[i])) {
+      return 0;
+    }
+    if (int8) {
+      ensmb_nn[i].Quantize();
+    }
+    object_pointers.push_back(&ensmb_nn[i]);
+  }
+
+  WorkerPool workers(max(num_threads, 1u));
+
+  // The greedy and the beam outputs of a word are cached apart, by using the
+  // beam size as the model id.
+  DecodeCache cache(cache_size);
+  // Returns false if the output came from the cache without decoding.
+  auto decode = [&](const unsigned& morph_id,
+                    const vector<unsigned>& input_ids,
+                    DecodeResult* result, BeamStats* stats) {
+    bool decoded = false;
+    DecodeOutputFunc run = [&](DecodeResult* output) {
+      decoded = true;
+      if (beam_size > 0) {
+        EnsembleBeamDecode(morph_id, beam_size, char_to_id, input_ids,
+                           &output->sequences, &output->scores,
+                           &object_pointers, &workers, pruning, stats);
+      } else {
+        vector<unsigned> pred_target_ids;
+        EnsembleDecode(morph_id, char_to_id, input_ids, &pred_target_ids,
+                       &object_pointers, &workers);
+        output->sequences.push_back(pred_target_ids);
+      }
+    };
+    if (cache_size > 0) {
+      cache.Decode(DecodeKey{beam_size, morph_id, input_ids}, run, result);
+    } else {
+      result->sequences.clear();
+      result->scores.clear();
+      run(result);
+    }
+    return decoded;
+  };
+  if (cache_size > 0 && !warm_filename.empty()) {
+    Corpus warm_data;
+    if (!ReadRequests(warm_filename, char_to_id, morph_to_id, &warm_data)) {
+      return 0;
+    }
+    // The least frequent requests go in first, so that the most frequent
+    // ones are the last to be evicted.
+    vector<unsigned> input_ids, rule_output;
+    DecodeResult result;
+    for (unsigned row = min(cache_size, warm_data.size()); row-- > 0;) {
+      warm_data.GetInput(row, &input_ids);
+      unsigned morph_id = warm_data.morph_id(row);
+      if (beam_size > 0 || !by_rule(morph_id, input_ids, &rule_output)) {
+        decode(morph_id, input_ids, &result, NULL);
+      }
+    }
+    cerr << "Warmed the cache with " << cache.Stats().size << " outputs"
+         << endl;
+    cache.ResetStats();
+  }
+  double correct = 0, total = 0, rule_answered = 0, rule_correct = 0;
+  BeamStats beam_stats;
+  double beam_searches = 0;  // Words not answered from the cache
+  vector<unsigned> input_ids, target_ids, pred_target_ids;
+  vector<vector<unsigned> > batch_preds;
+  auto start = chrono::steady_clock::now();
+  for (unsigned row = 0; row < test_data.size(); ++row) {
+    pred_target_ids.clear();
+    test_data.GetInput(row, &input_ids);
+    test_data.GetOutput(row, &target_ids);
+    unsigned morph_id = test_data.morph_id(row);
+
+    if (beam_size == 0 && batch_size > 1 && row % batch_size == 0) {
+      // Decode the next batch_size words, the words of every tag together.
+      unsigned end = min(row + batch_size, test_data.size());
+      map<unsigned, vector<unsigned> > tag_rows;
+      vector<unsigned> rule_input, rule_output;
+      DecodeResult cached;
+      batch_preds.resize(end - row);
+      for (unsigned r = row; r < end; ++r) {
+        test_data.GetInput(r, &rule_input);
+        unsigned tag = test_data.morph_id(r);
+        if (by_rule(tag, rule_input, &rule_output)) {
+          continue;
+        }
+        if (cache_size > 0 &&
+            cache.Find(DecodeKey{0, tag, rule_input}, &cached)) {
+          batch_preds[r - row] = cached.sequences[0];
+        } else {
+          tag_rows[tag].push_back(r);
+        }
+      }
+      for (auto& it : tag_rows) {
+        vector<vector<unsigned> > inputs(it.second.size()), preds;
+        for (unsigned i = 0; i < inputs.size(); ++i) {
+          test_data.GetInput(it.second[i], &inputs[i]);
+        }
+        EnsembleDecodeBatch(it.first, char_to_id, inputs, &preds,
+                            &object_pointers, &workers);
+        for (unsigned i = 0; i < preds.size(); ++i) {
+          batch_preds[it.second[i] - row] = preds[i];
+          if (cache_size > 0) {
+            cached.sequences.assign(1, preds[i]);
+            cache.Insert(DecodeKey{0, it.first, inputs[i]}, cached);
+          }
+        }
+      }
+    }
+
+    vector<vector<unsigned> > pred_beams;
+    vector<float> beam_score;
+    if (beam_size > 0) {
+      BeamStats word_stats;
+      DecodeResult result;
+      beam_searches += decode(morph_id, input_ids, &result, &word_stats);
+      pred_beams = result.sequences;
+      beam_score = result.scores;
+      beam_stats.Add(word_stats);
+    } else if (by_rule(morph_id, input_ids, &pred_target_ids)) {
+      pred_beams.push_back(pred_target_ids);
+      rule_answered += 1;
+      rule_correct += pred_target_ids == target_ids;
+    } else if (batch_size > 1) {
+      pred_beams.push_back(batch_preds[row % batch_size]);
+    } else {
+      DecodeResult result;
+      decode(morph_id, input_ids, &result, NULL);
+      pred_beams = result.sequences;
+    }
+
+    if (beam_size > 0) {
+      cout << "GOLD: " << test_data.Line(row, id_to_char, id_to_morph)
+           << endl;
+    }
+    for (unsigned beam_id = 0; beam_id < pred_beams.size(); ++beam_id) {
+      pred_target_ids = pred_beams[beam_id];
+      string prediction = "";
+      for (unsigned i = 0; i < pred_target_ids.size(); ++i) {
+        prediction += id_to_char[pred_target_ids[i]];
+        if (i != pred_target_ids.size() - 1) {
+          prediction += " ";
+        }
+      }
+      if (beam_size > 0) {
+        cout << "PRED: " << prediction << " " << beam_score[beam_id] << endl;
+      } else if (pred_target_ids == target_ids) {
+        correct += 1;
+      } else {
+        string line = test_data.Line(row, id_to_char, id_to_morph);
+        vector<string> items = split_line(line, '|');
+        cout << "GOLD: " << line << endl;
+        cout << "PRED: " << items[0] << "|" << prediction << "|" << items[2]
+             << endl;
+      }
+    }
+    total += 1;
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() -
+                                            start).count();
+  if (cache_size > 0) {
+    DecodeCacheStats cache_stats = cache.Stats();
+    cerr << "Cache hits: " << cache_stats.hits << ", misses: "
+         << cache_stats.misses << ", evictions: " << cache_stats.evictions
+         << endl;
+  }
+  if (beam_size == 0) {
+    cerr << "Prediction Accuracy: " << correct / total << endl;
+    if (!rules_filename.empty()) {
+      cerr << "Rules answered " << rule_answered / total << " of the words "
+           << "with accuracy " << rule_correct / max(rule_answered, 1.0)
+           << ", the models the others with accuracy "
+           << (correct - rule_correct) / max(total - rule_answered, 1.0)
+           << endl;
+    }
+  } else {
+    // The words answered from the cache expanded no hypotheses.
+    double searches = max(beam_searches, 1.0);
+    cerr << "Expanded " << beam_stats.expanded / searches
+         << " hypotheses per searched word, pruned "
+         << beam_stats.pruned / searches << " (" << beam_searches
+         << " of " << total << " words searched)" << endl;
+  }
+  cerr << "Decoded " << total << " words in " << seconds << " seconds ("
+       << total / seconds << " words/sec)" << endl;
+  return 1;
+}
@@ -0,0 +1,183 @@
+#include "inference.h"
+
+#include <cmath>
+#include <cstring>
+
+// The parameters of every layer of a cnn LSTMBuilder, in the order in which
+// the builder adds them to its model.
+enum { X2I, H2I, C2I, BI, X2O, H2O, C2O, BO, X2C, H2C, BC, kLSTMParams };
+
+void LoadMatrix(const MappedModel& mapped, const ParamEntry& param,
+                Matrix* matrix) {
+  matrix->Resize(param.rows, param.cols);
+  if (param.kind != kQuantizedParameters) {
+    matrix->SetBlock(0, 0, param.rows, param.cols, mapped.Values(param));
+    return;
+  }
+  const float* scales = mapped.Values(param);
+  const int8_t* values =
+      reinterpret_cast<const int8_t*>(mapped.Data(param) +
+                                      sizeof(float) * param.rows);
+  for (unsigned j = 0; j < param.cols; ++j) {
+    for (unsigned r = 0; r < param.rows; ++r) {
+      matrix->col(j)[r] = scales[r] * values[j * param.rows + r];
+    }
+  }
+}
+
+// Copies a parameter, dequantized if needed, into the rows of a stacked
+// matrix which start at row.
+static void LoadBlock(const MappedModel& mapped, const ParamEntry& param,
+                      const unsigned& row, Matrix* matrix) {
+  Matrix block;
+  LoadMatrix(mapped, param, &block);
+  for (unsigned j = 0; j < param.cols; ++j) {
+    memcpy(matrix->col(j) + row, block.col(j), sizeof(float) * param.rows);
+  }
+}
+
+bool InferLSTM::Load(const MappedModel& mapped, const unsigned& model_id,
+                     const unsigned& num_layers, const unsigned& input_len,
+                     const unsigned& hidden_len, unsigned* param_index) {
+  layers = num_layers;
+  input_dim = input_len;
+  hidden_dim = hidden_len;
+  stride = PadFloats(hidden_dim);
+  x2g.resize(layers);
+  h2g.resize(layers);
+  c2i.resize(layers);
+  c2o.resize(layers);
+  gate_bias.resize(layers);
+  qx2g.assign(layers, QuantMatrix());
+  qh2g.assign(layers, QuantMatrix());
+  qc2i.assign(layers, QuantMatrix());
+  qc2o.assign(layers, QuantMatrix());
+
+  unsigned layer_input_dim = input_dim;
+  for (unsigned l = 0; l < layers; ++l) {
+    const ParamEntry* p[kLSTMParams];
+    for (unsigned k = 0; k < kLSTMParams; ++k) {
+      p[k] = &mapped.Param(model_id, *param_index + k);
+    }
+    *param_index += kLSTMParams;
+    if (p[X2I]->rows * p[X2I]->cols != hidden_dim * layer_input_dim ||
+        p[H2I]->rows * p[H2I]->cols != hidden_dim * hidden_dim ||
+        p[BC]->rows * p[BC]->cols != hidden_dim) {
+      cerr << "LSTM parameters of model " << model_id
+           << " do not match the architecture" << endl;
+      return false;
+    }
+
+    x2g[l].Resize(3 * stride, layer_input_dim);
+    h2g[l].Resize(3 * stride, hidden_dim);
+    LoadBlock(mapped, *p[X2I], 0, &x2g[l]);
+    LoadBlock(mapped, *p[X2C], stride, &x2g[l]);
+    LoadBlock(mapped, *p[X2O], 2 * stride, &x2g[l]);
+    LoadBlock(mapped, *p[H2I], 0, &h2g[l]);
+    LoadBlock(mapped, *p[H2C], stride, &h2g[l]);
+    LoadBlock(mapped, *p[H2O], 2 * stride, &h2g[l]);
+    LoadMatrix(mapped, *p[C2I], &c2i[l]);
+    LoadMatrix(mapped, *p[C2O], &c2o[l]);
+
+    gate_bias[l].assign(3 * stride, 0.0f);
+    memcpy(&gate_bias[l][0], mapped.Values(*p[BI]), sizeof(float) * hidden_dim);
+    memcpy(&gate_bias[l][stride], mapped.Values(*p[BC]),
+           sizeof(float) * hidden_dim);
+    memcpy(&gate_bias[l][2 * stride], mapped.Values(*p[BO]),
+           sizeof(float) * hidden_dim);
+    layer_input_dim = hidden_dim;
+  }
+  return true;
+}
+
+void InferLSTM::Quantize() {
+  for (unsigned l = 0; l < layers; ++l) {
+    if (l > 0) {
+      qx2g[l].Quantize(x2g[l]);
+      x2g[l] = Matrix();
+    }
+    qh2g[l].Quantize(h2g[l]);
+    qc2i[l].Quantize(c2i[l]);
+    qc2o[l].Quantize(c2o[l]);
+    h2g[l] = Matrix();
+    c2i[l] = Matrix();
+    c2o[l] = Matrix();
+  }
+}
+
+void InferLSTM::InputBlock(const unsigned& first_input,
+                           const unsigned& num_inputs, Matrix* block) const {
+  block->Resize(3 * stride, num_inputs);
+  for (unsigned j = 0; j < num_inputs; ++j) {
+    memcpy(block->col(j), x2g[0].col(first_input + j),
+           sizeof(float) * 3 * stride);
+  }
+}
+
+void InferLSTM::InputGates(const Matrix& embeddings,
+                           const unsigned& first_input, const bool& add_bias,
+                           Matrix* table) const {
+  Matrix block;
+  InputBlock(first_input, embeddings.rows, &block);
+  table->Resize(3 * stride, embeddings.cols);
+  for (unsigned j = 0; j < embeddings.cols; ++j) {
+    if (add_bias) {
+      memcpy(table->col(j), gate_bias[0].data(), sizeof(float) * 3 * stride);
+    }
+    Gemv(block, embeddings.col(j), table->col(j));
+  }
+}
+
+void InferLSTM::Layer(const unsigned& l, const unsigned& n, float* gates,
+                      float* states, const unsigned& state_stride) const {
+  const unsigned gates_size = GatesSize();
+  float* h = states + 2 * l * stride;
+  float* c = h + stride;
+  Gemm(h2g[l], qh2g[l], n, h, state_stride, gates, gates_size);
+  Gemm(c2i[l], qc2i[l], n, c, state_stride, gates, gates_size);
+  for (unsigned b = 0; b < n; ++b) {
+    float* input_gate = gates + b * gates_size;
+    float* cell_gate = input_gate + stride;
+    float* cb = c + b * state_stride;
+    Sigmoid(stride, input_gate);
+    Tanh(stride, cell_gate);
+    for (unsigned k = 0; k < stride; ++k) {
+      cb[k] = (1.0f - input_gate[k]) * cb[k] + input_gate[k] * cell_gate[k];
+    }
+  }
+  Gemm(c2o[l], qc2o[l], n, c, state_stride, gates + 2 * stride, gates_size);
+  for (unsigned b = 0; b < n; ++b) {
+    float* output_gate = gates + b * gates_size + 2 * stride;
+    float* hb = h + b * state_stride;
+    const float* cb = c + b * state_stride;
+    Sigmoid(stride, output_gate);
+    for (unsigned k = 0; k < stride; ++k) {
+      hb[k] = output_gate[k] * tanhf(cb[k]);
+    }
+  }
+}
+
+void InferLSTM::Step(const float* x, float* state, float* scratch) const {
+  memcpy(scratch, gate_bias[0].data(), sizeof(float) * 3 * stride);
+  Gemv(x2g[0], x, scratch);
+  StepGates(scratch, state);
+}
+
+void InferLSTM::StepGates(float* gates, float* state) const {
+  StepGatesBatch(1, gates, state, StateSize());
+}
+
+void InferLSTM::StepGatesBatch(const unsigned& n, float* gates, float* states,
+                               const unsigned& state_stride) const {
+  const unsigned gates_size = GatesSize();
+  Layer(0, n, gates, states, state_stride);
+  for (unsigned l = 1; l < layers; ++l) {
+    for (unsigned b = 0; b < n; ++b) {
+      memcpy(gates + b * gates_size, gate_bias[l].data(),
+             sizeof(float) * gates_size);
+    }
+    Gemm(x2g[l], qx2g[l], n, states + 2 * (l - 1) * stride, state_stride,
+         gates, gates_size);
+    Layer(l, n, gates, states, state_stride);
+  }
+}
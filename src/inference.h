@@ -0,0 +1,91 @@
+#ifndef INFERENCE_H_
+#define INFERENCE_H_
+
+#include "kernels.h"
+#include "model-io.h"
+
+using namespace std;
+
+// Copies a parameter of a binary model into a padded matrix. A lookup
+// parameter becomes a matrix with one column per entry, a quantized one is
+// dequantized.
+void LoadMatrix(const MappedModel& mapped, const ParamEntry& param,
+                Matrix* matrix);
+
+// The weights of a cnn LSTMBuilder, rearranged for the inference kernels.
+// cnn's LSTM couples the forget gate to the input gate (f = 1 - i) and has
+// full peephole matrices from the previous cell to the input gate and from
+// the new cell to the output gate.
+class InferLSTM {
+ public:
+  unsigned layers = 0, input_dim = 0, hidden_dim = 0;
+  unsigned stride = 0;  // PadFloats(hidden_dim)
+
+  // For every layer, the rows of the input gate, the cell candidate and the
+  // output gate are stacked in that order, each padded to stride rows.
+  vector<Matrix> x2g, h2g;
+  vector<Matrix> c2i, c2o;
+  vector<AlignedVector> gate_bias;
+
+  // The int8 copies of the matrices multiplied at every step, after
+  // Quantize(). The input weights of the first layer are only read through
+  // tables and blocks and stay in float.
+  vector<QuantMatrix> qx2g, qh2g, qc2i, qc2o;
+
+  // Loads the parameters of an LSTMBuilder which start at the param_index-th
+  // parameter of the model_id-th cnn model, and advances param_index past
+  // them.
+  bool Load(const MappedModel& mapped, const unsigned& model_id,
+            const unsigned& num_layers, const unsigned& input_len,
+            const unsigned& hidden_len, unsigned* param_index);
+
+  // A state holds the hidden and the cell vector of every layer. An all
+  // zero state starts a new sequence, exactly like cnn does.
+  unsigned StateSize() const { return 2 * layers * stride; }
+  const float* Output(const float* state) const {
+    return state + 2 * (layers - 1) * stride;
+  }
+
+  // Switches the steps to the int8 kernels and frees the float copies of the
+  // quantized matrices.
+  void Quantize();
+
+  // Scratch space needed by Step().
+  unsigned ScratchSize() const { return 3 * stride; }
+
+  // Advances the state by one input.
+  void Step(const float* x, float* state, float* scratch) const;
+
+  // Advances the state given the gate bias plus the products of the input
+  // weights of the first layer with the input, e.g. summed from tables built
+  // with InputGates(). gates is also used as scratch space.
+  void StepGates(float* gates, float* state) const;
+
+  // Advances n states at once, e.g. the hypotheses of a beam, with one
+  // matrix-matrix product per weight matrix instead of n matrix-vector
+  // products. The gates and the states of consecutive sequences start every
+  // GatesSize() and state_stride floats. Every state gets exactly the same
+  // result as with StepGates().
+  void StepGatesBatch(const unsigned& n, float* gates, float* states,
+                      const unsigned& state_stride) const;
+  unsigned GatesSize() const { return 3 * stride; }
+
+  // Copies the columns [first_input, first_input + num_inputs) of the input
+  // weights of the first layer.
+  void InputBlock(const unsigned& first_input, const unsigned& num_inputs,
+                  Matrix* block) const;
+
+  // Precomputes the products of the input weights of the first layer with
+  // every column of embeddings, which feed the inputs starting at
+  // first_input. With add_bias, the gate bias is added to every column.
+  void InputGates(const Matrix& embeddings, const unsigned& first_input,
+                  const bool& add_bias, Matrix* table) const;
+
+ private:
+  // Finishes a step of layer l of n states from the pre-activations of
+  // their gates.
+  void Layer(const unsigned& l, const unsigned& n, float* gates,
+             float* states, const unsigned& state_stride) const;
+};
+
+#endif
@@ -0,0 +1,306 @@
+#include "inflection-table.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+// FNV-1a over the ids of the lemma.
+static uint64_t HashLemma(const vector<unsigned>& ids) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const unsigned& id : ids) {
+    hash = (hash ^ id) * 1099511628211ull;
+  }
+  return hash;
+}
+
+static unsigned ReadId(const uint8_t* ids, const unsigned& i,
+                       const unsigned& id_bytes) {
+  if (id_bytes == 1) {
+    return ids[i];
+  }
+  uint16_t id;
+  memcpy(&id, ids + 2 * i, sizeof(id));
+  return id;
+}
+
+static size_t SlotsOffset() {
+  return sizeof(InflectionTableHeader);
+}
+
+static size_t DataOffset(const uint64_t& num_slots) {
+  return SlotsOffset() + sizeof(uint32_t) * num_slots;
+}
+
+InflectionTable::InflectionTable()
+    : num_lemmas(0), morph_len(0), id_bytes(1), slot_mask(0), slots(NULL),
+      data(NULL), mapped(NULL), mapped_size(0) {}
+
+InflectionTable::~InflectionTable() {
+  if (mapped != NULL) {
+    munmap(mapped, mapped_size);
+  }
+}
+
+const uint8_t* InflectionTable::FindEntry(
+    const vector<unsigned>& input_ids) const {
+  if (slots == NULL || input_ids.size() > 255) {
+    return NULL;
+  }
+  // Attach() checked that a slot is empty, but the probes are bounded by
+  // the number of slots all the same.
+  uint64_t slot = HashLemma(input_ids) & slot_mask;
+  for (uint64_t probe = 0; probe <= slot_mask;
+       ++probe, slot = (slot + 1) & slot_mask) {
+    if (slots[slot] == kEmptySlot) {
+      return NULL;
+    }
+    const uint8_t* entry = data + slots[slot];
+    if (entry[0] != input_ids.size()) {
+      continue;
+    }
+    unsigned i = 0;
+    while (i < input_ids.size() &&
+           ReadId(entry + 1, i, id_bytes) == input_ids[i]) {
+      i++;
+    }
+    if (i == input_ids.size()) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+bool InflectionTable::Lookup(const unsigned& morph_id,
+                             const vector<unsigned>& input_ids,
+                             vector<unsigned>* output_ids) const {
+  const uint8_t* entry = FindEntry(input_ids);
+  if (entry == NULL || morph_id >= morph_len) {
+    return false;
+  }
+  const uint8_t* form = entry + 1 + id_bytes * entry[0];
+  for (unsigned tag = 0; tag < morph_id; ++tag) {
+    form += 2 + id_bytes * form[1];
+  }
+  unsigned prefix_len = form[0], suffix_len = form[1];
+  if (prefix_len + suffix_len == 0) {
+    return false;
+  }
+  output_ids->resize(prefix_len + suffix_len);
+  for (unsigned i = 0; i < prefix_len; ++i) {
+    (*output_ids)[i] = input_ids[i];
+  }
+  for (unsigned i = 0; i < suffix_len; ++i) {
+    (*output_ids)[prefix_len + i] = ReadId(form + 2, i, id_bytes);
+  }
+  return true;
+}
+
+// Checks that every slot points to an entry lying inside the data, whose
+// forms share at most the whole lemma, that the slots hold num_lemmas
+// entries and that one slot is empty, so that the probes of a lookup end.
+// This reads the whole table once.
+static bool CheckEntries(const uint32_t* slots, const uint64_t& num_slots,
+                         const uint8_t* data, const uint64_t& data_size,
+                         const unsigned& id_bytes, const unsigned& morph_len,
+                         const uint64_t& num_lemmas) {
+  uint64_t num_entries = 0;
+  for (uint64_t slot = 0; slot < num_slots; ++slot) {
+    if (slots[slot] == kEmptySlot) {
+      continue;
+    }
+    num_entries++;
+    uint64_t offset = slots[slot];
+    if (offset >= data_size) {
+      return false;
+    }
+    unsigned lemma_len = data[offset];
+    offset += 1 + uint64_t(id_bytes) * lemma_len;
+    for (unsigned tag = 0; tag < morph_len; ++tag) {
+      if (offset + 2 > data_size || data[offset] > lemma_len) {
+        return false;
+      }
+      offset += 2 + uint64_t(id_bytes) * data[offset + 1];
+    }
+    if (offset > data_size) {
+      return false;
+    }
+  }
+  return num_entries == num_lemmas && num_entries < num_slots;
+}
+
+bool InflectionTable::Attach(const char* image, const size_t& size,
+                             const unsigned& char_vocab_size,
+                             const unsigned& morph_vocab_size) {
+  if (size < sizeof(InflectionTableHeader)) {
+    cerr << "Inflection table is truncated" << endl;
+    return false;
+  }
+  const InflectionTableHeader* header =
+      reinterpret_cast<const InflectionTableHeader*>(image);
+  if (memcmp(header->magic, kInflectionTableMagic,
+             sizeof(kInflectionTableMagic)) != 0 ||
+      header->version != kInflectionTableVersion) {
+    cerr << "Not an inflection table of version " << kInflectionTableVersion
+         << endl;
+    return false;
+  }
+  if (header->char_vocab_size != char_vocab_size ||
+      header->morph_vocab_size != morph_vocab_size) {
+    cerr << "Inflection table was built with a different vocabulary" << endl;
+    return false;
+  }
+  if (header->id_bytes != 1 && header->id_bytes != 2) {
+    cerr << "Inflection table is corrupt" << endl;
+    return false;
+  }
+  if (header->num_slots == 0 ||
+      (header->num_slots & (header->num_slots - 1)) != 0 ||
+      header->num_slots > (size - SlotsOffset()) / sizeof(uint32_t) ||
+      header->data_size > size - DataOffset(header->num_slots)) {
+    cerr << "Inflection table is truncated" << endl;
+    return false;
+  }
+  const uint32_t* table_slots =
+      reinterpret_cast<const uint32_t*>(image + SlotsOffset());
+  const uint8_t* table_data = reinterpret_cast<const uint8_t*>(
+      image + DataOffset(header->num_slots));
+  if (!CheckEntries(table_slots, header->num_slots, table_data,
+                    header->data_size, header->id_bytes,
+                    header->morph_vocab_size, header->num_lemmas)) {
+    cerr << "Inflection table is corrupt" << endl;
+    return false;
+  }
+
+  num_lemmas = header->num_lemmas;
+  morph_len = header->morph_vocab_size;
+  id_bytes = header->id_bytes;
+  slot_mask = header->num_slots - 1;
+  slots = table_slots;
+  data = table_data;
+  return true;
+}
+
+bool InflectionTable::Map(const string& filename,
+                          const unsigned& char_vocab_size,
+                          const unsigned& morph_vocab_size) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "File opening failed" << endl;
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) < 0 || file_stat.st_size == 0) {
+    cerr << "File opening failed" << endl;
+    close(fd);
+    return false;
+  }
+  void* image = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    cerr << "Memory mapping failed: " << filename << endl;
+    return false;
+  }
+  // Lookups touch a few scattered pages, so read-ahead would only evict
+  // other pages of the table.
+  madvise(image, file_stat.st_size, MADV_RANDOM);
+
+  if (mapped != NULL) {
+    munmap(mapped, mapped_size);
+  }
+  mapped = image;
+  mapped_size = file_stat.st_size;
+  return Attach(static_cast<const char*>(image), mapped_size,
+                char_vocab_size, morph_vocab_size);
+}
+
+static void AppendId(const unsigned& id, const unsigned& id_bytes,
+                     vector<uint8_t>* data) {
+  data->push_back(id & 0xff);
+  if (id_bytes == 2) {
+    data->push_back(id >> 8);
+  }
+}
+
+bool BuildInflectionTable(const vector<vector<unsigned> >& lemmas,
+                          const vector<vector<vector<unsigned> > >& forms,
+                          const unsigned& char_vocab_size,
+                          const unsigned& morph_vocab_size,
+                          vector<char>* image) {
+  InflectionTableHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kInflectionTableMagic, sizeof(kInflectionTableMagic));
+  header.version = kInflectionTableVersion;
+  header.id_bytes = char_vocab_size <= 256 ? 1 : 2;
+  header.char_vocab_size = char_vocab_size;
+  header.morph_vocab_size = morph_vocab_size;
+  // At most half of the slots are used, keeping the probes short.
+  header.num_slots = 2;
+  while (header.num_slots < 2 * lemmas.size()) {
+    header.num_slots *= 2;
+  }
+
+  vector<uint32_t> slots(header.num_slots, kEmptySlot);
+  vector<uint8_t> data;
+  for (unsigned i = 0; i < lemmas.size(); ++i) {
+    const vector<unsigned>& lemma = lemmas[i];
+    if (lemma.size() > 255) {
+      cerr << "Lemma longer than 255 characters" << endl;
+      return false;
+    }
+    uint64_t slot = HashLemma(lemma) & (header.num_slots - 1);
+    bool repeated = false;
+    while (slots[slot] != kEmptySlot && !repeated) {
+      const uint8_t* entry = data.data() + slots[slot];
+      repeated = entry[0] == lemma.size();
+      for (unsigned j = 0; repeated && j < lemma.size(); ++j) {
+        repeated = ReadId(entry + 1, j, header.id_bytes) == lemma[j];
+      }
+      slot = (slot + 1) & (header.num_slots - 1);
+    }
+    if (repeated) {
+      continue;
+    }
+    if (data.size() >= kEmptySlot) {
+      cerr << "Inflection table larger than 4 GB" << endl;
+      return false;
+    }
+    slots[slot] = data.size();
+    header.num_lemmas++;
+
+    data.push_back(lemma.size());
+    for (const unsigned& id : lemma) {
+      AppendId(id, header.id_bytes, &data);
+    }
+    for (unsigned morph_id = 0; morph_id < morph_vocab_size; ++morph_id) {
+      static const vector<unsigned> kMissing;
+      const vector<unsigned>& form =
+          morph_id < forms[i].size() ? forms[i][morph_id] : kMissing;
+      unsigned prefix_len = 0;
+      while (prefix_len < form.size() && prefix_len < lemma.size() &&
+             prefix_len < 255 && form[prefix_len] == lemma[prefix_len]) {
+        prefix_len++;
+      }
+      if (form.size() - prefix_len > 255) {
+        cerr << "Form longer than 255 characters" << endl;
+        return false;
+      }
+      data.push_back(prefix_len);
+      data.push_back(form.size() - prefix_len);
+      for (unsigned j = prefix_len; j < form.size(); ++j) {
+        AppendId(form[j], header.id_bytes, &data);
+      }
+    }
+  }
+  header.data_size = data.size();
+
+  image->assign(DataOffset(header.num_slots) + data.size(), 0);
+  char* out = image->data();
+  memcpy(out, &header, sizeof(header));
+  memcpy(out + SlotsOffset(), slots.data(), sizeof(uint32_t) * slots.size());
+  memcpy(out + DataOffset(header.num_slots), data.data(), data.size());
+  return true;
+}
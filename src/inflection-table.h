@@ -0,0 +1,90 @@
+#ifndef INFLECTION_TABLE_H_
+#define INFLECTION_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// An inflection table file starts with this header, followed by:
+//   uint32 slots[num_slots]  open-addressing hash table over the lemmas,
+//                            holding the offset of the lemma's entry in
+//                            data, or kEmptySlot
+//   uint8 data[data_size]    one entry per lemma:
+//     uint8 lemma_len, ids[lemma_len]
+//     for every tag: uint8 prefix_len, uint8 suffix_len, ids[suffix_len]
+// The form of a tag is the first prefix_len ids of the lemma followed by
+// the suffix ids, so the characters a form shares with the start of the
+// lemma are not stored again. A form of length 0 is missing. The lemma and
+// the forms include <s> and </s>, and the ids are uint8 if the vocabulary
+// has at most 256 characters and uint16 otherwise.
+struct InflectionTableHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t id_bytes;
+  uint32_t char_vocab_size;
+  uint32_t morph_vocab_size;
+  uint64_t num_lemmas;
+  uint64_t num_slots;  // A power of two
+  uint64_t data_size;
+};
+
+const char kInflectionTableMagic[8] = {'I', 'N', 'F', 'L', 'T', 'A', 'B',
+                                       '\0'};
+const uint32_t kInflectionTableVersion = 1;
+const uint32_t kEmptySlot = 0xffffffff;
+
+// Read-only view of an inflection table, memory-mapped from a file so that
+// all the processes serving it share one copy in the page cache. A lookup
+// hashes the lemma, probes a few slots and decodes one form, without
+// allocating once output_ids has grown to the longest form.
+class InflectionTable {
+ public:
+  InflectionTable();
+  ~InflectionTable();
+
+  unsigned size() const { return num_lemmas; }
+
+  // Writes the form of the lemma (with <s> and </s>) for the tag to
+  // output_ids. Returns false if the lemma or its form are not in the table.
+  bool Lookup(const unsigned& morph_id, const vector<unsigned>& input_ids,
+              vector<unsigned>* output_ids) const;
+
+  // Points the table at an image. Returns false if the image is not a valid
+  // table for the given vocabulary sizes.
+  bool Attach(const char* data, const size_t& size,
+              const unsigned& char_vocab_size,
+              const unsigned& morph_vocab_size);
+
+  // Memory-maps a table file and attaches to it.
+  bool Map(const string& filename, const unsigned& char_vocab_size,
+           const unsigned& morph_vocab_size);
+
+ private:
+  InflectionTable(const InflectionTable&);
+  InflectionTable& operator=(const InflectionTable&);
+
+  // The entry of the lemma, or NULL.
+  const uint8_t* FindEntry(const vector<unsigned>& input_ids) const;
+
+  unsigned num_lemmas, morph_len, id_bytes;
+  uint64_t slot_mask;
+  const uint32_t* slots;
+  const uint8_t* data;
+  void* mapped;
+  size_t mapped_size;
+};
+
+// Packs the forms of every lemma into a table image. forms[i][morph_id] is
+// the form of lemmas[i] for the tag, with <s> and </s>, or empty if it is
+// missing. Repeated lemmas keep their first forms. Returns false if a lemma
+// or a form is longer than 255 characters or the data exceeds 4 GB.
+bool BuildInflectionTable(const vector<vector<unsigned> >& lemmas,
+                          const vector<vector<vector<unsigned> > >& forms,
+                          const unsigned& char_vocab_size,
+                          const unsigned& morph_vocab_size,
+                          vector<char>* image);
+
+#endif
@@ -78,6 +78,31 @@ void JointEncDecMorph::RunFwdBwd(const vector<unsigned>& inputs,
   *hidden = concatenate({forward_unit, backward_unit});
 }
 
+void JointEncDecMorph::RunFwdBwd(const vector<vector<unsigned> >& inputs,
+                                 Expression* hidden, ComputationGraph *cg) {
+  vector<Expression> input_vecs;
+  for (unsigned i = 0; i < inputs[0].size(); ++i) {
+    input_vecs.push_back(lookup(*cg, char_vecs, BatchColumn(inputs, i)));
+  }
+
+  // Run forward LSTM
+  Expression forward_unit;
+  input_forward.start_new_sequence();
+  for (unsigned i = 0; i < input_vecs.size(); ++i) {
+    forward_unit = input_forward.add_input(input_vecs[i]);
+  }
+
+  // Run backward LSTM
+  Expression backward_unit;
+  input_backward.start_new_sequence();
+  for (int i = input_vecs.size() - 1; i >= 0; --i) {
+    backward_unit = input_backward.add_input(input_vecs[i]);
+  }
+
+  // Concatenate the forward and back hidden layers
+  *hidden = concatenate({forward_unit, backward_unit});
+}
+
 void JointEncDecMorph::TransformEncodedInput(Expression* encoded_input) const {
   *encoded_input = affine_transform({transform_encoded_bias,
                                      transform_encoded, *encoded_input});
@@ -101,6 +126,18 @@ Expression JointEncDecMorph::ComputeLoss(const vector<Expression>& hidden_units,
   return sum(losses);
 }
 
+Expression JointEncDecMorph::ComputeLoss(const vector<Expression>& hidden_units,
+                                         const vector<vector<unsigned> >& targets) const {
+  assert(hidden_units.size() == targets.size());
+  vector<Expression> losses;
+  for (unsigned i = 0; i < hidden_units.size(); ++i) {
+    Expression out;
+    ProjectToOutput(hidden_units[i], &out);
+    losses.push_back(pickneglogsoftmax(out, targets[i]));
+  }
+  return sum_batches(sum(losses));
+}
+
 float JointEncDecMorph::Train(const unsigned& morph_id, const vector<unsigned>& inputs,
                            const vector<unsigned>& outputs, AdadeltaTrainer* opt,
                            AdadeltaTrainer* shared_opt) {
@@ -147,27 +184,102 @@ float JointEncDecMorph::Train(const unsigned& morph_id, const vector<unsigned>&
   return return_loss;
 }
 
-void Serialize(string& filename, JointEncDecMorph& model,
-               vector<Model*>* cnn_models) {
-  ofstream outfile(filename);
-  if (!outfile.is_open()) {
-    cerr << "File opening failed" << endl;
+float JointEncDecMorph::TrainBatch(const unsigned& morph_id,
+                                   const vector<vector<unsigned> >& inputs,
+                                   const vector<vector<unsigned> >& outputs,
+                                   AdadeltaTrainer* opt, AdadeltaTrainer* shared_opt) {
+  ComputationGraph cg;
+  AddParamsToCG(morph_id, &cg);
+
+  // Encode and Transform to feed into decoder
+  Expression encoded_input_vec;
+  RunFwdBwd(inputs, &encoded_input_vec, &cg);
+  TransformEncodedInput(&encoded_input_vec);
+
+  // All examples have the same lengths, so every decoder step reads either
+  // input characters or epsilons for the whole batch.
+  unsigned input_len = inputs[0].size(), output_len = outputs[0].size();
+  vector<Expression> input_vecs_for_dec;
+  vector<vector<unsigned> > output_ids_for_pred;
+  for (unsigned i = 0; i < output_len; ++i) {
+    if (i < output_len - 1) {
+      // '</s>' will not be fed as input -- it needs to be predicted.
+      Expression prev_output_vecs = lookup(cg, char_vecs,
+                                           BatchColumn(outputs, i));
+      if (i < input_len - 1) {
+        input_vecs_for_dec.push_back(concatenate(
+            {encoded_input_vec, prev_output_vecs,
+             lookup(cg, char_vecs, BatchColumn(inputs, i + 1))}));
+      } else {
+        vector<unsigned> eps_ids(inputs.size(),
+                                 min(unsigned(i - input_len), max_eps - 1));
+        input_vecs_for_dec.push_back(concatenate(
+            {encoded_input_vec, prev_output_vecs,
+             lookup(cg, eps_vecs, eps_ids)}));
+      }
+    }
+    if (i > 0) {  // '<s>' will not be predicted in the output -- its fed in.
+      output_ids_for_pred.push_back(BatchColumn(outputs, i));
+    }
   }
 
-  boost::archive::text_oarchive oa(outfile);
-  oa & model;
-  for (unsigned i = 0; i < cnn_models->size(); ++i) {
-    oa & *(*cnn_models)[i];
+  vector<Expression> decoder_hidden_units;
+  output_forward.start_new_sequence();
+  for (const auto& vec : input_vecs_for_dec) {
+    decoder_hidden_units.push_back(output_forward.add_input(vec));
   }
+  Expression loss = ComputeLoss(decoder_hidden_units, output_ids_for_pred);
 
-  cerr << "Saved model to: " << filename << endl;
-  outfile.close();
+  float return_loss = as_scalar(cg.forward());
+  cg.backward();
+  opt->update(1.0f);  // Update the morph specific parameters
+  shared_opt->update(1.0f);  // Update the shared parameters
+  return return_loss;
+}
+
+void Serialize(string& filename, JointEncDecMorph& model,
+               vector<Model*>* cnn_models) {
+  ModelHeader header = MakeModelHeader(kJointEncDecMorph, model.char_len,
+                                       model.hidden_len, model.vocab_len,
+                                       model.layers, model.morph_len,
+                                       model.max_eps, 0);
+  if (WriteBinaryModel(filename, header, *cnn_models)) {
+    cerr << "Saved model to: " << filename << endl;
+  }
 }
 
-void Read(string& filename, JointEncDecMorph* model, vector<Model*>* cnn_models) {
+bool Read(string& filename, JointEncDecMorph* model, vector<Model*>* cnn_models) {
+  if (IsBinaryModel(filename)) {
+    MappedModel* mapped = OpenBinaryModel(filename, kJointEncDecMorph, 1);
+    if (mapped == NULL) {
+      return false;
+    }
+    const ModelHeader& header = *mapped->header;
+    model->char_len = header.char_len;
+    model->hidden_len = header.hidden_len;
+    model->vocab_len = header.vocab_len;
+    model->layers = header.layers;
+    model->morph_len = header.morph_len;
+    model->max_eps = header.max_eps;
+    for (unsigned i = 0; i < model->morph_len + 1; ++i) {
+      cnn_models->push_back(new Model());
+    }
+
+    model->InitParams(cnn_models);
+    for (unsigned i = 0; i < cnn_models->size(); ++i) {
+      if (!mapped->LoadParams(i, true, (*cnn_models)[i])) {
+        return false;
+      }
+    }
+    cerr << "Loaded model from: " << filename << endl;
+    return true;
+  }
+
+  // Models saved in the old boost text format.
   ifstream infile(filename);
   if (!infile.is_open()) {
     cerr << "File opening failed" << endl;
+    return false;
   }
 
   boost::archive::text_iarchive ia(infile);
@@ -184,6 +296,7 @@ void Read(string& filename, JointEncDecMorph* model, vector<Model*>* cnn_models)
 
   cerr << "Loaded model from: " << filename << endl;
   infile.close();
+  return true;
 }
 
 void
@@ -193,15 +306,18 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
   ComputationGraph cg;
 
   unsigned ensmb = ensmb_model->size();
-  vector<Expression> encoded_word_vecs;
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
   for (unsigned i = 0; i < ensmb; ++i) {
     Expression encoded_word_vec;
     auto model = (*ensmb_model)[i];
     model->AddParamsToCG(morph_id, &cg);
     model->RunFwdBwd(input_ids, &encoded_word_vec, &cg);
     model->TransformEncodedInput(&encoded_word_vec);
-    encoded_word_vecs.push_back(encoded_word_vec);
-    model->output_forward.start_new_sequence();
+    decoders.push_back(FixedInputLSTM(model->output_forward,
+                                      model->hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
   }
 
   unsigned out_index = 1;
@@ -224,10 +340,11 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
                                 min(unsigned(out_index - input_ids.size()),
                                              model->max_eps - 1));
       }
-      input = concatenate({encoded_word_vecs[ensmb_id], prev_output_vec,
-                           input_char_vec});
+      input = concatenate({prev_output_vec, input_char_vec});
 
-      Expression hidden = model->output_forward.add_input(input);
+      Expression hidden = decoders[ensmb_id].AddInput(
+          encoded_biases[ensmb_id], states[ensmb_id], input,
+          &states[ensmb_id]);
       Expression out;
       model->ProjectToOutput(hidden, &out);
       ensmb_out.push_back(log_softmax(out));
@@ -239,3 +356,196 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
     out_index++;
   }
 }
+
+void
+EnsembleBatchDecode(const unsigned& morph_id,
+                    unordered_map<string, unsigned>& char_to_id,
+                    const vector<vector<unsigned> >& inputs,
+                    vector<vector<unsigned> >* pred_target_ids,
+                    vector<JointEncDecMorph*>* ensmb_model) {
+  ComputationGraph cg;
+
+  unsigned ensmb = ensmb_model->size();
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
+  for (unsigned i = 0; i < ensmb; ++i) {
+    Expression encoded_word_vec;
+    auto model = (*ensmb_model)[i];
+    model->AddParamsToCG(morph_id, &cg);
+    model->RunFwdBwd(inputs, &encoded_word_vec, &cg);
+    model->TransformEncodedInput(&encoded_word_vec);
+    decoders.push_back(FixedInputLSTM(model->output_forward,
+                                      model->hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
+  }
+
+  // live[i] is the word of the i-th element of the batch.
+  unsigned input_len = inputs[0].size(), out_index = 1;
+  unsigned eow_index = char_to_id[EOW];
+  pred_target_ids->assign(inputs.size(),
+                          vector<unsigned>(1, char_to_id[BOW]));
+  vector<unsigned> live;
+  for (unsigned i = 0; i < inputs.size(); ++i) {
+    live.push_back(i);
+  }
+  while (!live.empty()) {
+    vector<unsigned> prev_ids, input_char_ids;
+    for (const unsigned& word : live) {
+      prev_ids.push_back((*pred_target_ids)[word].back());
+      if (out_index < input_len) {
+        input_char_ids.push_back(inputs[word][out_index]);
+      }
+    }
+
+    vector<Expression> ensmb_out;
+    for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+      auto model = (*ensmb_model)[ensmb_id];
+      Expression prev_output_vecs = lookup(cg, model->char_vecs, prev_ids);
+      Expression input_char_vecs;
+      if (out_index < input_len) {
+        input_char_vecs = lookup(cg, model->char_vecs, input_char_ids);
+      } else {
+        vector<unsigned> eps_ids(live.size(),
+                                 min(unsigned(out_index - input_len),
+                                     model->max_eps - 1));
+        input_char_vecs = lookup(cg, model->eps_vecs, eps_ids);
+      }
+      Expression input = concatenate({prev_output_vecs, input_char_vecs});
+
+      Expression hidden = decoders[ensmb_id].AddInput(
+          encoded_biases[ensmb_id], states[ensmb_id], input,
+          &states[ensmb_id]);
+      Expression out;
+      model->ProjectToOutput(hidden, &out);
+      ensmb_out.push_back(log_softmax(out));
+    }
+
+    Expression out = sum(ensmb_out) / ensmb_out.size();
+    vector<float> dist = as_vector(cg.incremental_forward());
+    unsigned vocab_size = dist.size() / live.size();
+    vector<unsigned> kept;  // The elements of the batch that go on
+    for (unsigned i = 0; i < live.size(); ++i) {
+      auto begin = dist.begin() + i * vocab_size;
+      unsigned pred_index = distance(begin,
+                                     max_element(begin, begin + vocab_size));
+      vector<unsigned>& pred = (*pred_target_ids)[live[i]];
+      pred.push_back(pred_index);
+      if (pred_index != eow_index && pred.size() < MAX_PRED_LEN) {
+        kept.push_back(i);
+      }
+    }
+
+    // Drop the words that ended from the batch.
+    if (!kept.empty() && kept.size() < live.size()) {
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        auto model = (*ensmb_model)[ensmb_id];
+        for (Expression& bias : encoded_biases[ensmb_id]) {
+          bias = SelectBatchElems(bias, model->hidden_len, live.size(), kept);
+        }
+        KeepBatchElems(model->hidden_len, live.size(), kept,
+                       &states[ensmb_id]);
+      }
+    }
+    vector<unsigned> next_live;
+    for (const unsigned& i : kept) {
+      next_live.push_back(live[i]);
+    }
+    live = next_live;
+    out_index++;
+  }
+}
+
+void
+EnsembleDecodeParadigm(unordered_map<string, unsigned>& char_to_id,
+                       const vector<unsigned>& input_ids,
+                       vector<vector<unsigned> >* pred_target_ids,
+                       vector<JointEncDecMorph*>* ensmb_model) {
+  ComputationGraph cg;
+
+  unsigned ensmb = ensmb_model->size();
+  unsigned morph_len = (*ensmb_model)[0]->morph_len;
+  // The tags share the decoder, so every tag keeps its own decoder biases
+  // and state of every model, states[morph_id][ensmb_id].
+  vector<FixedInputLSTM> decoders;
+  vector<vector<vector<Expression> > > encoded_biases(morph_len);
+  vector<vector<LSTMState> > states(morph_len, vector<LSTMState>(ensmb));
+  for (unsigned i = 0; i < ensmb; ++i) {
+    Expression encoded;
+    auto model = (*ensmb_model)[i];
+    model->AddParamsToCG(0, &cg);
+    model->RunFwdBwd(input_ids, &encoded, &cg);
+    decoders.push_back(FixedInputLSTM(model->output_forward,
+                                      model->hidden_len));
+    for (unsigned morph_id = 0; morph_id < morph_len; ++morph_id) {
+      model->transform_encoded =
+          parameter(cg, model->ptransform_encoded[morph_id]);
+      model->transform_encoded_bias =
+          parameter(cg, model->ptransform_encoded_bias[morph_id]);
+      Expression encoded_word_vec = encoded;
+      model->TransformEncodedInput(&encoded_word_vec);
+      encoded_biases[morph_id].push_back(
+          decoders.back().InputBias(encoded_word_vec));
+    }
+  }
+
+  // The tags step together: each step adds one output to the graph for
+  // every tag still being decoded, and one forward pass computes all of them.
+  pred_target_ids->assign(morph_len, vector<unsigned>());
+  vector<unsigned> pred_index(morph_len, char_to_id[BOW]);
+  vector<unsigned> live;
+  for (unsigned morph_id = 0; morph_id < morph_len; ++morph_id) {
+    live.push_back(morph_id);
+  }
+  unsigned out_index = 1;
+  while (!live.empty()) {
+    vector<unsigned> next_live;
+    for (const unsigned& morph_id : live) {
+      vector<unsigned>& pred = (*pred_target_ids)[morph_id];
+      pred.push_back(pred_index[morph_id]);
+      if (pred_index[morph_id] != char_to_id[EOW] &&
+          pred.size() < MAX_PRED_LEN) {
+        next_live.push_back(morph_id);
+      }
+    }
+    live = next_live;
+    if (live.empty()) {
+      break;
+    }
+
+    vector<Expression> outs;
+    for (const unsigned& morph_id : live) {
+      vector<Expression> ensmb_out;
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        auto model = (*ensmb_model)[ensmb_id];
+        Expression prev_output_vec = lookup(cg, model->char_vecs,
+                                            pred_index[morph_id]);
+        Expression input, input_char_vec;
+        if (out_index < input_ids.size()) {
+          input_char_vec = lookup(cg, model->char_vecs, input_ids[out_index]);
+        } else {
+          input_char_vec = lookup(cg, model->eps_vecs,
+                                  min(unsigned(out_index - input_ids.size()),
+                                               model->max_eps - 1));
+        }
+        input = concatenate({prev_output_vec, input_char_vec});
+
+        LSTMState& state = states[morph_id][ensmb_id];
+        Expression hidden = decoders[ensmb_id].AddInput(
+            encoded_biases[morph_id][ensmb_id], state, input, &state);
+        Expression out;
+        model->ProjectToOutput(hidden, &out);
+        ensmb_out.push_back(log_softmax(out));
+      }
+      outs.push_back(sum(ensmb_out) / ensmb_out.size());
+    }
+
+    cg.incremental_forward();
+    for (unsigned i = 0; i < live.size(); ++i) {
+      vector<float> dist = as_vector(cg.get_value(outs[i].i));
+      pred_index[live[i]] = distance(dist.begin(),
+                                     max_element(dist.begin(), dist.end()));
+    }
+    out_index++;
+  }
+}
@@ -11,6 +11,8 @@
 #include "cnn/expr.h"
 
 #include "utils.h"
+#include "model-io.h"
+#include "lstm-utils.h"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -53,6 +55,10 @@ class JointEncDecMorph {
   void RunFwdBwd(const vector<unsigned>& inputs,
                  Expression* hidden, ComputationGraph *cg);
 
+  // Encodes a batch of inputs which all have the same length.
+  void RunFwdBwd(const vector<vector<unsigned> >& inputs,
+                 Expression* hidden, ComputationGraph *cg);
+
   void TransformEncodedInput(Expression* encoded_input) const; 
 
   void ProjectToOutput(const Expression& hidden, Expression* out) const;
@@ -60,10 +66,20 @@ class JointEncDecMorph {
   Expression ComputeLoss(const vector<Expression>& hidden_units,
                          const vector<unsigned>& targets) const;
 
+  Expression ComputeLoss(const vector<Expression>& hidden_units,
+                         const vector<vector<unsigned> >& targets) const;
+
   float Train(const unsigned& morph_id, const vector<unsigned>& inputs,
               const vector<unsigned>& outputs, AdadeltaTrainer* opt,
               AdadeltaTrainer* shared_opt);
 
+  // Trains on a batch of examples that all have the same input length and
+  // the same output length, with one update for the whole batch.
+  float TrainBatch(const unsigned& morph_id,
+                   const vector<vector<unsigned> >& inputs,
+                   const vector<vector<unsigned> >& outputs,
+                   AdadeltaTrainer* opt, AdadeltaTrainer* shared_opt);
+
   friend class boost::serialization::access;
   template<class Archive> void serialize(Archive& ar, const unsigned int) {
     ar & char_len;
@@ -77,11 +93,34 @@ class JointEncDecMorph {
 
 void Serialize(string& filename, JointEncDecMorph& model, vector<Model*>* cnn_model);
 
-void Read(string& filename, JointEncDecMorph* model, vector<Model*>* cnn_model);
+// Reads a model, returning false on failure.
+bool Read(string& filename, JointEncDecMorph* model, vector<Model*>* cnn_model);
 
 void
 EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_to_id,
                const vector<unsigned>& input_ids, vector<unsigned>* pred_target_ids,
                vector<JointEncDecMorph*>* ensmb_model);
 
+// Decodes a batch of inputs of the same length with the same tag, writing
+// the prediction of EnsembleDecode() for inputs[i] to (*pred_target_ids)[i].
+// The words are encoded and decoded together, every step computing the whole
+// batch with matrix-matrix products, and a word leaves the batch when it
+// ends.
+void
+EnsembleBatchDecode(const unsigned& morph_id,
+                    unordered_map<string, unsigned>& char_to_id,
+                    const vector<vector<unsigned> >& inputs,
+                    vector<vector<unsigned> >* pred_target_ids,
+                    vector<JointEncDecMorph*>* ensmb_model);
+
+// Decodes the lemma with every morph tag, writing the prediction of
+// EnsembleDecode() for tag i to (*pred_target_ids)[i]. The shared encoder
+// runs once per model instead of once per tag, and all the tags step
+// together in one graph, each from its own state of the shared decoder.
+void
+EnsembleDecodeParadigm(unordered_map<string, unsigned>& char_to_id,
+                       const vector<unsigned>& input_ids,
+                       vector<vector<unsigned> >* pred_target_ids,
+                       vector<JointEncDecMorph*>* ensmb_model);
+
 #endif
@@ -1,14 +1,11 @@
 #include "joint-enc-morph.h"
 
-#include <queue>
-
 using namespace std;
 using namespace cnn;
 using namespace cnn::expr;
 
 string BOW = "<s>", EOW = "</s>";
 unsigned MAX_PRED_LEN = 100;
-float NEG_INF = numeric_limits<int>::min();
 
 JointEncMorph::JointEncMorph(
   const unsigned& char_length, const unsigned& hidden_length,
@@ -83,6 +80,31 @@ void JointEncMorph::RunFwdBwd(const vector<unsigned>& inputs,
   *hidden = concatenate({forward_unit, backward_unit});
 }
 
+void JointEncMorph::RunFwdBwd(const vector<vector<unsigned> >& inputs,
+                              Expression* hidden, ComputationGraph *cg) {
+  vector<Expression> input_vecs;
+  for (unsigned i = 0; i < inputs[0].size(); ++i) {
+    input_vecs.push_back(lookup(*cg, char_vecs, BatchColumn(inputs, i)));
+  }
+
+  // Run forward LSTM
+  Expression forward_unit;
+  input_forward.start_new_sequence();
+  for (unsigned i = 0; i < input_vecs.size(); ++i) {
+    forward_unit = input_forward.add_input(input_vecs[i]);
+  }
+
+  // Run backward LSTM
+  Expression backward_unit;
+  input_backward.start_new_sequence();
+  for (int i = input_vecs.size() - 1; i >= 0; --i) {
+    backward_unit = input_backward.add_input(input_vecs[i]);
+  }
+
+  // Concatenate the forward and back hidden layers
+  *hidden = concatenate({forward_unit, backward_unit});
+}
+
 void JointEncMorph::TransformEncodedInput(Expression* encoded_input) const {
   *encoded_input = affine_transform({transform_encoded_bias,
                                      transform_encoded, *encoded_input});
@@ -106,6 +128,18 @@ Expression JointEncMorph::ComputeLoss(const vector<Expression>& hidden_units,
   return sum(losses);
 }
 
+Expression JointEncMorph::ComputeLoss(const vector<Expression>& hidden_units,
+                                      const vector<vector<unsigned> >& targets) const {
+  assert(hidden_units.size() == targets.size());
+  vector<Expression> losses;
+  for (unsigned i = 0; i < hidden_units.size(); ++i) {
+    Expression out;
+    ProjectToOutput(hidden_units[i], &out);
+    losses.push_back(pickneglogsoftmax(out, targets[i]));
+  }
+  return sum_batches(sum(losses));
+}
+
 float JointEncMorph::Train(const unsigned& morph_id, const vector<unsigned>& inputs,
                            const vector<unsigned>& outputs, AdadeltaTrainer* opt,
                            AdadeltaTrainer* shared_opt) {
@@ -153,27 +187,102 @@ float JointEncMorph::Train(const unsigned& morph_id, const vector<unsigned>& inp
   return return_loss;
 }
 
-void Serialize(string& filename, JointEncMorph& model,
-               vector<Model*>* cnn_models) {
-  ofstream outfile(filename);
-  if (!outfile.is_open()) {
-    cerr << "File opening failed: " << filename << endl;
+float JointEncMorph::TrainBatch(const unsigned& morph_id,
+                                const vector<vector<unsigned> >& inputs,
+                                const vector<vector<unsigned> >& outputs,
+                                AdadeltaTrainer* opt, AdadeltaTrainer* shared_opt) {
+  ComputationGraph cg;
+  AddParamsToCG(morph_id, &cg);
+
+  // Encode and Transform to feed into decoder
+  Expression encoded_input_vec;
+  RunFwdBwd(inputs, &encoded_input_vec, &cg);
+  TransformEncodedInput(&encoded_input_vec);
+
+  // All examples have the same lengths, so every decoder step reads either
+  // input characters or epsilons for the whole batch.
+  unsigned input_len = inputs[0].size(), output_len = outputs[0].size();
+  vector<Expression> input_vecs_for_dec;
+  vector<vector<unsigned> > output_ids_for_pred;
+  for (unsigned i = 0; i < output_len; ++i) {
+    if (i < output_len - 1) {
+      // '</s>' will not be fed as input -- it needs to be predicted.
+      Expression prev_output_vecs = lookup(cg, char_vecs,
+                                           BatchColumn(outputs, i));
+      if (i < input_len - 1) {
+        input_vecs_for_dec.push_back(concatenate(
+            {encoded_input_vec, prev_output_vecs,
+             lookup(cg, char_vecs, BatchColumn(inputs, i + 1))}));
+      } else {
+        vector<unsigned> eps_ids(inputs.size(),
+                                 min(unsigned(i - input_len), max_eps - 1));
+        input_vecs_for_dec.push_back(concatenate(
+            {encoded_input_vec, prev_output_vecs,
+             lookup(cg, eps_vecs[morph_id], eps_ids)}));
+      }
+    }
+    if (i > 0) {  // '<s>' will not be predicted in the output -- its fed in.
+      output_ids_for_pred.push_back(BatchColumn(outputs, i));
+    }
   }
 
-  boost::archive::text_oarchive oa(outfile);
-  oa & model;
-  for (unsigned i = 0; i < cnn_models->size(); ++i) {
-    oa & *(*cnn_models)[i];
+  vector<Expression> decoder_hidden_units;
+  output_forward[morph_id].start_new_sequence();
+  for (const auto& vec : input_vecs_for_dec) {
+    decoder_hidden_units.push_back(output_forward[morph_id].add_input(vec));
   }
+  Expression loss = ComputeLoss(decoder_hidden_units, output_ids_for_pred);
 
-  cerr << "Saved model to: " << filename << endl;
-  outfile.close();
+  float return_loss = as_scalar(cg.forward());
+  cg.backward();
+  opt->update(1.0f);  // Update the morph specific parameters
+  shared_opt->update(1.0f);  // Update the shared parameters
+  return return_loss;
+}
+
+void Serialize(string& filename, JointEncMorph& model,
+               vector<Model*>* cnn_models) {
+  ModelHeader header = MakeModelHeader(kJointEncMorph, model.char_len,
+                                       model.hidden_len, model.vocab_len,
+                                       model.layers, model.morph_len,
+                                       model.max_eps, 0);
+  if (WriteBinaryModel(filename, header, *cnn_models)) {
+    cerr << "Saved model to: " << filename << endl;
+  }
 }
 
-void Read(string& filename, JointEncMorph* model, vector<Model*>* cnn_models) {
+bool Read(string& filename, JointEncMorph* model, vector<Model*>* cnn_models) {
+  if (IsBinaryModel(filename)) {
+    MappedModel* mapped = OpenBinaryModel(filename, kJointEncMorph, 1);
+    if (mapped == NULL) {
+      return false;
+    }
+    const ModelHeader& header = *mapped->header;
+    model->char_len = header.char_len;
+    model->hidden_len = header.hidden_len;
+    model->vocab_len = header.vocab_len;
+    model->layers = header.layers;
+    model->morph_len = header.morph_len;
+    model->max_eps = header.max_eps;
+    for (unsigned i = 0; i < model->morph_len + 1; ++i) {
+      cnn_models->push_back(new Model());
+    }
+
+    model->InitParams(cnn_models);
+    for (unsigned i = 0; i < cnn_models->size(); ++i) {
+      if (!mapped->LoadParams(i, true, (*cnn_models)[i])) {
+        return false;
+      }
+    }
+    cerr << "Loaded model from: " << filename << endl;
+    return true;
+  }
+
+  // Models saved in the old boost text format.
   ifstream infile(filename);
   if (!infile.is_open()) {
     cerr << "File opening failed: " << filename << endl;
+    return false;
   }
 
   boost::archive::text_iarchive ia(infile);
@@ -190,6 +299,7 @@ void Read(string& filename, JointEncMorph* model, vector<Model*>* cnn_models) {
 
   cerr << "Loaded model from: " << filename << endl;
   infile.close();
+  return true;
 }
 
 void
@@ -199,15 +309,18 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
   ComputationGraph cg;
 
   unsigned ensmb = ensmb_model->size();
-  vector<Expression> encoded_word_vecs;
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
   for (unsigned i = 0; i < ensmb; ++i) {
     Expression encoded_word_vec;
     auto model = (*ensmb_model)[i];
     model->AddParamsToCG(morph_id, &cg);
     model->RunFwdBwd(input_ids, &encoded_word_vec, &cg);
     model->TransformEncodedInput(&encoded_word_vec);
-    encoded_word_vecs.push_back(encoded_word_vec);
-    model->output_forward[morph_id].start_new_sequence();
+    decoders.push_back(FixedInputLSTM(model->output_forward[morph_id],
+                                      model->hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
   }
 
   unsigned out_index = 1;
@@ -230,10 +343,11 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
                                 min(unsigned(out_index - input_ids.size()),
                                              model->max_eps - 1));
       }
-      input = concatenate({encoded_word_vecs[ensmb_id], prev_output_vec,
-                           input_char_vec});
+      input = concatenate({prev_output_vec, input_char_vec});
 
-      Expression hidden = model->output_forward[morph_id].add_input(input);
+      Expression hidden = decoders[ensmb_id].AddInput(
+          encoded_biases[ensmb_id], states[ensmb_id], input,
+          &states[ensmb_id]);
       Expression out;
       model->ProjectToOutput(hidden, &out);
       ensmb_out.push_back(log_softmax(out));
@@ -246,18 +360,217 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
   }
 }
 
+void
+EnsembleBatchDecode(const unsigned& morph_id,
+                    unordered_map<string, unsigned>& char_to_id,
+                    const vector<vector<unsigned> >& inputs,
+                    vector<vector<unsigned> >* pred_target_ids,
+                    vector<JointEncMorph*>* ensmb_model) {
+  ComputationGraph cg;
+
+  unsigned ensmb = ensmb_model->size();
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
+  for (unsigned i = 0; i < ensmb; ++i) {
+    Expression encoded_word_vec;
+    auto model = (*ensmb_model)[i];
+    model->AddParamsToCG(morph_id, &cg);
+    model->RunFwdBwd(inputs, &encoded_word_vec, &cg);
+    model->TransformEncodedInput(&encoded_word_vec);
+    decoders.push_back(FixedInputLSTM(model->output_forward[morph_id],
+                                      model->hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
+  }
+
+  // live[i] is the word of the i-th element of the batch.
+  unsigned input_len = inputs[0].size(), out_index = 1;
+  unsigned eow_index = char_to_id[EOW];
+  pred_target_ids->assign(inputs.size(),
+                          vector<unsigned>(1, char_to_id[BOW]));
+  vector<unsigned> live;
+  for (unsigned i = 0; i < inputs.size(); ++i) {
+    live.push_back(i);
+  }
+  while (!live.empty()) {
+    vector<unsigned> prev_ids, input_char_ids;
+    for (const unsigned& word : live) {
+      prev_ids.push_back((*pred_target_ids)[word].back());
+      if (out_index < input_len) {
+        input_char_ids.push_back(inputs[word][out_index]);
+      }
+    }
+
+    vector<Expression> ensmb_out;
+    for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+      auto model = (*ensmb_model)[ensmb_id];
+      Expression prev_output_vecs = lookup(cg, model->char_vecs, prev_ids);
+      Expression input_char_vecs;
+      if (out_index < input_len) {
+        input_char_vecs = lookup(cg, model->char_vecs, input_char_ids);
+      } else {
+        vector<unsigned> eps_ids(live.size(),
+                                 min(unsigned(out_index - input_len),
+                                     model->max_eps - 1));
+        input_char_vecs = lookup(cg, model->eps_vecs[morph_id], eps_ids);
+      }
+      Expression input = concatenate({prev_output_vecs, input_char_vecs});
+
+      Expression hidden = decoders[ensmb_id].AddInput(
+          encoded_biases[ensmb_id], states[ensmb_id], input,
+          &states[ensmb_id]);
+      Expression out;
+      model->ProjectToOutput(hidden, &out);
+      ensmb_out.push_back(log_softmax(out));
+    }
+
+    Expression out = sum(ensmb_out) / ensmb_out.size();
+    vector<float> dist = as_vector(cg.incremental_forward());
+    unsigned vocab_size = dist.size() / live.size();
+    vector<unsigned> kept;  // The elements of the batch that go on
+    for (unsigned i = 0; i < live.size(); ++i) {
+      auto begin = dist.begin() + i * vocab_size;
+      unsigned pred_index = distance(begin,
+                                     max_element(begin, begin + vocab_size));
+      vector<unsigned>& pred = (*pred_target_ids)[live[i]];
+      pred.push_back(pred_index);
+      if (pred_index != eow_index && pred.size() < MAX_PRED_LEN) {
+        kept.push_back(i);
+      }
+    }
+
+    // Drop the words that ended from the batch.
+    if (!kept.empty() && kept.size() < live.size()) {
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        auto model = (*ensmb_model)[ensmb_id];
+        for (Expression& bias : encoded_biases[ensmb_id]) {
+          bias = SelectBatchElems(bias, model->hidden_len, live.size(), kept);
+        }
+        KeepBatchElems(model->hidden_len, live.size(), kept,
+                       &states[ensmb_id]);
+      }
+    }
+    vector<unsigned> next_live;
+    for (const unsigned& i : kept) {
+      next_live.push_back(live[i]);
+    }
+    live = next_live;
+    out_index++;
+  }
+}
+
+void
+EnsembleDecodeParadigm(unordered_map<string, unsigned>& char_to_id,
+                       const vector<unsigned>& input_ids,
+                       vector<vector<unsigned> >* pred_target_ids,
+                       vector<JointEncMorph*>* ensmb_model) {
+  ComputationGraph cg;
+
+  unsigned ensmb = ensmb_model->size();
+  unsigned morph_len = (*ensmb_model)[0]->morph_len;
+  // decoders, encoded_biases and states are indexed [morph_id][ensmb_id].
+  vector<vector<FixedInputLSTM> > decoders(morph_len);
+  vector<vector<vector<Expression> > > encoded_biases(morph_len);
+  vector<vector<LSTMState> > states(morph_len, vector<LSTMState>(ensmb));
+  for (unsigned i = 0; i < ensmb; ++i) {
+    Expression encoded;
+    auto model = (*ensmb_model)[i];
+    model->AddParamsToCG(0, &cg);
+    model->RunFwdBwd(input_ids, &encoded, &cg);
+    for (unsigned morph_id = 0; morph_id < morph_len; ++morph_id) {
+      if (morph_id > 0) {
+        model->output_forward[morph_id].new_graph(cg);
+      }
+      model->transform_encoded =
+          parameter(cg, model->ptransform_encoded[morph_id]);
+      model->transform_encoded_bias =
+          parameter(cg, model->ptransform_encoded_bias[morph_id]);
+      Expression encoded_word_vec = encoded;
+      model->TransformEncodedInput(&encoded_word_vec);
+      decoders[morph_id].push_back(FixedInputLSTM(
+          model->output_forward[morph_id], model->hidden_len));
+      encoded_biases[morph_id].push_back(
+          decoders[morph_id].back().InputBias(encoded_word_vec));
+    }
+  }
+
+  // Every tag has its own decoder, so the tags step together: each step
+  // adds one output to the graph for every tag still being decoded, and one
+  // forward pass computes all of them.
+  pred_target_ids->assign(morph_len, vector<unsigned>());
+  vector<unsigned> pred_index(morph_len, char_to_id[BOW]);
+  vector<unsigned> live;
+  for (unsigned morph_id = 0; morph_id < morph_len; ++morph_id) {
+    live.push_back(morph_id);
+  }
+  unsigned out_index = 1;
+  while (true) {
+    vector<unsigned> next_live;
+    for (const unsigned& morph_id : live) {
+      vector<unsigned>& pred = (*pred_target_ids)[morph_id];
+      pred.push_back(pred_index[morph_id]);
+      if (pred_index[morph_id] != char_to_id[EOW] &&
+          pred.size() < MAX_PRED_LEN) {
+        next_live.push_back(morph_id);
+      }
+    }
+    live = next_live;
+    if (live.empty()) {
+      break;
+    }
+
+    vector<Expression> outs;
+    for (const unsigned& morph_id : live) {
+      vector<Expression> ensmb_out;
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        auto model = (*ensmb_model)[ensmb_id];
+        Expression prev_output_vec = lookup(cg, model->char_vecs,
+                                            pred_index[morph_id]);
+        Expression input, input_char_vec;
+        if (out_index < input_ids.size()) {
+          input_char_vec = lookup(cg, model->char_vecs, input_ids[out_index]);
+        } else {
+          input_char_vec = lookup(cg, model->eps_vecs[morph_id],
+                                  min(unsigned(out_index - input_ids.size()),
+                                               model->max_eps - 1));
+        }
+        input = concatenate({prev_output_vec, input_char_vec});
+
+        LSTMState& state = states[morph_id][ensmb_id];
+        Expression hidden = decoders[morph_id][ensmb_id].AddInput(
+            encoded_biases[morph_id][ensmb_id], state, input, &state);
+        Expression out;
+        model->ProjectToOutput(hidden, &out);
+        ensmb_out.push_back(log_softmax(out));
+      }
+      outs.push_back(sum(ensmb_out) / ensmb_out.size());
+    }
+
+    cg.incremental_forward();
+    for (unsigned i = 0; i < live.size(); ++i) {
+      vector<float> dist = as_vector(cg.get_value(outs[i].i));
+      pred_index[live[i]] = distance(dist.begin(),
+                                     max_element(dist.begin(), dist.end()));
+    }
+    out_index++;
+  }
+}
+
 void
 EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
                    unordered_map<string, unsigned>& char_to_id,
                    const vector<unsigned>& input_ids,
                    vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
-                   vector<JointEncMorph*>* ensmb_model) {
+                   vector<JointEncMorph*>* ensmb_model,
+                   const BeamPruning& pruning, BeamStats* stats) {
   unsigned out_index = 1;
   unsigned ensmb = ensmb_model->size();
   ComputationGraph cg;
 
   // Compute stuff for every model in the ensemble.
-  vector<Expression> encoded_word_vecs;
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
   vector<Expression> ensmb_out;
   for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
     auto& model = *(*ensmb_model)[ensmb_id];
@@ -266,15 +579,18 @@ EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
     Expression encoded_word_vec;
     model.RunFwdBwd(input_ids, &encoded_word_vec, &cg);
     model.TransformEncodedInput(&encoded_word_vec);
-    encoded_word_vecs.push_back(encoded_word_vec);
-    model.output_forward[morph_id].start_new_sequence();
+    decoders.push_back(FixedInputLSTM(model.output_forward[morph_id],
+                                      model.hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
 
     Expression prev_output_vec = lookup(cg, model.char_vecs,
                                         char_to_id[BOW]);
-    Expression input = concatenate({encoded_word_vecs[ensmb_id], prev_output_vec,
+    Expression input = concatenate({prev_output_vec,
                                     lookup(cg, model.char_vecs,
-                                    input_ids[out_index])});
-    Expression hidden = model.output_forward[morph_id].add_input(input);
+                                           input_ids[out_index])});
+    Expression hidden = decoders[ensmb_id].AddInput(
+        encoded_biases[ensmb_id], states[ensmb_id], input,
+        &states[ensmb_id]);
     Expression out;
     model.ProjectToOutput(hidden, &out);
     out = log_softmax(out);
@@ -284,135 +600,68 @@ EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
   // Compute the average of the ensemble output.
   Expression out_dist = average(ensmb_out);
   vector<float> log_dist = as_vector(cg.incremental_forward());
-  priority_queue<pair<float, unsigned> > init_queue;
-  for (unsigned i = 0; i < log_dist.size(); ++i) {
-    init_queue.push(make_pair(log_dist[i], i));
-  }
   unsigned vocab_size = log_dist.size();
 
-  // Initialise the beam_size sequences, scores, hidden states.
-  vector<float> log_scores;
-  vector<vector<RNNPointer> > prev_states;
+  // Every hypothesis starts from the state after the first step. Finished
+  // and pruned hypotheses drop out of search.Live() and get no more graph
+  // nodes.
+  BeamSearch search;
+  search.Start(beam_size, char_to_id[BOW], char_to_id[EOW], MAX_PRED_LEN,
+               log_dist.data(), vocab_size, pruning);
+  vector<LSTMState> prev_states, curr_states(beam_size * ensmb);
   for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-    vector<unsigned> seq;
-    seq.push_back(char_to_id[BOW]);
-    seq.push_back(init_queue.top().second);
-    sequences->push_back(seq);
-    log_scores.push_back(init_queue.top().first);
-
-    vector<RNNPointer> ensmb_states;
     for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
-      auto& model = *(*ensmb_model)[ensmb_id];
-      ensmb_states.push_back(model.output_forward[morph_id].state());
+      prev_states.push_back(states[ensmb_id]);
     }
-    prev_states.push_back(ensmb_states);
-    init_queue.pop();
   }
 
-  vector<cnn::real> neg_inf(vocab_size, NEG_INF);
-  Expression neg_inf_vec = cnn::expr::input(cg, {vocab_size}, &neg_inf);
-
-  vector<bool> active_beams(beam_size, true);
-  while (true) {
+  while (!search.Done()) {
     out_index++;
-    priority_queue<pair<float, pair<unsigned, unsigned> > > probs_queue;
-    vector<vector<RNNPointer> > curr_states;
+    const vector<unsigned>& live = search.Live();
     vector<Expression> out_dist;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id]) {
-        unsigned prev_out_char = (*sequences)[beam_id].back();
-        vector<Expression> ensmb_out;
-        vector<RNNPointer> ensmb_states;
-        for (unsigned ensmb_id = 0; ensmb_id < ensmb; ensmb_id++) {
-          auto& model = *(*ensmb_model)[ensmb_id];
-          Expression input_char_vec;
-          if (out_index < input_ids.size()) {
-            input_char_vec = lookup(cg, model.char_vecs, input_ids[out_index]);
-          } else {
-            input_char_vec = lookup(cg, model.eps_vecs[morph_id],
-                                    min(unsigned(out_index - input_ids.size()),
-                                                 model.max_eps - 1));
-          }
-
-          Expression prev_out_vec = lookup(cg, model.char_vecs, prev_out_char);
-          Expression input = concatenate({encoded_word_vecs[ensmb_id], prev_out_vec,
-                                          input_char_vec});
-          Expression hidden = model.output_forward[morph_id].add_input(
-                                prev_states[beam_id][ensmb_id], input);
-          ensmb_states.push_back(model.output_forward[morph_id].state());
-
-          Expression out;
-          model.ProjectToOutput(hidden, &out);
-          out = log_softmax(out);
-          ensmb_out.push_back(out);
+    for (unsigned i = 0; i < live.size(); ++i) {
+      unsigned beam_id = live[i];
+      unsigned prev_out_char = search.LastChar(beam_id);
+      vector<Expression> ensmb_out;
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ensmb_id++) {
+        auto& model = *(*ensmb_model)[ensmb_id];
+        Expression input_char_vec;
+        if (out_index < input_ids.size()) {
+          input_char_vec = lookup(cg, model.char_vecs, input_ids[out_index]);
+        } else {
+          input_char_vec = lookup(cg, model.eps_vecs[morph_id],
+                                  min(unsigned(out_index - input_ids.size()),
+                                               model.max_eps - 1));
         }
-        curr_states.push_back(ensmb_states);
-        out_dist.push_back(average(ensmb_out));
-      } else {
-        vector<RNNPointer> dummy(ensmb, RNNPointer(0));
-        curr_states.push_back(dummy);
-        out_dist.push_back(neg_inf_vec);
-      }
-    }
-
-    Expression all_scores = concatenate(out_dist);
-    vector<float> log_dist = as_vector(cg.incremental_forward());
-
-    for (unsigned index = 0; index < log_dist.size(); ++index) {
-      unsigned beam_id = index / vocab_size;
-      unsigned char_id = index % vocab_size;
-      if (active_beams[beam_id]) {
-        pair<unsigned, unsigned> location = make_pair(beam_id, char_id);
-        probs_queue.push(pair<float, pair<unsigned, unsigned> >(
-                         log_scores[beam_id] + log_dist[index], location));
-      }
-    }
 
-    // Find the beam_size best now and update the variables.
-    unordered_map<unsigned, vector<unsigned> > new_seq;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id]) {
-        float log_prob = probs_queue.top().first;
-        pair<unsigned, unsigned> location = probs_queue.top().second;
-        unsigned old_beam_id = location.first, char_id = location.second;
-
-        vector<unsigned> seq = (*sequences)[old_beam_id];
-        seq.push_back(char_id);
-        new_seq[beam_id] = seq;
-        log_scores[beam_id] = log_prob;  // Update the score
-
-        prev_states[beam_id] = curr_states[old_beam_id];  // Update hidden state
-        probs_queue.pop();
-      }
-    }
-
-    // Update the sequences now.
-    for (auto& it : new_seq) {
-      (*sequences)[it.first] = it.second;
-    }
+        Expression prev_out_vec = lookup(cg, model.char_vecs, prev_out_char);
+        Expression input = concatenate({prev_out_vec, input_char_vec});
+        Expression hidden = decoders[ensmb_id].AddInput(
+            encoded_biases[ensmb_id], prev_states[beam_id * ensmb + ensmb_id],
+            input, &curr_states[i * ensmb + ensmb_id]);
 
-    // Check if a sequence should be made inactive.
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id] &&
-          ((*sequences)[beam_id].back() == char_to_id[EOW] ||
-           (*sequences)[beam_id].size() > MAX_PRED_LEN)) {
-        active_beams[beam_id] = false;
+        Expression out;
+        model.ProjectToOutput(hidden, &out);
+        out = log_softmax(out);
+        ensmb_out.push_back(out);
       }
+      out_dist.push_back(average(ensmb_out));
     }
 
-    // Check if all sequences are inactive.
-    bool all_inactive = true;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id]) {
-        all_inactive = false;
-        break;
+    Expression all_scores = concatenate(out_dist);
+    vector<float> log_dist = as_vector(cg.incremental_forward());
+    search.Step(log_dist.data(), vocab_size);
+    for (unsigned beam_id : search.Extended()) {  // Update hidden state
+      unsigned parent = search.Parent(beam_id);
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        prev_states[beam_id * ensmb + ensmb_id] =
+            curr_states[parent * ensmb + ensmb_id];
       }
     }
-
-    if (all_inactive) {
-      *tm_scores = log_scores;
-      return;
-    }
+  }
+  search.Results(sequences, tm_scores);
+  if (stats != NULL) {
+    *stats = search.Stats();
   }
 }
 
@@ -10,7 +10,10 @@
 #include "cnn/gpu-ops.h"
 #include "cnn/expr.h"
 
+#include "beam-search.h"
 #include "utils.h"
+#include "model-io.h"
+#include "lstm-utils.h"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -53,6 +56,10 @@ class JointEncMorph {
   void RunFwdBwd(const vector<unsigned>& inputs,
                  Expression* hidden, ComputationGraph *cg);
 
+  // Encodes a batch of inputs which all have the same length.
+  void RunFwdBwd(const vector<vector<unsigned> >& inputs,
+                 Expression* hidden, ComputationGraph *cg);
+
   void TransformEncodedInput(Expression* encoded_input) const; 
 
   void ProjectToOutput(const Expression& hidden, Expression* out) const;
@@ -60,10 +67,20 @@ class JointEncMorph {
   Expression ComputeLoss(const vector<Expression>& hidden_units,
                          const vector<unsigned>& targets) const;
 
+  Expression ComputeLoss(const vector<Expression>& hidden_units,
+                         const vector<vector<unsigned> >& targets) const;
+
   float Train(const unsigned& morph_id, const vector<unsigned>& inputs,
               const vector<unsigned>& outputs, AdadeltaTrainer* opt,
               AdadeltaTrainer* shared_opt);
 
+  // Trains on a batch of examples that all have the same input length and
+  // the same output length, with one update for the whole batch.
+  float TrainBatch(const unsigned& morph_id,
+                   const vector<vector<unsigned> >& inputs,
+                   const vector<vector<unsigned> >& outputs,
+                   AdadeltaTrainer* opt, AdadeltaTrainer* shared_opt);
+
   friend class boost::serialization::access;
   template<class Archive> void serialize(Archive& ar, const unsigned int) {
     ar & char_len;
@@ -77,18 +94,43 @@ class JointEncMorph {
 
 void Serialize(string& filename, JointEncMorph& model, vector<Model*>* cnn_model);
 
-void Read(string& filename, JointEncMorph* model, vector<Model*>* cnn_model);
+// Reads a model, returning false on failure.
+bool Read(string& filename, JointEncMorph* model, vector<Model*>* cnn_model);
 
 void
 EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_to_id,
                const vector<unsigned>& input_ids, vector<unsigned>* pred_target_ids,
                vector<JointEncMorph*>* ensmb_model);
 
+// Decodes a batch of inputs of the same length with the same tag, writing
+// the prediction of EnsembleDecode() for inputs[i] to (*pred_target_ids)[i].
+// The words are encoded and decoded together, every step computing the whole
+// batch with matrix-matrix products, and a word leaves the batch when it
+// ends.
+void
+EnsembleBatchDecode(const unsigned& morph_id,
+                    unordered_map<string, unsigned>& char_to_id,
+                    const vector<vector<unsigned> >& inputs,
+                    vector<vector<unsigned> >* pred_target_ids,
+                    vector<JointEncMorph*>* ensmb_model);
+
+// Decodes the lemma with every morph tag, writing the prediction of
+// EnsembleDecode() for tag i to (*pred_target_ids)[i]. The shared encoder
+// runs once per model instead of once per tag, and the decoders of all the
+// tags step together in one graph.
+void
+EnsembleDecodeParadigm(unordered_map<string, unsigned>& char_to_id,
+                       const vector<unsigned>& input_ids,
+                       vector<vector<unsigned> >* pred_target_ids,
+                       vector<JointEncMorph*>* ensmb_model);
+
 void
 EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
                    unordered_map<string, unsigned>& char_to_id,
                    const vector<unsigned>& input_ids,
                    vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
-                   vector<JointEncMorph*>* ensmb_model);
+                   vector<JointEncMorph*>* ensmb_model,
+                   const BeamPruning& pruning = BeamPruning(),
+                   BeamStats* stats = NULL);
 
 #endif
@@ -0,0 +1,396 @@
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX512F__)
+#define HAVE_SIMD 1
+typedef __m512 Vec;
+const unsigned kVecFloats = 16;
+static inline Vec Load(const float* p) { return _mm512_load_ps(p); }
+static inline void Store(float* p, const Vec& v) { _mm512_store_ps(p, v); }
+static inline Vec Set1(const float& x) { return _mm512_set1_ps(x); }
+static inline Vec Add(const Vec& a, const Vec& b) {
+  return _mm512_add_ps(a, b);
+}
+static inline Vec Fma(const Vec& a, const Vec& b, const Vec& c) {
+  return _mm512_fmadd_ps(a, b, c);
+}
+#elif defined(__AVX2__) && defined(__FMA__)
+#define HAVE_SIMD 1
+typedef __m256 Vec;
+const unsigned kVecFloats = 8;
+static inline Vec Load(const float* p) { return _mm256_load_ps(p); }
+static inline void Store(float* p, const Vec& v) { _mm256_store_ps(p, v); }
+static inline Vec Set1(const float& x) { return _mm256_set1_ps(x); }
+static inline Vec Add(const Vec& a, const Vec& b) {
+  return _mm256_add_ps(a, b);
+}
+static inline Vec Fma(const Vec& a, const Vec& b, const Vec& c) {
+  return _mm256_fmadd_ps(a, b, c);
+}
+#endif
+
+void Matrix::Resize(const unsigned& num_rows, const unsigned& num_cols) {
+  rows = num_rows;
+  cols = num_cols;
+  stride = PadFloats(rows);
+  values.assign(stride * cols, 0.0f);
+}
+
+void Matrix::SetBlock(const unsigned& row, const unsigned& col_offset,
+                      const unsigned& num_rows, const unsigned& num_cols,
+                      const float* src) {
+  for (unsigned j = 0; j < num_cols; ++j) {
+    memcpy(col(col_offset + j) + row, src + j * num_rows,
+           sizeof(float) * num_rows);
+  }
+}
+
+void Gemv(const Matrix& m, const float* x, float* y) {
+#ifdef HAVE_SIMD
+  // Keeps a tile of four registers of y in registers over all the columns,
+  // so every column is streamed from memory once per tile.
+  const unsigned tile = 4 * kVecFloats;
+  unsigned r = 0;
+  for (; r + tile <= m.stride; r += tile) {
+    Vec y0 = Load(y + r), y1 = Load(y + r + kVecFloats);
+    Vec y2 = Load(y + r + 2 * kVecFloats), y3 = Load(y + r + 3 * kVecFloats);
+    for (unsigned j = 0; j < m.cols; ++j) {
+      const float* c = m.col(j) + r;
+      Vec xj = Set1(x[j]);
+      y0 = Fma(Load(c), xj, y0);
+      y1 = Fma(Load(c + kVecFloats), xj, y1);
+      y2 = Fma(Load(c + 2 * kVecFloats), xj, y2);
+      y3 = Fma(Load(c + 3 * kVecFloats), xj, y3);
+    }
+    Store(y + r, y0);
+    Store(y + r + kVecFloats, y1);
+    Store(y + r + 2 * kVecFloats, y2);
+    Store(y + r + 3 * kVecFloats, y3);
+  }
+  for (; r < m.stride; r += kVecFloats) {
+    Vec y0 = Load(y + r);
+    for (unsigned j = 0; j < m.cols; ++j) {
+      y0 = Fma(Load(m.col(j) + r), Set1(x[j]), y0);
+    }
+    Store(y + r, y0);
+  }
+#else
+  for (unsigned j = 0; j < m.cols; ++j) {
+    const float* c = m.col(j);
+    for (unsigned r = 0; r < m.stride; ++r) {
+      y[r] += c[r] * x[j];
+    }
+  }
+#endif
+}
+
+#ifdef HAVE_SIMD
+// Gemm() multiplies tiles of kGemmRegs registers of rows by kGemmBeams
+// columns, keeping all the sums in registers, so that every weight is
+// loaded once per kGemmBeams columns and every input once per kGemmRegs
+// registers of rows.
+#if defined(__AVX512F__)
+const unsigned kGemmRegs = 4;
+#else
+const unsigned kGemmRegs = 2;
+#endif
+const unsigned kGemmBeams = 4;
+
+template<unsigned kRegs, unsigned kBeams>
+static void GemmTile(const Matrix& m, const unsigned& r, const float* x,
+                     const unsigned& x_stride, float* y,
+                     const unsigned& y_stride) {
+  Vec acc[kBeams][kRegs];
+  for (unsigned beam = 0; beam < kBeams; ++beam) {
+    for (unsigned k = 0; k < kRegs; ++k) {
+      acc[beam][k] = Load(y + beam * y_stride + r + k * kVecFloats);
+    }
+  }
+  for (unsigned j = 0; j < m.cols; ++j) {
+    const float* c = m.col(j) + r;
+    Vec w[kRegs];
+    for (unsigned k = 0; k < kRegs; ++k) {
+      w[k] = Load(c + k * kVecFloats);
+    }
+    for (unsigned beam = 0; beam < kBeams; ++beam) {
+      Vec xj = Set1(x[beam * x_stride + j]);
+      for (unsigned k = 0; k < kRegs; ++k) {
+        acc[beam][k] = Fma(w[k], xj, acc[beam][k]);
+      }
+    }
+  }
+  for (unsigned beam = 0; beam < kBeams; ++beam) {
+    for (unsigned k = 0; k < kRegs; ++k) {
+      Store(y + beam * y_stride + r + k * kVecFloats, acc[beam][k]);
+    }
+  }
+}
+
+template<unsigned kBeams>
+static void GemmBeams(const Matrix& m, const float* x,
+                      const unsigned& x_stride, float* y,
+                      const unsigned& y_stride) {
+  unsigned r = 0;
+  for (; r + kGemmRegs * kVecFloats <= m.stride; r += kGemmRegs * kVecFloats) {
+    GemmTile<kGemmRegs, kBeams>(m, r, x, x_stride, y, y_stride);
+  }
+  for (; r < m.stride; r += kVecFloats) {
+    GemmTile<1, kBeams>(m, r, x, x_stride, y, y_stride);
+  }
+}
+#endif
+
+void Gemm(const Matrix& m, const unsigned& n, const float* x,
+          const unsigned& x_stride, float* y, const unsigned& y_stride) {
+  unsigned b = 0;
+#ifdef HAVE_SIMD
+  for (; b + kGemmBeams <= n; b += kGemmBeams) {
+    GemmBeams<kGemmBeams>(m, x + b * x_stride, x_stride, y + b * y_stride,
+                          y_stride);
+  }
+  if (n - b == 3) {
+    GemmBeams<3>(m, x + b * x_stride, x_stride, y + b * y_stride, y_stride);
+    return;
+  }
+  if (n - b == 2) {
+    GemmBeams<2>(m, x + b * x_stride, x_stride, y + b * y_stride, y_stride);
+    return;
+  }
+#endif
+  for (; b < n; ++b) {
+    Gemv(m, x + b * x_stride, y + b * y_stride);
+  }
+}
+
+void QuantizeRows(const Matrix& m, float* scales, int8_t* values) {
+  for (unsigned r = 0; r < m.rows; ++r) {
+    float max_abs = 0.0f;
+    for (unsigned j = 0; j < m.cols; ++j) {
+      max_abs = max(max_abs, fabsf(m.col(j)[r]));
+    }
+    scales[r] = max_abs / 127.0f;
+    float inv_scale = max_abs > 0.0f ? 127.0f / max_abs : 0.0f;
+    for (unsigned j = 0; j < m.cols; ++j) {
+      values[j * m.rows + r] = (int8_t) lrintf(m.col(j)[r] * inv_scale);
+    }
+  }
+}
+
+void QuantMatrix::Quantize(const Matrix& m) {
+  rows = m.rows;
+  cols = m.cols;
+  stride = m.stride;
+  groups = (cols + kQuantCols - 1) / kQuantCols;
+  vector<int8_t> col_major(rows * cols);
+  scales.assign(stride, 0.0f);
+  QuantizeRows(m, scales.data(), col_major.data());
+
+  values.assign(stride * groups * kQuantCols, 0);
+  row_sums.assign(stride, 0);
+  for (unsigned j = 0; j < cols; ++j) {
+    for (unsigned r = 0; r < rows; ++r) {
+      int8_t value = col_major[j * rows + r];
+      unsigned tile = r / kQuantRows * groups + j / kQuantCols;
+      values[(tile * kQuantRows + r % kQuantRows) * kQuantCols +
+             j % kQuantCols] = value;
+      row_sums[r] += value;
+    }
+  }
+}
+
+// The activations are quantized to [-63, 63] and shifted by kInputOffset to
+// be unsigned, so a product of two pairs is at most 2 * 127 * 127, which fits
+// the 16-bit sums of vpmaddubsw. The offset is subtracted again with the row
+// sums.
+static const int32_t kInputOffset = 64;
+
+// Quantizes the inputs of a tile of kBeams columns of x and accumulates the
+// products of every block of rows with them.
+template<unsigned kBeams>
+static void QuantTile(const QuantMatrix& m, const float* x,
+                      const unsigned& x_stride, float* y,
+                      const unsigned& y_stride) {
+  // One group of kQuantCols inputs per 32-bit word, padded with the offset.
+  thread_local vector<uint8_t> xq;
+  xq.assign(kBeams * m.groups * kQuantCols, kInputOffset);
+  float x_scales[kBeams];
+  for (unsigned beam = 0; beam < kBeams; ++beam) {
+    const float* xb = x + beam * x_stride;
+    float max_abs = 0.0f;
+    for (unsigned j = 0; j < m.cols; ++j) {
+      max_abs = max(max_abs, fabsf(xb[j]));
+    }
+    x_scales[beam] = max_abs / 63.0f;
+    float inv_x_scale = max_abs > 0.0f ? 63.0f / max_abs : 0.0f;
+    uint8_t* xqb = xq.data() + beam * m.groups * kQuantCols;
+    for (unsigned j = 0; j < m.cols; ++j) {
+      xqb[j] = (uint8_t) (lrintf(xb[j] * inv_x_scale) + kInputOffset);
+    }
+  }
+  const int32_t* x_groups = reinterpret_cast<const int32_t*>(xq.data());
+
+  int32_t sums[kBeams][kQuantRows];
+  for (unsigned b = 0; b < m.stride / kQuantRows; ++b) {
+    const int8_t* tiles =
+        m.values.data() + b * m.groups * kQuantRows * kQuantCols;
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+    __m512i acc[kBeams];
+    for (unsigned beam = 0; beam < kBeams; ++beam) {
+      acc[beam] = _mm512_setzero_si512();
+    }
+    for (unsigned g = 0; g < m.groups; ++g) {
+      __m512i tile = _mm512_load_si512(tiles + g * kQuantRows * kQuantCols);
+      for (unsigned beam = 0; beam < kBeams; ++beam) {
+        acc[beam] = _mm512_dpbusd_epi32(
+            acc[beam], _mm512_set1_epi32(x_groups[beam * m.groups + g]),
+            tile);
+      }
+    }
+    for (unsigned beam = 0; beam < kBeams; ++beam) {
+      _mm512_storeu_si512(sums[beam], acc[beam]);
+    }
+#elif defined(__AVX512BW__)
+    const __m512i ones = _mm512_set1_epi16(1);
+    __m512i acc[kBeams];
+    for (unsigned beam = 0; beam < kBeams; ++beam) {
+      acc[beam] = _mm512_setzero_si512();
+    }
+    for (unsigned g = 0; g < m.groups; ++g) {
+      __m512i tile = _mm512_load_si512(tiles + g * kQuantRows * kQuantCols);
+      for (unsigned beam = 0; beam < kBeams; ++beam) {
+        __m512i products = _mm512_maddubs_epi16(
+            _mm512_set1_epi32(x_groups[beam * m.groups + g]), tile);
+        acc[beam] = _mm512_add_epi32(acc[beam],
+                                     _mm512_madd_epi16(products, ones));
+      }
+    }
+    for (unsigned beam = 0; beam < kBeams; ++beam) {
+      _mm512_storeu_si512(sums[beam], acc[beam]);
+    }
+#elif defined(__AVX2__)
+    // A tile is two registers of eight rows.
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc0[kBeams], acc1[kBeams];
+    for (unsigned beam = 0; beam < kBeams; ++beam) {
+      acc0[beam] = acc1[beam] = _mm256_setzero_si256();
+    }
+    for (unsigned g = 0; g < m.groups; ++g) {
+      const int8_t* tile = tiles + g * kQuantRows * kQuantCols;
+      __m256i tile0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(tile));
+      __m256i tile1 =
+          _mm256_load_si256(reinterpret_cast<const __m256i*>(tile + 32));
+      for (unsigned beam = 0; beam < kBeams; ++beam) {
+        __m256i xg = _mm256_set1_epi32(x_groups[beam * m.groups + g]);
+        acc0[beam] = _mm256_add_epi32(
+            acc0[beam],
+            _mm256_madd_epi16(_mm256_maddubs_epi16(xg, tile0), ones));
+        acc1[beam] = _mm256_add_epi32(
+            acc1[beam],
+            _mm256_madd_epi16(_mm256_maddubs_epi16(xg, tile1), ones));
+      }
+    }
+    for (unsigned beam = 0; beam < kBeams; ++beam) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(sums[beam]), acc0[beam]);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(sums[beam] + 8),
+                          acc1[beam]);
+    }
+#else
+    for (unsigned beam = 0; beam < kBeams; ++beam) {
+      for (unsigned r = 0; r < kQuantRows; ++r) {
+        sums[beam][r] = 0;
+      }
+      for (unsigned g = 0; g < m.groups; ++g) {
+        const int8_t* tile = tiles + g * kQuantRows * kQuantCols;
+        const uint8_t* xg = xq.data() + (beam * m.groups + g) * kQuantCols;
+        for (unsigned r = 0; r < kQuantRows; ++r) {
+          for (unsigned k = 0; k < kQuantCols; ++k) {
+            sums[beam][r] += xg[k] * tile[r * kQuantCols + k];
+          }
+        }
+      }
+    }
+#endif
+    for (unsigned beam = 0; beam < kBeams; ++beam) {
+      float* yb = y + beam * y_stride;
+      for (unsigned r = 0; r < kQuantRows; ++r) {
+        unsigned row = b * kQuantRows + r;
+        yb[row] += m.scales[row] * x_scales[beam] *
+                   (float) (sums[beam][r] - kInputOffset * m.row_sums[row]);
+      }
+    }
+  }
+}
+
+void Gemv(const QuantMatrix& m, const float* x, float* y) {
+  QuantTile<1>(m, x, 0, y, 0);
+}
+
+void Gemm(const QuantMatrix& m, const unsigned& n, const float* x,
+          const unsigned& x_stride, float* y, const unsigned& y_stride) {
+  // A tile of kQuantBeams columns shares every load of the weights.
+  const unsigned kQuantBeams = 8;
+  unsigned b = 0;
+  for (; b + kQuantBeams <= n; b += kQuantBeams) {
+    QuantTile<kQuantBeams>(m, x + b * x_stride, x_stride, y + b * y_stride,
+                           y_stride);
+  }
+  for (; b + 2 <= n; b += 2) {
+    QuantTile<2>(m, x + b * x_stride, x_stride, y + b * y_stride, y_stride);
+  }
+  if (b < n) {
+    QuantTile<1>(m, x + b * x_stride, x_stride, y + b * y_stride, y_stride);
+  }
+}
+
+void AddTo(const unsigned& n, const float* x, float* y) {
+#ifdef HAVE_SIMD
+  for (unsigned i = 0; i < n; i += kVecFloats) {
+    Store(y + i, Add(Load(y + i), Load(x + i)));
+  }
+#else
+  for (unsigned i = 0; i < n; ++i) {
+    y[i] += x[i];
+  }
+#endif
+}
+
+void Sigmoid(const unsigned& n, float* x) {
+  for (unsigned i = 0; i < n; ++i) {
+    x[i] = 1.0f / (1.0f + expf(-x[i]));
+  }
+}
+
+void Tanh(const unsigned& n, float* x) {
+  for (unsigned i = 0; i < n; ++i) {
+    x[i] = tanhf(x[i]);
+  }
+}
+
+void AddLogSoftmax(const unsigned& n, const float* logits, const float& scale,
+                   float* out) {
+  float max_x = logits[0];
+  for (unsigned i = 1; i < n; ++i) {
+    max_x = max(max_x, logits[i]);
+  }
+  float sum = 0.0f;
+  for (unsigned i = 0; i < n; ++i) {
+    sum += expf(logits[i] - max_x);
+  }
+  float log_z = max_x + logf(sum);
+  for (unsigned i = 0; i < n; ++i) {
+    out[i] += scale * (logits[i] - log_z);
+  }
+}
+
+unsigned Argmax(const unsigned& n, const float* logits) {
+  unsigned best = 0;
+  for (unsigned i = 1; i < n; ++i) {
+    if (logits[i] > logits[best]) {
+      best = i;
+    }
+  }
+  return best;
+}
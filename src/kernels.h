@@ -0,0 +1,155 @@
+#ifndef KERNELS_H_
+#define KERNELS_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Dense kernels of the graph-free inference engine. Matrices are stored
+// column-major, as in cnn, but every column is padded to a multiple of
+// kFloatsPerLine floats and starts on a kAlignment byte boundary, so that the
+// kernels only ever work on full, aligned vector registers.
+const unsigned kAlignment = 64;  // A cache line and an AVX-512 register
+const unsigned kFloatsPerLine = kAlignment / sizeof(float);
+
+inline unsigned PadFloats(const unsigned& n) {
+  return (n + kFloatsPerLine - 1) / kFloatsPerLine * kFloatsPerLine;
+}
+
+template<class T> struct AlignedAllocator {
+  typedef T value_type;
+
+  AlignedAllocator() {}
+  template<class U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    void* p = NULL;
+    if (posix_memalign(&p, kAlignment, n * sizeof(T)) != 0) {
+      throw bad_alloc();
+    }
+    return static_cast<T*>(p);
+  }
+  void deallocate(T* p, size_t) { free(p); }
+
+  template<class U> bool operator==(const AlignedAllocator<U>&) const {
+    return true;
+  }
+  template<class U> bool operator!=(const AlignedAllocator<U>&) const {
+    return false;
+  }
+};
+
+typedef vector<float, AlignedAllocator<float> > AlignedVector;
+typedef vector<int8_t, AlignedAllocator<int8_t> > AlignedBytes;
+
+// A column-major matrix with padded columns. Padding rows are zero.
+struct Matrix {
+  unsigned rows = 0, cols = 0, stride = 0;  // stride = PadFloats(rows)
+  AlignedVector values;
+
+  void Resize(const unsigned& num_rows, const unsigned& num_cols);
+  float* col(const unsigned& j) { return values.data() + j * stride; }
+  const float* col(const unsigned& j) const {
+    return values.data() + j * stride;
+  }
+
+  // Copies a column-major rows x cols block of src into the matrix, with its
+  // top left corner at (row, col).
+  void SetBlock(const unsigned& row, const unsigned& col_offset,
+                const unsigned& num_rows, const unsigned& num_cols,
+                const float* src);
+};
+
+// A matrix quantized to int8 with one scale per row: row r is scales[r]
+// times the int8 values of the row. The values are stored in tiles of
+// kQuantRows rows by kQuantCols columns, row-major inside a tile, so that a
+// tile is one vpdpbusd (or vpmaddubsw) operand, and the tiles of a block of
+// rows are contiguous.
+const unsigned kQuantRows = kFloatsPerLine;
+const unsigned kQuantCols = 4;
+
+struct QuantMatrix {
+  unsigned rows = 0, cols = 0, stride = 0;  // stride = PadFloats(rows)
+  unsigned groups = 0;  // Tiles in a block of rows
+  AlignedBytes values;
+  AlignedVector scales;
+  vector<int32_t> row_sums;  // Sums of the int8 values of every row
+
+  bool empty() const { return rows == 0; }
+
+  // Quantizes m with QuantizeRows().
+  void Quantize(const Matrix& m);
+};
+
+// Quantizes every row of m symmetrically, with scale max |row| / 127, and
+// writes the m.rows scales and the column-major int8 values, the layout of a
+// quantized parameter in a binary model.
+void QuantizeRows(const Matrix& m, float* scales, int8_t* values);
+
+// y[0, m.stride) += m * x
+void Gemv(const Matrix& m, const float* x, float* y);
+
+// y[0, m.stride) += m * x, with x quantized on the fly to 7 bits plus an
+// offset, so that the unsigned by signed byte products of the dot-product
+// instructions never saturate and every instruction set computes exactly the
+// same integer sums.
+void Gemv(const QuantMatrix& m, const float* x, float* y);
+
+// Y[0, m.stride) += m * X for the n columns of X and Y, which start every
+// x_stride and y_stride floats, e.g. the hidden states of the hypotheses of
+// a beam. y_stride must be a multiple of kFloatsPerLine. Every column gets
+// exactly the same result as with Gemv().
+void Gemm(const Matrix& m, const unsigned& n, const float* x,
+          const unsigned& x_stride, float* y, const unsigned& y_stride);
+
+void Gemm(const QuantMatrix& m, const unsigned& n, const float* x,
+          const unsigned& x_stride, float* y, const unsigned& y_stride);
+
+// Multiply with the quantized copy of m when there is one.
+inline void Gemv(const Matrix& m, const QuantMatrix& quant, const float* x,
+                 float* y) {
+  if (quant.empty()) {
+    Gemv(m, x, y);
+  } else {
+    Gemv(quant, x, y);
+  }
+}
+
+inline void Gemm(const Matrix& m, const QuantMatrix& quant, const unsigned& n,
+                 const float* x, const unsigned& x_stride, float* y,
+                 const unsigned& y_stride) {
+  if (quant.empty()) {
+    Gemm(m, n, x, x_stride, y, y_stride);
+  } else {
+    Gemm(quant, n, x, x_stride, y, y_stride);
+  }
+}
+
+// y[0, n) += x[0, n), with n a multiple of kFloatsPerLine.
+void AddTo(const unsigned& n, const float* x, float* y);
+
+void Sigmoid(const unsigned& n, float* x);
+
+void Tanh(const unsigned& n, float* x);
+
+// Output layer kernels. They reduce the logits in place, instead of
+// materialising and copying distributions.
+
+// out[0, n) += scale * log_softmax(logits[0, n)), with the max subtracted
+// before exponentiating for stability. Summing the outputs of the members of
+// an ensemble with scale 1 / size averages them.
+void AddLogSoftmax(const unsigned& n, const float* logits, const float& scale,
+                   float* out);
+
+// Returns the index of the largest of logits[0, n), the first one on ties.
+// The log-softmax does not change the argmax, so it is skipped.
+unsigned Argmax(const unsigned& n, const float* logits);
+
+#endif
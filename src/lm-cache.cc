@@ -0,0 +1,24 @@
+#include "lm-cache.h"
+
+using namespace std;
+
+size_t LMStateHash::operator()(const LMState& state) const {
+  size_t seed = state.len;
+  for (unsigned i = 0; i < state.len; ++i) {
+    HashCombine(state.ids[i], &seed);
+  }
+  return seed;
+}
+
+bool LMCache::Find(const LMState& state, float* out) {
+  return cache.Find(state, [out](const vector<float>& dist) {
+    copy(dist.begin(), dist.end(), out);
+  });
+}
+
+void LMCache::Insert(const LMState& state, const float* dist) {
+  unsigned size = vocab_size;
+  cache.Insert(state, [dist, size](vector<float>* cached) {
+    cached->assign(dist, dist + size);
+  });
+}
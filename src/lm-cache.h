@@ -0,0 +1,48 @@
+#ifndef LM_CACHE_H_
+#define LM_CACHE_H_
+
+#include "lm.h"
+#include "sharded-lru-cache.h"
+
+#include <vector>
+
+using namespace std;
+
+struct LMStateHash {
+  size_t operator()(const LMState& state) const;
+};
+
+typedef CacheStats LMCacheStats;
+
+// A bounded cache of the next-character distributions of LM contexts
+// (LM::ScoreAll), evicting the least recently used one when it is full.
+// The LM itself is read-only, so one LM and one cache can serve any number
+// of decoding threads (see ShardedLRUCache).
+class LMCache {
+ public:
+  // Keeps at most about capacity distributions of vocab_size scores, split
+  // evenly over at most num_shards shards.
+  LMCache(const unsigned& capacity, const unsigned& vocab_size,
+          const unsigned& num_shards = 16)
+      : cache(capacity, num_shards), vocab_size(vocab_size) {}
+
+  // Copies the cached distribution of state to out[0 .. vocab_size) and
+  // returns true, or returns false if it is not cached.
+  bool Find(const LMState& state, float* out);
+
+  // Caches the distribution of state, evicting the least recently used one
+  // of its shard if the shard is full.
+  void Insert(const LMState& state, const float* dist);
+
+  // The sums of the counters of all the shards.
+  LMCacheStats Stats() { return cache.Stats(); }
+
+  // Zeroes the counters.
+  void ResetStats() { cache.ResetStats(); }
+
+ private:
+  ShardedLRUCache<LMState, vector<float>, LMStateHash> cache;
+  unsigned vocab_size;
+};
+
+#endif
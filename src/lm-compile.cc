@@ -0,0 +1,30 @@
+#include "utils.h"
+#include "lm.h"
+
+#include <iostream>
+
+using namespace std;
+
+// Compiles a text LM into the binary image that the LM binaries
+// memory-map, so that loading it takes no parsing and the processes using
+// it share one copy in memory.
+int main(int argc, char** argv) {
+  if (argc != 4) {
+    cerr << "Usage: " << argv[0] << " char_vocab.txt lm.txt lm.bin" << endl;
+    return 0;
+  }
+  string vocab_filename = argv[1];  // vocabulary of words/characters
+  string input_filename = argv[2];
+  string output_filename = argv[3];
+
+  unordered_map<string, unsigned> char_to_id;
+  unordered_map<unsigned, string> id_to_char;
+  ReadVocab(vocab_filename, &char_to_id, &id_to_char);
+
+  LM lm(input_filename, char_to_id, id_to_char);
+  if (!lm.Write(output_filename)) {
+    return 0;
+  }
+  cerr << "Wrote the LM to " << output_filename << endl;
+  return 1;
+}
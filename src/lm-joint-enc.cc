@@ -82,6 +82,31 @@ void LMJointEnc::RunFwdBwd(const vector<unsigned>& inputs,
   *hidden = concatenate({forward_unit, backward_unit});
 }
 
+void LMJointEnc::RunFwdBwd(const vector<vector<unsigned> >& inputs,
+                           Expression* hidden, ComputationGraph *cg) {
+  vector<Expression> input_vecs;
+  for (unsigned i = 0; i < inputs[0].size(); ++i) {
+    input_vecs.push_back(lookup(*cg, char_vecs, BatchColumn(inputs, i)));
+  }
+
+  // Run forward LSTM
+  Expression forward_unit;
+  input_forward.start_new_sequence();
+  for (unsigned i = 0; i < input_vecs.size(); ++i) {
+    forward_unit = input_forward.add_input(input_vecs[i]);
+  }
+
+  // Run backward LSTM
+  Expression backward_unit;
+  input_backward.start_new_sequence();
+  for (int i = input_vecs.size() - 1; i >= 0; --i) {
+    backward_unit = input_backward.add_input(input_vecs[i]);
+  }
+
+  // Concatenate the forward and back hidden layers
+  *hidden = concatenate({forward_unit, backward_unit});
+}
+
 void LMJointEnc::TransformEncodedInput(Expression* encoded_input) const {
   *encoded_input = affine_transform({transform_encoded_bias,
                                      transform_encoded, *encoded_input});
@@ -96,15 +121,15 @@ Expression LMJointEnc::ComputeLoss(const vector<Expression>& hidden_units,
                                    const vector<unsigned>& targets,
                                    LM *lm, ComputationGraph* cg) const {
   vector<Expression> losses;
-  vector<unsigned> incremental_targets;
-  incremental_targets.push_back(lm->char_to_id[BOW]);
+  // The LM does not see <s>, which is fed to the decoder first.
+  LMState lm_state = lm->Start();
   for (unsigned i = 0; i < hidden_units.size(); ++i) {
     Expression out;
     ProjectToOutput(hidden_units[i], &out);
     Expression trans_lp = log_softmax(out);
 
     // Calculate the LM probabilities of all possible outputs.
-    Expression lm_lp = LogProbDist(incremental_targets, lm, cg);
+    Expression lm_lp = LogProbDist(lm_state, lm, cg);
 
     unsigned lm_index = min(i + 1, max_lm_pos_weights - 1);
     Expression lm_weight = lookup(*cg, lm_pos_weights, lm_index);
@@ -112,11 +137,36 @@ Expression LMJointEnc::ComputeLoss(const vector<Expression>& hidden_units,
     //Expression total_lp = trans_lp + cwise_multiply(lm_lp, Softplus(lm_weight));
     Expression total_lp = trans_lp + lm_lp * Softplus(lm_weight);
     losses.push_back(pickneglogsoftmax(total_lp, targets[i]));
-    incremental_targets.push_back(targets[i]);
+    lm->Extend(lm_state, targets[i], &lm_state);
   }
   return sum(losses);
 }
 
+Expression LMJointEnc::ComputeLoss(const vector<Expression>& hidden_units,
+                                   const vector<vector<unsigned> >& targets,
+                                   LM *lm, ComputationGraph* cg) const {
+  vector<Expression> losses;
+  vector<LMState> lm_states(targets[0].size(), lm->Start());
+  for (unsigned i = 0; i < hidden_units.size(); ++i) {
+    Expression out;
+    ProjectToOutput(hidden_units[i], &out);
+    Expression trans_lp = log_softmax(out);
+
+    // Calculate the LM probabilities of all possible outputs.
+    Expression lm_lp = LogProbDist(lm_states, lm, cg);
+
+    unsigned lm_index = min(i + 1, max_lm_pos_weights - 1);
+    Expression lm_weight = lookup(*cg, lm_pos_weights, lm_index);
+
+    Expression total_lp = trans_lp + lm_lp * Softplus(lm_weight);
+    losses.push_back(pickneglogsoftmax(total_lp, targets[i]));
+    for (unsigned b = 0; b < targets[i].size(); ++b) {
+      lm->Extend(lm_states[b], targets[i][b], &lm_states[b]);
+    }
+  }
+  return sum_batches(sum(losses));
+}
+
 float LMJointEnc::Train(const unsigned& morph_id, const vector<unsigned>& inputs,
                            const vector<unsigned>& outputs,
                            LM* lm, AdadeltaTrainer* opt,
@@ -166,27 +216,104 @@ float LMJointEnc::Train(const unsigned& morph_id, const vector<unsigned>& inputs
   return return_loss;
 }
 
-void Serialize(string& filename, LMJointEnc& model,
-               vector<Model*>* cnn_models) {
-  ofstream outfile(filename);
-  if (!outfile.is_open()) {
-    cerr << "File opening failed" << endl;
+float LMJointEnc::TrainBatch(const unsigned& morph_id,
+                             const vector<vector<unsigned> >& inputs,
+                             const vector<vector<unsigned> >& outputs, LM *lm,
+                             AdadeltaTrainer* opt, AdadeltaTrainer* shared_opt) {
+  ComputationGraph cg;
+  AddParamsToCG(morph_id, &cg);
+
+  // Encode and Transform to feed into decoder
+  Expression encoded_input_vec;
+  RunFwdBwd(inputs, &encoded_input_vec, &cg);
+  TransformEncodedInput(&encoded_input_vec);
+
+  // All examples have the same lengths, so every decoder step reads either
+  // input characters or epsilons for the whole batch.
+  unsigned input_len = inputs[0].size(), output_len = outputs[0].size();
+  vector<Expression> input_vecs_for_dec;
+  vector<vector<unsigned> > output_ids_for_pred;
+  for (unsigned i = 0; i < output_len; ++i) {
+    if (i < output_len - 1) {
+      // '</s>' will not be fed as input -- it needs to be predicted.
+      Expression prev_output_vecs = lookup(cg, char_vecs,
+                                           BatchColumn(outputs, i));
+      if (i < input_len - 1) {
+        input_vecs_for_dec.push_back(concatenate(
+            {encoded_input_vec, prev_output_vecs,
+             lookup(cg, char_vecs, BatchColumn(inputs, i + 1))}));
+      } else {
+        vector<unsigned> eps_ids(inputs.size(),
+                                 min(unsigned(i - input_len), max_eps - 1));
+        input_vecs_for_dec.push_back(concatenate(
+            {encoded_input_vec, prev_output_vecs,
+             lookup(cg, eps_vecs[morph_id], eps_ids)}));
+      }
+    }
+    if (i > 0) {  // '<s>' will not be predicted in the output -- its fed in.
+      output_ids_for_pred.push_back(BatchColumn(outputs, i));
+    }
   }
 
-  boost::archive::text_oarchive oa(outfile);
-  oa & model;
-  for (unsigned i = 0; i < cnn_models->size(); ++i) {
-    oa & *(*cnn_models)[i];
+  vector<Expression> decoder_hidden_units;
+  output_forward[morph_id].start_new_sequence();
+  for (const auto& vec : input_vecs_for_dec) {
+    decoder_hidden_units.push_back(output_forward[morph_id].add_input(vec));
   }
+  Expression loss = ComputeLoss(decoder_hidden_units, output_ids_for_pred, lm,
+                                &cg);
 
-  cerr << "Saved model to: " << filename << endl;
-  outfile.close();
+  float return_loss = as_scalar(cg.forward());
+  cg.backward();
+  opt->update(1.0f);  // Update the morph specific parameters
+  shared_opt->update(1.0f);  // Update the shared parameters
+  return return_loss;
 }
 
-void Read(string& filename, LMJointEnc* model, vector<Model*>* cnn_models) {
+void Serialize(string& filename, LMJointEnc& model,
+               vector<Model*>* cnn_models) {
+  ModelHeader header = MakeModelHeader(kLMJointEnc, model.char_len,
+                                       model.hidden_len, model.vocab_len,
+                                       model.layers, model.morph_len,
+                                       model.max_eps, model.max_lm_pos_weights);
+  if (WriteBinaryModel(filename, header, *cnn_models)) {
+    cerr << "Saved model to: " << filename << endl;
+  }
+}
+
+bool Read(string& filename, LMJointEnc* model, vector<Model*>* cnn_models) {
+  if (IsBinaryModel(filename)) {
+    MappedModel* mapped = OpenBinaryModel(filename, kLMJointEnc, 1);
+    if (mapped == NULL) {
+      return false;
+    }
+    const ModelHeader& header = *mapped->header;
+    model->char_len = header.char_len;
+    model->hidden_len = header.hidden_len;
+    model->vocab_len = header.vocab_len;
+    model->layers = header.layers;
+    model->morph_len = header.morph_len;
+    model->max_eps = header.max_eps;
+    model->max_lm_pos_weights = header.max_lm_pos_weights;
+    for (unsigned i = 0; i < model->morph_len + 1; ++i) {
+      cnn_models->push_back(new Model());
+    }
+
+    model->InitParams(cnn_models);
+    for (unsigned i = 0; i < cnn_models->size(); ++i) {
+      if (!mapped->LoadParams(i, true, (*cnn_models)[i])) {
+        return false;
+      }
+    }
+    cerr << "Loaded model from: " << filename << endl;
+    return true;
+  }
+
+  // Models saved in the old boost text format.
   ifstream infile(filename);
   if (!infile.is_open()) {
     cerr << "File opening failed" << endl;
+    return false;
   }
 
   boost::archive::text_iarchive ia(infile);
@@ -203,22 +330,27 @@ void Read(string& filename, LMJointEnc* model, vector<Model*>* cnn_models) {
 
   cerr << "Loaded model from: " << filename << endl;
   infile.close();
+  return true;
 }
 
-// Computes the probability of all possible next characters given
-// a sequence, but removes the first character (<s>).
-Expression LogProbDist(const vector<unsigned>& seq, LM *lm,
+// Computes the log probability of every possible next character. The
+// state holds only the context the LM conditions on, so a step costs one
+// LM lookup per character whatever the length of the sequence.
+Expression LogProbDist(const LMState& state, LM *lm, ComputationGraph *cg) {
+  vector<float> lm_dist(lm->vocab_size());
+  lm->ScoreAll(state, lm_dist.data());
+  return input(*cg, {(long) lm_dist.size()}, lm_dist);
+}
+
+// Computes LogProbDist() for every state in a batch.
+Expression LogProbDist(const vector<LMState>& states, LM *lm,
                        ComputationGraph *cg) {
-  vector<float> lm_dist(lm->char_to_id.size(), 0.f);
-
-  // Remove the first (<s>) character.
-  vector<unsigned> seq_without_start(seq.begin() + 1, seq.end());
-  for (const auto& it : lm->char_to_id) {
-    vector<unsigned> possible_seq(seq_without_start);
-    possible_seq.push_back(it.second);
-    lm_dist[it.second] = lm->LogProbSeq(possible_seq);
+  unsigned vocab_size = lm->vocab_size();
+  vector<float> lm_dist(vocab_size * states.size());
+  for (unsigned b = 0; b < states.size(); ++b) {
+    lm->ScoreAll(states[b], &lm_dist[b * vocab_size]);
   }
-  return input(*cg, {(long) lm_dist.size()}, lm_dist);
+  return input(*cg, Dim({(long) vocab_size}, states.size()), lm_dist);
 }
 
 float Softplus(float x) {
@@ -236,19 +368,23 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
   ComputationGraph cg;
 
   unsigned ensmb = ensmb_model->size();
-  vector<Expression> encoded_word_vecs;
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
   for (unsigned i = 0; i < ensmb; ++i) {
     Expression encoded_word_vec;
     auto model = (*ensmb_model)[i];
     model->AddParamsToCG(morph_id, &cg);
     model->RunFwdBwd(input_ids, &encoded_word_vec, &cg);
     model->TransformEncodedInput(&encoded_word_vec);
-    encoded_word_vecs.push_back(encoded_word_vec);
-    model->output_forward[morph_id].start_new_sequence();
+    decoders.push_back(FixedInputLSTM(model->output_forward[morph_id],
+                                      model->hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
   }
 
   unsigned out_index = 1;
   unsigned pred_index = char_to_id[BOW];
+  LMState lm_state = lm->Start();  // The LM does not see <s>
   while (pred_target_ids->size() < MAX_PRED_LEN) {
     pred_target_ids->push_back(pred_index);
     if (pred_index == char_to_id[EOW]) {
@@ -256,7 +392,7 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
     }
 
     vector<Expression> ensmb_out;
-    Expression lm_dist = LogProbDist(*pred_target_ids, lm, &cg);
+    Expression lm_dist = LogProbDist(lm_state, lm, &cg);
     for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
       auto model = (*ensmb_model)[ensmb_id];
       Expression prev_output_vec = lookup(cg, model->char_vecs, pred_index);
@@ -268,10 +404,11 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
                                 min(unsigned(out_index - input_ids.size()),
                                              model->max_eps - 1));
       }
-      input = concatenate({encoded_word_vecs[ensmb_id], prev_output_vec,
-                           input_char_vec});
+      input = concatenate({prev_output_vec, input_char_vec});
 
-      Expression hidden = model->output_forward[morph_id].add_input(input);
+      Expression hidden = decoders[ensmb_id].AddInput(
+          encoded_biases[ensmb_id], states[ensmb_id], input,
+          &states[ensmb_id]);
       Expression tm_prob;
       model->ProjectToOutput(hidden, &tm_prob);
       tm_prob = log_softmax(tm_prob);
@@ -286,6 +423,266 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
     Expression out = average(ensmb_out);
     vector<float> dist = as_vector(cg.incremental_forward());
     pred_index = distance(dist.begin(), max_element(dist.begin(), dist.end()));
+    lm->Extend(lm_state, pred_index, &lm_state);
+    out_index++;
+  }
+}
+
+void
+EnsembleDecodeParadigm(unordered_map<string, unsigned>& char_to_id,
+                       const vector<unsigned>& input_ids,
+                       vector<vector<unsigned> >* pred_target_ids,
+                       LM* lm, vector<LMJointEnc*>* ensmb_model) {
+  ComputationGraph cg;
+
+  unsigned ensmb = ensmb_model->size();
+  unsigned morph_len = (*ensmb_model)[0]->morph_len;
+  // decoders, encoded_biases and states are indexed [morph_id][ensmb_id].
+  vector<vector<FixedInputLSTM> > decoders(morph_len);
+  vector<vector<vector<Expression> > > encoded_biases(morph_len);
+  vector<vector<LSTMState> > states(morph_len, vector<LSTMState>(ensmb));
+  for (unsigned i = 0; i < ensmb; ++i) {
+    Expression encoded;
+    auto model = (*ensmb_model)[i];
+    model->AddParamsToCG(0, &cg);
+    model->RunFwdBwd(input_ids, &encoded, &cg);
+    for (unsigned morph_id = 0; morph_id < morph_len; ++morph_id) {
+      if (morph_id > 0) {
+        model->output_forward[morph_id].new_graph(cg);
+      }
+      model->transform_encoded =
+          parameter(cg, model->ptransform_encoded[morph_id]);
+      model->transform_encoded_bias =
+          parameter(cg, model->ptransform_encoded_bias[morph_id]);
+      Expression encoded_word_vec = encoded;
+      model->TransformEncodedInput(&encoded_word_vec);
+      decoders[morph_id].push_back(FixedInputLSTM(
+          model->output_forward[morph_id], model->hidden_len));
+      encoded_biases[morph_id].push_back(
+          decoders[morph_id].back().InputBias(encoded_word_vec));
+    }
+  }
+
+  // Every tag has its own decoder, so the tags step together: each step
+  // adds one output to the graph for every tag still being decoded, and one
+  // forward pass computes all of them.
+  pred_target_ids->assign(morph_len, vector<unsigned>());
+  vector<unsigned> pred_index(morph_len, char_to_id[BOW]);
+  vector<LMState> lm_states(morph_len, lm->Start());
+  vector<unsigned> live;
+  for (unsigned morph_id = 0; morph_id < morph_len; ++morph_id) {
+    live.push_back(morph_id);
+  }
+  unsigned out_index = 1;
+  while (!live.empty()) {
+    vector<unsigned> next_live;
+    for (const unsigned& morph_id : live) {
+      vector<unsigned>& pred = (*pred_target_ids)[morph_id];
+      pred.push_back(pred_index[morph_id]);
+      if (pred_index[morph_id] != char_to_id[EOW] &&
+          pred.size() < MAX_PRED_LEN) {
+        next_live.push_back(morph_id);
+      }
+    }
+    live = next_live;
+    if (live.empty()) {
+      break;
+    }
+
+    vector<Expression> outs;
+    for (const unsigned& morph_id : live) {
+      vector<Expression> ensmb_out;
+      Expression lm_dist = LogProbDist(lm_states[morph_id], lm, &cg);
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        auto model = (*ensmb_model)[ensmb_id];
+        Expression prev_output_vec = lookup(cg, model->char_vecs,
+                                            pred_index[morph_id]);
+        Expression input, input_char_vec;
+        if (out_index < input_ids.size()) {
+          input_char_vec = lookup(cg, model->char_vecs, input_ids[out_index]);
+        } else {
+          input_char_vec = lookup(cg, model->eps_vecs[morph_id],
+                                  min(unsigned(out_index - input_ids.size()),
+                                               model->max_eps - 1));
+        }
+        input = concatenate({prev_output_vec, input_char_vec});
+
+        LSTMState& state = states[morph_id][ensmb_id];
+        Expression hidden = decoders[morph_id][ensmb_id].AddInput(
+            encoded_biases[morph_id][ensmb_id], state, input, &state);
+        Expression tm_prob;
+        model->ProjectToOutput(hidden, &tm_prob);
+        tm_prob = log_softmax(tm_prob);
+
+        unsigned lm_index = min(out_index, model->max_lm_pos_weights - 1);
+        Expression lm_weight = lookup(cg, model->lm_pos_weights, lm_index);
+        Expression total_lp = tm_prob + lm_dist * Softplus(lm_weight);
+
+        ensmb_out.push_back(log_softmax(total_lp));
+      }
+      outs.push_back(average(ensmb_out));
+    }
+
+    cg.incremental_forward();
+    for (unsigned i = 0; i < live.size(); ++i) {
+      vector<float> dist = as_vector(cg.get_value(outs[i].i));
+      pred_index[live[i]] = distance(dist.begin(),
+                                     max_element(dist.begin(), dist.end()));
+      lm->Extend(lm_states[live[i]], pred_index[live[i]], &lm_states[live[i]]);
+    }
     out_index++;
   }
 }
+
+void
+EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
+                   unordered_map<string, unsigned>& char_to_id,
+                   const vector<unsigned>& input_ids,
+                   vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
+                   LM* lm, vector<LMJointEnc*>* ensmb_model,
+                   const BeamPruning& pruning, BeamStats* stats) {
+  unsigned out_index = 1;
+  unsigned ensmb = ensmb_model->size();
+  ComputationGraph cg;
+
+  // Compute stuff for every model in the ensemble.
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
+  vector<Expression> ensmb_out;
+  LMState start = lm->Start();  // The LM does not see <s>
+  Expression start_lm_dist = LogProbDist(start, lm, &cg);
+  for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+    auto& model = *(*ensmb_model)[ensmb_id];
+    model.AddParamsToCG(morph_id, &cg);
+
+    Expression encoded_word_vec;
+    model.RunFwdBwd(input_ids, &encoded_word_vec, &cg);
+    model.TransformEncodedInput(&encoded_word_vec);
+    decoders.push_back(FixedInputLSTM(model.output_forward[morph_id],
+                                      model.hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
+
+    Expression prev_output_vec = lookup(cg, model.char_vecs,
+                                        char_to_id[BOW]);
+    Expression input = concatenate({prev_output_vec,
+                                    lookup(cg, model.char_vecs,
+                                           input_ids[out_index])});
+    Expression hidden = decoders[ensmb_id].AddInput(
+        encoded_biases[ensmb_id], states[ensmb_id], input,
+        &states[ensmb_id]);
+    Expression tm_prob;
+    model.ProjectToOutput(hidden, &tm_prob);
+    tm_prob = log_softmax(tm_prob);
+
+    unsigned lm_index = min(out_index, model.max_lm_pos_weights - 1);
+    Expression lm_weight = lookup(cg, model.lm_pos_weights, lm_index);
+    ensmb_out.push_back(log_softmax(tm_prob +
+                                    start_lm_dist * Softplus(lm_weight)));
+  }
+
+  // Compute the average of the ensemble output.
+  Expression out_dist = average(ensmb_out);
+  vector<float> log_dist = as_vector(cg.incremental_forward());
+  unsigned vocab_size = log_dist.size();
+
+  // Every hypothesis starts from the state after the first step. Finished
+  // and pruned hypotheses drop out of search.Live() and get no more graph
+  // nodes.
+  BeamSearch search;
+  search.Start(beam_size, char_to_id[BOW], char_to_id[EOW], MAX_PRED_LEN,
+               log_dist.data(), vocab_size, pruning);
+  vector<LSTMState> prev_states, curr_states(beam_size * ensmb);
+  for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
+    for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+      prev_states.push_back(states[ensmb_id]);
+    }
+  }
+  // The LM context of every slot, and of every live column of a step.
+  vector<LMState> lm_states(beam_size), curr_lm_states(beam_size);
+  for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
+    lm->Extend(start, search.LastChar(beam_id), &lm_states[beam_id]);
+  }
+
+  vector<LMState> contexts;
+  vector<unsigned> context_of;
+  while (!search.Done()) {
+    out_index++;
+    const vector<unsigned>& live = search.Live();
+
+    // Hypotheses ending in the same characters share one LM distribution,
+    // so the LM is queried once per distinct context. A beam holds few
+    // contexts, so they are compared directly.
+    contexts.clear();
+    context_of.resize(live.size());
+    for (unsigned i = 0; i < live.size(); ++i) {
+      curr_lm_states[i] = lm_states[live[i]];
+      unsigned c = find(contexts.begin(), contexts.end(), curr_lm_states[i]) -
+                   contexts.begin();
+      if (c == contexts.size()) {
+        contexts.push_back(curr_lm_states[i]);
+      }
+      context_of[i] = c;
+    }
+    // lm_terms[c * ensmb + ensmb_id] is the LM distribution of context c
+    // scaled by the LM weight of the model at this position.
+    vector<Expression> lm_terms;
+    for (const LMState& context : contexts) {
+      Expression lm_dist = LogProbDist(context, lm, &cg);
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        auto& model = *(*ensmb_model)[ensmb_id];
+        unsigned lm_index = min(out_index, model.max_lm_pos_weights - 1);
+        Expression lm_weight = lookup(cg, model.lm_pos_weights, lm_index);
+        lm_terms.push_back(lm_dist * Softplus(lm_weight));
+      }
+    }
+
+    vector<Expression> out_dist;
+    for (unsigned i = 0; i < live.size(); ++i) {
+      unsigned beam_id = live[i];
+      unsigned prev_out_char = search.LastChar(beam_id);
+      vector<Expression> ensmb_out;
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ensmb_id++) {
+        auto& model = *(*ensmb_model)[ensmb_id];
+        Expression input_char_vec;
+        if (out_index < input_ids.size()) {
+          input_char_vec = lookup(cg, model.char_vecs, input_ids[out_index]);
+        } else {
+          input_char_vec = lookup(cg, model.eps_vecs[morph_id],
+                                  min(unsigned(out_index - input_ids.size()),
+                                               model.max_eps - 1));
+        }
+
+        Expression prev_out_vec = lookup(cg, model.char_vecs, prev_out_char);
+        Expression input = concatenate({prev_out_vec, input_char_vec});
+        Expression hidden = decoders[ensmb_id].AddInput(
+            encoded_biases[ensmb_id], prev_states[beam_id * ensmb + ensmb_id],
+            input, &curr_states[i * ensmb + ensmb_id]);
+
+        Expression tm_prob;
+        model.ProjectToOutput(hidden, &tm_prob);
+        tm_prob = log_softmax(tm_prob);
+        ensmb_out.push_back(log_softmax(
+            tm_prob + lm_terms[context_of[i] * ensmb + ensmb_id]));
+      }
+      out_dist.push_back(average(ensmb_out));
+    }
+
+    Expression all_scores = concatenate(out_dist);
+    vector<float> log_dist = as_vector(cg.incremental_forward());
+    search.Step(log_dist.data(), vocab_size);
+    for (unsigned beam_id : search.Extended()) {  // Update hidden state
+      unsigned parent = search.Parent(beam_id);
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        prev_states[beam_id * ensmb + ensmb_id] =
+            curr_states[parent * ensmb + ensmb_id];
+      }
+      lm->Extend(curr_lm_states[parent], search.LastChar(beam_id),
+                 &lm_states[beam_id]);
+    }
+  }
+  search.Results(sequences, tm_scores);
+  if (stats != NULL) {
+    *stats = search.Stats();
+  }
+}
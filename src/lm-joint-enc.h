@@ -10,11 +10,15 @@
 #include "cnn/gpu-ops.h"
 #include "cnn/expr.h"
 
+#include "beam-search.h"
 #include "lm.h"
 #include "utils.h"
+#include "model-io.h"
+#include "lstm-utils.h"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
+#include <algorithm>
 #include <unordered_map>
 
 using namespace std;
@@ -57,6 +61,10 @@ class LMJointEnc {
   void RunFwdBwd(const vector<unsigned>& inputs,
                  Expression* hidden, ComputationGraph *cg);
 
+  // Encodes a batch of inputs which all have the same length.
+  void RunFwdBwd(const vector<vector<unsigned> >& inputs,
+                 Expression* hidden, ComputationGraph *cg);
+
   void TransformEncodedInput(Expression* encoded_input) const; 
 
   void ProjectToOutput(const Expression& hidden, Expression* out) const;
@@ -65,10 +73,21 @@ class LMJointEnc {
                          const vector<unsigned>& targets, LM *lm, 
                          ComputationGraph* cg) const;
 
+  Expression ComputeLoss(const vector<Expression>& hidden_units,
+                         const vector<vector<unsigned> >& targets, LM *lm,
+                         ComputationGraph* cg) const;
+
   float Train(const unsigned& morph_id, const vector<unsigned>& inputs,
               const vector<unsigned>& outputs, LM *lm, AdadeltaTrainer* opt,
               AdadeltaTrainer* shared_opt);
 
+  // Trains on a batch of examples that all have the same input length and
+  // the same output length, with one update for the whole batch.
+  float TrainBatch(const unsigned& morph_id,
+                   const vector<vector<unsigned> >& inputs,
+                   const vector<vector<unsigned> >& outputs, LM *lm,
+                   AdadeltaTrainer* opt, AdadeltaTrainer* shared_opt);
+
   friend class boost::serialization::access;
   template<class Archive> void serialize(Archive& ar, const unsigned int) {
     ar & char_len;
@@ -81,8 +100,13 @@ class LMJointEnc {
   }
 };
 
-Expression LogProbDist(const vector<unsigned>& seq,
-                       LM *lm, ComputationGraph *cg);
+// The LM log probabilities of every next character after the context of
+// state, as an input of the graph.
+Expression LogProbDist(const LMState& state, LM *lm, ComputationGraph *cg);
+
+// LogProbDist() of every state in a batch.
+Expression LogProbDist(const vector<LMState>& states, LM *lm,
+                       ComputationGraph *cg);
 
 Expression Softplus(Expression x);
 
@@ -91,11 +115,34 @@ float Softplus(float x);
 
 void Serialize(string& filename, LMJointEnc& model, vector<Model*>* cnn_model);
 
-void Read(string& filename, LMJointEnc* model, vector<Model*>* cnn_model);
+// Reads a model, returning false on failure.
+bool Read(string& filename, LMJointEnc* model, vector<Model*>* cnn_model);
 
 void
 EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_to_id,
                const vector<unsigned>& input_ids, vector<unsigned>* pred_target_ids,
                LM *lm, vector<LMJointEnc*>* ensmb_model);
 
+// Decodes the lemma with every morph tag, writing the prediction of
+// EnsembleDecode() for tag i to (*pred_target_ids)[i]. The shared encoder
+// runs once per model instead of once per tag, and the decoders of all the
+// tags step together in one graph.
+void
+EnsembleDecodeParadigm(unordered_map<string, unsigned>& char_to_id,
+                       const vector<unsigned>& input_ids,
+                       vector<vector<unsigned> >* pred_target_ids,
+                       LM *lm, vector<LMJointEnc*>* ensmb_model);
+
+// Beam search over the outputs of the ensemble combined with the LM like in
+// EnsembleDecode(). Every hypothesis carries its LM context, and the
+// hypotheses of a step with the same context share one LM distribution.
+void
+EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
+                   unordered_map<string, unsigned>& char_to_id,
+                   const vector<unsigned>& input_ids,
+                   vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
+                   LM* lm, vector<LMJointEnc*>* ensmb_model,
+                   const BeamPruning& pruning = BeamPruning(),
+                   BeamStats* stats = NULL);
+
 #endif
@@ -21,28 +21,84 @@ LMSepMorph::LMSepMorph(const unsigned& char_length, const unsigned& hidden_lengt
 }
 
 void LMSepMorph::InitParams(vector<Model*>* m) {
+  ResizeParams();
   for (unsigned i = 0; i < morph_len; ++i) {
-    input_forward.push_back(LSTMBuilder(layers, char_len, hidden_len, (*m)[i]));
-    input_backward.push_back(LSTMBuilder(layers, char_len, hidden_len, (*m)[i]));
-    output_forward.push_back(LSTMBuilder(layers, 2 * char_len + hidden_len,
-                                         hidden_len, (*m)[i]));
+    InitParams(i, (*m)[i]);
+  }
+}
+
+void LMSepMorph::InitParams(const unsigned& morph_id, Model* m) {
+  input_forward[morph_id] = LSTMBuilder(layers, char_len, hidden_len, m);
+  input_backward[morph_id] = LSTMBuilder(layers, char_len, hidden_len, m);
+  output_forward[morph_id] = LSTMBuilder(layers, 2 * char_len + hidden_len,
+                                         hidden_len, m);
 
-    phidden_to_output.push_back((*m)[i]->add_parameters({vocab_len, hidden_len}));
-    phidden_to_output_bias.push_back((*m)[i]->add_parameters({vocab_len, 1}));
+  phidden_to_output[morph_id] = m->add_parameters({vocab_len, hidden_len});
+  phidden_to_output_bias[morph_id] = m->add_parameters({vocab_len, 1});
 
-    char_vecs.push_back((*m)[i]->add_lookup_parameters(vocab_len, {char_len}));
+  char_vecs[morph_id] = m->add_lookup_parameters(vocab_len, {char_len});
 
-    ptransform_encoded.push_back((*m)[i]->add_parameters({hidden_len,
-                                                          2 * hidden_len}));
-    ptransform_encoded_bias.push_back((*m)[i]->add_parameters({hidden_len, 1}));
+  ptransform_encoded[morph_id] = m->add_parameters(
+      {hidden_len, 2 * hidden_len});
+  ptransform_encoded_bias[morph_id] = m->add_parameters({hidden_len, 1});
+
+  eps_vecs[morph_id] = m->add_lookup_parameters(max_eps, {char_len});
+  lm_pos_weights[morph_id] = m->add_lookup_parameters(max_lm_pos_weights, {1});
+}
+
+void LMSepMorph::ResizeParams() {
+  input_forward.resize(morph_len);
+  input_backward.resize(morph_len);
+  output_forward.resize(morph_len);
+  phidden_to_output.resize(morph_len);
+  phidden_to_output_bias.resize(morph_len);
+  char_vecs.resize(morph_len);
+  ptransform_encoded.resize(morph_len);
+  ptransform_encoded_bias.resize(morph_len);
+  eps_vecs.resize(morph_len);
+  lm_pos_weights.resize(morph_len);
+}
+
+void LMSepMorph::InitLazy(MappedModel* mapped) {
+  ResizeParams();
+  loaded_tag = -1;
+  lazy_model = mapped;
+}
 
-    eps_vecs.push_back((*m)[i]->add_lookup_parameters(max_eps, {char_len}));
-    lm_pos_weights.push_back((*m)[i]->add_lookup_parameters(
-        max_lm_pos_weights, {1}));
+bool LMSepMorph::LoadTag(const unsigned& morph_id) {
+  if ((int) morph_id == loaded_tag) {
+    return true;
   }
+  if (loaded_tag < 0) {
+    tag_model = new Model();
+    InitParams(morph_id, tag_model);
+  } else {
+    // The parameters of all the tags have the same shapes, so the new tag
+    // takes over the builders and parameters of the previous one.
+    swap(input_forward[loaded_tag], input_forward[morph_id]);
+    swap(input_backward[loaded_tag], input_backward[morph_id]);
+    swap(output_forward[loaded_tag], output_forward[morph_id]);
+    swap(phidden_to_output[loaded_tag], phidden_to_output[morph_id]);
+    swap(phidden_to_output_bias[loaded_tag], phidden_to_output_bias[morph_id]);
+    swap(char_vecs[loaded_tag], char_vecs[morph_id]);
+    swap(ptransform_encoded[loaded_tag], ptransform_encoded[morph_id]);
+    swap(ptransform_encoded_bias[loaded_tag],
+         ptransform_encoded_bias[morph_id]);
+    swap(eps_vecs[loaded_tag], eps_vecs[morph_id]);
+    swap(lm_pos_weights[loaded_tag], lm_pos_weights[morph_id]);
+  }
+  loaded_tag = morph_id;
+  return lazy_model->LoadParams(morph_id, true, tag_model);
 }
 
 void LMSepMorph::AddParamsToCG(const unsigned& morph_id, ComputationGraph* cg) {
+  // With a mapped model there is a single set of parameters, which fits every
+  // tag as their parameters have the same shapes; LoadTag() points it at the
+  // weights of morph_id.
+  if (lazy_model != NULL && !LoadTag(morph_id)) {
+    cerr << "Could not load the parameters of tag " << morph_id << endl;
+    exit(1);
+  }
   input_forward[morph_id].new_graph(*cg);
   input_backward[morph_id].new_graph(*cg);
   output_forward[morph_id].new_graph(*cg);
@@ -80,6 +136,33 @@ void LMSepMorph::RunFwdBwd(const unsigned& morph_id,
   *hidden = concatenate({forward_unit, backward_unit});
 }
 
+void LMSepMorph::RunFwdBwd(const unsigned& morph_id,
+                         const vector<vector<unsigned> >& inputs,
+                         Expression* hidden, ComputationGraph *cg) {
+  vector<Expression> input_vecs;
+  for (unsigned i = 0; i < inputs[0].size(); ++i) {
+    input_vecs.push_back(lookup(*cg, char_vecs[morph_id],
+                                BatchColumn(inputs, i)));
+  }
+
+  // Run forward LSTM
+  Expression forward_unit;
+  input_forward[morph_id].start_new_sequence();
+  for (unsigned i = 0; i < input_vecs.size(); ++i) {
+    forward_unit = input_forward[morph_id].add_input(input_vecs[i]);
+  }
+
+  // Run backward LSTM
+  Expression backward_unit;
+  input_backward[morph_id].start_new_sequence();
+  for (int i = input_vecs.size() - 1; i >= 0; --i) {
+    backward_unit = input_backward[morph_id].add_input(input_vecs[i]);
+  }
+
+  // Concatenate the forward and back hidden layers
+  *hidden = concatenate({forward_unit, backward_unit});
+}
+
 void LMSepMorph::TransformEncodedInput(Expression* encoded_input) const {
   *encoded_input = affine_transform({transform_encoded_bias,
                                      transform_encoded, *encoded_input});
@@ -95,15 +178,15 @@ Expression LMSepMorph::ComputeLoss(const unsigned& morph_id,
                                    const vector<unsigned>& targets,
                                    LM *lm, ComputationGraph* cg) const {
   vector<Expression> losses;
-  vector<unsigned> incremental_targets;
-  incremental_targets.push_back(lm->char_to_id[BOW]);
+  // The LM does not see <s>, which is fed to the decoder first.
+  LMState lm_state = lm->Start();
   for (unsigned i = 0; i < hidden_units.size(); ++i) {
     Expression out;
     ProjectToOutput(hidden_units[i], &out);
     Expression trans_lp = log_softmax(out);
 
     // Calculate the LM probabilities of all possible outputs.
-    Expression lm_lp = LogProbDist(incremental_targets, lm, cg);
+    Expression lm_lp = LogProbDist(lm_state, lm, cg);
 
     unsigned lm_index = min(i + 1, max_lm_pos_weights - 1);
     Expression lm_weight = lookup(*cg, lm_pos_weights[morph_id], lm_index);
@@ -111,11 +194,37 @@ Expression LMSepMorph::ComputeLoss(const unsigned& morph_id,
     //Expression total_lp = trans_lp + cwise_multiply(lm_lp, Softplus(lm_weight));
     Expression total_lp = trans_lp + lm_lp * Softplus(lm_weight);
     losses.push_back(pickneglogsoftmax(total_lp, targets[i]));
-    incremental_targets.push_back(targets[i]);
+    lm->Extend(lm_state, targets[i], &lm_state);
   }
   return sum(losses);
 }
 
+Expression LMSepMorph::ComputeLoss(const unsigned& morph_id,
+                                   const vector<Expression>& hidden_units,
+                                   const vector<vector<unsigned> >& targets,
+                                   LM *lm, ComputationGraph* cg) const {
+  vector<Expression> losses;
+  vector<LMState> lm_states(targets[0].size(), lm->Start());
+  for (unsigned i = 0; i < hidden_units.size(); ++i) {
+    Expression out;
+    ProjectToOutput(hidden_units[i], &out);
+    Expression trans_lp = log_softmax(out);
+
+    // Calculate the LM probabilities of all possible outputs.
+    Expression lm_lp = LogProbDist(lm_states, lm, cg);
+
+    unsigned lm_index = min(i + 1, max_lm_pos_weights - 1);
+    Expression lm_weight = lookup(*cg, lm_pos_weights[morph_id], lm_index);
+
+    Expression total_lp = trans_lp + lm_lp * Softplus(lm_weight);
+    losses.push_back(pickneglogsoftmax(total_lp, targets[i]));
+    for (unsigned b = 0; b < targets[i].size(); ++b) {
+      lm->Extend(lm_states[b], targets[i][b], &lm_states[b]);
+    }
+  }
+  return sum_batches(sum(losses));
+}
+
 float LMSepMorph::Train(const unsigned& morph_id,
                         const vector<unsigned>& inputs,
                         const vector<unsigned>& outputs, LM *lm,
@@ -166,22 +275,80 @@ float LMSepMorph::Train(const unsigned& morph_id,
   return return_loss;
 }
 
-// Computes the probability of all possible next characters given
-// a sequence, but removes the first character (<s>).
-Expression LogProbDist(const vector<unsigned>& seq, LM *lm,
-                       ComputationGraph *cg) {
-  vector<float> lm_dist(lm->char_to_id.size(), 0.f);
-
-  // Remove the first (<s>) character.
-  vector<unsigned> seq_without_start(seq.begin() + 1, seq.end());
-  for (const auto& it : lm->char_to_id) {
-    vector<unsigned> possible_seq(seq_without_start);
-    possible_seq.push_back(it.second);
-    lm_dist[it.second] = lm->LogProbSeq(possible_seq);
+float LMSepMorph::TrainBatch(const unsigned& morph_id,
+                             const vector<vector<unsigned> >& inputs,
+                             const vector<vector<unsigned> >& outputs, LM *lm,
+                             AdadeltaTrainer* ada_gd) {
+  ComputationGraph cg;
+  AddParamsToCG(morph_id, &cg);
+
+  // Encode and Transform to feed into decoder
+  Expression encoded_input_vec;
+  RunFwdBwd(morph_id, inputs, &encoded_input_vec, &cg);
+  TransformEncodedInput(&encoded_input_vec);
+
+  // All examples have the same lengths, so every decoder step reads either
+  // input characters or epsilons for the whole batch.
+  unsigned input_len = inputs[0].size(), output_len = outputs[0].size();
+  vector<Expression> input_vecs_for_dec;
+  vector<vector<unsigned> > output_ids_for_pred;
+  for (unsigned i = 0; i < output_len; ++i) {
+    if (i < output_len - 1) {
+      // '</s>' will not be fed as input -- it needs to be predicted.
+      Expression prev_output_vecs = lookup(cg, char_vecs[morph_id],
+                                           BatchColumn(outputs, i));
+      if (i < input_len - 1) {
+        input_vecs_for_dec.push_back(concatenate(
+            {encoded_input_vec, prev_output_vecs,
+             lookup(cg, char_vecs[morph_id], BatchColumn(inputs, i + 1))}));
+      } else {
+        vector<unsigned> eps_ids(inputs.size(),
+                                 min(unsigned(i - input_len), max_eps - 1));
+        input_vecs_for_dec.push_back(concatenate(
+            {encoded_input_vec, prev_output_vecs,
+             lookup(cg, eps_vecs[morph_id], eps_ids)}));
+      }
+    }
+    if (i > 0) {  // '<s>' will not be predicted in the output -- its fed in.
+      output_ids_for_pred.push_back(BatchColumn(outputs, i));
+    }
+  }
+
+  vector<Expression> decoder_hidden_units;
+  output_forward[morph_id].start_new_sequence();
+  for (const auto& vec : input_vecs_for_dec) {
+    decoder_hidden_units.push_back(output_forward[morph_id].add_input(vec));
   }
+  Expression loss = ComputeLoss(morph_id, decoder_hidden_units,
+                                output_ids_for_pred, lm, &cg);
+
+  float return_loss = as_scalar(cg.incremental_forward());
+  cg.backward();
+  ada_gd->update(1.0f);
+
+  return return_loss;
+}
+
+// Computes the log probability of every possible next character. The
+// state holds only the context the LM conditions on, so a step costs one
+// LM lookup per character whatever the length of the sequence.
+Expression LogProbDist(const LMState& state, LM *lm, ComputationGraph *cg) {
+  vector<float> lm_dist(lm->vocab_size());
+  lm->ScoreAll(state, lm_dist.data());
   return input(*cg, {(long) lm_dist.size()}, lm_dist);
 }
 
+// Computes LogProbDist() for every state in a batch.
+Expression LogProbDist(const vector<LMState>& states, LM *lm,
+                       ComputationGraph *cg) {
+  unsigned vocab_size = lm->vocab_size();
+  vector<float> lm_dist(vocab_size * states.size());
+  for (unsigned b = 0; b < states.size(); ++b) {
+    lm->ScoreAll(states[b], &lm_dist[b * vocab_size]);
+  }
+  return input(*cg, Dim({(long) vocab_size}, states.size()), lm_dist);
+}
+
 void
 EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_to_id,
                const vector<unsigned>& input_ids, vector<unsigned>* pred_target_ids,
@@ -189,19 +356,23 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
   ComputationGraph cg;
 
   unsigned ensmb = ensmb_model->size();
-  vector<Expression> encoded_word_vecs;
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
   for (unsigned i = 0; i < ensmb; ++i) {
     Expression encoded_word_vec;
     auto model = (*ensmb_model)[i];
     model->AddParamsToCG(morph_id, &cg);
     model->RunFwdBwd(morph_id, input_ids, &encoded_word_vec, &cg);
     model->TransformEncodedInput(&encoded_word_vec);
-    encoded_word_vecs.push_back(encoded_word_vec);
-    model->output_forward[morph_id].start_new_sequence();
+    decoders.push_back(FixedInputLSTM(model->output_forward[morph_id],
+                                      model->hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
   }
 
   unsigned out_index = 1;
   unsigned pred_index = char_to_id[BOW];
+  LMState lm_state = lm->Start();  // The LM does not see <s>
   while (pred_target_ids->size() < MAX_PRED_LEN) {
     pred_target_ids->push_back(pred_index);
     if (pred_index == char_to_id[EOW]) {
@@ -219,7 +390,7 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
     }
 
     vector<Expression> ensmb_out;
-    Expression lm_dist = LogProbDist(*pred_target_ids, lm, &cg);
+    Expression lm_dist = LogProbDist(lm_state, lm, &cg);
     for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
       auto model = (*ensmb_model)[ensmb_id];
       Expression prev_output_vec = lookup(cg, model->char_vecs[morph_id], pred_index);
@@ -231,10 +402,11 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
                                 min(unsigned(out_index - input_ids.size()),
                                              model->max_eps - 1));
       }
-      input = concatenate({encoded_word_vecs[ensmb_id], prev_output_vec,
-                           input_char_vec});
+      input = concatenate({prev_output_vec, input_char_vec});
 
-      Expression hidden = model->output_forward[morph_id].add_input(input);
+      Expression hidden = decoders[ensmb_id].AddInput(
+          encoded_biases[ensmb_id], states[ensmb_id], input,
+          &states[ensmb_id]);
       Expression tm_prob;
       model->ProjectToOutput(hidden, &tm_prob);
       tm_prob = log_softmax(tm_prob);
@@ -249,7 +421,162 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
 
     vector<float> dist = as_vector(cg.incremental_forward());
     pred_index = distance(dist.begin(), max_element(dist.begin(), dist.end()));
+    lm->Extend(lm_state, pred_index, &lm_state);
+    out_index++;
+  }
+}
+
+void
+EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
+                   unordered_map<string, unsigned>& char_to_id,
+                   const vector<unsigned>& input_ids,
+                   vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
+                   LM* lm, vector<LMSepMorph*>* ensmb_model,
+                   const BeamPruning& pruning, BeamStats* stats) {
+  unsigned out_index = 1;
+  unsigned ensmb = ensmb_model->size();
+  ComputationGraph cg;
+
+  // Compute stuff for every model in the ensemble.
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
+  vector<Expression> ensmb_out;
+  LMState start = lm->Start();  // The LM does not see <s>
+  Expression start_lm_dist = LogProbDist(start, lm, &cg);
+  for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+    auto& model = *(*ensmb_model)[ensmb_id];
+    model.AddParamsToCG(morph_id, &cg);
+
+    Expression encoded_word_vec;
+    model.RunFwdBwd(morph_id, input_ids, &encoded_word_vec, &cg);
+    model.TransformEncodedInput(&encoded_word_vec);
+    decoders.push_back(FixedInputLSTM(model.output_forward[morph_id],
+                                      model.hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
+
+    Expression prev_output_vec = lookup(cg, model.char_vecs[morph_id],
+                                        char_to_id[BOW]);
+    Expression input = concatenate({prev_output_vec,
+                                    lookup(cg, model.char_vecs[morph_id],
+                                           input_ids[out_index])});
+    Expression hidden = decoders[ensmb_id].AddInput(
+        encoded_biases[ensmb_id], states[ensmb_id], input,
+        &states[ensmb_id]);
+    Expression tm_prob;
+    model.ProjectToOutput(hidden, &tm_prob);
+    tm_prob = log_softmax(tm_prob);
+
+    unsigned lm_index = min(out_index, model.max_lm_pos_weights - 1);
+    Expression lm_weight = lookup(cg, model.lm_pos_weights[morph_id], lm_index);
+    ensmb_out.push_back(log_softmax(tm_prob +
+                                    start_lm_dist * Softplus(lm_weight)));
+  }
+
+  // Compute the average of the ensemble output.
+  Expression out_dist = average(ensmb_out);
+  vector<float> log_dist = as_vector(cg.incremental_forward());
+  unsigned vocab_size = log_dist.size();
+
+  // Every hypothesis starts from the state after the first step. Finished
+  // and pruned hypotheses drop out of search.Live() and get no more graph
+  // nodes.
+  BeamSearch search;
+  search.Start(beam_size, char_to_id[BOW], char_to_id[EOW], MAX_PRED_LEN,
+               log_dist.data(), vocab_size, pruning);
+  vector<LSTMState> prev_states, curr_states(beam_size * ensmb);
+  for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
+    for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+      prev_states.push_back(states[ensmb_id]);
+    }
+  }
+  // The LM context of every slot, and of every live column of a step.
+  vector<LMState> lm_states(beam_size), curr_lm_states(beam_size);
+  for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
+    lm->Extend(start, search.LastChar(beam_id), &lm_states[beam_id]);
+  }
+
+  vector<LMState> contexts;
+  vector<unsigned> context_of;
+  while (!search.Done()) {
     out_index++;
+    const vector<unsigned>& live = search.Live();
+
+    // Hypotheses ending in the same characters share one LM distribution,
+    // so the LM is queried once per distinct context. A beam holds few
+    // contexts, so they are compared directly.
+    contexts.clear();
+    context_of.resize(live.size());
+    for (unsigned i = 0; i < live.size(); ++i) {
+      curr_lm_states[i] = lm_states[live[i]];
+      unsigned c = find(contexts.begin(), contexts.end(), curr_lm_states[i]) -
+                   contexts.begin();
+      if (c == contexts.size()) {
+        contexts.push_back(curr_lm_states[i]);
+      }
+      context_of[i] = c;
+    }
+    // lm_terms[c * ensmb + ensmb_id] is the LM distribution of context c
+    // scaled by the LM weight of the model at this position.
+    vector<Expression> lm_terms;
+    for (const LMState& context : contexts) {
+      Expression lm_dist = LogProbDist(context, lm, &cg);
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        auto& model = *(*ensmb_model)[ensmb_id];
+        unsigned lm_index = min(out_index, model.max_lm_pos_weights - 1);
+        Expression lm_weight = lookup(cg, model.lm_pos_weights[morph_id],
+                                      lm_index);
+        lm_terms.push_back(lm_dist * Softplus(lm_weight));
+      }
+    }
+
+    vector<Expression> out_dist;
+    for (unsigned i = 0; i < live.size(); ++i) {
+      unsigned beam_id = live[i];
+      unsigned prev_out_char = search.LastChar(beam_id);
+      vector<Expression> ensmb_out;
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ensmb_id++) {
+        auto& model = *(*ensmb_model)[ensmb_id];
+        Expression input_char_vec;
+        if (out_index < input_ids.size()) {
+          input_char_vec = lookup(cg, model.char_vecs[morph_id], input_ids[out_index]);
+        } else {
+          input_char_vec = lookup(cg, model.eps_vecs[morph_id],
+                                  min(unsigned(out_index - input_ids.size()),
+                                               model.max_eps - 1));
+        }
+
+        Expression prev_out_vec = lookup(cg, model.char_vecs[morph_id], prev_out_char);
+        Expression input = concatenate({prev_out_vec, input_char_vec});
+        Expression hidden = decoders[ensmb_id].AddInput(
+            encoded_biases[ensmb_id], prev_states[beam_id * ensmb + ensmb_id],
+            input, &curr_states[i * ensmb + ensmb_id]);
+
+        Expression tm_prob;
+        model.ProjectToOutput(hidden, &tm_prob);
+        tm_prob = log_softmax(tm_prob);
+        ensmb_out.push_back(log_softmax(
+            tm_prob + lm_terms[context_of[i] * ensmb + ensmb_id]));
+      }
+      out_dist.push_back(average(ensmb_out));
+    }
+
+    Expression all_scores = concatenate(out_dist);
+    vector<float> log_dist = as_vector(cg.incremental_forward());
+    search.Step(log_dist.data(), vocab_size);
+    for (unsigned beam_id : search.Extended()) {  // Update hidden state
+      unsigned parent = search.Parent(beam_id);
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        prev_states[beam_id * ensmb + ensmb_id] =
+            curr_states[parent * ensmb + ensmb_id];
+      }
+      lm->Extend(curr_lm_states[parent], search.LastChar(beam_id),
+                 &lm_states[beam_id]);
+    }
+  }
+  search.Results(sequences, tm_scores);
+  if (stats != NULL) {
+    *stats = search.Stats();
   }
 }
 
@@ -262,25 +589,45 @@ Expression Softplus(Expression x) {
 }
 
 void Serialize(string& filename, LMSepMorph& model, vector<Model*>* cnn_models) {
-  ofstream outfile(filename);
-  if (!outfile.is_open()) {
-    cerr << "File opening failed" << endl;
-  }
-
-  boost::archive::text_oarchive oa(outfile);
-  oa & model;
-  for (unsigned i = 0; i < cnn_models->size(); ++i) {
-    oa & *(*cnn_models)[i];
+  ModelHeader header = MakeModelHeader(kLMSepMorph, model.char_len,
+                                       model.hidden_len, model.vocab_len,
+                                       model.layers, model.morph_len,
+                                       model.max_eps, model.max_lm_pos_weights);
+  if (WriteBinaryModel(filename, header, *cnn_models)) {
+    cerr << "Saved model to: " << filename << endl;
   }
+}
 
-  cerr << "Saved model to: " << filename << endl;
-  outfile.close();
+static void CopyHyperParams(const ModelHeader& header, LMSepMorph* model) {
+  model->char_len = header.char_len;
+  model->hidden_len = header.hidden_len;
+  model->vocab_len = header.vocab_len;
+  model->layers = header.layers;
+  model->morph_len = header.morph_len;
+  model->max_eps = header.max_eps;
+  model->max_lm_pos_weights = header.max_lm_pos_weights;
 }
 
-void Read(string& filename, LMSepMorph* model, vector<Model*>* cnn_models) {
+bool Read(string& filename, LMSepMorph* model, vector<Model*>* cnn_models) {
+  if (IsBinaryModel(filename)) {
+    MappedModel* mapped = OpenBinaryModel(filename, kLMSepMorph, 0);
+    if (mapped == NULL) {
+      return false;
+    }
+    CopyHyperParams(*mapped->header, model);
+    model->InitLazy(mapped);
+    if (!model->LoadTag(0)) {
+      return false;
+    }
+    cerr << "Loaded model from: " << filename << endl;
+    return true;
+  }
+
+  // Models saved in the old boost text format.
   ifstream infile(filename);
   if (!infile.is_open()) {
     cerr << "File opening failed" << endl;
+    return false;
   }
 
   boost::archive::text_iarchive ia(infile);
@@ -297,5 +644,6 @@ void Read(string& filename, LMSepMorph* model, vector<Model*>* cnn_models) {
 
   cerr << "Loaded model from: " << filename << endl;
   infile.close();
+  return true;
 }
 
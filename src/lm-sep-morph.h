@@ -10,11 +10,15 @@
 #include "cnn/gpu-ops.h"
 #include "cnn/expr.h"
 
+#include "beam-search.h"
 #include "lm.h"
 #include "utils.h"
+#include "model-io.h"
+#include "lstm-utils.h"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
+#include <algorithm>
 #include <unordered_map>
 
 using namespace std;
@@ -37,6 +41,10 @@ class LMSepMorph {
   vector<LookupParameters*> eps_vecs;
   vector<LookupParameters*> lm_pos_weights;
 
+  MappedModel* lazy_model = NULL;  // NULL unless read from a binary model
+  int loaded_tag = -1;  // The tag the parameters point at, -1 for none
+  Model* tag_model = NULL;
+
   LMSepMorph() {}
 
   LMSepMorph(const unsigned& char_length, const unsigned& hidden_length,
@@ -46,11 +54,28 @@ class LMSepMorph {
 
   void InitParams(vector<Model*>* m);
 
+  void InitParams(const unsigned& morph_id, Model* m);
+
+  void ResizeParams();
+
+  // Lazy loading: the tags share one set of parameters, which LoadTag()
+  // points at the weights of a tag in the mapped model whenever
+  // AddParamsToCG() switches to another tag.
+  void InitLazy(MappedModel* mapped);
+
+  // Returns false if the parameters of the tag do not match the model.
+  bool LoadTag(const unsigned& morph_id);
+
   void AddParamsToCG(const unsigned& morph_id, ComputationGraph* cg);
 
   void RunFwdBwd(const unsigned& morph_id, const vector<unsigned>& inputs,
                  Expression* hidden, ComputationGraph *cg);
 
+  // Encodes a batch of inputs which all have the same length.
+  void RunFwdBwd(const unsigned& morph_id,
+                 const vector<vector<unsigned> >& inputs,
+                 Expression* hidden, ComputationGraph *cg);
+
   void TransformEncodedInput(Expression* encoded_input) const;
 
   void TransformEncodedInputDuringDecoding(Expression* encoded_input) const;
@@ -62,9 +87,21 @@ class LMSepMorph {
                          const vector<unsigned>& targets,
                          LM *lm, ComputationGraph* cg) const;
 
+  Expression ComputeLoss(const unsigned& morph_id,
+                         const vector<Expression>& hidden_units,
+                         const vector<vector<unsigned> >& targets,
+                         LM *lm, ComputationGraph* cg) const;
+
   float Train(const unsigned& morph_id, const vector<unsigned>& inputs,
               const vector<unsigned>& outputs, LM* lm, AdadeltaTrainer* ada_gd);
 
+  // Trains on a batch of examples that all have the same input length and
+  // the same output length, with one update for the whole batch.
+  float TrainBatch(const unsigned& morph_id,
+                   const vector<vector<unsigned> >& inputs,
+                   const vector<vector<unsigned> >& outputs, LM* lm,
+                   AdadeltaTrainer* ada_gd);
+
   friend class boost::serialization::access;
   template<class Archive> void serialize(Archive& ar, const unsigned int) {
     ar & char_len;
@@ -77,8 +114,13 @@ class LMSepMorph {
   }
 };
 
-Expression LogProbDist(const vector<unsigned>& seq,
-                       LM *lm, ComputationGraph *cg);
+// The LM log probabilities of every next character after the context of
+// state, as an input of the graph.
+Expression LogProbDist(const LMState& state, LM *lm, ComputationGraph *cg);
+
+// LogProbDist() of every state in a batch.
+Expression LogProbDist(const vector<LMState>& states, LM *lm,
+                       ComputationGraph *cg);
 
 Expression Softplus(Expression x);
 
@@ -90,8 +132,23 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
                vector<unsigned>* pred_target_ids, LM* lm,
                vector<LMSepMorph*>* ensmb_model);
 
+// Beam search over the outputs of the ensemble combined with the LM like in
+// EnsembleDecode(). Every hypothesis carries its LM context, and the
+// hypotheses of a step with the same context share one LM distribution.
+void
+EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
+                   unordered_map<string, unsigned>& char_to_id,
+                   const vector<unsigned>& input_ids,
+                   vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
+                   LM* lm, vector<LMSepMorph*>* ensmb_model,
+                   const BeamPruning& pruning = BeamPruning(),
+                   BeamStats* stats = NULL);
+
 void Serialize(string& filename, LMSepMorph& model, vector<Model*>* cnn_model);
 
-void Read(string& filename, LMSepMorph* model, vector<Model*>* cnn_model);
+// Reads a model, returning false on failure. A binary model is mapped and
+// its tags are loaded lazily, see InitLazy(); only the text models fill
+// cnn_model.
+bool Read(string& filename, LMSepMorph* model, vector<Model*>* cnn_model);
 
 #endif
@@ -1,42 +1,390 @@
 #include "lm.h"
+#include "lm-cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+typedef pair<vector<unsigned>, pair<float, float> > NGram;
+
+static const unsigned kNumCodes = 0xffff;  // kNoLMProb is not a code
 
 LM::LM(string& lm_model_file, unordered_map<string, unsigned>& char_id,
        unordered_map<unsigned, string>& id_char) {
-  ifstream model_file(lm_model_file);
-  if (model_file.is_open()) {
+  char_to_id = char_id;
+  id_to_char = id_char;
+  if (IsCompiledLM(lm_model_file)) {
+    if (!Map(lm_model_file)) {
+      exit(0);
+    }
+    cerr << "LM mapped from: " << lm_model_file << endl;
+  } else {
+    ifstream model_file(lm_model_file);
+    if (!model_file.is_open()) {
+      cerr << "File opening failed" << endl;
+      exit(0);
+    }
     string line;
-    char_to_id = char_id;
-    id_to_char = id_char;
+    // ngrams[n - 1] holds the n-grams with their log prob and backoff.
+    vector<vector<NGram> > ngrams;
+    unsigned num_unknown = 0;
     while(getline(model_file, line)) {
       vector<string> items = split_line(line, '\t');
-      if (items.size() == 2) {
+      if (items.size() == 2 || items.size() == 3) {
+        vector<string> chars = split_line(items[1], ' ');
         vector<unsigned> seq;
-        for (string& ch : split_line(items[1], ' ')) {
-          seq.push_back(char_to_id[ch]);
+        for (string& ch : chars) {
+          auto it = char_to_id.find(ch);
+          if (it == char_to_id.end()) {
+            break;
+          }
+          seq.push_back(it->second);
         }
-        lp[HashSeq(seq)] = atof(items[0].c_str());
-      } else if (items.size() == 3) {
-        vector<unsigned> seq;
-        for (string& ch : split_line(items[1], ' ')) {
-          seq.push_back(char_to_id[ch]);
+        if (seq.size() < chars.size()) {
+          num_unknown++;  // The models can never output it
+          continue;
+        }
+        if (seq.empty()) {
+          continue;
+        }
+        if (seq.size() > kMaxLMOrder) {
+          cerr << "LM order " << seq.size() << " is above " << kMaxLMOrder
+               << endl;
+          exit(0);
+        }
+        float backoff = items.size() == 3 ? atof(items[2].c_str()) : 0.;
+        if (ngrams.size() < seq.size()) {
+          ngrams.resize(seq.size());
         }
-        lp[HashSeq(seq)] = atof(items[0].c_str());
-        b[HashSeq(seq)] = atof(items[2].c_str());
+        ngrams[seq.size() - 1].push_back(
+            NGram(seq, make_pair(atof(items[0].c_str()), backoff)));
       }
     }
     model_file.close();
+    if (num_unknown > 0) {
+      cerr << num_unknown << " n-grams with characters not in the vocabulary"
+           << " skipped" << endl;
+    }
+    Build(&ngrams);
+    if (!Attach(image.data(), image.size())) {
+      exit(0);
+    }
     cerr << "LM loaded from: " << lm_model_file << endl;
-    cerr << "LM size: " << lp.size() << endl;
-  } else {
+  }
+  unsigned num_ngrams = 0;
+  for (const LMLevel& level : levels) {
+    num_ngrams += level.size - count(level.probs, level.probs + level.size,
+                                     kNoLMProb);
+  }
+  cerr << "LM size: " << num_ngrams << " (order " << order << ", "
+       << image_size << " bytes)" << endl;
+}
+
+LM::~LM() {
+  if (mapped != NULL) {
+    munmap(mapped, mapped_size);
+  }
+}
+
+bool IsCompiledLM(const string& filename) {
+  char magic[sizeof(kLMMagic)] = {0};
+  ifstream infile(filename, ios::binary);
+  infile.read(magic, sizeof(magic));
+  return infile && memcmp(magic, kLMMagic, sizeof(kLMMagic)) == 0;
+}
+
+// The sorted distinct values, or the means of kNumCodes bins holding equal
+// numbers of the sorted values if there are more distinct values.
+static void MakeCodebook(vector<float> values, vector<float>* codebook) {
+  sort(values.begin(), values.end());
+  codebook->clear();
+  vector<float> distinct(values.begin(),
+                         unique(values.begin(), values.end()));
+  if (distinct.size() <= kNumCodes) {
+    *codebook = distinct;
+    return;
+  }
+  for (unsigned bin = 0; bin < kNumCodes; ++bin) {
+    size_t begin = values.size() * bin / kNumCodes;
+    size_t end = values.size() * (bin + 1) / kNumCodes;
+    double sum = 0.;
+    for (size_t i = begin; i < end; ++i) {
+      sum += values[i];
+    }
+    codebook->push_back(end > begin ? sum / (end - begin) : values[begin]);
+  }
+}
+
+// The code of the codebook value nearest to value.
+static uint16_t Code(const vector<float>& codebook, const float& value) {
+  auto it = lower_bound(codebook.begin(), codebook.end(), value);
+  if (it == codebook.end()) {
+    return codebook.size() - 1;
+  }
+  if (it != codebook.begin() && value - *(it - 1) < *it - value) {
+    --it;
+  }
+  return it - codebook.begin();
+}
+
+static size_t Align8(const size_t& size) {
+  return (size + 7) & ~size_t(7);
+}
+
+void LM::Build(vector<vector<NGram> >* ngrams) {
+  unsigned num_levels = ngrams->size();
+  // Sort every order, keeping the last of repeated n-grams, and add the
+  // contexts missing from the lower orders without a probability.
+  auto less_ngram = [](const NGram& a, const NGram& b) {
+    return a.first < b.first;
+  };
+  for (int n = num_levels; n >= 1; --n) {
+    vector<NGram>& level = (*ngrams)[n - 1];
+    stable_sort(level.begin(), level.end(), less_ngram);
+    vector<NGram> last;
+    for (unsigned i = 0; i < level.size(); ++i) {
+      if (i + 1 == level.size() || level[i].first != level[i + 1].first) {
+        last.push_back(level[i]);
+      }
+    }
+    level.swap(last);
+    if (n == 1) {
+      break;
+    }
+    vector<NGram>& lower = (*ngrams)[n - 2];
+    stable_sort(lower.begin(), lower.end(), less_ngram);
+    vector<NGram> missing;
+    for (const NGram& ngram : level) {
+      NGram context(vector<unsigned>(ngram.first.begin(),
+                                     ngram.first.end() - 1),
+                    make_pair(numeric_limits<float>::quiet_NaN(), 0.f));
+      if (!binary_search(lower.begin(), lower.end(), context, less_ngram) &&
+          (missing.empty() || missing.back().first != context.first)) {
+        missing.push_back(context);
+      }
+    }
+    lower.insert(lower.end(), missing.begin(), missing.end());
+  }
+
+  // Lay out the header, the vocabulary, and the arrays of every order and
+  // their codebooks.
+  string vocab = "";
+  for (unsigned id = 0; id < char_to_id.size(); ++id) {
+    vocab += id_to_char[id] + "\n";
+  }
+  size_t size = Align8(sizeof(LMHeader) + num_levels * sizeof(LMLevelEntry));
+  size_t vocab_offset = size;
+  size += Align8(vocab.size());
+  vector<vector<float> > prob_codebooks(num_levels);
+  vector<vector<float> > backoff_codebooks(num_levels);
+  vector<LMLevelEntry> entries(num_levels);
+  for (unsigned n = 1; n <= num_levels; ++n) {
+    const vector<NGram>& level = (*ngrams)[n - 1];
+    bool top = n == num_levels;
+    vector<float> probs, backoffs;
+    for (const NGram& ngram : level) {
+      if (ngram.second.first == ngram.second.first) {  // Not NaN
+        probs.push_back(ngram.second.first);
+      }
+      backoffs.push_back(ngram.second.second);
+    }
+    MakeCodebook(probs, &prob_codebooks[n - 1]);
+    if (!top) {
+      MakeCodebook(backoffs, &backoff_codebooks[n - 1]);
+    }
+    LMLevelEntry& entry = entries[n - 1];
+    memset(&entry, 0, sizeof(entry));
+    entry.size = level.size();
+    entry.num_prob_values = prob_codebooks[n - 1].size();
+    entry.num_backoff_values = backoff_codebooks[n - 1].size();
+    pair<uint64_t*, size_t> arrays[] = {
+        {&entry.chars, sizeof(uint16_t) * level.size()},
+        {&entry.probs, sizeof(uint16_t) * level.size()},
+        {&entry.backoffs, top ? 0 : sizeof(uint16_t) * level.size()},
+        {&entry.children, top ? 0 : sizeof(uint32_t) * (level.size() + 1)},
+        {&entry.prob_values, sizeof(float) * entry.num_prob_values},
+        {&entry.backoff_values, sizeof(float) * entry.num_backoff_values}};
+    for (auto& array : arrays) {
+      if (array.second > 0) {
+        *array.first = size;
+        size += Align8(array.second);
+      }
+    }
+  }
+
+  image.assign(size, 0);
+  LMHeader* header = reinterpret_cast<LMHeader*>(image.data());
+  memcpy(header->magic, kLMMagic, sizeof(kLMMagic));
+  header->version = kLMVersion;
+  header->order = num_levels;
+  header->vocab_size = char_to_id.size();
+  header->vocab_offset = vocab_offset;
+  header->vocab_bytes = vocab.size();
+  header->image_size = size;
+  memcpy(image.data() + sizeof(LMHeader), entries.data(),
+         num_levels * sizeof(LMLevelEntry));
+  memcpy(image.data() + vocab_offset, vocab.data(), vocab.size());
+
+  for (unsigned n = 1; n <= num_levels; ++n) {
+    const vector<NGram>& level = (*ngrams)[n - 1];
+    const LMLevelEntry& entry = entries[n - 1];
+    char* data = image.data();
+    uint16_t* chars = reinterpret_cast<uint16_t*>(data + entry.chars);
+    uint16_t* probs = reinterpret_cast<uint16_t*>(data + entry.probs);
+    uint16_t* backoffs = reinterpret_cast<uint16_t*>(data + entry.backoffs);
+    uint32_t* children = reinterpret_cast<uint32_t*>(data + entry.children);
+    const vector<float>& prob_codebook = prob_codebooks[n - 1];
+    const vector<float>& backoff_codebook = backoff_codebooks[n - 1];
+    copy(prob_codebook.begin(), prob_codebook.end(),
+         reinterpret_cast<float*>(data + entry.prob_values));
+    copy(backoff_codebook.begin(), backoff_codebook.end(),
+         reinterpret_cast<float*>(data + entry.backoff_values));
+
+    unsigned child = 0;
+    for (unsigned i = 0; i < level.size(); ++i) {
+      const NGram& ngram = level[i];
+      chars[i] = ngram.first.back();
+      probs[i] = ngram.second.first == ngram.second.first ?
+          Code(prob_codebook, ngram.second.first) : kNoLMProb;
+      if (n < num_levels) {
+        backoffs[i] = Code(backoff_codebook, ngram.second.second);
+        // The (n+1)-grams extending this one follow the ones extending the
+        // previous n-grams.
+        const vector<NGram>& higher = (*ngrams)[n];
+        children[i] = child;
+        while (child < higher.size() &&
+               equal(ngram.first.begin(), ngram.first.end(),
+                     higher[child].first.begin())) {
+          child++;
+        }
+      }
+    }
+    if (n < num_levels) {
+      children[level.size()] = child;
+    }
+  }
+}
+
+bool LM::Attach(const char* data, const size_t& size) {
+  const LMHeader* header = reinterpret_cast<const LMHeader*>(data);
+  if (size < sizeof(LMHeader) ||
+      memcmp(header->magic, kLMMagic, sizeof(kLMMagic)) != 0 ||
+      header->version != kLMVersion) {
+    cerr << "Not a compiled LM of version " << kLMVersion << endl;
+    return false;
+  }
+  // An array of bytes at offset must lie in the image and be aligned.
+  auto fits = [&](const uint64_t& offset, const uint64_t& bytes) {
+    return offset % 8 == 0 && offset <= header->image_size &&
+           bytes <= header->image_size - offset;
+  };
+  if (header->image_size > size || header->order > kMaxLMOrder ||
+      !fits(sizeof(LMHeader), header->order * sizeof(LMLevelEntry)) ||
+      !fits(0, header->vocab_offset) ||
+      header->vocab_bytes > header->image_size - header->vocab_offset) {
+    cerr << "Compiled LM is truncated" << endl;
+    return false;
+  }
+
+  vector<string> vocab = split_line(string(data + header->vocab_offset,
+                                           header->vocab_bytes), '\n');
+  bool same_vocab = vocab.size() == header->vocab_size &&
+                    vocab.size() == char_to_id.size();
+  for (unsigned id = 0; same_vocab && id < vocab.size(); ++id) {
+    auto it = char_to_id.find(vocab[id]);
+    same_vocab = it != char_to_id.end() && it->second == id;
+  }
+  if (!same_vocab) {
+    cerr << "LM was compiled with a different vocabulary" << endl;
+    return false;
+  }
+
+  const LMLevelEntry* entries =
+      reinterpret_cast<const LMLevelEntry*>(data + sizeof(LMHeader));
+  levels.assign(header->order, LMLevel());
+  for (unsigned n = 1; n <= header->order; ++n) {
+    const LMLevelEntry& entry = entries[n - 1];
+    bool top = n == header->order;
+    uint64_t codes = sizeof(uint16_t) * entry.size;
+    if (entry.size >= numeric_limits<uint32_t>::max() ||
+        !fits(entry.chars, codes) || !fits(entry.probs, codes) ||
+        !fits(entry.prob_values, sizeof(float) * entry.num_prob_values) ||
+        (!top && (!fits(entry.backoffs, codes) ||
+                  !fits(entry.children, sizeof(uint32_t) * (entry.size + 1)) ||
+                  !fits(entry.backoff_values,
+                        sizeof(float) * entry.num_backoff_values)))) {
+      cerr << "Compiled LM is truncated" << endl;
+      return false;
+    }
+    LMLevel& level = levels[n - 1];
+    level.size = entry.size;
+    level.chars = reinterpret_cast<const uint16_t*>(data + entry.chars);
+    level.probs = reinterpret_cast<const uint16_t*>(data + entry.probs);
+    level.prob_values =
+        reinterpret_cast<const float*>(data + entry.prob_values);
+    if (!top) {
+      level.backoffs = reinterpret_cast<const uint16_t*>(data + entry.backoffs);
+      level.children =
+          reinterpret_cast<const uint32_t*>(data + entry.children);
+      level.backoff_values =
+          reinterpret_cast<const float*>(data + entry.backoff_values);
+    }
+  }
+  for (unsigned n = 1; n < header->order; ++n) {
+    if (levels[n - 1].children[levels[n - 1].size] > levels[n].size) {
+      cerr << "Compiled LM is corrupt" << endl;
+      return false;
+    }
+  }
+  order = header->order;
+  image_data = data;
+  image_size = header->image_size;
+  return true;
+}
+
+bool LM::Map(const string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "File opening failed" << endl;
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) < 0 || file_stat.st_size == 0) {
     cerr << "File opening failed" << endl;
-    exit(0);
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    cerr << "Memory mapping failed: " << filename << endl;
+    return false;
   }
+  // Every character scored touches a few scattered pages, so read-ahead
+  // would only evict other pages of the model.
+  madvise(data, file_stat.st_size, MADV_RANDOM);
+  mapped = data;
+  mapped_size = file_stat.st_size;
+  return Attach(static_cast<const char*>(data), mapped_size);
 }
 
-size_t LM::HashSeq(vector<unsigned>& seq) {
-  return boost::hash_range(seq.begin(), seq.end());
+bool LM::Write(const string& filename) const {
+  ofstream outfile(filename, ios::binary);
+  if (!outfile.is_open()) {
+    cerr << "File opening failed" << endl;
+    return false;
+  }
+  outfile.write(image_data, image_size);
+  outfile.close();
+  return bool(outfile);
 }
 
+
 void
 PrintSeq(vector<unsigned>& seq, unordered_map<unsigned, string>& id_to_char) {
   for (unsigned i = 0; i < seq.size(); ++i) {
@@ -45,40 +393,132 @@ PrintSeq(vector<unsigned>& seq, unordered_map<unsigned, string>& id_to_char) {
   cerr << endl;
 }
 
+// Finds ch among the chars [begin, end) of a level, or returns end.
+static unsigned FindChar(const LMLevel& level, const unsigned& begin,
+                         const unsigned& end, const unsigned& ch) {
+  const uint16_t* it = lower_bound(level.chars + begin, level.chars + end, ch);
+  return it != level.chars + end && *it == ch ? it - level.chars : end;
+}
+
+bool LM::FindContext(const unsigned* ids, const unsigned& len,
+                     unsigned* begin, unsigned* end, unsigned* index) const {
+  if (len >= order) {
+    return false;  // No n-gram extends it
+  }
+  *begin = 0;
+  *end = levels.empty() ? 0 : levels[0].size;
+  for (unsigned i = 0; i < len; ++i) {
+    const LMLevel& level = levels[i];
+    *index = FindChar(level, *begin, *end, ids[i]);
+    if (*index == *end) {
+      return false;
+    }
+    *begin = level.children[*index];
+    *end = level.children[*index + 1];
+  }
+  return true;
+}
+
 /* LogProbSeq(w1, w2, ..., wn) = LogProbSeq(w2, w3, ..., wn)
                                 + backoff(w1, w2, ..., wn-1);
    http://cmusphinx.sourceforge.net/wiki/sphinx4:standardgrammarformats
 
-   Assumes that unigrams are always present in lp[].
+   Unigrams missing from the model get the sum of the backoffs.
 */
-float LM::LogProb(vector<unsigned>& seq) {
-  size_t seq_hash = HashSeq(seq);
-  auto it_seq = lp.find(seq_hash);
-  if (it_seq == lp.end()) {
-    vector<unsigned> backoff_seq(seq.begin(), seq.end() - 1);
-    size_t backoff_hash = HashSeq(backoff_seq);
-    auto it_backoff = b.find(backoff_hash);
-
-    float backoff;
-    if (it_backoff == b.end()) {
-      backoff = 0.0;
-    } else {
-      backoff = it_backoff->second;
-    }
-
-    vector<unsigned> small(seq.begin() + 1, seq.end());
-    lp[seq_hash] = backoff + LogProb(small);
-    return lp[seq_hash];
-  } else {
-    return it_seq->second;  // Return the log prob 
+float LM::LogProb(const unsigned* ids, const unsigned& len) const {
+  float backoff = 0.;
+  for (unsigned start = 0; start < len; ++start) {
+    unsigned context_len = len - 1 - start;
+    unsigned begin, end, index;
+    if (!FindContext(ids + start, context_len, &begin, &end, &index)) {
+      continue;
+    }
+    const LMLevel& level = levels[context_len];
+    unsigned found = FindChar(level, begin, end, ids[len - 1]);
+    if (found != end && level.probs[found] != kNoLMProb) {
+      return backoff + level.prob_values[level.probs[found]];
+    }
+    if (context_len > 0) {
+      const LMLevel& context = levels[context_len - 1];
+      backoff += context.backoff_values[context.backoffs[index]];
+    }
   }
+  return backoff;
+}
+
+float LM::LogProb(vector<unsigned>& seq) {
+  return seq.empty() ? 0. : LogProb(seq.data(), seq.size());
 }
 
 float LM::LogProbSeq(vector<unsigned>& seq) {
   float score = 0.;
   for (unsigned i = 1; i <= seq.size(); ++i) {
-    vector<unsigned> temp(seq.begin(), seq.begin()+ i);
-    score += LogProb(temp);
+    score += LogProb(seq.data(), i);
   }
   return score;
 }
+
+void LM::Extend(const LMState& state, const unsigned& ch,
+                LMState* next) const {
+  unsigned context_len = order > 0 ? order - 1 : 0;
+  if (context_len == 0) {
+    next->len = 0;
+    return;
+  }
+  unsigned keep = min(state.len, context_len - 1);
+  // next may be state itself, so move the kept characters forward first.
+  for (unsigned i = 0; i < keep; ++i) {
+    next->ids[i] = state.ids[state.len - keep + i];
+  }
+  next->ids[keep] = ch;
+  next->len = keep + 1;
+}
+
+float LM::Score(const LMState& state, const unsigned& ch,
+                LMState* next) const {
+  unsigned ids[kMaxLMOrder];
+  copy(state.ids, state.ids + state.len, ids);
+  ids[state.len] = ch;
+  float score = LogProb(ids, state.len + 1);
+  if (next != NULL) {
+    Extend(state, ch, next);
+  }
+  return score;
+}
+
+// Every context of the state, from the longest, gives its continuations
+// which no longer context had, with the backoffs of the longer contexts.
+void LM::ScoreAll(const LMState& state, float* out) const {
+  if (cache != NULL && cache->Find(state, out)) {
+    return;
+  }
+  const float unset = numeric_limits<float>::infinity();
+  fill(out, out + vocab_size(), unset);
+  float backoff = 0.;
+  for (unsigned start = 0; start <= state.len; ++start) {
+    unsigned context_len = state.len - start;
+    unsigned begin, end, index;
+    if (!FindContext(state.ids + start, context_len, &begin, &end, &index)) {
+      continue;
+    }
+    const LMLevel& level = levels[context_len];
+    for (unsigned i = begin; i < end; ++i) {
+      if (level.probs[i] != kNoLMProb && level.chars[i] < vocab_size() &&
+          out[level.chars[i]] == unset) {
+        out[level.chars[i]] = backoff + level.prob_values[level.probs[i]];
+      }
+    }
+    if (context_len > 0) {
+      const LMLevel& context = levels[context_len - 1];
+      backoff += context.backoff_values[context.backoffs[index]];
+    }
+  }
+  for (unsigned ch = 0; ch < vocab_size(); ++ch) {
+    if (out[ch] == unset) {
+      out[ch] = backoff;
+    }
+  }
+  if (cache != NULL) {
+    cache->Insert(state, out);
+  }
+}
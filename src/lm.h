@@ -3,26 +3,157 @@
 
 #include "utils.h"
 
-#include <boost/functional/hash.hpp>
+#include <cstddef>
+#include <cstdint>
 #include <unordered_map>
 
 using namespace std;
 
+const unsigned kMaxLMOrder = 16;
+
+class LMCache;
+
+// The context of the next character: the last (order - 1) characters scored
+// so far, which are all that an n-gram model conditions on.
+struct LMState {
+  unsigned len = 0;
+  unsigned ids[kMaxLMOrder - 1];
+
+  bool operator==(const LMState& other) const {
+    for (unsigned i = 0; i < len && i < other.len; ++i) {
+      if (ids[i] != other.ids[i]) {
+        return false;
+      }
+    }
+    return len == other.len;
+  }
+};
+
+// The n-grams of one order of the trie, sorted by their context and then by
+// their last character, so that the continuations of a context are
+// contiguous. The children of n-gram i are the (n+1)-grams
+// [children[i], children[i + 1]) of the next order. The log probabilities
+// and backoffs are stored as 16-bit codes into per-order codebooks, which
+// are exact when an order has fewer distinct values than codes.
+struct LMLevel {
+  unsigned size = 0;
+  const uint16_t* chars = NULL;
+  const uint16_t* probs = NULL;  // kNoLMProb for n-grams only seen as contexts
+  const uint16_t* backoffs = NULL;  // NULL at the highest order
+  const uint32_t* children = NULL;  // NULL at the highest order
+  const float* prob_values = NULL;
+  const float* backoff_values = NULL;
+};
+
+const uint16_t kNoLMProb = 0xffff;
+
+// A compiled LM (lm-compile) is the image of an LM written to a file. It
+// starts with this header, followed by:
+//   LMLevelEntry levels[order]
+//   the characters of the vocabulary in id order, each followed by '\n'
+//   the arrays of every level, each aligned to 8 bytes
+// The offsets are from the start of the image; the arrays missing at the
+// highest order have offset 0.
+struct LMHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t order;
+  uint32_t vocab_size;
+  uint32_t reserved;
+  uint64_t vocab_offset;
+  uint64_t vocab_bytes;
+  uint64_t image_size;
+};
+
+struct LMLevelEntry {
+  uint64_t size;
+  uint64_t num_prob_values;
+  uint64_t num_backoff_values;
+  uint64_t chars, probs, backoffs, children, prob_values, backoff_values;
+};
+
+const char kLMMagic[8] = {'C', 'H', 'A', 'R', 'L', 'M', '\0', '\0'};
+const uint32_t kLMVersion = 1;
+
 class LM {
  public:
   unordered_map<string, unsigned> char_to_id;
   unordered_map<unsigned, string> id_to_char;
+  unsigned order = 0;  // Longest n-gram of the model
 
+  // Reads a text model, or memory-maps a model compiled by lm-compile so
+  // that the processes using it share one copy through the page cache. The
+  // vocabulary must be the one the model was compiled with.
   LM (string& lm_model_file, unordered_map<string, unsigned>& char_id,
       unordered_map<unsigned, string>& id_char);
+  ~LM();
   float LogProbSeq(vector<unsigned>& seq);
   float LogProb(vector<unsigned>& seq);
-  size_t HashSeq(vector<unsigned>& seq);
+
+  unsigned vocab_size() const { return char_to_id.size(); }
+
+  // The state before the first character.
+  LMState Start() const { return LMState(); }
+
+  // Appends ch to the context of state, dropping its first character if it
+  // is already order - 1 characters long.
+  void Extend(const LMState& state, const unsigned& ch, LMState* next) const;
+
+  // Returns the log probability of ch after the context of state, backing
+  // off to shorter contexts, and writes the state after ch to next, if
+  // given. Does not allocate.
+  float Score(const LMState& state, const unsigned& ch,
+              LMState* next = NULL) const;
+
+  // Writes Score(state, ch) of every character ch to out[0 .. vocab_size()).
+  // Each context is looked up once and its continuations are read with one
+  // scan, unless the distribution is in the cache.
+  void ScoreAll(const LMState& state, float* out) const;
+
+  // Keeps the distributions of ScoreAll in cache, which must hold
+  // vocab_size() scores per context and may be shared by the threads using
+  // this LM. NULL computes every distribution.
+  void SetCache(LMCache* cache) { this->cache = cache; }
+
+  // Writes the image of the model to a file for lm-compile.
+  bool Write(const string& filename) const;
 
  private:
-  unordered_map<size_t, float> lp, b;
+  LM(const LM&);
+  LM& operator=(const LM&);
+
+  // The log probability of the last character of ids[0 .. len) given the
+  // others, backing off until an n-gram is found.
+  float LogProb(const unsigned* ids, const unsigned& len) const;
+
+  // Finds the n-gram ids[0 .. len) in the trie. The empty context is the
+  // root, whose children are the unigrams. Returns false if it is missing.
+  bool FindContext(const unsigned* ids, const unsigned& len,
+                   unsigned* begin, unsigned* end, unsigned* index) const;
+
+  // Packs the n-grams of a text model into image.
+  void Build(vector<vector<pair<vector<unsigned>, pair<float, float> > > >*
+                 ngrams);
+
+  // Points the levels at an image. Returns false if it is not a valid
+  // image or was compiled with another vocabulary.
+  bool Attach(const char* data, const size_t& size);
+
+  // Memory-maps a compiled model and attaches to it.
+  bool Map(const string& filename);
+
+  vector<LMLevel> levels;  // levels[n - 1] holds the n-grams
+  vector<char> image;  // The image of a text model
+  const char* image_data = NULL;  // The attached image
+  size_t image_size = 0;
+  void* mapped = NULL;
+  size_t mapped_size = 0;
+  LMCache* cache = NULL;  // Not owned
 };
 
+// Returns true if the file starts with the magic of a compiled LM.
+bool IsCompiledLM(const string& filename);
+
 void
 PrintSeq(vector<unsigned>& seq, unordered_map<unsigned, string>& id_to_char);
 
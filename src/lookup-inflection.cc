@@ -0,0 +1,117 @@
+/*
+Answers inflection requests from a table written by build-inflection-table.
+Every line of the standard input is a request "lemma|tag", or a line of the
+data "lemma|form|tag", optionally preceded by a count as uniq -c writes it,
+and is answered with "lemma|form|tag" on the standard output. Lemmas
+missing from the table are decoded with the SepMorph binary models, if
+given, on --threads=N threads, and printed with an empty form otherwise.
+The models of the other architectures need cnn and are refused, so their
+tables have to hold every lemma that is requested. The table is
+memory-mapped, so all the processes serving it share it through the page
+cache.
+*/
+#include "utils.h"
+#include "corpus.h"
+#include "inflection-table.h"
+#include "sep-morph-infer.h"
+
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+
+using namespace std;
+
+int main(int argc, char** argv) {
+  unsigned num_threads = atoi(GetOption("threads", "1", &argc, argv).c_str());
+  if (argc < 4) {
+    cerr << "Usage: " << argv[0] << " [--threads=N]"
+         << " char_vocab.txt morph_vocab.txt table.bin [model1.bin ...]"
+         << " < requests.txt" << endl;
+    return 0;
+  }
+  string vocab_filename = argv[1];  // vocabulary of words/characters
+  string morph_filename = argv[2];
+  string table_filename = argv[3];
+
+  unordered_map<string, unsigned> char_to_id, morph_to_id;
+  unordered_map<unsigned, string> id_to_char, id_to_morph;
+
+  ReadVocab(vocab_filename, &char_to_id, &id_to_char);
+  ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
+
+  InflectionTable table;
+  if (!table.Map(table_filename, char_to_id.size(), morph_to_id.size())) {
+    return 0;
+  }
+  cerr << "Mapped the forms of " << table.size() << " lemmas from "
+       << table_filename << endl;
+
+  vector<SepMorphInfer> ensmb_nn(argc - 4);
+  vector<SepMorphInfer*> object_pointers;
+  for (unsigned i = 0; i < argc - 4; ++i) {
+    string f = argv[i + 4];
+    // Only SepMorph has a decoder without cnn; the lemmas of the tables of
+    // the other architectures cannot be decoded here.
+    if (!IsBinaryModel(f, kSepMorph)) {
+      cerr << f << " is not a binary sep-morph model. Only those can decode "
+           << "the lemmas missing from the table; with the other "
+           << "architectures, build the table with all the lemmas" << endl;
+      return 0;
+    }
+    if (!Read(f, &ensmb_nn[i])) {
+      return 0;
+    }
+    object_pointers.push_back(&ensmb_nn[i]);
+  }
+  WorkerPool workers(max(num_threads, 1u));
+
+  double found = 0, decoded = 0, missing = 0, lookup_seconds = 0;
+  string line, lemma, tag;
+  vector<unsigned> input_ids, output_ids;
+  while (getline(cin, line)) {
+    if (!SplitRequest(line, &lemma, &tag)) {
+      continue;
+    }
+    auto morph_it = morph_to_id.find(tag);
+    input_ids.clear();
+    for (const string& ch : split_line(lemma, ' ')) {
+      auto it = char_to_id.find(ch);
+      input_ids.push_back(it == char_to_id.end() ? 0 : it->second);
+    }
+
+    output_ids.clear();
+    bool answered = false;
+    if (morph_it != morph_to_id.end()) {
+      auto start = chrono::steady_clock::now();
+      answered = table.Lookup(morph_it->second, input_ids, &output_ids);
+      lookup_seconds += chrono::duration<double>(
+          chrono::steady_clock::now() - start).count();
+      if (answered) {
+        found += 1;
+      } else if (!object_pointers.empty()) {
+        EnsembleDecode(morph_it->second, char_to_id, input_ids, &output_ids,
+                       &object_pointers, &workers);
+        answered = true;
+        decoded += 1;
+      }
+    }
+    if (!answered) {
+      missing += 1;
+    }
+
+    string form = "";
+    for (unsigned i = 0; i < output_ids.size(); ++i) {
+      form += (i > 0 ? " " : "") + id_to_char[output_ids[i]];
+    }
+    cout << lemma << "|" << form << "|" << tag << endl;
+  }
+  double total = found + decoded + missing;
+  cerr << "Answered " << found << " requests from the table, decoded "
+       << decoded << ", could not answer " << missing << endl;
+  if (total > 0) {
+    cerr << "Table lookups took " << 1e9 * lookup_seconds / total
+         << " ns on average" << endl;
+  }
+  return 1;
+}
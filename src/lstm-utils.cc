@@ -0,0 +1,104 @@
+#include "lstm-utils.h"
+
+using namespace std;
+using namespace cnn;
+using namespace cnn::expr;
+
+// The parameters of every layer of a cnn LSTMBuilder, in the order in which
+// the builder adds them to its model.
+enum { X2I, H2I, C2I, BI, X2O, H2O, C2O, BO, X2C, H2C, BC };
+
+// Returns the num_cols columns of the matrix w from first_col on. The matrix
+// is stored column by column, so they are a range of it seen as a vector.
+static Expression Columns(const Expression& w, const Dim& dim,
+                          const unsigned& first_col,
+                          const unsigned& num_cols) {
+  unsigned rows = dim.rows();
+  Expression flat = reshape(w, Dim({(long) (rows * dim.cols())}));
+  return reshape(pickrange(flat, first_col * rows,
+                           (first_col + num_cols) * rows),
+                 Dim({(long) rows, (long) num_cols}));
+}
+
+FixedInputLSTM::FixedInputLSTM(const LSTMBuilder& builder,
+                               const unsigned& fixed_len) {
+  vars = builder.param_vars;
+  const Dim& dim = builder.params[0][X2I]->dim;
+  unsigned rest_len = dim.cols() - fixed_len;
+  for (unsigned gate : {X2I, X2C, X2O}) {
+    fixed_weights.push_back(Columns(vars[0][gate], dim, 0, fixed_len));
+    rest_weights.push_back(Columns(vars[0][gate], dim, fixed_len, rest_len));
+  }
+}
+
+vector<Expression> FixedInputLSTM::InputBias(const Expression& fixed) const {
+  return {affine_transform({vars[0][BI], fixed_weights[0], fixed}),
+          affine_transform({vars[0][BC], fixed_weights[1], fixed}),
+          affine_transform({vars[0][BO], fixed_weights[2], fixed})};
+}
+
+Expression FixedInputLSTM::AddInput(const vector<Expression>& input_bias,
+                                    const LSTMState& prev,
+                                    const Expression& x,
+                                    LSTMState* next) const {
+  bool has_prev_state = !prev.h.empty();
+  LSTMState state;
+  Expression in = x;
+  for (unsigned i = 0; i < vars.size(); ++i) {
+    const vector<Expression>& v = vars[i];
+    vector<Expression> input_gate, cell_gate, output_gate;
+    if (i == 0) {
+      input_gate = {input_bias[0], rest_weights[0], in};
+      cell_gate = {input_bias[1], rest_weights[1], in};
+      output_gate = {input_bias[2], rest_weights[2], in};
+    } else {
+      input_gate = {v[BI], v[X2I], in};
+      cell_gate = {v[BC], v[X2C], in};
+      output_gate = {v[BO], v[X2O], in};
+    }
+
+    if (has_prev_state) {
+      input_gate.insert(input_gate.end(),
+                        {v[H2I], prev.h[i], v[C2I], prev.c[i]});
+      cell_gate.insert(cell_gate.end(), {v[H2C], prev.h[i]});
+      output_gate.insert(output_gate.end(), {v[H2O], prev.h[i]});
+    }
+    Expression i_it = logistic(affine_transform(input_gate));
+    Expression i_wt = tanh(affine_transform(cell_gate));
+    // The input gate also decides what is forgotten from the cell.
+    Expression ct = cwise_multiply(i_it, i_wt);
+    if (has_prev_state) {
+      ct = cwise_multiply(1.f - i_it, prev.c[i]) + ct;
+    }
+    output_gate.insert(output_gate.end(), {v[C2O], ct});
+    Expression i_ot = logistic(affine_transform(output_gate));
+    in = cwise_multiply(i_ot, tanh(ct));
+    state.c.push_back(ct);
+    state.h.push_back(in);
+  }
+  *next = state;
+  return in;
+}
+
+Expression SelectBatchElems(const Expression& x, const unsigned& dim,
+                            const unsigned& batch_size,
+                            const vector<unsigned>& elems) {
+  // The elements of a batch are stored one after the other, so they are
+  // ranges of the batch seen as a single vector.
+  Expression flat = reshape(x, Dim({(long) (dim * batch_size)}));
+  vector<Expression> kept;
+  for (const unsigned& elem : elems) {
+    kept.push_back(pickrange(flat, elem * dim, (elem + 1) * dim));
+  }
+  return reshape(concatenate(kept), Dim({(long) dim}, elems.size()));
+}
+
+void KeepBatchElems(const unsigned& hidden_len, const unsigned& batch_size,
+                    const vector<unsigned>& elems, LSTMState* state) {
+  for (Expression& c : state->c) {
+    c = SelectBatchElems(c, hidden_len, batch_size, elems);
+  }
+  for (Expression& h : state->h) {
+    h = SelectBatchElems(h, hidden_len, batch_size, elems);
+  }
+}
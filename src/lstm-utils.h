@@ -0,0 +1,61 @@
+#ifndef LSTM_UTILS_H_
+#define LSTM_UTILS_H_
+
+#include "cnn/cnn.h"
+#include "cnn/lstm.h"
+#include "cnn/expr.h"
+
+#include <vector>
+
+using namespace std;
+using namespace cnn;
+using namespace cnn::expr;
+
+// The cells and hidden states of every layer of an LSTM after a step. A
+// state without layers starts a new sequence.
+struct LSTMState {
+  vector<Expression> c, h;
+};
+
+// Runs the steps of an LSTMBuilder whose inputs all start with the same
+// fixed_len values, like the encoded word that starts every input of the
+// decoders. The product of these values with the first layer's input weights
+// is added to the biases of the gates once per word by InputBias(), so that
+// a step only multiplies the rest of its input. The steps give the outputs
+// of LSTMBuilder::add_input() with the whole input.
+class FixedInputLSTM {
+ public:
+  FixedInputLSTM() {}
+
+  // Takes the parameters that new_graph() added to the graph.
+  FixedInputLSTM(const LSTMBuilder& builder, const unsigned& fixed_len);
+
+  // Returns the biases of the first layer's gates for the fixed values, a
+  // vector or a batch of vectors.
+  vector<Expression> InputBias(const Expression& fixed) const;
+
+  // Runs a step from prev on the rest of the input, x, with the biases of
+  // InputBias(). Sets next and returns the hidden state of the last layer.
+  Expression AddInput(const vector<Expression>& input_bias,
+                      const LSTMState& prev, const Expression& x,
+                      LSTMState* next) const;
+
+ private:
+  vector<vector<Expression> > vars;  // The parameters of every layer
+  // The first layer's input weights of the input, cell and output gates,
+  // split into the columns of the fixed values and the rest.
+  vector<Expression> fixed_weights, rest_weights;
+};
+
+// Returns the elements elems of x, a batch of batch_size vectors of dim
+// values, as a batch of elems.size() vectors.
+Expression SelectBatchElems(const Expression& x, const unsigned& dim,
+                            const unsigned& batch_size,
+                            const vector<unsigned>& elems);
+
+// Keeps the states of the sequences elems only of a state of batch_size
+// sequences.
+void KeepBatchElems(const unsigned& hidden_len, const unsigned& batch_size,
+                    const vector<unsigned>& elems, LSTMState* state);
+
+#endif
@@ -0,0 +1,369 @@
+#include "model-io.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+static uint64_t AlignUp(const uint64_t& offset) {
+  return (offset + kParamAlignment - 1) / kParamAlignment * kParamAlignment;
+}
+
+// FNV-1a over 64-bit words. Every block of the file is padded to a multiple
+// of 8 bytes, so there is no tail to take care of.
+static uint64_t Checksum(const char* data, const size_t& size) {
+  uint64_t hash = 14695981039346656037ULL;
+  const uint64_t* words = reinterpret_cast<const uint64_t*>(data);
+  for (size_t i = 0; i < size / sizeof(uint64_t); ++i) {
+    hash = (hash ^ words[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// The checksum of the block of a parameter, its values padded with zeros to
+// a multiple of kParamAlignment bytes, folded to 32 bits.
+static uint32_t ParamChecksum(const char* block, const ParamEntry& param) {
+  uint64_t hash = Checksum(block, AlignUp(ParamBytes(param)));
+  return hash ^ (hash >> 32);
+}
+
+ModelHeader MakeModelHeader(const ModelArch& arch, const unsigned& char_len,
+                            const unsigned& hidden_len,
+                            const unsigned& vocab_len, const unsigned& layers,
+                            const unsigned& morph_len, const unsigned& max_eps,
+                            const unsigned& max_lm_pos_weights) {
+  ModelHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kModelMagic, sizeof(kModelMagic));
+  header.version = kModelVersion;
+  header.arch = arch;
+  header.char_len = char_len;
+  header.hidden_len = hidden_len;
+  header.vocab_len = vocab_len;
+  header.layers = layers;
+  header.morph_len = morph_len;
+  header.max_eps = max_eps;
+  header.max_lm_pos_weights = max_lm_pos_weights;
+  return header;
+}
+
+uint64_t ParamBytes(const ParamEntry& param) {
+  if (param.kind == kQuantizedParameters) {
+    uint64_t bytes = sizeof(float) * param.rows + param.rows * param.cols;
+    return (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t) *
+           sizeof(uint64_t);
+  }
+  return sizeof(float) * param.rows * param.cols;
+}
+
+bool WriteBinaryModel(const string& filename, const ModelHeader& model_header,
+                      const vector<ModelEntry>& models,
+                      vector<ParamEntry> params,
+                      const vector<const char*>& data) {
+  ModelHeader header = model_header;
+  header.num_models = models.size();
+  header.num_params = params.size();
+  header.flags |= kParamChecksums;
+
+  uint64_t offset = sizeof(ModelHeader) + sizeof(ModelEntry) * models.size() +
+                    sizeof(ParamEntry) * params.size();
+  for (ParamEntry& param : params) {
+    param.offset = AlignUp(offset);
+    offset = param.offset + ParamBytes(param);
+  }
+
+  vector<char> image(AlignUp(offset), 0);
+  char* out = image.data();
+  for (unsigned i = 0; i < params.size(); ++i) {
+    memcpy(out + params[i].offset, data[i], ParamBytes(params[i]));
+    params[i].checksum = ParamChecksum(out + params[i].offset, params[i]);
+  }
+  memcpy(out + sizeof(ModelHeader), models.data(),
+         sizeof(ModelEntry) * models.size());
+  memcpy(out + sizeof(ModelHeader) + sizeof(ModelEntry) * models.size(),
+         params.data(), sizeof(ParamEntry) * params.size());
+  header.checksum = Checksum(out + sizeof(ModelHeader),
+                             image.size() - sizeof(ModelHeader));
+  memcpy(out, &header, sizeof(ModelHeader));
+
+  // Write to a temporary file first, so that processes mapping the old
+  // model never see a partially written one.
+  string tmp_filename = filename + ".tmp";
+  ofstream outfile(tmp_filename, ios::binary);
+  if (!outfile.is_open()) {
+    cerr << "File opening failed: " << tmp_filename << endl;
+    return false;
+  }
+  outfile.write(image.data(), image.size());
+  outfile.close();
+  if (!outfile || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    cerr << "Writing model failed: " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+bool WriteBinaryModel(const string& filename, const ModelHeader& header,
+                      const vector<Model*>& cnn_models) {
+  vector<ModelEntry> models;
+  vector<ParamEntry> params;
+  vector<const char*> data;
+  // Lookup parameters are not contiguous in cnn, so they are gathered here.
+  vector<vector<float> > lookup_values;
+  for (const Model* cnn_model : cnn_models) {
+    ModelEntry model_entry;
+    model_entry.first_param = params.size();
+    model_entry.num_params = cnn_model->all_parameters_list().size();
+    models.push_back(model_entry);
+    for (const ParametersBase* p : cnn_model->all_parameters_list()) {
+      ParamEntry param;
+      memset(&param, 0, sizeof(param));
+      const Parameters* dense = dynamic_cast<const Parameters*>(p);
+      const LookupParameters* lookup =
+          dynamic_cast<const LookupParameters*>(p);
+      if (dense != NULL) {
+        param.kind = kParameters;
+        param.rows = dense->dim.rows();
+        param.cols = dense->dim.size() / dense->dim.rows();
+        data.push_back(reinterpret_cast<const char*>(dense->values.v));
+      } else if (lookup != NULL) {
+        param.kind = kLookupParameters;
+        param.rows = lookup->dim.size();
+        param.cols = lookup->values.size();
+        vector<float> values(param.rows * param.cols);
+        for (unsigned j = 0; j < param.cols; ++j) {
+          memcpy(values.data() + j * param.rows, lookup->values[j].v,
+                 sizeof(float) * param.rows);
+        }
+        lookup_values.push_back(values);
+        data.push_back(NULL);
+      } else {
+        cerr << "Unknown parameter type" << endl;
+        return false;
+      }
+      params.push_back(param);
+    }
+  }
+  for (unsigned i = 0, j = 0; i < params.size(); ++i) {
+    if (params[i].kind == kLookupParameters) {
+      data[i] = reinterpret_cast<const char*>(lookup_values[j++].data());
+    }
+  }
+  return WriteBinaryModel(filename, header, models, params, data);
+}
+
+bool IsBinaryModel(const string& filename) {
+  char magic[sizeof(kModelMagic)] = {0};
+  ifstream infile(filename, ios::binary);
+  infile.read(magic, sizeof(magic));
+  return infile && memcmp(magic, kModelMagic, sizeof(kModelMagic)) == 0;
+}
+
+bool IsBinaryModel(const string& filename, const ModelArch& arch) {
+  ModelHeader header;
+  ifstream infile(filename, ios::binary);
+  infile.read((char*) &header, sizeof(header));
+  return infile &&
+         memcmp(header.magic, kModelMagic, sizeof(kModelMagic)) == 0 &&
+         header.arch == (uint32_t) arch;
+}
+
+MappedModel::MappedModel() : header(NULL), models(NULL), params(NULL),
+                             data(NULL), size(0) {}
+
+MappedModel::~MappedModel() {
+  if (data != NULL) {
+    munmap(const_cast<char*>(data), size);
+  }
+}
+
+bool MappedModel::Open(const string& filename, const ModelArch& arch,
+                       const bool& verify_checksum) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "File opening failed: " << filename << endl;
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) < 0 ||
+      file_stat.st_size < (off_t) sizeof(ModelHeader)) {
+    cerr << "Model file is truncated: " << filename << endl;
+    close(fd);
+    return false;
+  }
+  void* mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    cerr << "Memory mapping failed: " << filename << endl;
+    return false;
+  }
+  data = static_cast<const char*>(mapping);
+  size = file_stat.st_size;
+
+  header = reinterpret_cast<const ModelHeader*>(data);
+  if (memcmp(header->magic, kModelMagic, sizeof(kModelMagic)) != 0 ||
+      header->version != kModelVersion) {
+    cerr << "Not a binary model of version " << kModelVersion << ": "
+         << filename << endl;
+    return false;
+  }
+  if (header->arch != (uint32_t) arch) {
+    cerr << "Model has architecture " << header->arch << " instead of "
+         << arch << ": " << filename << endl;
+    return false;
+  }
+  size_t tables_size = sizeof(ModelHeader) +
+                       sizeof(ModelEntry) * header->num_models +
+                       sizeof(ParamEntry) * header->num_params;
+  if (size < tables_size) {
+    cerr << "Model file is truncated: " << filename << endl;
+    return false;
+  }
+  models = reinterpret_cast<const ModelEntry*>(data + sizeof(ModelHeader));
+  params = reinterpret_cast<const ParamEntry*>(models + header->num_models);
+  for (unsigned i = 0; i < header->num_models; ++i) {
+    if (models[i].first_param > header->num_params ||
+        models[i].num_params > header->num_params - models[i].first_param) {
+      cerr << "Model " << i << " has parameters out of range: " << filename
+           << endl;
+      return false;
+    }
+  }
+  for (unsigned i = 0; i < header->num_params; ++i) {
+    if (params[i].offset + ::ParamBytes(params[i]) > size) {
+      cerr << "Model file is truncated: " << filename << endl;
+      return false;
+    }
+  }
+  verified.assign(header->num_models, false);
+  if (verify_checksum && !VerifyChecksum()) {
+    cerr << "Checksum mismatch: " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+bool MappedModel::VerifyChecksum() const {
+  return Checksum(data + sizeof(ModelHeader), size - sizeof(ModelHeader)) ==
+         header->checksum;
+}
+
+bool MappedModel::VerifyParams(const unsigned& model_id) const {
+  for (unsigned i = 0; i < models[model_id].num_params; ++i) {
+    const ParamEntry& param = Param(model_id, i);
+    if (param.offset + AlignUp(::ParamBytes(param)) > size ||
+        ParamChecksum(Data(param), param) != param.checksum) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MappedModel::LoadParams(const unsigned& model_id,
+                             const bool& share_weights,
+                             Model* cnn_model) const {
+  const vector<ParametersBase*>& cnn_params = cnn_model->all_parameters_list();
+  if (header->flags & kQuantizedModel) {
+    cerr << "Quantized models can only be run by the inference engine" << endl;
+    return false;
+  }
+  if (model_id >= header->num_models ||
+      models[model_id].num_params != cnn_params.size()) {
+    cerr << "Model " << model_id << " does not match the architecture" << endl;
+    return false;
+  }
+  if ((header->flags & kParamChecksums) && !verified[model_id]) {
+    if (!VerifyParams(model_id)) {
+      cerr << "Checksum mismatch in model " << model_id << endl;
+      return false;
+    }
+    verified[model_id] = true;
+  }
+#if HAVE_CUDA
+  const bool share = false;  // Parameters live in device memory
+#else
+  const bool share = share_weights;
+#endif
+  for (unsigned i = 0; i < cnn_params.size(); ++i) {
+    const ParamEntry& param = Param(model_id, i);
+    float* values = const_cast<float*>(Values(param));
+    Parameters* dense = dynamic_cast<Parameters*>(cnn_params[i]);
+    LookupParameters* lookup = dynamic_cast<LookupParameters*>(cnn_params[i]);
+    if (dense != NULL && param.kind == kParameters &&
+        dense->dim.size() == param.rows * param.cols) {
+      if (share) {
+        dense->values.v = values;
+      } else {
+        memcpy(dense->values.v, values, sizeof(float) * dense->dim.size());
+      }
+    } else if (lookup != NULL && param.kind == kLookupParameters &&
+               lookup->dim.size() == param.rows &&
+               lookup->values.size() == param.cols) {
+      for (unsigned j = 0; j < param.cols; ++j) {
+        if (share) {
+          lookup->values[j].v = values + j * param.rows;
+        } else {
+          memcpy(lookup->values[j].v, values + j * param.rows,
+                 sizeof(float) * param.rows);
+        }
+      }
+    } else {
+      cerr << "Parameter " << i << " of model " << model_id
+           << " does not match the architecture" << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MappedModel::CheckTagModels(const unsigned& num_shared) const {
+  if (header->morph_len == 0) {
+    cerr << "Model has no morph tags" << endl;
+    return false;
+  }
+  if (header->num_models != header->morph_len + num_shared) {
+    cerr << "Model has " << header->num_models << " cnn models instead of "
+         << header->morph_len + num_shared << endl;
+    return false;
+  }
+  for (unsigned i = 1; i < header->morph_len; ++i) {
+    bool same = models[i].num_params == models[0].num_params;
+    for (unsigned j = 0; same && j < models[0].num_params; ++j) {
+      const ParamEntry& param = Param(i, j);
+      const ParamEntry& first = Param(0, j);
+      same = param.kind == first.kind && param.rows == first.rows &&
+             param.cols == first.cols;
+    }
+    if (!same) {
+      cerr << "Model " << i << " does not match the architecture" << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+MappedModel* OpenBinaryModel(const string& filename, const ModelArch& arch,
+                             const unsigned& num_shared_models) {
+  MappedModel* mapped = new MappedModel();
+  if (!mapped->Open(filename, arch, false) ||
+      !mapped->CheckTagModels(num_shared_models)) {
+    delete mapped;
+    return NULL;
+  }
+  if (!(mapped->header->flags & kParamChecksums) &&
+      !mapped->VerifyChecksum()) {
+    cerr << "Checksum mismatch: " << filename << endl;
+    delete mapped;
+    return NULL;
+  }
+  if (mapped->header->flags & kQuantizedModel) {
+    cerr << "Quantized models can only be run by the inference engine: "
+         << filename << endl;
+    delete mapped;
+    return NULL;
+  }
+  return mapped;
+}
@@ -0,0 +1,173 @@
+#ifndef MODEL_IO_H_
+#define MODEL_IO_H_
+
+#include "cnn/cnn.h"
+
+#include "utils.h"
+
+#include <cstdint>
+
+using namespace std;
+using namespace cnn;
+
+enum ModelArch {
+  kSepMorph = 1,
+  kLMSepMorph = 2,
+  kNoEnc = 3,
+  kEncDec = 4,
+  kEncDecAttn = 5,
+  kJointEncMorph = 6,
+  kJointEncDecMorph = 7,
+  kLMJointEnc = 8
+};
+
+// A binary model file is laid out as:
+//   ModelHeader
+//   ModelEntry[num_models]   the parameters of every cnn Model
+//   ParamEntry[num_params]   in the order of Model::all_parameters_list()
+//   the float values of every parameter, each block starting at a multiple
+//   of kParamAlignment bytes
+// Parameters are stored column-major as in cnn. A lookup parameter is stored
+// as a (dim x entries) matrix, i.e. one column per entry. A quantized
+// parameter stores one float scale per row followed by the int8 values,
+// column-major, of a matrix whose row r is scale[r] * values. The checksum
+// of the header covers everything after it. With kParamChecksums, every
+// ParamEntry also has the checksum of its own values, so that the values of a
+// cnn model can be checked when it is first loaded instead of reading the
+// whole file up front.
+struct ModelHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t arch;
+  uint32_t char_len, hidden_len, vocab_len, layers, morph_len, max_eps;
+  uint32_t max_lm_pos_weights;  // 0 for the models without an LM
+  uint32_t num_models;
+  uint32_t num_params;
+  uint32_t flags;
+  uint64_t checksum;
+};
+
+const uint32_t kQuantizedModel = 1;  // Some parameters are quantized
+const uint32_t kParamChecksums = 2;  // Every ParamEntry has a checksum
+
+struct ModelEntry {
+  uint32_t first_param;
+  uint32_t num_params;
+};
+
+enum ParamKind {
+  kParameters = 0,
+  kLookupParameters = 1,
+  kQuantizedParameters = 2
+};
+
+struct ParamEntry {
+  uint64_t offset;  // From the start of the file
+  uint32_t kind;
+  uint32_t rows, cols;
+  uint32_t checksum;  // Of the values, with kParamChecksums
+};
+
+const char kModelMagic[8] = {'I', 'N', 'F', 'L', 'M', 'D', 'L', '\0'};
+const uint32_t kModelVersion = 1;
+const unsigned kParamAlignment = 64;  // A cache line and an AVX-512 register
+
+// Returns the number of bytes of the values of a parameter in the file.
+uint64_t ParamBytes(const ParamEntry& param);
+
+ModelHeader MakeModelHeader(const ModelArch& arch, const unsigned& char_len,
+                            const unsigned& hidden_len,
+                            const unsigned& vocab_len, const unsigned& layers,
+                            const unsigned& morph_len, const unsigned& max_eps,
+                            const unsigned& max_lm_pos_weights);
+
+// Writes the header and the parameters of all the cnn models.
+bool WriteBinaryModel(const string& filename, const ModelHeader& header,
+                      const vector<Model*>& cnn_models);
+
+// Writes a model given the parameter table directly. data[i] holds the
+// ParamBytes(params[i]) bytes of the i-th parameter; the offsets of the
+// entries are filled in.
+bool WriteBinaryModel(const string& filename, const ModelHeader& header,
+                      const vector<ModelEntry>& models,
+                      vector<ParamEntry> params,
+                      const vector<const char*>& data);
+
+// Returns true if the file starts with the magic of a binary model.
+bool IsBinaryModel(const string& filename);
+
+// Returns true if the file is a binary model of the architecture.
+bool IsBinaryModel(const string& filename, const ModelArch& arch);
+
+// A read-only memory mapping of a binary model file.
+class MappedModel {
+ public:
+  const ModelHeader* header;
+  const ModelEntry* models;
+  const ParamEntry* params;
+
+  MappedModel();
+  ~MappedModel();
+
+  // Maps the file and checks its magic, version, architecture and sizes.
+  // The checksum is only verified when verify_checksum is true, since it
+  // has to read every page of the file.
+  bool Open(const string& filename, const ModelArch& arch,
+            const bool& verify_checksum);
+
+  // Returns false if the checksum of the whole file does not match.
+  bool VerifyChecksum() const;
+
+  const float* Values(const ParamEntry& param) const {
+    return reinterpret_cast<const float*>(data + param.offset);
+  }
+  const char* Data(const ParamEntry& param) const {
+    return data + param.offset;
+  }
+
+  // Returns the index-th parameter of the model_id-th cnn model.
+  const ParamEntry& Param(const unsigned& model_id,
+                          const unsigned& index) const {
+    return params[models[model_id].first_param + index];
+  }
+
+  // Fills the parameters of a cnn model, which must have been created with
+  // the same architecture. With share_weights the parameters point into the
+  // mapping instead of being copied, so that processes reading the same file
+  // share one page-cached copy of the weights. Shared weights are read-only
+  // and the mapping must outlive the cnn model. Quantized models can only be
+  // run by the inference engine. With kParamChecksums, the first load of a
+  // cnn model checks the checksums of its parameters.
+  bool LoadParams(const unsigned& model_id, const bool& share_weights,
+                  Model* cnn_model) const;
+
+  // Checks that there is a cnn model for every morph tag, followed by
+  // num_shared models shared by the tags, and that the parameters of all the
+  // tags have the same kinds and shapes, so that the cnn parameters created
+  // for one tag can load any other tag.
+  bool CheckTagModels(const unsigned& num_shared) const;
+
+ private:
+  MappedModel(const MappedModel&);
+  MappedModel& operator=(const MappedModel&);
+
+  // Returns false if a parameter of the cnn model does not match its
+  // checksum.
+  bool VerifyParams(const unsigned& model_id) const;
+
+  const char* data;
+  size_t size;
+  mutable vector<bool> verified;  // The cnn models whose values are checked
+};
+
+// Opens a binary model for Read(). The cnn parameters share the weights of
+// the mapping, so it is never unmapped. The model must have a cnn model per
+// tag and num_shared_models shared ones (see CheckTagModels()). Only the
+// header and the tables are read here; the values of a tag are checked when
+// it is first loaded, or the whole file for models written without
+// kParamChecksums. Returns NULL on failure, and for the quantized models,
+// which cnn cannot run.
+MappedModel* OpenBinaryModel(const string& filename, const ModelArch& arch,
+                             const unsigned& num_shared_models);
+
+#endif
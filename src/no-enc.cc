@@ -6,7 +6,6 @@ using namespace cnn::expr;
 
 string BOW = "<s>", EOW = "</s>";
 int MAX_PRED_LEN = 100;
-float NEG_INF = numeric_limits<int>::min();
 
 NoEnc::NoEnc(const unsigned& char_length, const unsigned& hidden_length,
                    const unsigned& vocab_length, const unsigned& num_layers,
@@ -21,26 +20,72 @@ NoEnc::NoEnc(const unsigned& char_length, const unsigned& hidden_length,
 }
 
 void NoEnc::InitParams(vector<Model*>* m) {
+  ResizeParams();
   for (unsigned i = 0; i < morph_len; ++i) {
-    //input_forward.push_back(LSTMBuilder(layers, char_len, hidden_len, (*m)[i]));
-    //input_backward.push_back(LSTMBuilder(layers, char_len, hidden_len, (*m)[i]));
-    output_forward.push_back(LSTMBuilder(layers, 2 * char_len,  // + hidden_len,
-                                         hidden_len, (*m)[i]));
+    InitParams(i, (*m)[i]);
+  }
+}
+
+void NoEnc::InitParams(const unsigned& morph_id, Model* m) {
+  //input_forward[morph_id] = LSTMBuilder(layers, char_len, hidden_len, m);
+  //input_backward[morph_id] = LSTMBuilder(layers, char_len, hidden_len, m);
+  output_forward[morph_id] = LSTMBuilder(layers, 2 * char_len,  // + hidden_len,
+                                         hidden_len, m);
+
+  phidden_to_output[morph_id] = m->add_parameters({vocab_len, hidden_len});
+  phidden_to_output_bias[morph_id] = m->add_parameters({vocab_len, 1});
+
+  char_vecs[morph_id] = m->add_lookup_parameters(vocab_len, {char_len});
 
-    phidden_to_output.push_back((*m)[i]->add_parameters({vocab_len, hidden_len}));
-    phidden_to_output_bias.push_back((*m)[i]->add_parameters({vocab_len, 1}));
+  //ptransform_encoded[morph_id] = m->add_parameters(
+  //    {hidden_len, 2 * hidden_len});
+  //ptransform_encoded_bias[morph_id] = m->add_parameters({hidden_len, 1});
 
-    char_vecs.push_back((*m)[i]->add_lookup_parameters(vocab_len, {char_len}));
+  eps_vecs[morph_id] = m->add_lookup_parameters(max_eps, {char_len});
+}
 
-    //ptransform_encoded.push_back((*m)[i]->add_parameters({hidden_len,
-    //                                                      2 * hidden_len}));
-    //ptransform_encoded_bias.push_back((*m)[i]->add_parameters({hidden_len, 1}));
+void NoEnc::ResizeParams() {
+  output_forward.resize(morph_len);
+  phidden_to_output.resize(morph_len);
+  phidden_to_output_bias.resize(morph_len);
+  char_vecs.resize(morph_len);
+  eps_vecs.resize(morph_len);
+}
 
-    eps_vecs.push_back((*m)[i]->add_lookup_parameters(max_eps, {char_len}));
+void NoEnc::InitLazy(MappedModel* mapped) {
+  ResizeParams();
+  loaded_tag = -1;
+  lazy_model = mapped;
+}
+
+bool NoEnc::LoadTag(const unsigned& morph_id) {
+  if ((int) morph_id == loaded_tag) {
+    return true;
+  }
+  if (loaded_tag < 0) {
+    tag_model = new Model();
+    InitParams(morph_id, tag_model);
+  } else {
+    // The parameters of all the tags have the same shapes, so the new tag
+    // takes over the builders and parameters of the previous one.
+    swap(output_forward[loaded_tag], output_forward[morph_id]);
+    swap(phidden_to_output[loaded_tag], phidden_to_output[morph_id]);
+    swap(phidden_to_output_bias[loaded_tag], phidden_to_output_bias[morph_id]);
+    swap(char_vecs[loaded_tag], char_vecs[morph_id]);
+    swap(eps_vecs[loaded_tag], eps_vecs[morph_id]);
   }
+  loaded_tag = morph_id;
+  return lazy_model->LoadParams(morph_id, true, tag_model);
 }
 
 void NoEnc::AddParamsToCG(const unsigned& morph_id, ComputationGraph* cg) {
+  // With a mapped model there is a single set of parameters, which fits every
+  // tag as their parameters have the same shapes; LoadTag() points it at the
+  // weights of morph_id.
+  if (lazy_model != NULL && !LoadTag(morph_id)) {
+    cerr << "Could not load the parameters of tag " << morph_id << endl;
+    exit(1);
+  }
   //input_forward[morph_id].new_graph(*cg);
   //input_backward[morph_id].new_graph(*cg);
   output_forward[morph_id].new_graph(*cg);
@@ -99,6 +144,18 @@ Expression NoEnc::ComputeLoss(const vector<Expression>& hidden_units,
   return sum(losses);
 }
 
+Expression NoEnc::ComputeLoss(const vector<Expression>& hidden_units,
+                                 const vector<vector<unsigned> >& targets) const {
+  assert(hidden_units.size() == targets.size());
+  vector<Expression> losses;
+  for (unsigned i = 0; i < hidden_units.size(); ++i) {
+    Expression out;
+    ProjectToOutput(hidden_units[i], &out);
+    losses.push_back(pickneglogsoftmax(out, targets[i]));
+  }
+  return sum_batches(sum(losses));
+}
+
 float NoEnc::Train(const unsigned& morph_id, const vector<unsigned>& inputs,
                       const vector<unsigned>& outputs, AdadeltaTrainer* ada_gd) {
   ComputationGraph cg;
@@ -143,6 +200,52 @@ float NoEnc::Train(const unsigned& morph_id, const vector<unsigned>& inputs,
   return return_loss;
 }
 
+float NoEnc::TrainBatch(const unsigned& morph_id,
+                        const vector<vector<unsigned> >& inputs,
+                        const vector<vector<unsigned> >& outputs,
+                        AdadeltaTrainer* ada_gd) {
+  ComputationGraph cg;
+  AddParamsToCG(morph_id, &cg);
+
+  // All examples have the same lengths, so every decoder step reads either
+  // input characters or epsilons for the whole batch.
+  unsigned input_len = inputs[0].size(), output_len = outputs[0].size();
+  vector<Expression> input_vecs_for_dec;
+  vector<vector<unsigned> > output_ids_for_pred;
+  for (unsigned i = 0; i < output_len; ++i) {
+    if (i < output_len - 1) {
+      // '</s>' will not be fed as input -- it needs to be predicted.
+      Expression prev_output_vecs = lookup(cg, char_vecs[morph_id],
+                                           BatchColumn(outputs, i));
+      if (i < input_len - 1) {
+        input_vecs_for_dec.push_back(concatenate(
+            {prev_output_vecs,
+             lookup(cg, char_vecs[morph_id], BatchColumn(inputs, i + 1))}));
+      } else {
+        vector<unsigned> eps_ids(inputs.size(),
+                                 min(unsigned(i - input_len), max_eps - 1));
+        input_vecs_for_dec.push_back(concatenate(
+            {prev_output_vecs, lookup(cg, eps_vecs[morph_id], eps_ids)}));
+      }
+    }
+    if (i > 0) {  // '<s>' will not be predicted in the output -- its fed in.
+      output_ids_for_pred.push_back(BatchColumn(outputs, i));
+    }
+  }
+
+  vector<Expression> decoder_hidden_units;
+  output_forward[morph_id].start_new_sequence();
+  for (const auto& vec : input_vecs_for_dec) {
+    decoder_hidden_units.push_back(output_forward[morph_id].add_input(vec));
+  }
+  Expression loss = ComputeLoss(decoder_hidden_units, output_ids_for_pred);
+
+  float return_loss = as_scalar(cg.forward());
+  cg.backward();
+  ada_gd->update(1.0f);
+  return return_loss;
+}
+
 void
 EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_to_id,
                const vector<unsigned>& input_ids,
@@ -212,7 +315,8 @@ EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
                    unordered_map<string, unsigned>& char_to_id,
                    const vector<unsigned>& input_ids,
                    vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
-                   vector<NoEnc*>* ensmb_model) {
+                   vector<NoEnc*>* ensmb_model,
+                   const BeamPruning& pruning, BeamStats* stats) {
   unsigned out_index = 1;
   unsigned ensmb = ensmb_model->size();
   ComputationGraph cg;
@@ -246,159 +350,114 @@ EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
   // Compute the average of the ensemble output.
   Expression out_dist = average(ensmb_out);
   vector<float> log_dist = as_vector(cg.incremental_forward());
-  priority_queue<pair<float, unsigned> > init_queue;
-  for (unsigned i = 0; i < log_dist.size(); ++i) {
-    init_queue.push(make_pair(log_dist[i], i));
-  }
   unsigned vocab_size = log_dist.size();
 
-  // Initialise the beam_size sequences, scores, hidden states.
-  vector<float> log_scores;
-  vector<vector<RNNPointer> > prev_states;
+  // Every hypothesis starts from the state after the first step. Finished
+  // and pruned hypotheses drop out of search.Live() and get no more graph
+  // nodes.
+  BeamSearch search;
+  search.Start(beam_size, char_to_id[BOW], char_to_id[EOW], MAX_PRED_LEN,
+               log_dist.data(), vocab_size, pruning);
+  vector<RNNPointer> prev_states, curr_states(beam_size * ensmb);
   for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-    vector<unsigned> seq;
-    seq.push_back(char_to_id[BOW]);
-    seq.push_back(init_queue.top().second);
-    sequences->push_back(seq);
-    log_scores.push_back(init_queue.top().first);
-   
-    vector<RNNPointer> ensmb_states;
     for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
       auto& model = *(*ensmb_model)[ensmb_id];
-      ensmb_states.push_back(model.output_forward[morph_id].state());
+      prev_states.push_back(model.output_forward[morph_id].state());
     }
-    prev_states.push_back(ensmb_states);
-    init_queue.pop();
   }
 
-  vector<cnn::real> neg_inf(vocab_size, NEG_INF);
-  Expression neg_inf_vec = cnn::expr::input(cg, {vocab_size}, &neg_inf);
- 
-  vector<bool> active_beams(beam_size, true);
-  while (true) {
-    out_index++;      
-    priority_queue<pair<float, pair<unsigned, unsigned> > > probs_queue;
-    vector<vector<RNNPointer> > curr_states;
+  while (!search.Done()) {
+    out_index++;
+    const vector<unsigned>& live = search.Live();
     vector<Expression> out_dist;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id]) {
-        unsigned prev_out_char = (*sequences)[beam_id].back();
-        vector<Expression> ensmb_out;
-        vector<RNNPointer> ensmb_states;
-        for (unsigned ensmb_id = 0; ensmb_id < ensmb; ensmb_id++) {
-          auto& model = *(*ensmb_model)[ensmb_id];
-          Expression input_char_vec;
-          if (out_index < input_ids.size()) { 
-            input_char_vec = lookup(cg, model.char_vecs[morph_id], input_ids[out_index]);
-          } else { 
-            input_char_vec = lookup(cg, model.eps_vecs[morph_id],
-                                    min(unsigned(out_index - input_ids.size()),
-                                                 model.max_eps - 1));
-          }
-
-          Expression prev_out_vec = lookup(cg, model.char_vecs[morph_id], prev_out_char);
-          Expression input = concatenate({//encoded_word_vecs[ensmb_id],
-                                          prev_out_vec,
-                                          input_char_vec});
-          Expression hidden = model.output_forward[morph_id].add_input(
-                                prev_states[beam_id][ensmb_id], input);
-          ensmb_states.push_back(model.output_forward[morph_id].state());
-          
-          Expression out;
-          model.ProjectToOutput(hidden, &out);
-          out = log_softmax(out);
-          ensmb_out.push_back(out);
+    for (unsigned i = 0; i < live.size(); ++i) {
+      unsigned beam_id = live[i];
+      unsigned prev_out_char = search.LastChar(beam_id);
+      vector<Expression> ensmb_out;
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ensmb_id++) {
+        auto& model = *(*ensmb_model)[ensmb_id];
+        Expression input_char_vec;
+        if (out_index < input_ids.size()) {
+          input_char_vec = lookup(cg, model.char_vecs[morph_id], input_ids[out_index]);
+        } else {
+          input_char_vec = lookup(cg, model.eps_vecs[morph_id],
+                                  min(unsigned(out_index - input_ids.size()),
+                                               model.max_eps - 1));
         }
-        curr_states.push_back(ensmb_states);
-        out_dist.push_back(average(ensmb_out));
-      } else {
-        vector<RNNPointer> dummy(ensmb, RNNPointer(0));
-        curr_states.push_back(dummy);
-        out_dist.push_back(neg_inf_vec);
+
+        Expression prev_out_vec = lookup(cg, model.char_vecs[morph_id], prev_out_char);
+        Expression input = concatenate({//encoded_word_vecs[ensmb_id],
+                                        prev_out_vec,
+                                        input_char_vec});
+        Expression hidden = model.output_forward[morph_id].add_input(
+                              prev_states[beam_id * ensmb + ensmb_id], input);
+        curr_states[i * ensmb + ensmb_id] =
+            model.output_forward[morph_id].state();
+
+        Expression out;
+        model.ProjectToOutput(hidden, &out);
+        out = log_softmax(out);
+        ensmb_out.push_back(out);
       }
+      out_dist.push_back(average(ensmb_out));
     }
 
     Expression all_scores = concatenate(out_dist);
     vector<float> log_dist = as_vector(cg.incremental_forward());
-
-    for (unsigned index = 0; index < log_dist.size(); ++index) {
-      unsigned beam_id = index / vocab_size;
-      unsigned char_id = index % vocab_size;
-      if (active_beams[beam_id]) {
-        pair<unsigned, unsigned> location = make_pair(beam_id, char_id);
-        probs_queue.push(pair<float, pair<unsigned, unsigned> >(
-                         log_scores[beam_id] + log_dist[index], location));
-      }
-    }
-      
-    // Find the beam_size best now and update the variables.
-    unordered_map<unsigned, vector<unsigned> > new_seq;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id]) {
-        float log_prob = probs_queue.top().first;
-        pair<unsigned, unsigned> location = probs_queue.top().second;
-        unsigned old_beam_id = location.first, char_id = location.second;
-
-        vector<unsigned> seq = (*sequences)[old_beam_id];
-        seq.push_back(char_id);
-        new_seq[beam_id] = seq;
-        log_scores[beam_id] = log_prob;  // Update the score
-
-        prev_states[beam_id] = curr_states[old_beam_id];  // Update hidden state
-        probs_queue.pop();
+    search.Step(log_dist.data(), vocab_size);
+    for (unsigned beam_id : search.Extended()) {  // Update hidden state
+      unsigned parent = search.Parent(beam_id);
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        prev_states[beam_id * ensmb + ensmb_id] =
+            curr_states[parent * ensmb + ensmb_id];
       }
     }
-      
-    // Update the sequences now.
-    for (auto& it : new_seq) {
-      (*sequences)[it.first] = it.second;
-    }
-
-    // Check if a sequence should be made inactive.
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id] && 
-          ((*sequences)[beam_id].back() == char_to_id[EOW] ||
-           (*sequences)[beam_id].size() > MAX_PRED_LEN)) {
-        active_beams[beam_id] = false;
-      }
-    }
-
-    // Check if all sequences are inactive.
-    bool all_inactive = true;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id]) {
-        all_inactive = false;
-        break;
-      }
-    }
-
-    if (all_inactive) {
-      *tm_scores = log_scores;
-      return;
-    }
+  }
+  search.Results(sequences, tm_scores);
+  if (stats != NULL) {
+    *stats = search.Stats();
   }
 }
 
 void Serialize(string& filename, NoEnc& model, vector<Model*>* cnn_models) {
-  ofstream outfile(filename);
-  if (!outfile.is_open()) {
-    cerr << "File opening failed" << endl;
-  }
-
-  boost::archive::text_oarchive oa(outfile);
-  oa & model;
-  for (unsigned i = 0; i < cnn_models->size(); ++i) {
-    oa & *(*cnn_models)[i];
+  ModelHeader header = MakeModelHeader(kNoEnc, model.char_len,
+                                       model.hidden_len, model.vocab_len,
+                                       model.layers, model.morph_len,
+                                       model.max_eps, 0);
+  if (WriteBinaryModel(filename, header, *cnn_models)) {
+    cerr << "Saved model to: " << filename << endl;
   }
+}
 
-  cerr << "Saved model to: " << filename << endl;
-  outfile.close();
+static void CopyHyperParams(const ModelHeader& header, NoEnc* model) {
+  model->char_len = header.char_len;
+  model->hidden_len = header.hidden_len;
+  model->vocab_len = header.vocab_len;
+  model->layers = header.layers;
+  model->morph_len = header.morph_len;
+  model->max_eps = header.max_eps;
 }
 
-void Read(string& filename, NoEnc* model, vector<Model*>* cnn_models) {
+bool Read(string& filename, NoEnc* model, vector<Model*>* cnn_models) {
+  if (IsBinaryModel(filename)) {
+    MappedModel* mapped = OpenBinaryModel(filename, kNoEnc, 0);
+    if (mapped == NULL) {
+      return false;
+    }
+    CopyHyperParams(*mapped->header, model);
+    model->InitLazy(mapped);
+    if (!model->LoadTag(0)) {
+      return false;
+    }
+    cerr << "Loaded model from: " << filename << endl;
+    return true;
+  }
+
+  // Models saved in the old boost text format.
   ifstream infile(filename);
   if (!infile.is_open()) {
     cerr << "File opening failed" << endl;
+    return false;
   }
 
   boost::archive::text_iarchive ia(infile);
@@ -415,5 +474,6 @@ void Read(string& filename, NoEnc* model, vector<Model*>* cnn_models) {
 
   cerr << "Loaded model from: " << filename << endl;
   infile.close();
+  return true;
 }
 
@@ -0,0 +1,177 @@
+#include "parallel-train.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+using namespace std;
+using namespace cnn;
+
+// Groups the rows of the corpus by their morph tag.
+static void RowsByMorph(const Corpus& data, const unsigned& morph_size,
+                        vector<vector<unsigned> >* rows) {
+  rows->assign(morph_size, vector<unsigned>());
+  for (unsigned row = 0; row < data.size(); ++row) {
+    (*rows)[data.morph_id(row)].push_back(row);
+  }
+}
+
+static string ScratchFile(const string& scratch_prefix, const unsigned& worker) {
+  return scratch_prefix + ".worker" + to_string(worker);
+}
+
+// Runs all the training iterations for the given tags, then writes the best
+// parameters of every tag along with its dev accuracy to the scratch file.
+static bool TrainWorker(const unsigned& worker, const vector<unsigned>& tags,
+                        const unsigned& num_iter,
+                        const Corpus& train_data, const Corpus& test_data,
+                        const vector<vector<unsigned> >& train,
+                        const vector<vector<unsigned> >& test,
+                        const string& scratch_prefix, const TrainFunc& train_func,
+                        const DecodeFunc& decode, vector<Model*>* cnn_models) {
+  vector<unsigned> train_rows;
+  for (const unsigned& morph_id : tags) {
+    train_rows.insert(train_rows.end(), train[morph_id].begin(),
+                      train[morph_id].end());
+  }
+
+  unordered_map<unsigned, int> best_correct;
+  unordered_map<unsigned, string> best_params;
+  for (unsigned iter = 0; iter < num_iter; ++iter) {
+    random_shuffle(train_rows.begin(), train_rows.end());
+    float loss = 0.0f;
+    vector<unsigned> input_ids, target_ids, pred_target_ids;
+    for (const unsigned& row : train_rows) {
+      train_data.GetInput(row, &input_ids);
+      train_data.GetOutput(row, &target_ids);
+      loss += train_func(train_data.morph_id(row), input_ids, target_ids);
+    }
+
+    double correct = 0, total = 0;
+    for (const unsigned& morph_id : tags) {
+      int tag_correct = 0;
+      for (const unsigned& row : test[morph_id]) {
+        pred_target_ids.clear();
+        test_data.GetInput(row, &input_ids);
+        test_data.GetOutput(row, &target_ids);
+        decode(morph_id, input_ids, &pred_target_ids);
+        if (pred_target_ids == target_ids) {
+          tag_correct += 1;
+        }
+      }
+      correct += tag_correct;
+      total += test[morph_id].size();
+
+      // Tags without dev data keep the parameters of the last iteration.
+      auto it = best_correct.find(morph_id);
+      if (it == best_correct.end() || tag_correct > it->second ||
+          test[morph_id].empty()) {
+        best_correct[morph_id] = tag_correct;
+        ostringstream params;
+        boost::archive::text_oarchive oa(params);
+        oa & *(*cnn_models)[morph_id];
+        best_params[morph_id] = params.str();
+      }
+    }
+    cerr << "Worker " << worker << " Iter " << iter + 1 << " Loss: " << loss;
+    cerr << " Prediction Accuracy: " << (total > 0 ? correct / total : 0.)
+         << endl;
+  }
+
+  ofstream outfile(ScratchFile(scratch_prefix, worker));
+  if (!outfile.is_open()) {
+    cerr << "File opening failed: " << ScratchFile(scratch_prefix, worker)
+         << endl;
+    return false;
+  }
+  boost::archive::text_oarchive oa(outfile);
+  unsigned num_tags = tags.size();
+  oa & num_tags;
+  for (unsigned morph_id : tags) {
+    istringstream params(best_params[morph_id]);
+    boost::archive::text_iarchive ia(params);
+    ia & *(*cnn_models)[morph_id];
+
+    int correct = best_correct[morph_id];
+    oa & morph_id;
+    oa & correct;
+    oa & *(*cnn_models)[morph_id];
+  }
+  outfile.close();
+  return true;
+}
+
+bool ParallelTrainByMorph(const unsigned& num_workers, const unsigned& num_iter,
+                          const Corpus& train_data, const Corpus& test_data,
+                          const string& scratch_prefix, const TrainFunc& train,
+                          const DecodeFunc& decode, vector<Model*>* cnn_models) {
+  vector<vector<unsigned> > train_rows, test_rows;
+  RowsByMorph(train_data, cnn_models->size(), &train_rows);
+  RowsByMorph(test_data, cnn_models->size(), &test_rows);
+
+  // The cost of an example is roughly linear in its number of characters.
+  vector<unsigned> load(cnn_models->size(), 0);
+  for (unsigned row = 0; row < train_data.size(); ++row) {
+    load[train_data.morph_id(row)] +=
+        train_data.input_size(row) + train_data.output_size(row);
+  }
+  vector<vector<unsigned> > assignment;
+  AssignToWorkers(load, num_workers, &assignment);
+  cerr << "Training " << assignment.size() << " workers" << endl;
+
+  vector<pid_t> pids;
+  for (unsigned worker = 0; worker < assignment.size(); ++worker) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      cerr << "Forking worker " << worker << " failed" << endl;
+      break;
+    } else if (pid == 0) {
+      bool ok = TrainWorker(worker, assignment[worker], num_iter,
+                            train_data, test_data, train_rows, test_rows,
+                            scratch_prefix, train, decode, cnn_models);
+      _exit(ok ? 0 : 1);
+    }
+    pids.push_back(pid);
+  }
+
+  bool ok = (pids.size() == assignment.size());
+  for (const pid_t& pid : pids) {
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      ok = false;
+    }
+  }
+  if (!ok) {
+    cerr << "Training worker failed" << endl;
+    return false;
+  }
+
+  // Collect the best parameters of every tag.
+  double correct = 0, total = test_data.size();
+  for (unsigned worker = 0; worker < assignment.size(); ++worker) {
+    string filename = ScratchFile(scratch_prefix, worker);
+    ifstream infile(filename);
+    if (!infile.is_open()) {
+      cerr << "File opening failed: " << filename << endl;
+      return false;
+    }
+    boost::archive::text_iarchive ia(infile);
+    unsigned num_tags;
+    ia & num_tags;
+    for (unsigned i = 0; i < num_tags; ++i) {
+      unsigned morph_id;
+      int tag_correct;
+      ia & morph_id;
+      ia & tag_correct;
+      ia & *(*cnn_models)[morph_id];
+      correct += tag_correct;
+    }
+    infile.close();
+    remove(filename.c_str());
+  }
+  cerr << "Prediction Accuracy: " << (total > 0 ? correct / total : 0.) << endl;
+  return true;
+}
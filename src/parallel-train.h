@@ -0,0 +1,39 @@
+#ifndef PARALLEL_TRAIN_H_
+#define PARALLEL_TRAIN_H_
+
+#include "cnn/cnn.h"
+
+#include "utils.h"
+#include "corpus.h"
+
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
+#include <functional>
+#include <unordered_map>
+
+using namespace std;
+using namespace cnn;
+
+typedef function<float(const unsigned& morph_id, const vector<unsigned>& inputs,
+                       const vector<unsigned>& outputs)> TrainFunc;
+
+typedef function<void(const unsigned& morph_id, const vector<unsigned>& inputs,
+                      vector<unsigned>* pred_target_ids)> DecodeFunc;
+
+// Trains models whose parameters are completely separate for every morph
+// tag (one cnn Model per tag, e.g. SepMorph) on a pool of workers. The
+// training data is partitioned by morph tag and the tags are balanced
+// across the workers by the number of characters they have to process.
+//
+// cnn keeps its memory pools in global state and allows only one
+// ComputationGraph at a time, so the workers are forked processes and not
+// threads. Every worker keeps, for each of its tags, the parameters from the
+// iteration with the best dev accuracy on that tag, and hands them back to
+// the parent through scratch files named scratch_prefix.worker<i>.
+// Returns false if any of the workers failed.
+bool ParallelTrainByMorph(const unsigned& num_workers, const unsigned& num_iter,
+                          const Corpus& train_data, const Corpus& test_data,
+                          const string& scratch_prefix, const TrainFunc& train,
+                          const DecodeFunc& decode, vector<Model*>* cnn_models);
+
+#endif
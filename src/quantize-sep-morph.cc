@@ -0,0 +1,162 @@
+/*
+Quantizes the weight matrices of a binary SepMorph model to int8 with one
+scale per row, for the int8 kernels of the inference engine. Biases and
+character embeddings stay in float. The quantized model is decoded greedily
+on the development data next to the float one, and it is only kept if its
+accuracy drops by at most --tolerance (absolute, 0.005 by default).
+*/
+#include "utils.h"
+#include "corpus.h"
+#include "sep-morph-infer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+// Decodes the whole corpus greedily and returns the accuracy.
+static double Evaluate(const Corpus& data,
+                       unordered_map<string, unsigned>& char_to_id,
+                       SepMorphInfer* model,
+                       vector<vector<unsigned> >* predictions,
+                       double* words_per_sec) {
+  vector<SepMorphInfer*> object_pointers(1, model);
+  vector<unsigned> input_ids, target_ids, pred_target_ids;
+  double correct = 0;
+  predictions->clear();
+  auto start = chrono::steady_clock::now();
+  for (unsigned row = 0; row < data.size(); ++row) {
+    pred_target_ids.clear();
+    data.GetInput(row, &input_ids);
+    data.GetOutput(row, &target_ids);
+    EnsembleDecode(data.morph_id(row), char_to_id, input_ids,
+                   &pred_target_ids, &object_pointers);
+    if (pred_target_ids == target_ids) {
+      correct += 1;
+    }
+    predictions->push_back(pred_target_ids);
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() -
+                                            start).count();
+  *words_per_sec = data.size() / seconds;
+  return correct / data.size();
+}
+
+// Writes a copy of the model with every weight matrix quantized.
+static bool WriteQuantized(string& in_filename, const string& out_filename,
+                           unsigned* num_quantized, size_t* float_bytes,
+                           size_t* int8_bytes) {
+  MappedModel mapped;
+  if (!mapped.Open(in_filename, kSepMorph, true)) {
+    return false;
+  }
+  if (mapped.header->flags & kQuantizedModel) {
+    cerr << "Model is already quantized: " << in_filename << endl;
+    return false;
+  }
+  ModelHeader header = *mapped.header;
+  header.flags |= kQuantizedModel;
+  vector<ModelEntry> models(mapped.models,
+                            mapped.models + header.num_models);
+  vector<ParamEntry> params(mapped.params,
+                            mapped.params + header.num_params);
+  vector<const char*> data;
+  vector<vector<char> > quantized;
+  *num_quantized = 0;
+  *float_bytes = *int8_bytes = 0;
+  for (ParamEntry& param : params) {
+    *float_bytes += ParamBytes(param);
+    if (param.kind == kParameters && param.cols > 1) {
+      Matrix matrix;
+      LoadMatrix(mapped, param, &matrix);
+      param.kind = kQuantizedParameters;
+      vector<char> bytes(ParamBytes(param), 0);
+      QuantizeRows(matrix, reinterpret_cast<float*>(bytes.data()),
+                   reinterpret_cast<int8_t*>(bytes.data() +
+                                             sizeof(float) * param.rows));
+      quantized.push_back(bytes);
+      *num_quantized += 1;
+    }
+    *int8_bytes += ParamBytes(param);
+  }
+  for (unsigned i = 0, j = 0; i < params.size(); ++i) {
+    if (params[i].kind == kQuantizedParameters) {
+      data.push_back(quantized[j++].data());
+    } else {
+      data.push_back(mapped.Data(params[i]));
+    }
+  }
+  return WriteBinaryModel(out_filename, header, models, params, data);
+}
+
+int main(int argc, char** argv) {
+  double tolerance = atof(GetOption("tolerance", "0.005", &argc, argv).c_str());
+  if (argc != 6) {
+    cerr << "Usage: " << argv[0] << " [--tolerance=X] char_vocab.txt"
+         << " morph_vocab.txt dev_infl.txt model.bin model.int8.bin" << endl;
+    return 0;
+  }
+
+  string vocab_filename = argv[1];  // vocabulary of words/characters
+  string morph_filename = argv[2];
+  string dev_filename = argv[3];
+  string float_filename = argv[4];
+  string int8_filename = argv[5];
+
+  unordered_map<string, unsigned> char_to_id, morph_to_id;
+  unordered_map<unsigned, string> id_to_char, id_to_morph;
+
+  ReadVocab(vocab_filename, &char_to_id, &id_to_char);
+  ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
+
+  Corpus dev_data;
+  if (!ReadCorpus(dev_filename, char_to_id, morph_to_id, &dev_data) ||
+      dev_data.size() == 0) {
+    cerr << "No development data: " << dev_filename << endl;
+    return 0;
+  }
+
+  unsigned num_quantized;
+  size_t float_bytes, int8_bytes;
+  if (!WriteQuantized(float_filename, int8_filename, &num_quantized,
+                      &float_bytes, &int8_bytes)) {
+    return 0;
+  }
+
+  // Evaluate the written file, so that the report is about what is shipped.
+  SepMorphInfer float_model, int8_model;
+  if (!Read(float_filename, &float_model) ||
+      !Read(int8_filename, &int8_model)) {
+    remove(int8_filename.c_str());
+    return 0;
+  }
+  vector<vector<unsigned> > float_pred, int8_pred;
+  double float_speed, int8_speed;
+  double float_acc = Evaluate(dev_data, char_to_id, &float_model, &float_pred,
+                              &float_speed);
+  double int8_acc = Evaluate(dev_data, char_to_id, &int8_model, &int8_pred,
+                             &int8_speed);
+  double same = 0;
+  for (unsigned i = 0; i < float_pred.size(); ++i) {
+    same += float_pred[i] == int8_pred[i];
+  }
+
+  cerr << "Quantized " << num_quantized << " matrices, parameters "
+       << float_bytes / 1024.0 << " KB -> " << int8_bytes / 1024.0 << " KB"
+       << endl;
+  cerr << "Float accuracy: " << float_acc << " (" << float_speed
+       << " words/sec)" << endl;
+  cerr << "Int8 accuracy: " << int8_acc << " (" << int8_speed
+       << " words/sec)" << endl;
+  cerr << "Identical predictions: " << same / float_pred.size() << endl;
+  if (float_acc - int8_acc > tolerance) {
+    cerr << "Accuracy drop " << float_acc - int8_acc << " exceeds the"
+         << " tolerance " << tolerance << ", not writing: " << int8_filename
+         << endl;
+    remove(int8_filename.c_str());
+    return 0;
+  }
+  cerr << "Wrote quantized model to: " << int8_filename << endl;
+  return 1;
+}
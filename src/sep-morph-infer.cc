@@ -0,0 +1,601 @@
+#include "sep-morph-infer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+using namespace std;
+
+static const string BOW = "<s>", EOW = "</s>";
+static const unsigned MAX_PRED_LEN = 100;
+
+void SepMorphInferTag::PrecomputeGates(const unsigned& hidden_len,
+                                       const unsigned& char_len) {
+  input_forward.InputGates(char_vecs, 0, true, &forward_char_gates);
+  input_backward.InputGates(char_vecs, 0, true, &backward_char_gates);
+
+  // The decoder reads the encoded word, the previous output character and
+  // the input character or epsilon aligned with the output.
+  output_forward.InputBlock(0, hidden_len, &encoded_to_gates);
+  output_forward.InputGates(char_vecs, hidden_len, false, &prev_char_gates);
+  output_forward.InputGates(char_vecs, hidden_len + char_len, false,
+                            &input_char_gates);
+  output_forward.InputGates(eps_vecs, hidden_len + char_len, false,
+                            &eps_gates);
+}
+
+void SepMorphInferTag::Quantize() {
+  input_forward.Quantize();
+  input_backward.Quantize();
+  output_forward.Quantize();
+  quant_hidden_to_output.Quantize(hidden_to_output);
+  quant_transform_encoded.Quantize(transform_encoded);
+  quant_encoded_to_gates.Quantize(encoded_to_gates);
+  hidden_to_output = Matrix();
+  transform_encoded = Matrix();
+  encoded_to_gates = Matrix();
+}
+
+void SepMorphInfer::Quantize() {
+  for (SepMorphInferTag& tag : tags) {
+    if (tag.quant_hidden_to_output.empty()) {  // Not quantized when read
+      tag.Quantize();
+    }
+  }
+}
+
+void SepMorphInfer::ResizeScratch() {
+  unsigned stride = PadFloats(hidden_len);
+  encoder_state.assign(tags[0].input_forward.StateSize(), 0.0f);
+  encoder_output.assign(2 * hidden_len, 0.0f);
+  encoded.assign(stride, 0.0f);
+  gates.assign(3 * stride, 0.0f);  // Grows with the size of the beam
+  logits.assign(PadFloats(vocab_len), 0.0f);
+}
+
+void SepMorphInfer::Encode(const unsigned& morph_id,
+                           const vector<unsigned>& input_ids,
+                           float* encoded_gates) {
+  const SepMorphInferTag& tag = tags[morph_id];
+
+  // Run forward LSTM
+  fill(encoder_state.begin(), encoder_state.end(), 0.0f);
+  for (unsigned i = 0; i < input_ids.size(); ++i) {
+    memcpy(gates.data(), tag.forward_char_gates.col(input_ids[i]),
+           sizeof(float) * tag.input_forward.GatesSize());
+    tag.input_forward.StepGates(gates.data(), encoder_state.data());
+  }
+  memcpy(encoder_output.data(),
+         tag.input_forward.Output(encoder_state.data()),
+         sizeof(float) * hidden_len);
+
+  // Run backward LSTM
+  fill(encoder_state.begin(), encoder_state.end(), 0.0f);
+  for (int i = input_ids.size() - 1; i >= 0; --i) {
+    memcpy(gates.data(), tag.backward_char_gates.col(input_ids[i]),
+           sizeof(float) * tag.input_backward.GatesSize());
+    tag.input_backward.StepGates(gates.data(), encoder_state.data());
+  }
+  memcpy(encoder_output.data() + hidden_len,
+         tag.input_backward.Output(encoder_state.data()),
+         sizeof(float) * hidden_len);
+
+  // Transform the concatenated states to feed into the decoder
+  memcpy(encoded.data(), tag.transform_encoded_bias.col(0),
+         sizeof(float) * encoded.size());
+  Gemv(tag.transform_encoded, tag.quant_transform_encoded,
+       encoder_output.data(), encoded.data());
+  memcpy(encoded_gates, tag.output_forward.gate_bias[0].data(),
+         sizeof(float) * EncodedSize());
+  Gemv(tag.encoded_to_gates, tag.quant_encoded_to_gates, encoded.data(),
+       encoded_gates);
+}
+
+void SepMorphInfer::EncodeBatch(const unsigned& morph_id,
+                                const vector<const vector<unsigned>*>& inputs,
+                                float* encoded_gates,
+                                const unsigned& encoded_stride) {
+  const SepMorphInferTag& tag = tags[morph_id];
+  const unsigned n = inputs.size();
+  const unsigned state_size = tag.input_forward.StateSize();
+  const unsigned gates_size = tag.input_forward.GatesSize();
+  const unsigned stride = PadFloats(hidden_len);
+  if (batch_states.size() < n * state_size) {
+    batch_states.resize(n * state_size);
+    batch_output.resize(n * 2 * hidden_len);
+    batch_encoded.resize(n * stride);
+  }
+  if (gates.size() < n * gates_size) {
+    gates.resize(n * gates_size);
+  }
+
+  // The words are read longest first, so that the words which still have
+  // characters left are always the first columns.
+  vector<unsigned> order(n);
+  for (unsigned i = 0; i < n; ++i) {
+    order[i] = i;
+  }
+  stable_sort(order.begin(), order.end(),
+              [&](const unsigned& a, const unsigned& b) {
+                return inputs[a]->size() > inputs[b]->size();
+              });
+  unsigned max_len = n > 0 ? inputs[order[0]]->size() : 0;
+
+  // Run the forward and the backward LSTM
+  for (unsigned backward = 0; backward < 2; ++backward) {
+    const InferLSTM& lstm =
+        backward ? tag.input_backward : tag.input_forward;
+    const Matrix& char_gates =
+        backward ? tag.backward_char_gates : tag.forward_char_gates;
+    fill(batch_states.begin(), batch_states.begin() + n * state_size, 0.0f);
+    unsigned num_reading = n;
+    for (unsigned t = 0; t < max_len; ++t) {
+      while (inputs[order[num_reading - 1]]->size() <= t) {
+        num_reading--;
+      }
+      for (unsigned b = 0; b < num_reading; ++b) {
+        const vector<unsigned>& input_ids = *inputs[order[b]];
+        unsigned i = backward ? input_ids.size() - 1 - t : t;
+        memcpy(gates.data() + b * gates_size, char_gates.col(input_ids[i]),
+               sizeof(float) * gates_size);
+      }
+      lstm.StepGatesBatch(num_reading, gates.data(), batch_states.data(),
+                          state_size);
+    }
+    for (unsigned b = 0; b < n; ++b) {
+      memcpy(&batch_output[order[b] * 2 * hidden_len + backward * hidden_len],
+             lstm.Output(&batch_states[b * state_size]),
+             sizeof(float) * hidden_len);
+    }
+  }
+
+  // Transform the concatenated states to feed into the decoder
+  for (unsigned b = 0; b < n; ++b) {
+    memcpy(&batch_encoded[b * stride], tag.transform_encoded_bias.col(0),
+           sizeof(float) * stride);
+    memcpy(encoded_gates + b * encoded_stride,
+           tag.output_forward.gate_bias[0].data(),
+           sizeof(float) * EncodedSize());
+  }
+  Gemm(tag.transform_encoded, tag.quant_transform_encoded, n,
+       batch_output.data(), 2 * hidden_len, batch_encoded.data(), stride);
+  Gemm(tag.encoded_to_gates, tag.quant_encoded_to_gates, n,
+       batch_encoded.data(), stride, encoded_gates, encoded_stride);
+}
+
+const float* SepMorphInfer::InputCharGates(
+    const SepMorphInferTag& tag, const unsigned& out_index,
+    const vector<unsigned>& input_ids) const {
+  if (out_index < input_ids.size()) {
+    return tag.input_char_gates.col(input_ids[out_index]);
+  }
+  return tag.eps_gates.col(
+      min(unsigned(out_index - input_ids.size()), max_eps - 1));
+}
+
+void SepMorphInfer::DecodeStep(const unsigned& morph_id,
+                               const float* encoded_gates,
+                               const unsigned& prev_char,
+                               const unsigned& out_index,
+                               const vector<unsigned>& input_ids,
+                               float* state) {
+  DecodeSteps(morph_id, encoded_gates, 1, &prev_char, out_index, input_ids,
+              state, DecoderStateSize());
+}
+
+void SepMorphInfer::DecodeSteps(const unsigned& morph_id,
+                                const float* encoded_gates, const unsigned& n,
+                                const unsigned* prev_chars,
+                                const unsigned& out_index,
+                                const vector<unsigned>& input_ids,
+                                float* states, const unsigned& state_stride) {
+  const SepMorphInferTag& tag = tags[morph_id];
+  const unsigned gates_size = EncodedSize();
+  const float* input_char_gates = InputCharGates(tag, out_index, input_ids);
+  if (gates.size() < n * gates_size) {
+    gates.resize(n * gates_size);
+  }
+  for (unsigned b = 0; b < n; ++b) {
+    float* beam_gates = gates.data() + b * gates_size;
+    memcpy(beam_gates, encoded_gates, sizeof(float) * gates_size);
+    AddTo(gates_size, tag.prev_char_gates.col(prev_chars[b]), beam_gates);
+    AddTo(gates_size, input_char_gates, beam_gates);
+  }
+  tag.output_forward.StepGatesBatch(n, gates.data(), states, state_stride);
+}
+
+void SepMorphInfer::DecodeWords(const unsigned& morph_id, const unsigned& n,
+                                const float* encoded_gates,
+                                const unsigned& encoded_stride,
+                                const unsigned* prev_chars,
+                                const unsigned& out_index,
+                                const vector<unsigned>* const* inputs,
+                                float* states, const unsigned& state_stride) {
+  const SepMorphInferTag& tag = tags[morph_id];
+  const unsigned gates_size = EncodedSize();
+  if (gates.size() < n * gates_size) {
+    gates.resize(n * gates_size);
+  }
+  for (unsigned b = 0; b < n; ++b) {
+    float* word_gates = gates.data() + b * gates_size;
+    memcpy(word_gates, encoded_gates + b * encoded_stride,
+           sizeof(float) * gates_size);
+    AddTo(gates_size, tag.prev_char_gates.col(prev_chars[b]), word_gates);
+    AddTo(gates_size, InputCharGates(tag, out_index, *inputs[b]),
+          word_gates);
+  }
+  tag.output_forward.StepGatesBatch(n, gates.data(), states, state_stride);
+}
+
+void SepMorphInfer::Logits(const SepMorphInferTag& tag, const unsigned& n,
+                           const float* states, const unsigned& state_stride) {
+  const unsigned logits_size = PadFloats(vocab_len);
+  if (logits.size() < n * logits_size) {
+    logits.resize(n * logits_size);
+  }
+  for (unsigned b = 0; b < n; ++b) {
+    memcpy(logits.data() + b * logits_size, tag.hidden_to_output_bias.col(0),
+           sizeof(float) * logits_size);
+  }
+  Gemm(tag.hidden_to_output, tag.quant_hidden_to_output, n,
+       tag.output_forward.Output(states), state_stride, logits.data(),
+       logits_size);
+}
+
+void SepMorphInfer::AddLogDist(const unsigned& morph_id, const float* state,
+                               const float& scale, float* log_dist) {
+  AddLogDists(morph_id, 1, state, DecoderStateSize(), scale, log_dist, 0);
+}
+
+void SepMorphInfer::AddLogDists(const unsigned& morph_id, const unsigned& n,
+                                const float* states,
+                                const unsigned& state_stride,
+                                const float& scale, float* log_dists,
+                                const unsigned& dist_stride) {
+  const unsigned logits_size = PadFloats(vocab_len);
+  Logits(tags[morph_id], n, states, state_stride);
+  for (unsigned b = 0; b < n; ++b) {
+    AddLogSoftmax(vocab_len, logits.data() + b * logits_size, scale,
+                  log_dists + b * dist_stride);
+  }
+}
+
+unsigned SepMorphInfer::BestChar(const unsigned& morph_id,
+                                 const float* state) {
+  unsigned best;
+  BestChars(morph_id, 1, state, DecoderStateSize(), &best);
+  return best;
+}
+
+void SepMorphInfer::BestChars(const unsigned& morph_id, const unsigned& n,
+                              const float* states,
+                              const unsigned& state_stride, unsigned* chars) {
+  const unsigned logits_size = PadFloats(vocab_len);
+  Logits(tags[morph_id], n, states, state_stride);
+  for (unsigned b = 0; b < n; ++b) {
+    chars[b] = Argmax(vocab_len, logits.data() + b * logits_size);
+  }
+}
+
+bool Read(string& filename, SepMorphInfer* model) {
+  MappedModel mapped;
+  if (!mapped.Open(filename, kSepMorph, true)) {
+    return false;
+  }
+  const ModelHeader& header = *mapped.header;
+  model->char_len = header.char_len;
+  model->hidden_len = header.hidden_len;
+  model->vocab_len = header.vocab_len;
+  model->layers = header.layers;
+  model->morph_len = header.morph_len;
+  model->max_eps = header.max_eps;
+
+  // The parameters of every tag are in the order of SepMorph::InitParams().
+  model->tags.resize(model->morph_len);
+  for (unsigned i = 0; i < model->morph_len; ++i) {
+    SepMorphInferTag& tag = model->tags[i];
+    unsigned p = 0;
+    if (mapped.models[i].num_params != 3 * 11 * model->layers + 6 ||
+        !tag.input_forward.Load(mapped, i, model->layers, model->char_len,
+                                model->hidden_len, &p) ||
+        !tag.input_backward.Load(mapped, i, model->layers, model->char_len,
+                                 model->hidden_len, &p) ||
+        !tag.output_forward.Load(mapped, i, model->layers,
+                                 2 * model->char_len + model->hidden_len,
+                                 model->hidden_len, &p)) {
+      cerr << "Model " << i << " does not match the architecture" << endl;
+      return false;
+    }
+    LoadMatrix(mapped, mapped.Param(i, p++), &tag.hidden_to_output);
+    LoadMatrix(mapped, mapped.Param(i, p++), &tag.hidden_to_output_bias);
+    LoadMatrix(mapped, mapped.Param(i, p++), &tag.char_vecs);
+    LoadMatrix(mapped, mapped.Param(i, p++), &tag.transform_encoded);
+    LoadMatrix(mapped, mapped.Param(i, p++), &tag.transform_encoded_bias);
+    LoadMatrix(mapped, mapped.Param(i, p++), &tag.eps_vecs);
+    tag.PrecomputeGates(model->hidden_len, model->char_len);
+    if (header.flags & kQuantizedModel) {
+      tag.Quantize();
+    }
+  }
+  model->ResizeScratch();
+  cerr << "Loaded model from: " << filename << endl;
+  return true;
+}
+
+void
+EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_to_id,
+               const vector<unsigned>& input_ids,
+               vector<unsigned>* pred_target_ids,
+               vector<SepMorphInfer*>* ensmb_model, WorkerPool* workers) {
+  WorkerPool serial(1);
+  if (workers == NULL) {
+    workers = &serial;
+  }
+  vector<SepMorphInfer*>& models = *ensmb_model;
+  unsigned ensmb = models.size();
+  unsigned vocab_size = models[0]->vocab_len;
+  unsigned dist_stride = PadFloats(vocab_size);
+  unsigned encoded_size = models[0]->EncodedSize();
+  unsigned state_size = models[0]->DecoderStateSize();
+  AlignedVector encoded(ensmb * encoded_size);
+  AlignedVector states(ensmb * state_size, 0.0f);
+  AlignedVector member_dists(ensmb * dist_stride);
+  vector<float> ensmb_dist(vocab_size);
+  workers->Run(ensmb, [&](const unsigned& ensmb_id) {
+    models[ensmb_id]->Encode(morph_id, input_ids,
+                             &encoded[ensmb_id * encoded_size]);
+  });
+
+  unsigned out_index = 1;
+  unsigned pred_index = char_to_id[BOW];
+  unsigned eow_index = char_to_id[EOW];
+  // Every member steps and normalises on its own thread. They only wait for
+  // each other to sum the distributions.
+  TaskFunc member_step = [&](const unsigned& ensmb_id) {
+    float* state = &states[ensmb_id * state_size];
+    float* dist = &member_dists[ensmb_id * dist_stride];
+    models[ensmb_id]->DecodeStep(morph_id, &encoded[ensmb_id * encoded_size],
+                                 pred_index, out_index, input_ids, state);
+    fill(dist, dist + vocab_size, 0.0f);
+    models[ensmb_id]->AddLogDist(morph_id, state, 1.0f, dist);
+  };
+  while (pred_target_ids->size() < MAX_PRED_LEN) {
+    pred_target_ids->push_back(pred_index);
+    if (pred_index == eow_index) {
+      return;  // If the end is found, break from the loop and return
+    }
+
+    if (ensmb == 1) {
+      models[0]->DecodeStep(morph_id, &encoded[0], pred_index, out_index,
+                            input_ids, &states[0]);
+      pred_index = models[0]->BestChar(morph_id, &states[0]);
+    } else {
+      // Averaging does not change the argmax, so the distributions are
+      // only summed, in the order of the members.
+      workers->Run(ensmb, member_step);
+      fill(ensmb_dist.begin(), ensmb_dist.end(), 0.0f);
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        const float* dist = &member_dists[ensmb_id * dist_stride];
+        for (unsigned i = 0; i < vocab_size; ++i) {
+          ensmb_dist[i] += dist[i];
+        }
+      }
+      pred_index = distance(ensmb_dist.begin(),
+                            max_element(ensmb_dist.begin(), ensmb_dist.end()));
+    }
+    out_index++;
+  }
+}
+
+void
+EnsembleDecodeBatch(const unsigned& morph_id,
+                    unordered_map<string, unsigned>& char_to_id,
+                    const vector<vector<unsigned> >& inputs,
+                    vector<vector<unsigned> >* pred_target_ids,
+                    vector<SepMorphInfer*>* ensmb_model, WorkerPool* workers) {
+  WorkerPool serial(1);
+  if (workers == NULL) {
+    workers = &serial;
+  }
+  vector<SepMorphInfer*>& models = *ensmb_model;
+  unsigned n = inputs.size();
+  unsigned ensmb = models.size();
+  unsigned vocab_size = models[0]->vocab_len;
+  unsigned dist_stride = PadFloats(vocab_size);
+  unsigned encoded_size = models[0]->EncodedSize();
+  unsigned state_size = models[0]->DecoderStateSize();
+  unsigned eow_index = char_to_id[EOW];
+
+  // The words still being decoded are packed into the first num_live
+  // columns, column i holding the word words[i]. Every member keeps the
+  // encoded gates and the decoder states of all the columns.
+  vector<unsigned> words(n);
+  vector<const vector<unsigned>*> word_inputs(n);
+  for (unsigned i = 0; i < n; ++i) {
+    words[i] = i;
+    word_inputs[i] = &inputs[i];
+  }
+  AlignedVector encoded(ensmb * n * encoded_size);
+  AlignedVector states(ensmb * n * state_size, 0.0f);
+  AlignedVector member_dists(ensmb * n * dist_stride);
+  vector<float> ensmb_dist(vocab_size);
+  workers->Run(ensmb, [&](const unsigned& ensmb_id) {
+    models[ensmb_id]->EncodeBatch(morph_id, word_inputs,
+                                  &encoded[ensmb_id * n * encoded_size],
+                                  encoded_size);
+  });
+
+  unsigned out_index = 1, num_live = n;
+  vector<unsigned> pred_chars(n, char_to_id[BOW]);
+  TaskFunc member_step = [&](const unsigned& ensmb_id) {
+    float* member_states = &states[ensmb_id * n * state_size];
+    float* dists = &member_dists[ensmb_id * n * dist_stride];
+    models[ensmb_id]->DecodeWords(
+        morph_id, num_live, &encoded[ensmb_id * n * encoded_size],
+        encoded_size, pred_chars.data(), out_index, word_inputs.data(),
+        member_states, state_size);
+    fill(dists, dists + num_live * dist_stride, 0.0f);
+    models[ensmb_id]->AddLogDists(morph_id, num_live, member_states,
+                                  state_size, 1.0f, dists, dist_stride);
+  };
+  pred_target_ids->assign(n, vector<unsigned>());
+  while (num_live > 0) {
+    // Retire the words which ended, keeping the order of the others.
+    unsigned kept = 0;
+    for (unsigned i = 0; i < num_live; ++i) {
+      vector<unsigned>& pred = (*pred_target_ids)[words[i]];
+      pred.push_back(pred_chars[i]);
+      if (pred_chars[i] == eow_index || pred.size() >= MAX_PRED_LEN) {
+        continue;
+      }
+      if (kept != i) {
+        words[kept] = words[i];
+        word_inputs[kept] = word_inputs[i];
+        pred_chars[kept] = pred_chars[i];
+        for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+          memcpy(&encoded[(ensmb_id * n + kept) * encoded_size],
+                 &encoded[(ensmb_id * n + i) * encoded_size],
+                 sizeof(float) * encoded_size);
+          memcpy(&states[(ensmb_id * n + kept) * state_size],
+                 &states[(ensmb_id * n + i) * state_size],
+                 sizeof(float) * state_size);
+        }
+      }
+      kept++;
+    }
+    num_live = kept;
+    if (num_live == 0) {
+      break;
+    }
+
+    if (ensmb == 1) {
+      models[0]->DecodeWords(morph_id, num_live, &encoded[0], encoded_size,
+                             pred_chars.data(), out_index,
+                             word_inputs.data(), &states[0], state_size);
+      models[0]->BestChars(morph_id, num_live, &states[0], state_size,
+                           pred_chars.data());
+    } else {
+      // As in EnsembleDecode(), the distributions are summed in the order
+      // of the members.
+      workers->Run(ensmb, member_step);
+      for (unsigned i = 0; i < num_live; ++i) {
+        fill(ensmb_dist.begin(), ensmb_dist.end(), 0.0f);
+        for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+          const float* dist = &member_dists[(ensmb_id * n + i) * dist_stride];
+          for (unsigned j = 0; j < vocab_size; ++j) {
+            ensmb_dist[j] += dist[j];
+          }
+        }
+        pred_chars[i] = distance(ensmb_dist.begin(),
+                                 max_element(ensmb_dist.begin(),
+                                             ensmb_dist.end()));
+      }
+    }
+    out_index++;
+  }
+}
+
+void
+EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
+                   unordered_map<string, unsigned>& char_to_id,
+                   const vector<unsigned>& input_ids,
+                   vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
+                   vector<SepMorphInfer*>* ensmb_model, WorkerPool* workers,
+                   const BeamPruning& pruning, BeamStats* stats) {
+  WorkerPool serial(1);
+  if (workers == NULL) {
+    workers = &serial;
+  }
+  vector<SepMorphInfer*>& models = *ensmb_model;
+  unsigned out_index = 1;
+  unsigned ensmb = models.size();
+  unsigned vocab_size = models[0]->vocab_len;
+  unsigned dist_stride = PadFloats(vocab_size);
+  unsigned encoded_size = models[0]->EncodedSize();
+  unsigned state_size = models[0]->DecoderStateSize();
+  unsigned bow_index = char_to_id[BOW], eow_index = char_to_id[EOW];
+
+  // The states of every beam are stored one after the other, each holding
+  // the decoder states of all the members of the ensemble. The live
+  // hypotheses are packed into the first columns of curr_states, so that
+  // every member advances all of them with one matrix-matrix product per
+  // weight matrix. Every member writes its scaled log distribution for every
+  // column to member_dists, and they are summed in the order of the members.
+  unsigned beam_state_size = ensmb * state_size;
+  AlignedVector encoded(ensmb * encoded_size);
+  AlignedVector prev_states(beam_size * beam_state_size, 0.0f);
+  AlignedVector curr_states(beam_size * beam_state_size, 0.0f);
+  AlignedVector member_dists(ensmb * beam_size * dist_stride);
+  AlignedVector log_dists(beam_size * dist_stride);
+  auto sum_dists = [&](const unsigned& column) {
+    float* log_dist = &log_dists[column * dist_stride];
+    fill(log_dist, log_dist + vocab_size, 0.0f);
+    for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+      const float* dist =
+          &member_dists[(ensmb_id * beam_size + column) * dist_stride];
+      for (unsigned i = 0; i < vocab_size; ++i) {
+        log_dist[i] += dist[i];
+      }
+    }
+  };
+  workers->Run(ensmb, [&](const unsigned& ensmb_id) {
+    SepMorphInfer& model = *models[ensmb_id];
+    float* state = &prev_states[ensmb_id * state_size];
+    float* dist = &member_dists[ensmb_id * beam_size * dist_stride];
+    model.Encode(morph_id, input_ids, &encoded[ensmb_id * encoded_size]);
+    model.DecodeStep(morph_id, &encoded[ensmb_id * encoded_size], bow_index,
+                     out_index, input_ids, state);
+    fill(dist, dist + vocab_size, 0.0f);
+    model.AddLogDist(morph_id, state, 1.0f / ensmb, dist);
+  });
+  sum_dists(0);
+
+  // Every hypothesis starts from the state after the first step.
+  BeamSearch search;
+  search.Start(beam_size, bow_index, eow_index, MAX_PRED_LEN, &log_dists[0],
+               vocab_size, pruning);
+  for (unsigned beam_id = 1; beam_id < beam_size; ++beam_id) {
+    memcpy(&prev_states[beam_id * beam_state_size], &prev_states[0],
+           sizeof(float) * beam_state_size);
+  }
+
+  vector<unsigned> prev_chars;
+  TaskFunc member_step = [&](const unsigned& ensmb_id) {
+    SepMorphInfer& model = *models[ensmb_id];
+    const vector<unsigned>& live = search.Live();
+    float* states = &curr_states[ensmb_id * state_size];
+    float* dists = &member_dists[ensmb_id * beam_size * dist_stride];
+    for (unsigned i = 0; i < live.size(); ++i) {
+      memcpy(states + i * beam_state_size,
+             &prev_states[live[i] * beam_state_size + ensmb_id * state_size],
+             sizeof(float) * state_size);
+    }
+    model.DecodeSteps(morph_id, &encoded[ensmb_id * encoded_size],
+                      live.size(), prev_chars.data(), out_index, input_ids,
+                      states, beam_state_size);
+    fill(dists, dists + live.size() * dist_stride, 0.0f);
+    model.AddLogDists(morph_id, live.size(), states, beam_state_size,
+                      1.0f / ensmb, dists, dist_stride);
+  };
+  while (!search.Done()) {
+    out_index++;
+    prev_chars.clear();
+    for (unsigned beam_id : search.Live()) {
+      prev_chars.push_back(search.LastChar(beam_id));
+    }
+    workers->Run(ensmb, member_step);
+    for (unsigned i = 0; i < search.Live().size(); ++i) {
+      sum_dists(i);
+    }
+    search.Step(&log_dists[0], dist_stride);
+    for (unsigned beam_id : search.Extended()) {  // Update hidden state
+      memcpy(&prev_states[beam_id * beam_state_size],
+             &curr_states[search.Parent(beam_id) * beam_state_size],
+             sizeof(float) * beam_state_size);
+    }
+  }
+  search.Results(sequences, tm_scores);
+  if (stats != NULL) {
+    *stats = search.Stats();
+  }
+}
@@ -0,0 +1,180 @@
+#ifndef SEP_MORPH_INFER_H_
+#define SEP_MORPH_INFER_H_
+
+#include "beam-search.h"
+#include "inference.h"
+#include "utils.h"
+#include "worker-pool.h"
+
+#include <unordered_map>
+
+using namespace std;
+
+// The weights of one morph tag of a SepMorph model.
+struct SepMorphInferTag {
+  InferLSTM input_forward, input_backward, output_forward;
+  Matrix hidden_to_output, hidden_to_output_bias;
+  Matrix char_vecs, eps_vecs;  // One column per character or epsilon
+  Matrix transform_encoded, transform_encoded_bias;
+
+  // Every input of the LSTMs but the encoded word comes from a small table
+  // of embeddings, so the products of the first layer's input weights with
+  // every embedding are precomputed, turning those GEMVs into column
+  // lookups. The encoder tables include the gate bias.
+  Matrix forward_char_gates, backward_char_gates;
+  Matrix encoded_to_gates;  // The decoder's input weights of the encoded word
+  Matrix prev_char_gates, input_char_gates, eps_gates;
+
+  // The int8 copies of the remaining matrices, after Quantize().
+  QuantMatrix quant_hidden_to_output, quant_transform_encoded;
+  QuantMatrix quant_encoded_to_gates;
+
+  // Builds the tables from the loaded weights.
+  void PrecomputeGates(const unsigned& hidden_len, const unsigned& char_len);
+
+  // Quantizes the LSTMs and the matrices above to int8 and frees their float
+  // copies. The tables are built before, from the float weights.
+  void Quantize();
+};
+
+// Runs a trained SepMorph model on the CPU without cnn: no computation graph
+// is built, the weights are repacked into padded, aligned matrices once at
+// load time and every step only calls the kernels. It computes the same
+// function as SepMorph, up to the order of floating point additions.
+class SepMorphInfer {
+ public:
+  unsigned char_len, hidden_len, vocab_len, layers, morph_len, max_eps;
+  vector<SepMorphInferTag> tags;
+
+  // Runs the bidirectional encoder over the input and transforms the
+  // concatenated final states. The transformed word is fed to the decoder at
+  // every step, so its product with the decoder's input weights is computed
+  // here once per word and written with the gate bias to encoded_gates
+  // (EncodedSize() floats), which every step and beam then reuses.
+  void Encode(const unsigned& morph_id, const vector<unsigned>& input_ids,
+              float* encoded_gates);
+
+  // Encode() for several words of the same tag at once: the encoders step
+  // all the words still being read with one matrix-matrix product per weight
+  // matrix. The encoded gates of the i-th word start at
+  // encoded_gates + i * encoded_stride and are the same as with Encode().
+  void EncodeBatch(const unsigned& morph_id,
+                   const vector<const vector<unsigned>*>& inputs,
+                   float* encoded_gates, const unsigned& encoded_stride);
+
+  unsigned EncodedSize() const {
+    return tags.empty() ? 0 : tags[0].output_forward.ScratchSize();
+  }
+
+  unsigned DecoderStateSize() const {
+    return tags.empty() ? 0 : tags[0].output_forward.StateSize();
+  }
+
+  // Feeds the previous output character and the input character (or
+  // epsilon) aligned with out_index to the decoder.
+  void DecodeStep(const unsigned& morph_id, const float* encoded_gates,
+                  const unsigned& prev_char, const unsigned& out_index,
+                  const vector<unsigned>& input_ids, float* state);
+
+  // Advances n decoder states, e.g. the hypotheses of a beam, with one
+  // matrix-matrix product per weight matrix. The states start every
+  // state_stride floats and get the same results as with DecodeStep().
+  void DecodeSteps(const unsigned& morph_id, const float* encoded_gates,
+                   const unsigned& n, const unsigned* prev_chars,
+                   const unsigned& out_index,
+                   const vector<unsigned>& input_ids, float* states,
+                   const unsigned& state_stride);
+
+  // DecodeSteps() for n different words, e.g. a batch of EncodeBatch(),
+  // each with its own encoded gates and input.
+  void DecodeWords(const unsigned& morph_id, const unsigned& n,
+                   const float* encoded_gates, const unsigned& encoded_stride,
+                   const unsigned* prev_chars, const unsigned& out_index,
+                   const vector<unsigned>* const* inputs, float* states,
+                   const unsigned& state_stride);
+
+  // Adds scale times the log-softmax of the output layer over the
+  // vocabulary to log_dist.
+  void AddLogDist(const unsigned& morph_id, const float* state,
+                  const float& scale, float* log_dist);
+
+  // AddLogDist() for n states, with the output layer of all of them
+  // computed by one matrix-matrix product. The distributions start every
+  // dist_stride floats.
+  void AddLogDists(const unsigned& morph_id, const unsigned& n,
+                   const float* states, const unsigned& state_stride,
+                   const float& scale, float* log_dists,
+                   const unsigned& dist_stride);
+
+  // Returns the most likely next character, without normalising.
+  unsigned BestChar(const unsigned& morph_id, const float* state);
+
+  // BestChar() of n states, into chars.
+  void BestChars(const unsigned& morph_id, const unsigned& n,
+                 const float* states, const unsigned& state_stride,
+                 unsigned* chars);
+
+  // Runs every tag with the int8 kernels. Binary models written by
+  // quantize-sep-morph are quantized when they are read.
+  void Quantize();
+
+ private:
+  void ResizeScratch();
+
+  // Computes the logits of the output layer of n states into the logits
+  // scratch space, PadFloats(vocab_len) floats apart.
+  void Logits(const SepMorphInferTag& tag, const unsigned& n,
+              const float* states, const unsigned& state_stride);
+
+  // The decoder gates of the input character aligned with out_index, or of
+  // the epsilon after the end of the input.
+  const float* InputCharGates(const SepMorphInferTag& tag,
+                              const unsigned& out_index,
+                              const vector<unsigned>& input_ids) const;
+
+  // Scratch space, so that decoding does not allocate.
+  AlignedVector encoder_state, encoder_output, encoded, gates;
+  AlignedVector logits;
+  AlignedVector batch_states, batch_output, batch_encoded;  // EncodeBatch()
+
+  friend bool Read(string& filename, SepMorphInfer* model);
+};
+
+// Reads a binary SepMorph model. Models in the old text format have to be
+// converted with convert-sep-morph first.
+bool Read(string& filename, SepMorphInfer* model);
+
+// The members of the ensemble run in parallel on workers, if given. Every
+// member has its own scratch space, so a member must not be shared by two
+// decodes running at the same time.
+void
+EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_to_id,
+               const vector<unsigned>& input_ids,
+               vector<unsigned>* pred_target_ids,
+               vector<SepMorphInfer*>* ensmb_model,
+               WorkerPool* workers = NULL);
+
+// Greedily decodes several words of the same tag in lockstep, giving each
+// the prediction of EnsembleDecode(). The words still being decoded advance
+// together with one matrix-matrix product per weight matrix, and a word
+// leaves the batch as soon as it ends, so the words need not have similar
+// lengths.
+void
+EnsembleDecodeBatch(const unsigned& morph_id,
+                    unordered_map<string, unsigned>& char_to_id,
+                    const vector<vector<unsigned> >& inputs,
+                    vector<vector<unsigned> >* pred_target_ids,
+                    vector<SepMorphInfer*>* ensmb_model,
+                    WorkerPool* workers = NULL);
+
+void
+EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
+                   unordered_map<string, unsigned>& char_to_id,
+                   const vector<unsigned>& input_ids,
+                   vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
+                   vector<SepMorphInfer*>* ensmb_model,
+                   WorkerPool* workers = NULL,
+                   const BeamPruning& pruning = BeamPruning(),
+                   BeamStats* stats = NULL);
+
+#endif
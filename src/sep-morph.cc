@@ -6,7 +6,6 @@ using namespace cnn::expr;
 
 string BOW = "<s>", EOW = "</s>";
 int MAX_PRED_LEN = 100;
-float NEG_INF = numeric_limits<int>::min();
 
 SepMorph::SepMorph(const unsigned& char_length, const unsigned& hidden_length,
                    const unsigned& vocab_length, const unsigned& num_layers,
@@ -21,26 +20,81 @@ SepMorph::SepMorph(const unsigned& char_length, const unsigned& hidden_length,
 }
 
 void SepMorph::InitParams(vector<Model*>* m) {
+  ResizeParams();
   for (unsigned i = 0; i < morph_len; ++i) {
-    input_forward.push_back(LSTMBuilder(layers, char_len, hidden_len, (*m)[i]));
-    input_backward.push_back(LSTMBuilder(layers, char_len, hidden_len, (*m)[i]));
-    output_forward.push_back(LSTMBuilder(layers, 2 * char_len + hidden_len,
-                                         hidden_len, (*m)[i]));
+    InitParams(i, (*m)[i]);
+  }
+}
+
+void SepMorph::InitParams(const unsigned& morph_id, Model* m) {
+  input_forward[morph_id] = LSTMBuilder(layers, char_len, hidden_len, m);
+  input_backward[morph_id] = LSTMBuilder(layers, char_len, hidden_len, m);
+  output_forward[morph_id] = LSTMBuilder(layers, 2 * char_len + hidden_len,
+                                         hidden_len, m);
 
-    phidden_to_output.push_back((*m)[i]->add_parameters({vocab_len, hidden_len}));
-    phidden_to_output_bias.push_back((*m)[i]->add_parameters({vocab_len, 1}));
+  phidden_to_output[morph_id] = m->add_parameters({vocab_len, hidden_len});
+  phidden_to_output_bias[morph_id] = m->add_parameters({vocab_len, 1});
 
-    char_vecs.push_back((*m)[i]->add_lookup_parameters(vocab_len, {char_len}));
+  char_vecs[morph_id] = m->add_lookup_parameters(vocab_len, {char_len});
 
-    ptransform_encoded.push_back((*m)[i]->add_parameters({hidden_len,
-                                                          2 * hidden_len}));
-    ptransform_encoded_bias.push_back((*m)[i]->add_parameters({hidden_len, 1}));
+  ptransform_encoded[morph_id] = m->add_parameters(
+      {hidden_len, 2 * hidden_len});
+  ptransform_encoded_bias[morph_id] = m->add_parameters({hidden_len, 1});
 
-    eps_vecs.push_back((*m)[i]->add_lookup_parameters(max_eps, {char_len}));
+  eps_vecs[morph_id] = m->add_lookup_parameters(max_eps, {char_len});
+}
+
+void SepMorph::ResizeParams() {
+  input_forward.resize(morph_len);
+  input_backward.resize(morph_len);
+  output_forward.resize(morph_len);
+  phidden_to_output.resize(morph_len);
+  phidden_to_output_bias.resize(morph_len);
+  char_vecs.resize(morph_len);
+  ptransform_encoded.resize(morph_len);
+  ptransform_encoded_bias.resize(morph_len);
+  eps_vecs.resize(morph_len);
+}
+
+void SepMorph::InitLazy(MappedModel* mapped) {
+  ResizeParams();
+  loaded_tag = -1;
+  lazy_model = mapped;
+}
+
+bool SepMorph::LoadTag(const unsigned& morph_id) {
+  if ((int) morph_id == loaded_tag) {
+    return true;
   }
+  if (loaded_tag < 0) {
+    tag_model = new Model();
+    InitParams(morph_id, tag_model);
+  } else {
+    // The parameters of all the tags have the same shapes, so the new tag
+    // takes over the builders and parameters of the previous one.
+    swap(input_forward[loaded_tag], input_forward[morph_id]);
+    swap(input_backward[loaded_tag], input_backward[morph_id]);
+    swap(output_forward[loaded_tag], output_forward[morph_id]);
+    swap(phidden_to_output[loaded_tag], phidden_to_output[morph_id]);
+    swap(phidden_to_output_bias[loaded_tag], phidden_to_output_bias[morph_id]);
+    swap(char_vecs[loaded_tag], char_vecs[morph_id]);
+    swap(ptransform_encoded[loaded_tag], ptransform_encoded[morph_id]);
+    swap(ptransform_encoded_bias[loaded_tag],
+         ptransform_encoded_bias[morph_id]);
+    swap(eps_vecs[loaded_tag], eps_vecs[morph_id]);
+  }
+  loaded_tag = morph_id;
+  return lazy_model->LoadParams(morph_id, true, tag_model);
 }
 
 void SepMorph::AddParamsToCG(const unsigned& morph_id, ComputationGraph* cg) {
+  // With a mapped model there is a single set of parameters, which fits every
+  // tag as their parameters have the same shapes; LoadTag() points it at the
+  // weights of morph_id.
+  if (lazy_model != NULL && !LoadTag(morph_id)) {
+    cerr << "Could not load the parameters of tag " << morph_id << endl;
+    exit(1);
+  }
   input_forward[morph_id].new_graph(*cg);
   input_backward[morph_id].new_graph(*cg);
   output_forward[morph_id].new_graph(*cg);
@@ -78,6 +132,33 @@ void SepMorph::RunFwdBwd(const unsigned& morph_id,
   *hidden = concatenate({forward_unit, backward_unit});
 }
 
+void SepMorph::RunFwdBwd(const unsigned& morph_id,
+                         const vector<vector<unsigned> >& inputs,
+                         Expression* hidden, ComputationGraph *cg) {
+  vector<Expression> input_vecs;
+  for (unsigned i = 0; i < inputs[0].size(); ++i) {
+    input_vecs.push_back(lookup(*cg, char_vecs[morph_id],
+                                BatchColumn(inputs, i)));
+  }
+
+  // Run forward LSTM
+  Expression forward_unit;
+  input_forward[morph_id].start_new_sequence();
+  for (unsigned i = 0; i < input_vecs.size(); ++i) {
+    forward_unit = input_forward[morph_id].add_input(input_vecs[i]);
+  }
+
+  // Run backward LSTM
+  Expression backward_unit;
+  input_backward[morph_id].start_new_sequence();
+  for (int i = input_vecs.size() - 1; i >= 0; --i) {
+    backward_unit = input_backward[morph_id].add_input(input_vecs[i]);
+  }
+
+  // Concatenate the forward and back hidden layers
+  *hidden = concatenate({forward_unit, backward_unit});
+}
+
 void SepMorph::TransformEncodedInput(Expression* encoded_input) const {
   *encoded_input = affine_transform({transform_encoded_bias,
                                      transform_encoded, *encoded_input});
@@ -99,6 +180,18 @@ Expression SepMorph::ComputeLoss(const vector<Expression>& hidden_units,
   return sum(losses);
 }
 
+Expression SepMorph::ComputeLoss(const vector<Expression>& hidden_units,
+                                 const vector<vector<unsigned> >& targets) const {
+  assert(hidden_units.size() == targets.size());
+  vector<Expression> losses;
+  for (unsigned i = 0; i < hidden_units.size(); ++i) {
+    Expression out;
+    ProjectToOutput(hidden_units[i], &out);
+    losses.push_back(pickneglogsoftmax(out, targets[i]));
+  }
+  return sum_batches(sum(losses));
+}
+
 float SepMorph::Train(const unsigned& morph_id, const vector<unsigned>& inputs,
                       const vector<unsigned>& outputs, AdadeltaTrainer* ada_gd) {
   ComputationGraph cg;
@@ -143,6 +236,165 @@ float SepMorph::Train(const unsigned& morph_id, const vector<unsigned>& inputs,
   return return_loss;
 }
 
+float SepMorph::TrainBatch(const unsigned& morph_id,
+                           const vector<vector<unsigned> >& inputs,
+                           const vector<vector<unsigned> >& outputs,
+                           AdadeltaTrainer* ada_gd) {
+  ComputationGraph cg;
+  AddParamsToCG(morph_id, &cg);
+
+  // Encode and Transform to feed into decoder
+  Expression encoded_input_vec;
+  RunFwdBwd(morph_id, inputs, &encoded_input_vec, &cg);
+  TransformEncodedInput(&encoded_input_vec);
+
+  // All examples have the same lengths, so every decoder step reads either
+  // input characters or epsilons for the whole batch.
+  unsigned input_len = inputs[0].size(), output_len = outputs[0].size();
+  vector<Expression> input_vecs_for_dec;
+  vector<vector<unsigned> > output_ids_for_pred;
+  for (unsigned i = 0; i < output_len; ++i) {
+    if (i < output_len - 1) {
+      // '</s>' will not be fed as input -- it needs to be predicted.
+      Expression prev_output_vecs = lookup(cg, char_vecs[morph_id],
+                                           BatchColumn(outputs, i));
+      if (i < input_len - 1) {
+        input_vecs_for_dec.push_back(concatenate(
+            {encoded_input_vec, prev_output_vecs,
+             lookup(cg, char_vecs[morph_id], BatchColumn(inputs, i + 1))}));
+      } else {
+        vector<unsigned> eps_ids(inputs.size(),
+                                 min(unsigned(i - input_len), max_eps - 1));
+        input_vecs_for_dec.push_back(concatenate(
+            {encoded_input_vec, prev_output_vecs,
+             lookup(cg, eps_vecs[morph_id], eps_ids)}));
+      }
+    }
+    if (i > 0) {  // '<s>' will not be predicted in the output -- its fed in.
+      output_ids_for_pred.push_back(BatchColumn(outputs, i));
+    }
+  }
+
+  vector<Expression> decoder_hidden_units;
+  output_forward[morph_id].start_new_sequence();
+  for (const auto& vec : input_vecs_for_dec) {
+    decoder_hidden_units.push_back(output_forward[morph_id].add_input(vec));
+  }
+  Expression loss = ComputeLoss(decoder_hidden_units, output_ids_for_pred);
+
+  float return_loss = as_scalar(cg.forward());
+  cg.backward();
+  ada_gd->update(1.0f);
+  return return_loss;
+}
+
+void
+EnsembleSpeculativeDecode(const unsigned& morph_id,
+                          unordered_map<string, unsigned>& char_to_id,
+                          const vector<unsigned>& input_ids,
+                          vector<unsigned>* pred_target_ids,
+                          vector<SepMorph*>* ensmb_model,
+                          unsigned* num_passes) {
+  ComputationGraph cg;
+
+  unsigned ensmb = ensmb_model->size();
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);  // After the last predicted character
+  for (unsigned i = 0; i < ensmb; ++i) {
+    Expression encoded_word_vec;
+    auto model = (*ensmb_model)[i];
+    model->AddParamsToCG(morph_id, &cg);
+    model->RunFwdBwd(morph_id, input_ids, &encoded_word_vec, &cg);
+    model->TransformEncodedInput(&encoded_word_vec);
+    decoders.push_back(FixedInputLSTM(model->output_forward[morph_id],
+                                      model->hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
+  }
+
+  // The output is aligned with the input character at source, which is
+  // moved when the models predict a character of the input after it.
+  unsigned out_index = 1, source = 0, passes = 0;
+  unsigned eow_index = char_to_id[EOW];
+  pred_target_ids->push_back(char_to_id[BOW]);
+  while (true) {
+    vector<unsigned> draft(input_ids.begin() + min<unsigned>(
+                               source + 1, input_ids.size()),
+                           input_ids.end());
+    if (draft.size() > MAX_PRED_LEN - pred_target_ids->size()) {
+      draft.resize(MAX_PRED_LEN - pred_target_ids->size());
+    }
+
+    // Feed the draft teacher-forced, like Train() feeds the gold output.
+    // Without a draft, this is a single step of EnsembleDecode().
+    unsigned num_steps = max<unsigned>(draft.size(), 1);
+    unsigned prev_char = pred_target_ids->back();
+    vector<Expression> step_outs;
+    vector<vector<LSTMState> > step_states(num_steps,
+                                           vector<LSTMState>(ensmb));
+    for (unsigned step = 0; step < num_steps; ++step) {
+      vector<Expression> ensmb_out;
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        auto model = (*ensmb_model)[ensmb_id];
+        unsigned index = out_index + step;
+        Expression prev_output_vec = lookup(cg, model->char_vecs[morph_id], prev_char);
+        Expression input, input_char_vec;
+        if (index < input_ids.size()) {
+          input_char_vec = lookup(cg, model->char_vecs[morph_id], input_ids[index]);
+        } else {
+          input_char_vec = lookup(cg, model->eps_vecs[morph_id],
+                                  min(unsigned(index - input_ids.size()),
+                                               model->max_eps - 1));
+        }
+        input = concatenate({prev_output_vec, input_char_vec});
+
+        const LSTMState& prev_state =
+            step > 0 ? step_states[step - 1][ensmb_id] : states[ensmb_id];
+        Expression hidden = decoders[ensmb_id].AddInput(
+            encoded_biases[ensmb_id], prev_state, input,
+            &step_states[step][ensmb_id]);
+        Expression out;
+        model->ProjectToOutput(hidden, &out);
+        ensmb_out.push_back(log_softmax(out));
+      }
+      step_outs.push_back(sum(ensmb_out) / ensmb_out.size());
+      if (step < draft.size()) {
+        prev_char = draft[step];
+      }
+    }
+    cg.incremental_forward();
+    passes++;
+
+    // Every prediction up to the first one which differs from the draft is
+    // the one EnsembleDecode() makes, and so is that one.
+    for (unsigned step = 0; step < num_steps; ++step) {
+      vector<float> dist = as_vector(cg.get_value(step_outs[step].i));
+      unsigned pred_index = distance(dist.begin(),
+                                     max_element(dist.begin(), dist.end()));
+      pred_target_ids->push_back(pred_index);
+      states = step_states[step];
+      out_index++;
+      if (pred_index == eow_index ||
+          pred_target_ids->size() >= MAX_PRED_LEN) {
+        if (num_passes != NULL) {
+          *num_passes = passes;
+        }
+        return;
+      }
+
+      for (unsigned i = source + 1; i < input_ids.size(); ++i) {
+        if (input_ids[i] == pred_index) {
+          source = i;
+          break;
+        }
+      }
+      if (step >= draft.size() || pred_index != draft[step]) {
+        break;
+      }
+    }
+  }
+}
+
 void
 EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_to_id,
                const vector<unsigned>& input_ids,
@@ -150,15 +402,18 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
   ComputationGraph cg;
 
   unsigned ensmb = ensmb_model->size();
-  vector<Expression> encoded_word_vecs;
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
   for (unsigned i = 0; i < ensmb; ++i) {
     Expression encoded_word_vec;
     auto model = (*ensmb_model)[i];
     model->AddParamsToCG(morph_id, &cg);
     model->RunFwdBwd(morph_id, input_ids, &encoded_word_vec, &cg);
     model->TransformEncodedInput(&encoded_word_vec);
-    encoded_word_vecs.push_back(encoded_word_vec);
-    model->output_forward[morph_id].start_new_sequence();
+    decoders.push_back(FixedInputLSTM(model->output_forward[morph_id],
+                                      model->hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
   }
 
   unsigned out_index = 1;
@@ -181,10 +436,11 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
                                 min(unsigned(out_index - input_ids.size()),
                                              model->max_eps - 1));
       }
-      input = concatenate({encoded_word_vecs[ensmb_id], prev_output_vec,
-                           input_char_vec});
+      input = concatenate({prev_output_vec, input_char_vec});
 
-      Expression hidden = model->output_forward[morph_id].add_input(input);
+      Expression hidden = decoders[ensmb_id].AddInput(
+          encoded_biases[ensmb_id], states[ensmb_id], input,
+          &states[ensmb_id]);
       Expression out;
       model->ProjectToOutput(hidden, &out);
       ensmb_out.push_back(log_softmax(out));
@@ -197,18 +453,122 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
   }
 }
 
+void
+EnsembleBatchDecode(const unsigned& morph_id,
+                    unordered_map<string, unsigned>& char_to_id,
+                    const vector<vector<unsigned> >& inputs,
+                    vector<vector<unsigned> >* pred_target_ids,
+                    vector<SepMorph*>* ensmb_model) {
+  ComputationGraph cg;
+
+  unsigned ensmb = ensmb_model->size();
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
+  for (unsigned i = 0; i < ensmb; ++i) {
+    Expression encoded_word_vec;
+    auto model = (*ensmb_model)[i];
+    model->AddParamsToCG(morph_id, &cg);
+    model->RunFwdBwd(morph_id, inputs, &encoded_word_vec, &cg);
+    model->TransformEncodedInput(&encoded_word_vec);
+    decoders.push_back(FixedInputLSTM(model->output_forward[morph_id],
+                                      model->hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
+  }
+
+  // live[i] is the word of the i-th element of the batch.
+  unsigned input_len = inputs[0].size(), out_index = 1;
+  unsigned eow_index = char_to_id[EOW];
+  pred_target_ids->assign(inputs.size(),
+                          vector<unsigned>(1, char_to_id[BOW]));
+  vector<unsigned> live;
+  for (unsigned i = 0; i < inputs.size(); ++i) {
+    live.push_back(i);
+  }
+  while (!live.empty()) {
+    vector<unsigned> prev_ids, input_char_ids;
+    for (const unsigned& word : live) {
+      prev_ids.push_back((*pred_target_ids)[word].back());
+      if (out_index < input_len) {
+        input_char_ids.push_back(inputs[word][out_index]);
+      }
+    }
+
+    vector<Expression> ensmb_out;
+    for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+      auto model = (*ensmb_model)[ensmb_id];
+      Expression prev_output_vecs = lookup(cg, model->char_vecs[morph_id],
+                                           prev_ids);
+      Expression input_char_vecs;
+      if (out_index < input_len) {
+        input_char_vecs = lookup(cg, model->char_vecs[morph_id],
+                                 input_char_ids);
+      } else {
+        vector<unsigned> eps_ids(live.size(),
+                                 min(unsigned(out_index - input_len),
+                                     model->max_eps - 1));
+        input_char_vecs = lookup(cg, model->eps_vecs[morph_id], eps_ids);
+      }
+      Expression input = concatenate({prev_output_vecs, input_char_vecs});
+
+      Expression hidden = decoders[ensmb_id].AddInput(
+          encoded_biases[ensmb_id], states[ensmb_id], input,
+          &states[ensmb_id]);
+      Expression out;
+      model->ProjectToOutput(hidden, &out);
+      ensmb_out.push_back(log_softmax(out));
+    }
+
+    Expression out = sum(ensmb_out) / ensmb_out.size();
+    vector<float> dist = as_vector(cg.incremental_forward());
+    unsigned vocab_size = dist.size() / live.size();
+    vector<unsigned> kept;  // The elements of the batch that go on
+    for (unsigned i = 0; i < live.size(); ++i) {
+      auto begin = dist.begin() + i * vocab_size;
+      unsigned pred_index = distance(begin,
+                                     max_element(begin, begin + vocab_size));
+      vector<unsigned>& pred = (*pred_target_ids)[live[i]];
+      pred.push_back(pred_index);
+      if (pred_index != eow_index && pred.size() < MAX_PRED_LEN) {
+        kept.push_back(i);
+      }
+    }
+
+    // Drop the words that ended from the batch.
+    if (!kept.empty() && kept.size() < live.size()) {
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        auto model = (*ensmb_model)[ensmb_id];
+        for (Expression& bias : encoded_biases[ensmb_id]) {
+          bias = SelectBatchElems(bias, model->hidden_len, live.size(), kept);
+        }
+        KeepBatchElems(model->hidden_len, live.size(), kept,
+                       &states[ensmb_id]);
+      }
+    }
+    vector<unsigned> next_live;
+    for (const unsigned& i : kept) {
+      next_live.push_back(live[i]);
+    }
+    live = next_live;
+    out_index++;
+  }
+}
+
 void
 EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size, 
                    unordered_map<string, unsigned>& char_to_id,
                    const vector<unsigned>& input_ids,
                    vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
-                   vector<SepMorph*>* ensmb_model) {
+                   vector<SepMorph*>* ensmb_model,
+                   const BeamPruning& pruning, BeamStats* stats) {
   unsigned out_index = 1;
   unsigned ensmb = ensmb_model->size();
   ComputationGraph cg;
 
   // Compute stuff for every model in the ensemble.
-  vector<Expression> encoded_word_vecs;
+  vector<FixedInputLSTM> decoders;
+  vector<vector<Expression> > encoded_biases;
+  vector<LSTMState> states(ensmb);
   vector<Expression> ensmb_out;
   for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
     auto& model = *(*ensmb_model)[ensmb_id];
@@ -217,15 +577,18 @@ EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
     Expression encoded_word_vec;
     model.RunFwdBwd(morph_id, input_ids, &encoded_word_vec, &cg);
     model.TransformEncodedInput(&encoded_word_vec);
-    encoded_word_vecs.push_back(encoded_word_vec);
-    model.output_forward[morph_id].start_new_sequence();
+    decoders.push_back(FixedInputLSTM(model.output_forward[morph_id],
+                                      model.hidden_len));
+    encoded_biases.push_back(decoders.back().InputBias(encoded_word_vec));
 
     Expression prev_output_vec = lookup(cg, model.char_vecs[morph_id],
                                         char_to_id[BOW]);
-    Expression input = concatenate({encoded_word_vecs[ensmb_id], prev_output_vec,
+    Expression input = concatenate({prev_output_vec,
                                     lookup(cg, model.char_vecs[morph_id],
-                                    input_ids[out_index])});
-    Expression hidden = model.output_forward[morph_id].add_input(input);
+                                           input_ids[out_index])});
+    Expression hidden = decoders[ensmb_id].AddInput(
+        encoded_biases[ensmb_id], states[ensmb_id], input,
+        &states[ensmb_id]);
     Expression out;
     model.ProjectToOutput(hidden, &out);
     out = log_softmax(out);
@@ -235,158 +598,110 @@ EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
   // Compute the average of the ensemble output.
   Expression out_dist = average(ensmb_out);
   vector<float> log_dist = as_vector(cg.incremental_forward());
-  priority_queue<pair<float, unsigned> > init_queue;
-  for (unsigned i = 0; i < log_dist.size(); ++i) {
-    init_queue.push(make_pair(log_dist[i], i));
-  }
   unsigned vocab_size = log_dist.size();
 
-  // Initialise the beam_size sequences, scores, hidden states.
-  vector<float> log_scores;
-  vector<vector<RNNPointer> > prev_states;
+  // Every hypothesis starts from the state after the first step. Finished
+  // and pruned hypotheses drop out of search.Live() and get no more graph
+  // nodes.
+  BeamSearch search;
+  search.Start(beam_size, char_to_id[BOW], char_to_id[EOW], MAX_PRED_LEN,
+               log_dist.data(), vocab_size, pruning);
+  vector<LSTMState> prev_states, curr_states(beam_size * ensmb);
   for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-    vector<unsigned> seq;
-    seq.push_back(char_to_id[BOW]);
-    seq.push_back(init_queue.top().second);
-    sequences->push_back(seq);
-    log_scores.push_back(init_queue.top().first);
-   
-    vector<RNNPointer> ensmb_states;
     for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
-      auto& model = *(*ensmb_model)[ensmb_id];
-      ensmb_states.push_back(model.output_forward[morph_id].state());
+      prev_states.push_back(states[ensmb_id]);
     }
-    prev_states.push_back(ensmb_states);
-    init_queue.pop();
   }
 
-  vector<cnn::real> neg_inf(vocab_size, NEG_INF);
-  Expression neg_inf_vec = cnn::expr::input(cg, {vocab_size}, &neg_inf);
- 
-  vector<bool> active_beams(beam_size, true);
-  while (true) {
-    out_index++;      
-    priority_queue<pair<float, pair<unsigned, unsigned> > > probs_queue;
-    vector<vector<RNNPointer> > curr_states;
+  while (!search.Done()) {
+    out_index++;
+    const vector<unsigned>& live = search.Live();
     vector<Expression> out_dist;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id]) {
-        unsigned prev_out_char = (*sequences)[beam_id].back();
-        vector<Expression> ensmb_out;
-        vector<RNNPointer> ensmb_states;
-        for (unsigned ensmb_id = 0; ensmb_id < ensmb; ensmb_id++) {
-          auto& model = *(*ensmb_model)[ensmb_id];
-          Expression input_char_vec;
-          if (out_index < input_ids.size()) { 
-            input_char_vec = lookup(cg, model.char_vecs[morph_id], input_ids[out_index]);
-          } else { 
-            input_char_vec = lookup(cg, model.eps_vecs[morph_id],
-                                    min(unsigned(out_index - input_ids.size()),
-                                                 model.max_eps - 1));
-          }
-
-          Expression prev_out_vec = lookup(cg, model.char_vecs[morph_id], prev_out_char);
-          Expression input = concatenate({encoded_word_vecs[ensmb_id], prev_out_vec,
-                                          input_char_vec});
-          Expression hidden = model.output_forward[morph_id].add_input(
-                                prev_states[beam_id][ensmb_id], input);
-          ensmb_states.push_back(model.output_forward[morph_id].state());
-          
-          Expression out;
-          model.ProjectToOutput(hidden, &out);
-          out = log_softmax(out);
-          ensmb_out.push_back(out);
+    for (unsigned i = 0; i < live.size(); ++i) {
+      unsigned beam_id = live[i];
+      unsigned prev_out_char = search.LastChar(beam_id);
+      vector<Expression> ensmb_out;
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ensmb_id++) {
+        auto& model = *(*ensmb_model)[ensmb_id];
+        Expression input_char_vec;
+        if (out_index < input_ids.size()) {
+          input_char_vec = lookup(cg, model.char_vecs[morph_id], input_ids[out_index]);
+        } else {
+          input_char_vec = lookup(cg, model.eps_vecs[morph_id],
+                                  min(unsigned(out_index - input_ids.size()),
+                                               model.max_eps - 1));
         }
-        curr_states.push_back(ensmb_states);
-        out_dist.push_back(average(ensmb_out));
-      } else {
-        vector<RNNPointer> dummy(ensmb, RNNPointer(0));
-        curr_states.push_back(dummy);
-        out_dist.push_back(neg_inf_vec);
-      }
-    }
 
-    Expression all_scores = concatenate(out_dist);
-    vector<float> log_dist = as_vector(cg.incremental_forward());
+        Expression prev_out_vec = lookup(cg, model.char_vecs[morph_id], prev_out_char);
+        Expression input = concatenate({prev_out_vec, input_char_vec});
+        Expression hidden = decoders[ensmb_id].AddInput(
+            encoded_biases[ensmb_id], prev_states[beam_id * ensmb + ensmb_id],
+            input, &curr_states[i * ensmb + ensmb_id]);
 
-    for (unsigned index = 0; index < log_dist.size(); ++index) {
-      unsigned beam_id = index / vocab_size;
-      unsigned char_id = index % vocab_size;
-      if (active_beams[beam_id]) {
-        pair<unsigned, unsigned> location = make_pair(beam_id, char_id);
-        probs_queue.push(pair<float, pair<unsigned, unsigned> >(
-                         log_scores[beam_id] + log_dist[index], location));
-      }
-    }
-      
-    // Find the beam_size best now and update the variables.
-    unordered_map<unsigned, vector<unsigned> > new_seq;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id]) {
-        float log_prob = probs_queue.top().first;
-        pair<unsigned, unsigned> location = probs_queue.top().second;
-        unsigned old_beam_id = location.first, char_id = location.second;
-
-        vector<unsigned> seq = (*sequences)[old_beam_id];
-        seq.push_back(char_id);
-        new_seq[beam_id] = seq;
-        log_scores[beam_id] = log_prob;  // Update the score
-
-        prev_states[beam_id] = curr_states[old_beam_id];  // Update hidden state
-        probs_queue.pop();
+        Expression out;
+        model.ProjectToOutput(hidden, &out);
+        out = log_softmax(out);
+        ensmb_out.push_back(out);
       }
-    }
-      
-    // Update the sequences now.
-    for (auto& it : new_seq) {
-      (*sequences)[it.first] = it.second;
+      out_dist.push_back(average(ensmb_out));
     }
 
-    // Check if a sequence should be made inactive.
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id] && 
-          ((*sequences)[beam_id].back() == char_to_id[EOW] ||
-           (*sequences)[beam_id].size() > MAX_PRED_LEN)) {
-        active_beams[beam_id] = false;
-      }
-    }
-
-    // Check if all sequences are inactive.
-    bool all_inactive = true;
-    for (unsigned beam_id = 0; beam_id < beam_size; ++beam_id) {
-      if (active_beams[beam_id]) {
-        all_inactive = false;
-        break;
+    Expression all_scores = concatenate(out_dist);
+    vector<float> log_dist = as_vector(cg.incremental_forward());
+    search.Step(log_dist.data(), vocab_size);
+    for (unsigned beam_id : search.Extended()) {  // Update hidden state
+      unsigned parent = search.Parent(beam_id);
+      for (unsigned ensmb_id = 0; ensmb_id < ensmb; ++ensmb_id) {
+        prev_states[beam_id * ensmb + ensmb_id] =
+            curr_states[parent * ensmb + ensmb_id];
       }
     }
-
-    if (all_inactive) {
-      *tm_scores = log_scores;
-      return;
-    }
+  }
+  search.Results(sequences, tm_scores);
+  if (stats != NULL) {
+    *stats = search.Stats();
   }
 }
 
 void Serialize(string& filename, SepMorph& model, vector<Model*>* cnn_models) {
-  ofstream outfile(filename);
-  if (!outfile.is_open()) {
-    cerr << "File opening failed" << endl;
-  }
-
-  boost::archive::text_oarchive oa(outfile);
-  oa & model;
-  for (unsigned i = 0; i < cnn_models->size(); ++i) {
-    oa & *(*cnn_models)[i];
+  ModelHeader header = MakeModelHeader(kSepMorph, model.char_len,
+                                       model.hidden_len, model.vocab_len,
+                                       model.layers, model.morph_len,
+                                       model.max_eps, 0);
+  if (WriteBinaryModel(filename, header, *cnn_models)) {
+    cerr << "Saved model to: " << filename << endl;
   }
+}
 
-  cerr << "Saved model to: " << filename << endl;
-  outfile.close();
+static void CopyHyperParams(const ModelHeader& header, SepMorph* model) {
+  model->char_len = header.char_len;
+  model->hidden_len = header.hidden_len;
+  model->vocab_len = header.vocab_len;
+  model->layers = header.layers;
+  model->morph_len = header.morph_len;
+  model->max_eps = header.max_eps;
 }
 
-void Read(string& filename, SepMorph* model, vector<Model*>* cnn_models) {
+bool Read(string& filename, SepMorph* model, vector<Model*>* cnn_models) {
+  if (IsBinaryModel(filename)) {
+    MappedModel* mapped = OpenBinaryModel(filename, kSepMorph, 0);
+    if (mapped == NULL) {
+      return false;
+    }
+    CopyHyperParams(*mapped->header, model);
+    model->InitLazy(mapped);
+    if (!model->LoadTag(0)) {
+      return false;
+    }
+    cerr << "Loaded model from: " << filename << endl;
+    return true;
+  }
+
+  // Models saved in the old boost text format.
   ifstream infile(filename);
   if (!infile.is_open()) {
     cerr << "File opening failed" << endl;
+    return false;
   }
 
   boost::archive::text_iarchive ia(infile);
@@ -403,5 +718,6 @@ void Read(string& filename, SepMorph* model, vector<Model*>* cnn_models) {
 
   cerr << "Loaded model from: " << filename << endl;
   infile.close();
+  return true;
 }
 
@@ -10,7 +10,10 @@
 #include "cnn/gpu-ops.h"
 #include "cnn/expr.h"
 
+#include "beam-search.h"
 #include "utils.h"
+#include "model-io.h"
+#include "lstm-utils.h"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -36,6 +39,10 @@ class SepMorph {
   unsigned char_len, hidden_len, vocab_len, layers, morph_len, max_eps = 5;
   vector<LookupParameters*> eps_vecs;
 
+  MappedModel* lazy_model = NULL;  // NULL unless read from a binary model
+  int loaded_tag = -1;  // The tag the parameters point at, -1 for none
+  Model* tag_model = NULL;
+
   SepMorph() {}
 
   SepMorph(const unsigned& char_length, const unsigned& hidden_length,
@@ -45,11 +52,28 @@ class SepMorph {
 
   void InitParams(vector<Model*>* m);
 
+  void InitParams(const unsigned& morph_id, Model* m);
+
+  void ResizeParams();
+
+  // Lazy loading: the tags share one set of parameters, which LoadTag()
+  // points at the weights of a tag in the mapped model whenever
+  // AddParamsToCG() switches to another tag.
+  void InitLazy(MappedModel* mapped);
+
+  // Returns false if the parameters of the tag do not match the model.
+  bool LoadTag(const unsigned& morph_id);
+
   void AddParamsToCG(const unsigned& morph_id, ComputationGraph* cg);
 
   void RunFwdBwd(const unsigned& morph_id, const vector<unsigned>& inputs,
                  Expression* hidden, ComputationGraph *cg);
 
+  // Encodes a batch of inputs which all have the same length.
+  void RunFwdBwd(const unsigned& morph_id,
+                 const vector<vector<unsigned> >& inputs,
+                 Expression* hidden, ComputationGraph *cg);
+
   void TransformEncodedInput(Expression* encoded_input) const;
 
   void TransformEncodedInputDuringDecoding(Expression* encoded_input) const;
@@ -59,9 +83,19 @@ class SepMorph {
   Expression ComputeLoss(const vector<Expression>& hidden_units,
                          const vector<unsigned>& targets) const;
 
+  Expression ComputeLoss(const vector<Expression>& hidden_units,
+                         const vector<vector<unsigned> >& targets) const;
+
   float Train(const unsigned& morph_id, const vector<unsigned>& inputs,
               const vector<unsigned>& outputs, AdadeltaTrainer* ada_gd);
 
+  // Trains on a batch of examples that all have the same input length and
+  // the same output length, with one update for the whole batch.
+  float TrainBatch(const unsigned& morph_id,
+                   const vector<vector<unsigned> >& inputs,
+                   const vector<vector<unsigned> >& outputs,
+                   AdadeltaTrainer* ada_gd);
+
   friend class boost::serialization::access;
   template<class Archive> void serialize(Archive& ar, const unsigned int) {
     ar & char_len;
@@ -78,16 +112,47 @@ EnsembleDecode(const unsigned& morph_id, unordered_map<string, unsigned>& char_t
                const vector<unsigned>& input_ids,
                vector<unsigned>* pred_target_ids, vector<SepMorph*>* ensmb_model);
 
+// Decodes a batch of inputs of the same length with the same tag, writing
+// the prediction of EnsembleDecode() for inputs[i] to (*pred_target_ids)[i].
+// The words are encoded and decoded together, every step computing the whole
+// batch with matrix-matrix products, and a word leaves the batch when it
+// ends.
+void
+EnsembleBatchDecode(const unsigned& morph_id,
+                    unordered_map<string, unsigned>& char_to_id,
+                    const vector<vector<unsigned> >& inputs,
+                    vector<vector<unsigned> >* pred_target_ids,
+                    vector<SepMorph*>* ensmb_model);
+
+// Gives the output of EnsembleDecode() with fewer forward passes: the rest
+// of the input, from the character the output is aligned with, is guessed
+// as the next output characters and fed to the decoder in one pass. The
+// guess is kept up to the first character the models do not predict, and
+// decoding goes on from there. num_passes, if given, gets the number of
+// incremental_forward() calls.
+void
+EnsembleSpeculativeDecode(const unsigned& morph_id,
+                          unordered_map<string, unsigned>& char_to_id,
+                          const vector<unsigned>& input_ids,
+                          vector<unsigned>* pred_target_ids,
+                          vector<SepMorph*>* ensmb_model,
+                          unsigned* num_passes = NULL);
+
 void
 EnsembleBeamDecode(const unsigned& morph_id, const unsigned& beam_size,
                    unordered_map<string, unsigned>& char_to_id,
                    const vector<unsigned>& input_ids,
                    vector<vector<unsigned> >* sequences, vector<float>* tm_scores,
-                   vector<SepMorph*>* ensmb_model);
+                   vector<SepMorph*>* ensmb_model,
+                   const BeamPruning& pruning = BeamPruning(),
+                   BeamStats* stats = NULL);
 
 void Serialize(string& filename, SepMorph& model, vector<Model*>* cnn_model);
 
-void Read(string& filename, SepMorph* model, vector<Model*>* cnn_model);
+// Reads a model, returning false on failure. A binary model is mapped and
+// its tags are loaded lazily, see InitLazy(); only the text models fill
+// cnn_model.
+bool Read(string& filename, SepMorph* model, vector<Model*>* cnn_model);
 
 
 #endif
@@ -0,0 +1,124 @@
+#ifndef SHARDED_LRU_CACHE_H_
+#define SHARDED_LRU_CACHE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+struct CacheStats {
+  unsigned long long hits = 0, misses = 0, evictions = 0;
+  unsigned long long size = 0;  // Entries cached
+};
+
+// Mixes value into a hash seed, for the hashes of the cache keys.
+inline void HashCombine(const size_t& value, size_t* seed) {
+  *seed ^= value + 0x9e3779b9u + (*seed << 6) + (*seed >> 2);
+}
+
+// A bounded map from keys to values, evicting the least recently used entry
+// when it is full. The entries are spread over shards, each with its own
+// lock, so that threads using different keys rarely wait for each other.
+// The values are only read and written under the lock of their shard, by
+// the functions given to Find() and Insert(). An evicted entry is reused for
+// the new one, so a full cache reuses the memory of its values.
+template <class Key, class Value, class Hash>
+class ShardedLRUCache {
+ public:
+  // Keeps at most about capacity entries, split evenly over at most
+  // num_shards shards. Small caches use fewer shards, so that the keys of a
+  // shard do not evict each other long before the cache is full.
+  ShardedLRUCache(const unsigned& capacity, const unsigned& num_shards = 16)
+      : shards(max(min(num_shards, capacity / kMinShardCapacity), 1u)) {
+    shard_capacity = max((capacity + shards.size() - 1) / shards.size(),
+                         size_t(1));
+  }
+
+  // Calls read(value) with the cached value of key and returns true, or
+  // returns false if it is not cached.
+  template <class Read>
+  bool Find(const Key& key, const Read& read) {
+    Shard& shard = ShardOf(key);
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+      shard.stats.misses++;
+      return false;
+    }
+    shard.stats.hits++;
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    read(static_cast<const Value&>(it->second->second));
+    return true;
+  }
+
+  // Caches the value of key, which write(&value) stores in the entry of key
+  // (the old value, the value of an evicted entry, or a new Value()). The
+  // least recently used entry of the shard is evicted if it is full.
+  template <class Write>
+  void Insert(const Key& key, const Write& write) {
+    Shard& shard = ShardOf(key);
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    } else {
+      if (shard.entries.size() >= shard_capacity) {
+        shard.index.erase(shard.entries.back().first);
+        shard.entries.splice(shard.entries.begin(), shard.entries,
+                             prev(shard.entries.end()));
+        shard.entries.front().first = key;
+        shard.stats.evictions++;
+      } else {
+        shard.entries.emplace_front(key, Value());
+      }
+      shard.index[key] = shard.entries.begin();
+    }
+    write(&shard.entries.front().second);
+  }
+
+  // The sums of the counters of all the shards.
+  CacheStats Stats() {
+    CacheStats total;
+    for (Shard& shard : shards) {
+      lock_guard<mutex> guard(shard.lock);
+      total.hits += shard.stats.hits;
+      total.misses += shard.stats.misses;
+      total.evictions += shard.stats.evictions;
+      total.size += shard.entries.size();
+    }
+    return total;
+  }
+
+  // Zeroes the counters, e.g. after warming the cache.
+  void ResetStats() {
+    for (Shard& shard : shards) {
+      lock_guard<mutex> guard(shard.lock);
+      shard.stats = CacheStats();
+    }
+  }
+
+ private:
+  static const unsigned kMinShardCapacity = 256;
+
+  typedef list<pair<Key, Value> > Entries;
+  struct Shard {
+    mutex lock;
+    Entries entries;  // Most recently used first
+    unordered_map<Key, typename Entries::iterator, Hash> index;
+    CacheStats stats;
+  };
+
+  Shard& ShardOf(const Key& key) {
+    return shards[Hash()(key) % shards.size()];
+  }
+
+  vector<Shard> shards;
+  size_t shard_capacity;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include "suffix-rules.h"
+
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+void SuffixRules::Train(const Corpus& corpus, const unsigned& char_vocab,
+                        const unsigned& morph_vocab, const unsigned& context) {
+  char_vocab_size = char_vocab;
+  morph_vocab_size = morph_vocab;
+  max_context = context;
+  tags.assign(morph_vocab, map<vector<unsigned>, SuffixRuleStats>());
+
+  // Count every lemma for every one of its endings, and its edit for the
+  // endings which contain the characters it strips, then keep the most
+  // frequent edit of every ending. An edit stripping more than an ending
+  // would copy lemma characters the ending does not condition on into
+  // other lemmas, so it is not a rule of the ending, but its lemma still
+  // counts against the confidence of the ending's rule.
+  typedef pair<unsigned, vector<unsigned> > Edit;
+  vector<map<vector<unsigned>, map<Edit, unsigned> > > counts(morph_vocab);
+  vector<map<vector<unsigned>, unsigned> > totals(morph_vocab);
+  vector<unsigned> input_ids, output_ids;
+  for (unsigned row = 0; row < corpus.size(); ++row) {
+    corpus.GetInput(row, &input_ids);
+    corpus.GetOutput(row, &output_ids);
+    if (input_ids.size() < 2 || output_ids.size() < 2) {
+      continue;
+    }
+    // The lemma and the inflected form without <s> and </s>
+    unsigned lemma_len = input_ids.size() - 2;
+    unsigned form_len = output_ids.size() - 2;
+    unsigned prefix = 0;
+    while (prefix < lemma_len && prefix < form_len &&
+           input_ids[prefix + 1] == output_ids[prefix + 1]) {
+      prefix++;
+    }
+    Edit edit(lemma_len - prefix,
+              vector<unsigned>(output_ids.begin() + prefix + 1,
+                               output_ids.end() - 1));
+    auto& tag_counts = counts[corpus.morph_id(row)];
+    auto& tag_totals = totals[corpus.morph_id(row)];
+    for (unsigned len = 0; len <= context && len <= lemma_len + 1; ++len) {
+      vector<unsigned> ending(input_ids.end() - 1 - len, input_ids.end() - 1);
+      tag_totals[ending]++;
+      if (len >= edit.first) {
+        tag_counts[ending][edit]++;
+      }
+    }
+  }
+
+  for (unsigned morph_id = 0; morph_id < morph_vocab; ++morph_id) {
+    for (auto& it : totals[morph_id]) {
+      // An ending no edit fits gets an empty rule of confidence 0.
+      SuffixRuleStats& stats = tags[morph_id][it.first];
+      stats.total = it.second;
+      stats.count = 0;
+      stats.rule.strip_len = 0;
+      stats.rule.add.clear();
+      for (auto& edit : counts[morph_id][it.first]) {
+        if (edit.second > stats.count) {
+          stats.count = edit.second;
+          stats.rule.strip_len = edit.first.first;
+          stats.rule.add = edit.first.second;
+        }
+      }
+    }
+  }
+}
+
+const SuffixRuleStats* SuffixRules::Find(const unsigned& morph_id,
+                                         const vector<unsigned>& input_ids,
+                                         const unsigned& min_count) const {
+  if (morph_id >= tags.size() || input_ids.size() < 2) {
+    return NULL;
+  }
+  unsigned lemma_len = input_ids.size() - 2;
+  vector<unsigned> ending;
+  for (int len = min(max_context, lemma_len + 1); len >= 0; --len) {
+    ending.assign(input_ids.end() - 1 - len, input_ids.end() - 1);
+    auto it = tags[morph_id].find(ending);
+    if (it != tags[morph_id].end() && it->second.total >= min_count) {
+      return &it->second;
+    }
+  }
+  return NULL;
+}
+
+bool SuffixRules::Apply(const unsigned& morph_id,
+                        const vector<unsigned>& input_ids,
+                        const float& threshold, const unsigned& min_count,
+                        vector<unsigned>* output_ids) const {
+  const SuffixRuleStats* stats = Find(morph_id, input_ids, min_count);
+  if (stats == NULL || stats->Confidence() < threshold ||
+      stats->rule.strip_len > input_ids.size() - 2) {
+    return false;
+  }
+  output_ids->assign(input_ids.begin(),
+                     input_ids.end() - 1 - stats->rule.strip_len);
+  output_ids->insert(output_ids->end(), stats->rule.add.begin(),
+                     stats->rule.add.end());
+  output_ids->push_back(input_ids.back());
+  return true;
+}
+
+// Every ending is one line:
+//   morph_id total count strip_len ending_len ending... add_len add...
+bool Write(string& filename, const SuffixRules& rules) {
+  ofstream outfile(filename);
+  if (!outfile.is_open()) {
+    cerr << "File opening failed" << endl;
+    return false;
+  }
+  unsigned num_endings = 0;
+  for (const auto& tag : rules.tags) {
+    num_endings += tag.size();
+  }
+  outfile << rules.char_vocab_size << " " << rules.morph_vocab_size << " "
+          << rules.max_context << " " << num_endings << endl;
+  for (unsigned morph_id = 0; morph_id < rules.tags.size(); ++morph_id) {
+    for (const auto& it : rules.tags[morph_id]) {
+      const SuffixRuleStats& stats = it.second;
+      outfile << morph_id << " " << stats.total << " " << stats.count << " "
+              << stats.rule.strip_len << " " << it.first.size();
+      for (const unsigned& id : it.first) {
+        outfile << " " << id;
+      }
+      outfile << " " << stats.rule.add.size();
+      for (const unsigned& id : stats.rule.add) {
+        outfile << " " << id;
+      }
+      outfile << endl;
+    }
+  }
+  return true;
+}
+
+bool Read(string& filename, SuffixRules* rules) {
+  ifstream infile(filename);
+  if (!infile.is_open()) {
+    cerr << "File opening failed" << endl;
+    return false;
+  }
+  unsigned num_endings;
+  if (!(infile >> rules->char_vocab_size >> rules->morph_vocab_size >>
+        rules->max_context >> num_endings)) {
+    cerr << "Not a rules file: " << filename << endl;
+    return false;
+  }
+  rules->tags.assign(rules->morph_vocab_size,
+                     map<vector<unsigned>, SuffixRuleStats>());
+  for (unsigned i = 0; i < num_endings; ++i) {
+    unsigned morph_id, size;
+    SuffixRuleStats stats;
+    vector<unsigned> ending;
+    infile >> morph_id >> stats.total >> stats.count >> stats.rule.strip_len
+           >> size;
+    ending.resize(size);
+    for (unsigned& id : ending) {
+      infile >> id;
+    }
+    infile >> size;
+    stats.rule.add.resize(size);
+    for (unsigned& id : stats.rule.add) {
+      infile >> id;
+    }
+    if (!infile || morph_id >= rules->morph_vocab_size) {
+      cerr << "Corrupt rules file: " << filename << endl;
+      return false;
+    }
+    rules->tags[morph_id][ending] = stats;
+  }
+  cerr << "Loaded " << num_endings << " lemma endings from: " << filename
+       << endl;
+  return true;
+}
@@ -0,0 +1,65 @@
+#ifndef SUFFIX_RULES_H_
+#define SUFFIX_RULES_H_
+
+#include "corpus.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A suffix edit: the last strip_len characters of the lemma are replaced by
+// add, e.g. strip_len 0 and add "e n" for +en.
+struct SuffixRule {
+  unsigned strip_len;
+  vector<unsigned> add;
+};
+
+// What the training lemmas of a tag ending in the same characters do: how
+// many there are, and the most frequent edit and how many of them use it.
+struct SuffixRuleStats {
+  unsigned total, count;
+  SuffixRule rule;
+
+  float Confidence() const { return float(count) / total; }
+};
+
+// Suffix edits learned per morph tag from the training data, conditioned on
+// the last characters of the lemma. Only lemmas whose edit is the same for
+// nearly all training lemmas with the same ending are answered by a rule,
+// the others are left to the neural models.
+class SuffixRules {
+ public:
+  unsigned char_vocab_size = 0, morph_vocab_size = 0;
+  unsigned max_context = 0;  // Longest ending a rule is conditioned on
+  // For every tag, the statistics of every lemma ending seen in the
+  // training data. An ending which reaches the start of a lemma includes
+  // <s>, so that whole short lemmas are told apart from their suffixes.
+  vector<map<vector<unsigned>, SuffixRuleStats> > tags;
+
+  // Counts the edits of all the rows of the corpus, for the endings of up to
+  // context characters of every lemma.
+  void Train(const Corpus& corpus, const unsigned& char_vocab,
+             const unsigned& morph_vocab, const unsigned& context);
+
+  // Finds the statistics of the longest ending of the lemma (with <s> and
+  // </s>) seen at least min_count times with the tag, or returns NULL.
+  const SuffixRuleStats* Find(const unsigned& morph_id,
+                              const vector<unsigned>& input_ids,
+                              const unsigned& min_count) const;
+
+  // Writes the output of the rule of Find() to output_ids, with <s> and
+  // </s>, if its confidence is at least threshold. Returns false when the
+  // lemma has to be decoded by the models.
+  bool Apply(const unsigned& morph_id, const vector<unsigned>& input_ids,
+             const float& threshold, const unsigned& min_count,
+             vector<unsigned>* output_ids) const;
+};
+
+// The rules are stored as text, with character and tag ids, so they can
+// only be used with the vocabularies they were trained with.
+bool Write(string& filename, const SuffixRules& rules);
+bool Read(string& filename, SuffixRules* rules);
+
+#endif
@@ -8,9 +8,12 @@
 #include "cnn/expr.h"
 
 #include "utils.h"
+#include "corpus.h"
 #include "joint-enc-morph.h"
 
+#include <chrono>
 #include <iostream>
+#include <numeric>
 #include <unordered_map>
 
 using namespace std;
@@ -19,6 +22,7 @@ using namespace cnn::expr;
 
 int main(int argc, char** argv) {
   cnn::Initialize(argc, argv);
+  unsigned batch_size = atoi(GetOption("batch-size", "1", &argc, argv).c_str());
 
   string vocab_filename = argv[1];  // vocabulary of words/characters
   string morph_filename = argv[2];
@@ -38,11 +42,12 @@ int main(int argc, char** argv) {
   ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
   unsigned morph_size = morph_to_id.size();
 
-  vector<string> train_data;  // Read the training file in a vector
-  ReadData(train_filename, &train_data);
-
-  vector<string> test_data;  // Read the dev file in a vector
-  ReadData(test_filename, &test_data);
+  // Read the training and dev files, either as text or compiled corpora.
+  Corpus train_data, test_data;
+  if (!ReadCorpus(train_filename, char_to_id, morph_to_id, &train_data) ||
+      !ReadCorpus(test_filename, char_to_id, morph_to_id, &test_data)) {
+    return 0;
+  }
 
   vector<Model*> m;
   vector<AdadeltaTrainer> optimizer;
@@ -61,51 +66,67 @@ int main(int argc, char** argv) {
   double best_score = -1;
   vector<JointEncMorph*> model_pointers;
   model_pointers.push_back(&nn);
+
+  // Batches only group examples of the same morph tag, input length and
+  // output length, so that every batch step is a single batched lookup.
+  vector<vector<unsigned> > batch_keys;
+  for (unsigned i = 0; i < train_data.size() && batch_size > 1; ++i) {
+    batch_keys.push_back({train_data.morph_id(i), train_data.input_size(i),
+                          train_data.output_size(i)});
+  }
+  vector<unsigned> order(train_data.size());
+  iota(order.begin(), order.end(), 0);
+
   for (unsigned iter = 0; iter < num_iter; ++iter) {
     unsigned line_id = 0;
-    random_shuffle(train_data.begin(), train_data.end());
+    random_shuffle(order.begin(), order.end());
     vector<float> loss(morph_size, 0.0f);
-    for (string& line : train_data) {
-      vector<string> items = split_line(line, '|');
-      vector<unsigned> input_ids, target_ids;
-      input_ids.clear(); target_ids.clear();
-      for (const string& ch : split_line(items[0], ' ')) {
-        input_ids.push_back(char_to_id[ch]);
+    auto start_time = chrono::steady_clock::now();
+    if (batch_size > 1) {
+      vector<vector<unsigned> > batches;
+      MakeBatches(batch_keys, batch_size, &batches);
+      for (const vector<unsigned>& batch : batches) {
+        vector<vector<unsigned> > inputs(batch.size()), outputs(batch.size());
+        for (unsigned i = 0; i < batch.size(); ++i) {
+          train_data.GetInput(batch[i], &inputs[i]);
+          train_data.GetOutput(batch[i], &outputs[i]);
+        }
+        unsigned morph_id = train_data.morph_id(batch[0]);
+        loss[morph_id] += nn.TrainBatch(morph_id, inputs, outputs,
+                                        &optimizer[morph_id],
+                                        &optimizer[morph_size]);
+        line_id += batch.size();
+        cerr << line_id << "\r";
       }
-      for (const string& ch : split_line(items[1], ' ')) {
-        target_ids.push_back(char_to_id[ch]);
+    } else {
+      vector<unsigned> input_ids, target_ids;
+      for (const unsigned& row : order) {
+        train_data.GetInput(row, &input_ids);
+        train_data.GetOutput(row, &target_ids);
+        unsigned morph_id = train_data.morph_id(row);
+        loss[morph_id] += nn.Train(morph_id, input_ids, target_ids,
+                                   &optimizer[morph_id],
+                                   &optimizer[morph_size]);
+        cerr << ++line_id << "\r";
       }
-      unsigned morph_id = morph_to_id[items[2]];
-      loss[morph_id] += nn.Train(morph_id, input_ids, target_ids,
-                                 &optimizer[morph_id], &optimizer[morph_size]);
-      cerr << ++line_id << "\r";
     }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+    cerr << "Iter " << iter + 1 << " Examples/sec: "
+         << train_data.size() / elapsed.count() << endl;
 
     // Read the test file and output predictions for the words.
     string line;
     double correct = 0, total = 0;
-    for (string& line : test_data) {
-      vector<string> items = split_line(line, '|');
-      vector<unsigned> input_ids, target_ids, pred_target_ids;
-      input_ids.clear(); target_ids.clear(); pred_target_ids.clear();
-      for (const string& ch : split_line(items[0], ' ')) {
-        input_ids.push_back(char_to_id[ch]);
-      }
-      for (const string& ch : split_line(items[1], ' ')) {
-        target_ids.push_back(char_to_id[ch]);
-      }
-      unsigned morph_id = morph_to_id[items[2]];
+    vector<unsigned> input_ids, target_ids, pred_target_ids;
+    for (unsigned row = 0; row < test_data.size(); ++row) {
+      pred_target_ids.clear();
+      test_data.GetInput(row, &input_ids);
+      test_data.GetOutput(row, &target_ids);
+      unsigned morph_id = test_data.morph_id(row);
       EnsembleDecode(morph_id, char_to_id, input_ids, &pred_target_ids,
                      &model_pointers);
 
-      string prediction = "";
-      for (unsigned i = 0; i < pred_target_ids.size(); ++i) {
-        prediction += id_to_char[pred_target_ids[i]];
-        if (i != pred_target_ids.size() - 1) {
-          prediction += " ";
-        }
-      }
-      if (prediction == items[1]) {
+      if (pred_target_ids == target_ids) {
         correct += 1;
       }
       total += 1;
@@ -0,0 +1,80 @@
+/*
+Learns the suffix edits of every morph tag from the training data, see
+SuffixRules. --context=N conditions the edits on up to N characters of the
+end of the lemma (5 by default). With a development file it also prints how
+many of its words the rules answer and how accurately, for several
+confidence thresholds, to pick --rule-threshold for the eval binaries.
+*/
+#include "utils.h"
+#include "corpus.h"
+#include "suffix-rules.h"
+
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+
+using namespace std;
+
+int main(int argc, char** argv) {
+  unsigned context = atoi(GetOption("context", "5", &argc, argv).c_str());
+  unsigned min_count =
+      atoi(GetOption("rule-min-count", "5", &argc, argv).c_str());
+  if (argc != 5 && argc != 6) {
+    cerr << "Usage: " << argv[0] << " [--context=N] [--rule-min-count=N]"
+         << " char_vocab.txt morph_vocab.txt train_infl.txt rules.txt"
+         << " [dev_infl.txt]" << endl;
+    return 0;
+  }
+  string vocab_filename = argv[1];  // vocabulary of words/characters
+  string morph_filename = argv[2];
+  string train_filename = argv[3];
+  string rules_filename = argv[4];
+
+  unordered_map<string, unsigned> char_to_id, morph_to_id;
+  unordered_map<unsigned, string> id_to_char, id_to_morph;
+
+  ReadVocab(vocab_filename, &char_to_id, &id_to_char);
+  ReadVocab(morph_filename, &morph_to_id, &id_to_morph);
+
+  Corpus train_data;
+  if (!ReadCorpus(train_filename, char_to_id, morph_to_id, &train_data)) {
+    return 0;
+  }
+  SuffixRules rules;
+  rules.Train(train_data, char_to_id.size(), morph_to_id.size(), context);
+  if (!Write(rules_filename, rules)) {
+    return 0;
+  }
+  unsigned num_endings = 0;
+  for (const auto& tag : rules.tags) {
+    num_endings += tag.size();
+  }
+  cerr << "Wrote the edits of " << num_endings << " lemma endings to "
+       << rules_filename << endl;
+
+  if (argc == 6) {
+    string dev_filename = argv[5];
+    Corpus dev_data;
+    if (!ReadCorpus(dev_filename, char_to_id, morph_to_id, &dev_data)) {
+      return 0;
+    }
+    const float thresholds[] = {0.8, 0.9, 0.95, 0.98, 0.99, 1.0};
+    vector<unsigned> input_ids, target_ids, pred_target_ids;
+    cerr << "threshold\tanswered\taccuracy" << endl;
+    for (const float& threshold : thresholds) {
+      double answered = 0, correct = 0;
+      for (unsigned row = 0; row < dev_data.size(); ++row) {
+        dev_data.GetInput(row, &input_ids);
+        dev_data.GetOutput(row, &target_ids);
+        if (rules.Apply(dev_data.morph_id(row), input_ids, threshold,
+                        min_count, &pred_target_ids)) {
+          answered += 1;
+          correct += pred_target_ids == target_ids;
+        }
+      }
+      cerr << threshold << "\t" << answered / dev_data.size() << "\t"
+           << (answered > 0 ? correct / answered : 0) << endl;
+    }
+  }
+  return 1;
+}
@@ -42,3 +42,74 @@ void ReadData(string& filename, vector<string>* data) {
   }
   train_file.close();
 }
+
+void MakeBatches(const vector<vector<unsigned> >& keys,
+                 const unsigned& batch_size,
+                 vector<vector<unsigned> >* batches) {
+  map<vector<unsigned>, vector<unsigned> > buckets;
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    buckets[keys[i]].push_back(i);
+  }
+
+  batches->clear();
+  for (auto& it : buckets) {
+    vector<unsigned>& bucket = it.second;
+    random_shuffle(bucket.begin(), bucket.end());
+    for (unsigned start = 0; start < bucket.size(); start += batch_size) {
+      unsigned end = min(start + batch_size, (unsigned) bucket.size());
+      batches->push_back(vector<unsigned>(bucket.begin() + start,
+                                          bucket.begin() + end));
+    }
+  }
+  random_shuffle(batches->begin(), batches->end());
+}
+
+vector<unsigned> BatchColumn(const vector<vector<unsigned> >& batch,
+                             const unsigned& index) {
+  vector<unsigned> column;
+  for (const vector<unsigned>& seq : batch) {
+    column.push_back(seq[index]);
+  }
+  return column;
+}
+
+string GetOption(const string& name, const string& default_value,
+                 int* argc, char** argv) {
+  string prefix = "--" + name + "=";
+  string value = default_value;
+  int kept = 1;
+  for (int i = 1; i < *argc; ++i) {
+    string arg = argv[i];
+    if (arg.compare(0, prefix.size(), prefix) == 0) {
+      value = arg.substr(prefix.size());
+    } else {
+      argv[kept++] = argv[i];
+    }
+  }
+  *argc = kept;
+  return value;
+}
+
+void AssignToWorkers(const vector<unsigned>& load, const unsigned& num_workers,
+                     vector<vector<unsigned> >* assignment) {
+  vector<unsigned> jobs;
+  for (unsigned i = 0; i < load.size(); ++i) {
+    if (load[i] > 0) {
+      jobs.push_back(i);
+    }
+  }
+  sort(jobs.begin(), jobs.end(), [&load](unsigned a, unsigned b) {
+    return load[a] > load[b];
+  });
+
+  assignment->clear();
+  assignment->resize(min(num_workers, (unsigned) jobs.size()));
+  vector<unsigned long> worker_load(assignment->size(), 0);
+  for (const unsigned& job : jobs) {
+    unsigned worker = distance(worker_load.begin(),
+                               min_element(worker_load.begin(),
+                                           worker_load.end()));
+    (*assignment)[worker].push_back(job);
+    worker_load[worker] += load[job];
+  }
+}
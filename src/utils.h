@@ -7,6 +7,8 @@
 #include <fstream>
 #include <vector>
 #include <unordered_map>
+#include <map>
+#include <algorithm>
 
 using namespace std;
 
@@ -17,4 +19,25 @@ void ReadVocab(string& filename, unordered_map<string, unsigned>* item_to_id,
 
 void ReadData(string& filename, vector<string>* data);
 
+// Groups the examples with identical keys (e.g. morph id, input length and
+// output length) into batches of at most batch_size examples. Both the
+// examples inside a bucket and the order of the batches are shuffled.
+void MakeBatches(const vector<vector<unsigned> >& keys,
+                 const unsigned& batch_size,
+                 vector<vector<unsigned> >* batches);
+
+// Returns the index-th element of every sequence in the batch.
+vector<unsigned> BatchColumn(const vector<vector<unsigned> >& batch,
+                             const unsigned& index);
+
+// Returns the value of an optional "--name=value" argument and removes it
+// from argv, so that the positional arguments keep their indices.
+string GetOption(const string& name, const string& default_value,
+                 int* argc, char** argv);
+
+// Greedily assigns the jobs to workers, heaviest job first, always picking
+// the least loaded worker. Jobs with zero load are not assigned.
+void AssignToWorkers(const vector<unsigned>& load, const unsigned& num_workers,
+                     vector<vector<unsigned> >* assignment);
+
 #endif
@@ -0,0 +1,74 @@
+#include "worker-pool.h"
+
+#include <algorithm>
+
+// Polls before an idle worker goes to sleep; long enough to cover the
+// sequential work between two steps of a decoder. Polling yields, so that
+// spinning threads do not starve the others on a busy host.
+static const unsigned kSpins = 1 << 12;
+
+WorkerPool::WorkerPool(const unsigned& num_threads)
+    : task(NULL), num_tasks(0), stop(false), generation(0), pending(0) {
+  // More threads than cores would only make the others wait for them.
+  unsigned cores = max(thread::hardware_concurrency(), 1u);
+  for (unsigned i = 1; i < min(num_threads, cores); ++i) {
+    workers.push_back(thread(&WorkerPool::Work, this, i));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    lock_guard<mutex> lock(wakeup_mutex);
+    stop = true;
+    generation++;
+  }
+  wakeup.notify_all();
+  for (thread& worker : workers) {
+    worker.join();
+  }
+}
+
+void WorkerPool::Run(const unsigned& tasks, const TaskFunc& func) {
+  if (workers.empty()) {
+    for (unsigned i = 0; i < tasks; ++i) {
+      func(i);
+    }
+    return;
+  }
+  task = &func;
+  num_tasks = tasks;
+  pending.store(workers.size());
+  {
+    lock_guard<mutex> lock(wakeup_mutex);
+    generation++;
+  }
+  wakeup.notify_all();
+  for (unsigned i = 0; i < tasks; i += size()) {
+    func(i);
+  }
+  while (pending.load() > 0) {
+    this_thread::yield();
+  }
+}
+
+void WorkerPool::Work(const unsigned& thread_id) {
+  unsigned seen = 0;
+  while (true) {
+    for (unsigned spins = 0; generation.load() == seen; ++spins) {
+      if (spins < kSpins) {
+        this_thread::yield();
+      } else {
+        unique_lock<mutex> lock(wakeup_mutex);
+        wakeup.wait(lock, [&] { return generation.load() != seen; });
+      }
+    }
+    seen = generation.load();
+    if (stop) {
+      return;
+    }
+    for (unsigned i = thread_id; i < num_tasks; i += size()) {
+      (*task)(i);
+    }
+    pending--;
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+typedef function<void(const unsigned& task_id)> TaskFunc;
+
+// A fixed set of threads which run the tasks of one step of a decoder in
+// parallel, e.g. the members of an ensemble, and wait for each other at the
+// end of the step. A step takes microseconds, so idle workers spin for a
+// while before sleeping and no thread is started per step.
+class WorkerPool {
+ public:
+  // The calling thread is one of the num_threads threads.
+  explicit WorkerPool(const unsigned& num_threads);
+  ~WorkerPool();
+
+  unsigned size() const { return workers.size() + 1; }
+
+  // Runs task(0), ..., task(num_tasks - 1) and returns when all of them are
+  // done. Thread t runs the tasks t, t + size(), ..., so a task keeps
+  // running on the same thread from one step to the next.
+  void Run(const unsigned& num_tasks, const TaskFunc& task);
+
+ private:
+  void Work(const unsigned& thread_id);
+
+  vector<thread> workers;
+  const TaskFunc* task;
+  unsigned num_tasks;
+  bool stop;
+  atomic<unsigned> generation;  // Incremented by every Run()
+  atomic<unsigned> pending;  // Workers still running the current step
+  mutex wakeup_mutex;
+  condition_variable wakeup;
+};
+
+#endif